@@ -13,7 +13,7 @@ This is a GUI class for real time control of the DARKNESS instrument.
  
  CLASSES:
     MkidDashboard - main GUI
-    ImageSearcher - searches for new images on ramdisk
+    ImageSearcher - searches for new images on ramdisk (or in PacketMaster2's live image ring)
     ConvertPhotonsToRGB - converts a 2D list of photon counts to a QImage
  """
  
@@ -34,6 +34,7 @@ from LaserControl import LaserControl
 from Telescope import *
 import casperfpga
 from Roach2Controls import Roach2Controls
+from pm2live import LiveImage
 
 class ImageSearcher(QtCore.QObject):     #Extends QObject for use with QThreads
     """
@@ -42,12 +43,18 @@ class ImageSearcher(QtCore.QObject):     #Extends QObject for use with QThreads
     When it finds an image, it grabs the data, parses it into an array, and emits an imageFound signal
     Optionally, it deletes the data on the ramdisk so it doesn't fill up
     
+    If PacketMaster2 publishes its images to the shared memory ring LiveImage.shm on the ramdisk
+    (see pm2live.py) they are read from there instead, and there are no files to delete.  A ring
+    that stops getting new images for LIVE_STALE subframes (left by an earlier run, say) is dropped
+    for the files until it moves again
+    
     SIGNALS
         imageFound - emits when an image is found
         finished - emits when self.search is set to False
     """
     imageFound = QtCore.pyqtSignal(object)
     finished = QtCore.pyqtSignal()
+    LIVE_STALE = 5
     
     def __init__(self, path, nCols, nRows, parent=None):
         """
@@ -62,6 +69,7 @@ class ImageSearcher(QtCore.QObject):     #Extends QObject for use with QThreads
         self.nCols = nCols
         self.nRows= nRows
         self.search=True
+        self.staleRing=None     # (inode, latest frame) of the ring last given up on
         
     def checkDir(self, removeOldFiles=False):
         """
@@ -77,10 +85,15 @@ class ImageSearcher(QtCore.QObject):     #Extends QObject for use with QThreads
         self.search=True
         latestTime = time.time()-.5
         while self.search:
+            live = self.openLive()
+            if live is not None:
+                self.checkLive(live)
+                latestTime = time.time()-.5
+                continue
             flist = []
             for f in os.listdir(self.path):
                 if f.endswith(".img"):
-                    if float(f.split('.')[0]) > latestTime:
+                    if float(f[:-4]) > latestTime:
                         flist.append(f)
                     elif removeOldFiles:
                         os.remove(self.path+f)
@@ -89,7 +102,7 @@ class ImageSearcher(QtCore.QObject):     #Extends QObject for use with QThreads
             if len(flist)>0:
                 flist.sort()
                 for f in flist:
-                    latestTime = float(f.split('.')[0])+.1
+                    latestTime = float(f[:-4])
                     try:
                         image = self.readBinToList(self.path+f)
                         self.imageFound.emit(image)
@@ -101,6 +114,45 @@ class ImageSearcher(QtCore.QObject):     #Extends QObject for use with QThreads
                         os.remove(self.path+f)
         self.finished.emit()
     
+    def openLive(self):
+        """
+        Map PacketMaster2's live image ring, None if there is none or it has not moved since it went stale
+        """
+        if not os.path.exists(self.path+'LiveImage.shm'):
+            return None
+        try:
+            live = LiveImage(self.path+'LiveImage.shm')
+        except IOError:
+            return None
+        if (live.inode, live.latest()) == self.staleRing:
+            live.close()
+            return None
+        return live
+    
+    def checkLive(self, live):
+        """
+        Same as checkDir but takes each new image from PacketMaster2's live image ring.  Returns when
+        self.search is set to False or no new image has come for LIVE_STALE subframes
+        
+        INPUTS:
+            live - pm2live.LiveImage mapping the ring
+        """
+        frame = live.latest()
+        last = time.time()
+        while self.search:
+            newest = live.wait(frame, timeout=.2)
+            if newest == frame:
+                if time.time() - last > max(self.LIVE_STALE * live.subframe / 1000., 1.):
+                    self.staleRing = (live.inode, live.latest())
+                    break
+                continue
+            frame = newest
+            last = time.time()
+            meta, image = live.read(frame)
+            if meta is not None and image.shape == (self.nRows, self.nCols):
+                self.imageFound.emit(image)
+        live.close()
+    
     def readBinToList(self,fn):
         """
         Parses the binary image file into a numpy array
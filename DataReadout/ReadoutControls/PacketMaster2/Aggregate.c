@@ -0,0 +1,196 @@
+// Aggregate.c
+// multi-host scale out, the node side: send the Cuber's images to the Aggregator, see Aggregate.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+
+#include "Aggregate.h"
+
+_Static_assert(sizeof(struct aggheader) == 32, "aggheader is part of the Aggregator protocol");
+
+int AggAddress(const char *addr, char *host, size_t len, int *port)
+{
+    const char *colon = strrchr(addr, ':');
+
+    if( colon == NULL || colon == addr || (size_t) (colon - addr) >= len || (*port = atoi(colon+1)) <= 0 || *port > 65535 ) return -1;
+    memcpy(host, addr, colon - addr);
+    host[colon - addr] = 0;
+    return 0;
+}
+
+static int AggConnect(struct aggsender *a)
+{
+    struct addrinfo hints, *res, *ai;
+    struct timeval tv = { 1, 0 };
+    char port[16];
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%d", a->port);
+    if( getaddrinfo(a->host, port, &hints, &res) != 0 ) return -1;
+    for(ai=res;ai!=NULL;ai=ai->ai_next) {
+       if( (a->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol)) == -1 ) continue;
+       // a wedged Aggregator costs us a reconnect, never a stuck thread
+       setsockopt(a->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+       if( connect(a->fd, ai->ai_addr, ai->ai_addrlen) == 0 ) break;
+       close(a->fd);
+       a->fd = -1;
+    }
+    freeaddrinfo(res);
+    return a->fd == -1 ? -1 : 0;
+}
+
+static int AggSend(int fd, const void *p, size_t len)
+{
+    ssize_t n;
+
+    while( len > 0 ) {
+       if( (n = send(fd, p, len, MSG_NOSIGNAL)) <= 0 ) return -1;
+       p = (const char *) p + n;
+       len -= n;
+    }
+    return 0;
+}
+
+static void *AggThread(void *arg)
+{
+    struct aggsender *a = (struct aggsender *) arg;
+    struct aggheader hdr;
+    struct timespec until;
+    int down = 0;
+
+    pthread_mutex_lock(&a->lock);
+    while( 1 ) {
+       while( a->head == a->tail && !a->quit ) pthread_cond_wait(&a->cond, &a->lock);
+       if( a->head == a->tail ) break;
+
+       if( a->fd == -1 ) {
+          pthread_mutex_unlock(&a->lock);
+          if( AggConnect(a) == 0 ) {
+             printf("CUBER: sending images to the aggregator at %s:%d\n", a->host, a->port); fflush(stdout);
+             down = 0;
+          }
+          else if( !down ) {
+             printf("CUBER: cannot reach the aggregator at %s:%d, retrying every %d ms\n", a->host, a->port, AGG_RETRY); fflush(stdout);
+             down = 1;
+          }
+          pthread_mutex_lock(&a->lock);
+          if( a->fd == -1 ) {
+             // on the way out there is no waiting for an aggregator that is not there
+             if( a->quit ) break;
+             clock_gettime(CLOCK_REALTIME, &until);
+             until.tv_sec += AGG_RETRY / 1000;
+             until.tv_nsec += (AGG_RETRY % 1000) * 1000000L;
+             if( until.tv_nsec >= 1000000000L ) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+             }
+             pthread_cond_timedwait(&a->cond, &a->lock, &until);
+             continue;
+          }
+       }
+
+       hdr = a->hdr[a->tail % AGG_QUEUE];
+       memcpy(a->sending, a->image[a->tail % AGG_QUEUE], sizeof(uint16_t) * (a->npix+1));
+       a->tail++;
+       pthread_mutex_unlock(&a->lock);
+       if( AggSend(a->fd, &hdr, sizeof(hdr)) != 0 || AggSend(a->fd, a->sending, sizeof(uint16_t) * (a->npix+1)) != 0 ) {
+          printf("CUBER: lost the aggregator at %s:%d\n", a->host, a->port); fflush(stdout);
+          close(a->fd);
+          a->fd = -1;
+       }
+       pthread_mutex_lock(&a->lock);
+       if( a->fd != -1 ) a->sent++;
+       else a->dropped++;
+    }
+    pthread_mutex_unlock(&a->lock);
+    return NULL;
+}
+
+struct aggsender *AggSenderCreate(const struct pm2config *cfg)
+{
+    struct aggsender *a;
+    int i;
+
+    if( (a = calloc(1, sizeof(struct aggsender))) == NULL ) return NULL;
+    if( AggAddress(cfg->aggregator, a->host, sizeof(a->host), &a->port) != 0 ) {
+       fprintf(stderr, "aggregator = %s is not host:port\n", cfg->aggregator);
+       free(a);
+       return NULL;
+    }
+    a->fd = -1;
+    a->xpix = cfg->xpix;
+    a->ypix = cfg->ypix;
+    a->npix = ConfigNpix(cfg);
+    a->node = cfg->node;
+    for(i=0;i<256;i++) a->nown += i < cfg->nroach && cfg->ownroach[i];
+    for(i=0;i<AGG_QUEUE;i++) {
+       if( (a->image[i] = AllocImage(cfg)) == NULL ) break;
+    }
+    if( i < AGG_QUEUE || (a->sending = AllocImage(cfg)) == NULL ) {
+       AggSenderFree(a);
+       return NULL;
+    }
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->cond, NULL);
+    if( pthread_create(&a->thread, NULL, AggThread, a) != 0 ) {
+       pthread_mutex_destroy(&a->lock);
+       pthread_cond_destroy(&a->cond);
+       for(i=0;i<AGG_QUEUE;i++) free(a->image[i]);
+       free(a->sending);
+       free(a);
+       return NULL;
+    }
+    return a;
+}
+
+void AggSubmit(struct aggsender *a, const uint16_t *image, int64_t start, uint32_t window)
+{
+    struct aggheader *h;
+
+    pthread_mutex_lock(&a->lock);
+    if( a->head - a->tail == AGG_QUEUE ) {
+       a->tail++;
+       a->dropped++;
+    }
+    h = &a->hdr[a->head % AGG_QUEUE];
+    memcpy(h->magic, AGG_MAGIC, 4);
+    h->node = a->node;
+    h->nroach = a->nown;
+    h->xpix = a->xpix;
+    h->ypix = a->ypix;
+    h->start = start;
+    h->window = window;
+    h->pad = 0;
+    memcpy(a->image[a->head % AGG_QUEUE], image, sizeof(uint16_t) * (a->npix+1));
+    a->head++;
+    pthread_cond_signal(&a->cond);
+    pthread_mutex_unlock(&a->lock);
+}
+
+void AggSenderFree(struct aggsender *a)
+{
+    int i;
+
+    if( a == NULL ) return;
+    if( a->sending != NULL ) {
+       pthread_mutex_lock(&a->lock);
+       a->quit = 1;
+       pthread_cond_signal(&a->cond);
+       pthread_mutex_unlock(&a->lock);
+       pthread_join(a->thread, NULL);
+       pthread_mutex_destroy(&a->lock);
+       pthread_cond_destroy(&a->cond);
+    }
+    if( a->fd != -1 ) close(a->fd);
+    for(i=0;i<AGG_QUEUE;i++) free(a->image[i]);
+    free(a->sending);
+    free(a);
+}
@@ -0,0 +1,71 @@
+// Aggregate.h
+// scale out over several hosts: PacketMaster2 nodes each read out some of the boards, one Aggregator
+// merges their images
+//
+// One host's NIC and disks only go so far, so a large array can be split between several nodes, each
+// running its own PacketMaster2 with roaches set to the boards it owns (the boards are pointed at their
+// node by the readout).  A node receives and writes only its own boards' .bin stream, and its Cuber
+// closes a subframe as soon as those boards have moved past it.  Its images cover the whole array but
+// only its boards' pixels have counts in them.
+//
+// With aggregator = host:port set the Cuber hands every image to an AggSender thread, which sends it
+// to the Aggregator (Aggregator.c) over TCP and reconnects whenever the link drops.  The Cuber never
+// waits on the network: the thread holds AGG_QUEUE images and the oldest is dropped when it falls
+// further behind.  The Aggregator sums the images with the same start from every node into one
+// full-array frame and writes it out the way a single host Cuber would, so the dashboard runs
+// unchanged on the Aggregator's host.
+//
+// Each image goes as a struct aggheader and the npix+1 counts (the sink pixel last), little endian.
+
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "Config.h"
+
+#define AGG_MAGIC "PM2A"
+#define AGG_QUEUE 16                    // images waiting to be sent before the oldest is dropped
+#define AGG_RETRY 1000                  // ms between attempts to reach the Aggregator
+
+struct aggheader {
+    char magic[4];
+    uint16_t node;
+    uint16_t nroach;                    // boards the node owns
+    uint32_t xpix, ypix;
+    int64_t start;                      // ms since the Unix epoch of the start of the image's window
+    uint32_t window;                    // ms summed into the image
+    uint32_t pad;
+};
+
+struct aggsender {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char host[128];
+    int port;
+    int fd;                             // connection to the Aggregator, -1 while there is none
+    unsigned int xpix, ypix, npix;
+    int node, nown;                     // this node's id and how many boards it owns
+    struct aggheader hdr[AGG_QUEUE];
+    uint16_t *image[AGG_QUEUE];
+    uint16_t *sending;                  // copy of the image on its way out
+    uint64_t head, tail;                // images submitted and taken by the thread
+    int quit;
+    uint64_t sent, dropped;             // images sent, and lost to a full queue or a dropped link
+};
+
+// split "host:port", returns 0 if addr is one
+int AggAddress(const char *addr, char *host, size_t len, int *port);
+
+// start a sender thread for cfg->aggregator, NULL on failure
+struct aggsender *AggSenderCreate(const struct pm2config *cfg);
+
+// queue an image of npix+1 counts for the window starting at start ms, never blocks on the network
+void AggSubmit(struct aggsender *a, const uint16_t *image, int64_t start, uint32_t window);
+
+// send what is queued if the Aggregator is there, and stop the thread
+void AggSenderFree(struct aggsender *a);
+
+#endif
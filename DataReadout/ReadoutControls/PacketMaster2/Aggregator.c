@@ -0,0 +1,340 @@
+// Aggregator.c
+// merge the images of several PacketMaster2 nodes into full-array frames for the dashboard
+//
+// Every node of a multi-host array (see Aggregate.h) sends each image it closes here.  The pieces with
+// the same start are summed, and a frame goes out once every one of the -n nodes has sent its piece, or
+// -t ms after its first piece came in if a node is slow or down (counted as partial).  Frames go out in
+// start order the way the Cuber writes them on a single host: a .img and a .png on the ramdisk unless
+// imgfiles = 0, and the live image ring unless liveslots = 0, so MkidDashboard runs unchanged on this
+// host.  A piece for a frame already written is counted late and dropped.
+//
+// The port and geometry come from the same config file as the nodes (aggregator, nodes, xpix, ypix).
+// Runs until SIGINT or SIGTERM.
+//
+//   Aggregator [-n nodes] [-t ms] [config]
+
+#define _GNU_SOURCE     // accept4()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "Config.h"
+#include "Aggregate.h"
+#include "LiveImage.h"
+#include "RenderPNG.h"
+
+// compile with gcc -O2 -o Aggregator Aggregator.c Config.c Aggregate.c LiveImage.c RenderPNG.c PacketCodec.c -I. -lm -lpthread -lpng
+
+#define AGG_MAXPENDING 64           // frames waiting for pieces at once
+#define AGG_POLLMS 20               // longest the loop sleeps before checking for overdue frames
+#define AGG_LOGMS 10000             // ms between status lines
+
+struct aggconn {
+    int fd;
+    int node;                       // from its first piece, -1 until then
+    char *buf;                      // one message
+    size_t have;
+};
+
+struct aggframe {
+    int used;
+    int64_t start;
+    uint32_t window;
+    uint64_t nodes;                 // bit per node whose piece is in
+    int64_t first;                  // CLOCK_MONOTONIC ms the first piece arrived
+    uint32_t *sum;                  // npix+1 counts
+};
+
+struct aggregator {
+    const struct pm2config *cfg;
+    unsigned int npix;
+    size_t msglen;
+    int nodes;
+    int timeout;
+    int listenfd;
+    struct aggconn conn[CONFIG_MAXNODES];
+    struct aggframe frame[AGG_MAXPENDING];
+    int64_t lastout;                // start of the newest frame written
+    uint16_t *out;
+    struct liveimage *live;
+    struct pngrender *render;
+    uint64_t written, partial, late, bad;
+};
+
+static volatile sig_atomic_t quit = 0;
+
+static void Quit(int sig)
+{
+    quit = 1;
+}
+
+static int64_t NowMs()
+{
+    struct timespec spec;
+
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return (int64_t) spec.tv_sec*1000 + spec.tv_nsec/1000000;
+}
+
+// write a frame out the way CuberClose() does, and free its slot
+static void AggWrite(struct aggregator *ag, struct aggframe *f)
+{
+    const struct pm2config *cfg = ag->cfg;
+    int64_t start = f->start + f->window - cfg->subframe;    // files are named by their last subframe
+    char outfile[160];
+    unsigned int i, have = __builtin_popcountll(f->nodes);
+    FILE *wp;
+
+    for(i=0;i<=ag->npix;i++) ag->out[i] = f->sum[i] > 0xFFFF ? 0xFFFF : f->sum[i];
+    if( ag->live != NULL ) LivePublish(ag->live, ag->out, f->start, f->window);
+    if( cfg->imgfiles ) {
+       if( cfg->subframe % 1000 == 0 ) sprintf(outfile,"/mnt/ramdisk/%" PRId64 ".img",start/1000);
+       else sprintf(outfile,"/mnt/ramdisk/%" PRId64 ".%03d.img",start/1000,(int) (start%1000));
+       if( (wp = fopen(outfile,"wb")) != NULL ) {
+          fwrite(ag->out, sizeof(ag->out[0]), ag->npix, wp);
+          fclose(wp);
+       }
+       else perror(outfile);
+       strcpy(outfile + strlen(outfile) - 4, ".png");
+       RenderSubmit(ag->render, ag->out, outfile);
+    }
+
+    if( (int) have < ag->nodes ) {
+       ag->partial++;
+       printf("AGGREGATOR: frame at %" PRId64 ".%03d written with %u of %d nodes\n", f->start/1000, (int) (f->start%1000), have, ag->nodes); fflush(stdout);
+    }
+    ag->written++;
+    if( f->start > ag->lastout ) ag->lastout = f->start;
+    f->used = 0;
+}
+
+// write every pending frame that starts before start, oldest first
+static void AggWriteBefore(struct aggregator *ag, int64_t start)
+{
+    struct aggframe *f;
+    int i;
+
+    do {
+       f = NULL;
+       for(i=0;i<AGG_MAXPENDING;i++) {
+          if( ag->frame[i].used && ag->frame[i].start < start && (f == NULL || ag->frame[i].start < f->start) ) f = &ag->frame[i];
+       }
+       if( f != NULL ) AggWrite(ag, f);
+    } while( f != NULL );
+}
+
+static void AggPiece(struct aggregator *ag, const struct aggheader *h, const uint16_t *image)
+{
+    struct aggframe *f = NULL, *oldest = NULL;
+    unsigned int i;
+
+    if( h->start <= ag->lastout ) {
+       ag->late++;
+       return;
+    }
+    for(i=0;i<AGG_MAXPENDING;i++) {
+       if( ag->frame[i].used && ag->frame[i].start == h->start ) f = &ag->frame[i];
+    }
+    if( f == NULL ) {
+       for(i=0;i<AGG_MAXPENDING && ag->frame[i].used;i++) {
+          if( oldest == NULL || ag->frame[i].start < oldest->start ) oldest = &ag->frame[i];
+       }
+       if( i == AGG_MAXPENDING ) {
+          // far too many frames waiting on a node, give up on the oldest
+          AggWriteBefore(ag, oldest->start + 1);
+          if( h->start <= ag->lastout ) {
+             ag->late++;
+             return;
+          }
+          for(i=0;ag->frame[i].used;i++) ;
+       }
+       f = &ag->frame[i];
+       f->used = 1;
+       f->start = h->start;
+       f->window = h->window;
+       f->nodes = 0;
+       f->first = NowMs();
+       memset(f->sum, 0, sizeof(uint32_t) * (ag->npix+1));
+    }
+    if( f->nodes & (1ULL << h->node) ) {
+       ag->bad++;
+       return;
+    }
+    f->nodes |= 1ULL << h->node;
+    for(i=0;i<=ag->npix;i++) f->sum[i] += image[i];
+
+    // the frames before a complete one are not going to complete either before it has to go out
+    if( __builtin_popcountll(f->nodes) >= ag->nodes ) {
+       AggWriteBefore(ag, f->start);
+       AggWrite(ag, f);
+    }
+}
+
+static void AggDrop(struct aggconn *c, const char *why)
+{
+    if( c->node >= 0 ) printf("AGGREGATOR: node %d %s\n", c->node, why);
+    else printf("AGGREGATOR: a node %s before sending an image\n", why);
+    fflush(stdout);
+    close(c->fd);
+    c->fd = -1;
+}
+
+static void AggRead(struct aggregator *ag, struct aggconn *c)
+{
+    const struct aggheader *h = (const struct aggheader *) c->buf;
+    ssize_t n;
+
+    while( (n = recv(c->fd, c->buf + c->have, ag->msglen - c->have, MSG_DONTWAIT)) > 0 ) {
+       c->have += n;
+       if( c->have < ag->msglen ) continue;
+       c->have = 0;
+       if( memcmp(h->magic, AGG_MAGIC, 4) != 0 || h->xpix != (uint32_t) ag->cfg->xpix || h->ypix != (uint32_t) ag->cfg->ypix || h->node >= CONFIG_MAXNODES ) {
+          ag->bad++;
+          AggDrop(c, "sent an image that is not ours (check the nodes' xpix and ypix)");
+          return;
+       }
+       if( c->node < 0 ) {
+          printf("AGGREGATOR: node %d connected, imaging %d boards\n", h->node, h->nroach); fflush(stdout);
+          c->node = h->node;
+       }
+       AggPiece(ag, h, (const uint16_t *) (c->buf + sizeof(struct aggheader)));
+    }
+    if( n == 0 ) AggDrop(c, "disconnected");
+    else if( errno != EAGAIN && errno != EWOULDBLOCK ) AggDrop(c, "connection failed");
+}
+
+static int AggListen(int port)
+{
+    struct sockaddr_in si;
+    int fd, one = 1;
+
+    if( (fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1 ) {
+       perror("aggregator socket");
+       return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&si, 0, sizeof(si));
+    si.sin_family = AF_INET;
+    si.sin_port = htons(port);
+    si.sin_addr.s_addr = htonl(INADDR_ANY);
+    if( bind(fd, (const struct sockaddr *) &si, sizeof(si)) == -1 || listen(fd, CONFIG_MAXNODES) == -1 ) {
+       perror("aggregator bind");
+       close(fd);
+       return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char *argv[])
+{
+    struct pm2config cfg;
+    struct aggregator ag;
+    struct pollfd pfd[CONFIG_MAXNODES+1];
+    char host[128];
+    int i, fd, opt, port;
+    int64_t now, lastlog;
+
+    memset(&ag, 0, sizeof(ag));
+    ag.timeout = 1000;
+    ag.nodes = -1;
+    while( (opt = getopt(argc, argv, "n:t:")) != -1 ) {
+       switch( opt ) {
+          case 'n': ag.nodes = atoi(optarg); break;
+          case 't': ag.timeout = atoi(optarg); break;
+          default:
+             fprintf(stderr, "usage: %s [-n nodes] [-t ms to wait for a slow node] [config]\n", argv[0]);
+             return 1;
+       }
+    }
+    ConfigLoad(optind < argc ? argv[optind] : NULL, &cfg);
+    if( ag.nodes < 1 || ag.nodes > CONFIG_MAXNODES ) ag.nodes = cfg.nodes;
+    if( AggAddress(cfg.aggregator, host, sizeof(host), &port) != 0 ) {
+       fprintf(stderr, "Aggregator: set aggregator = host:port in the config, the nodes send to it\n");
+       return 1;
+    }
+
+    ag.cfg = &cfg;
+    ag.npix = ConfigNpix(&cfg);
+    ag.msglen = sizeof(struct aggheader) + sizeof(uint16_t) * (ag.npix+1);
+    ag.lastout = INT64_MIN;
+    if( (ag.out = AllocImage(&cfg)) == NULL ) return 1;
+    for(i=0;i<AGG_MAXPENDING;i++) {
+       if( (ag.frame[i].sum = calloc(ag.npix+1, sizeof(uint32_t))) == NULL ) return 1;
+    }
+    for(i=0;i<CONFIG_MAXNODES;i++) {
+       ag.conn[i].fd = -1;
+       if( (ag.conn[i].buf = malloc(ag.msglen)) == NULL ) return 1;
+    }
+    if( cfg.liveslots > 0 && (ag.live = LiveCreate(&cfg, cfg.liveslots)) == NULL ) return 1;
+    if( (ag.render = RenderCreate(cfg.xpix, cfg.ypix)) == NULL ) return 1;
+    if( (ag.listenfd = AggListen(port)) == -1 ) return 1;
+
+    signal(SIGINT, Quit);
+    signal(SIGTERM, Quit);
+    signal(SIGPIPE, SIG_IGN);
+    lastlog = NowMs();
+    printf("AGGREGATOR: merging %dx%d images from %d nodes on port %d, waiting up to %d ms for a slow one\n", cfg.xpix, cfg.ypix, ag.nodes, port, ag.timeout); fflush(stdout);
+
+    while( !quit ) {
+       pfd[0].fd = ag.listenfd;
+       pfd[0].events = POLLIN;
+       for(i=0;i<CONFIG_MAXNODES;i++) {
+          pfd[i+1].fd = ag.conn[i].fd;
+          pfd[i+1].events = POLLIN;
+       }
+       if( poll(pfd, CONFIG_MAXNODES+1, AGG_POLLMS) < 0 && errno != EINTR ) {
+          perror("aggregator poll");
+          break;
+       }
+
+       if( pfd[0].revents & POLLIN ) {
+          if( (fd = accept4(ag.listenfd, NULL, NULL, SOCK_CLOEXEC)) != -1 ) {
+             for(i=0;i<CONFIG_MAXNODES && ag.conn[i].fd != -1;i++) ;
+             if( i == CONFIG_MAXNODES ) close(fd);
+             else {
+                ag.conn[i].fd = fd;
+                ag.conn[i].node = -1;
+                ag.conn[i].have = 0;
+             }
+          }
+       }
+       for(i=0;i<CONFIG_MAXNODES;i++) {
+          if( ag.conn[i].fd != -1 && (pfd[i+1].revents & (POLLIN | POLLHUP | POLLERR)) ) AggRead(&ag, &ag.conn[i]);
+       }
+
+       // a node that is down or slow only holds a frame up for the timeout
+       now = NowMs();
+       for(i=0;i<AGG_MAXPENDING;i++) {
+          if( ag.frame[i].used && now - ag.frame[i].first > ag.timeout ) AggWriteBefore(&ag, ag.frame[i].start + 1);
+       }
+
+       if( now - lastlog >= AGG_LOGMS ) {
+          printf("AGGREGATOR: %lu frames written, %lu partial, %lu late pieces dropped, %lu bad\n", ag.written, ag.partial, ag.late, ag.bad); fflush(stdout);
+          lastlog = now;
+       }
+    }
+
+    AggWriteBefore(&ag, INT64_MAX);
+    printf("AGGREGATOR: Closing, %lu frames written, %lu partial, %lu late pieces dropped, %lu bad\n", ag.written, ag.partial, ag.late, ag.bad);
+    for(i=0;i<CONFIG_MAXNODES;i++) {
+       if( ag.conn[i].fd != -1 ) close(ag.conn[i].fd);
+       free(ag.conn[i].buf);
+    }
+    for(i=0;i<AGG_MAXPENDING;i++) free(ag.frame[i].sum);
+    close(ag.listenfd);
+    RenderFree(ag.render);
+    LiveFree(ag.live);
+    free(ag.out);
+    return 0;
+}
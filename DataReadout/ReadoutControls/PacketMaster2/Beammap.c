@@ -0,0 +1,63 @@
+// Beammap.c
+// remap the pixel coordinates the boards stamp on each photon, see Beammap.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Beammap.h"
+
+struct beammap *BeammapLoad(const char *path, const struct pm2config *cfg)
+{
+    struct beammap *bm;
+    FILE *rp;
+    char line[512], *p;
+    unsigned int i, r, first, last, to;
+    int roach, x, y, px, py, n, lineno = 0, bad = 0;
+
+    if( (rp = fopen(path, "r")) == NULL ) {
+       perror(path);
+       return NULL;
+    }
+    if( (bm = calloc(1, sizeof(struct beammap))) == NULL ) {
+       fclose(rp);
+       return NULL;
+    }
+    bm->nroach = cfg->nroach;
+    bm->npix = ConfigNpix(cfg);
+    if( posix_memalign((void **) &bm->map, 64, sizeof(uint32_t) * bm->nroach * (bm->npix+1)) != 0 ) {
+       free(bm);
+       fclose(rp);
+       return NULL;
+    }
+    for(r=0;r<bm->nroach;r++)
+       for(i=0;i<=bm->npix;i++) bm->map[r*(bm->npix+1) + i] = i;
+
+    while( fgets(line, sizeof(line), rp) != NULL ) {
+       lineno++;
+       if( (p = strchr(line, '#')) != NULL ) *p = 0;
+       if( (n = sscanf(line, "%d %d %d %d %d", &roach, &x, &y, &px, &py)) <= 0 ) continue;
+       if( n < 5 || roach < -1 || roach >= cfg->nroach || x < 0 || x >= cfg->xpix || y < 0 || y >= cfg->ypix ||
+           !((px == -1 && py == -1) || (px >= 0 && px < cfg->xpix && py >= 0 && py < cfg->ypix)) ) {
+          if( bad++ < 10 ) fprintf(stderr, "Beammap: %s:%d is not roach x y px py for %d boards and a %dx%d array\n", path, lineno, cfg->nroach, cfg->xpix, cfg->ypix);
+          continue;
+       }
+       to = px < 0 ? bm->npix : (unsigned int) (px*cfg->ypix + py);
+       if( to == bm->npix ) bm->nbad++;
+       else bm->nmoved++;
+       first = roach < 0 ? 0 : roach;
+       last = roach < 0 ? bm->nroach : (unsigned int) roach + 1;
+       for(r=first;r<last;r++) bm->map[r*(bm->npix+1) + x*cfg->ypix + y] = to;
+    }
+    fclose(rp);
+
+    if( bad > 0 ) fprintf(stderr, "Beammap: skipped %d lines of %s\n", bad, path);
+    return bm;
+}
+
+void BeammapFree(struct beammap *bm)
+{
+    if( bm == NULL ) return;
+    free(bm->map);
+    free(bm);
+}
@@ -0,0 +1,50 @@
+// Beammap.h
+// remap the pixel coordinates the boards stamp on each photon to the physical pixel layout
+//
+// The firmware stamps each photon with the x and y it was loaded with from the beammap.  After the
+// beammap is redone (DataReadout/Setup/DARKNESS-Beammapping) the boards can keep stamping the old
+// coordinates: a remap table sends every (roach, stamped pixel) to the pixel it really is.  The table
+// is loaded from a text file with a line
+//
+//   roach x y px py
+//
+// per pixel that moved, roach -1 for a line that holds for every board, and px py = -1 -1 for a bad
+// pixel, whose photons go to the sink pixel with the off-array ones.  A stamped pixel with no line
+// keeps its coordinates.  MakeRemap.py writes one from the old and new Beamlist files.
+//
+// In memory it is one flat uint32 index per stamped pixel per board, sink pixel included, so applying
+// it is a single load per photon with no branch, after the decoder has already clamped anything off
+// the array to the sink.  The Cuber loads cfg->beammap at startup and again whenever a BEAMMAP file
+// is dropped on the ramdisk (see Control.h), swapping the table in without a restart.
+
+#ifndef BEAMMAP_H
+#define BEAMMAP_H
+
+#include <stdint.h>
+
+#include "Config.h"
+#include "PhotonDecode.h"
+
+struct beammap {
+    unsigned int nroach;
+    unsigned int npix;              // pixels in the array, each board's table has one more for the sink
+    unsigned int nmoved;            // lines of the file that move a pixel
+    unsigned int nbad;              // lines that mark one bad
+    uint32_t *map;                  // map[roach * (npix+1) + stamped pixel] = physical pixel
+};
+
+// load a remap for cfg's array and boards from path, NULL (and the reason on stderr) if it can't be used
+struct beammap *BeammapLoad(const char *path, const struct pm2config *cfg);
+
+void BeammapFree(struct beammap *bm);
+
+// replace the decoded pixel indices of a packet from roach (< nroach) with the physical ones
+static inline void RemapPhotons(const struct beammap *bm, unsigned int roach, struct photonbatch *pb)
+{
+    const uint32_t *map = bm->map + (size_t) roach * (bm->npix + 1);
+    unsigned int i;
+
+    for(i=0;i<pb->n;i++) pb->pix[i] = map[pb->pix[i]];
+}
+
+#endif
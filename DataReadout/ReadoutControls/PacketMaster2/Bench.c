@@ -0,0 +1,291 @@
+// Bench.c
+// microbenchmarks for the PacketMaster2 stages, results as JSON on stdout
+//
+// Each benchmark runs the same library code the pipeline runs on synthetic DARKNESS packets (in the
+// configured firmware's format), for at least BENCH_MINTIME seconds, and reports a rate:
+//
+//   decode      DecodePhotons() on full packets, photons/s
+//   parse       decode plus HistogramPhotons(), the body of ParsePacket(), photons/s
+//   cube        parse plus CubePhotons() into 64 wavelength bins, photons/s
+//   framing     FramerPush()/FramerNext() over a stream of whole and short packets, packets/s
+//   image       AddImage() of one subframe into another, and RollingAdd() over a 10 subframe window, images/s
+//   pack        PackRecord() and UnpackRecord(), packets/s and the packed size
+//   disk        DiskWriter blocks to a file in -d dir, MB/s (skipped with -d "")
+//
+// The build (packet format, decode kernel, compiler, geometry) goes in the output too, so runs on different hosts and
+// builds can be compared.  bench_e2e.py runs the whole pipeline against LoadGen.
+//
+//   Bench [-d dir] [-m disk MB]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "Config.h"
+#include "PhotonDecode.h"
+#include "PacketFramer.h"
+#include "PhotonPack.h"
+#include "RollingImage.h"
+#include "DiskWriter.h"
+#include "SpectralCube.h"
+
+#define BENCH_MINTIME 0.5           // seconds each benchmark runs for at least
+#define BENCH_NPKT 4096             // synthetic packets cycled through
+#define BENCH_NPHOT 100             // photons in a full packet
+
+// compile with gcc -O2 -o Bench Bench.c Config.c PhotonDecode.c PacketFramer.c PhotonPack.c RollingImage.c DiskWriter.c SpectralCube.c Realtime.c PacketCodec.c -I. -lm -lrt -lpthread
+
+struct packets {
+    char *data;                     // BENCH_NPKT packets of BENCH_NPHOT+1 words, big endian
+    unsigned int *len;              // bytes of each, a short one has a fake photon on the end
+};
+
+static double Now()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+static uint64_t Rand(uint64_t *s)
+{
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 0x2545F4914F6CDD1DUL;
+}
+
+// one packet in three short, photons on the board's columns with a slowly wandering baseline, like LoadGen
+static void MakePackets(struct packets *p, const struct pm2config *cfg)
+{
+    uint64_t s = 12345, r;
+    char *words;
+    unsigned int i, k, n, roach, ncol = cfg->xpix / cfg->nroach > 0 ? cfg->xpix / cfg->nroach : 1;
+    uint32_t baseline = 40000;
+
+    p->data = aligned_alloc(64, (size_t) BENCH_NPKT * 8 * (BENCH_NPHOT + 1));
+    p->len = malloc(sizeof(unsigned int) * BENCH_NPKT);
+    for(k=0;k<BENCH_NPKT;k++) {
+       words = p->data + (size_t) k * 8 * (BENCH_NPHOT + 1);
+       roach = k % cfg->nroach;
+       n = k % 3 ? BENCH_NPHOT : 1 + Rand(&s) % (BENCH_NPHOT - 2);
+       cfg->codec->putheader(words, roach, k / cfg->nroach % 4096, k / cfg->nroach);
+       for(i=0;i<n;i++) {
+          r = Rand(&s);
+          baseline = (baseline + (r >> 60) - 8) & 0x1FFFF;
+          cfg->codec->putphoton(&words[8*(i+1)], (roach * ncol + (r & 0xFFFF) % ncol) % cfg->xpix, ((r >> 16) & 0xFFFF) % cfg->ypix,
+                                i * 500 / n, (r >> 32) & 0x3FFF, baseline);
+       }
+       if( n < BENCH_NPHOT ) {
+          cfg->codec->putshort(&words[8*(n+1)]);
+          n++;
+       }
+       p->len[k] = 8 * (n + 1);
+    }
+}
+
+static inline char *Packet(const struct packets *p, unsigned int k)
+{
+    return p->data + (size_t) (k % BENCH_NPKT) * 8 * (BENCH_NPHOT + 1);
+}
+
+// photons in packet k, without the fake photon
+static inline unsigned int Photons(const struct packets *p, unsigned int k)
+{
+    unsigned int n = p->len[k % BENCH_NPKT] / 8 - 1;
+
+    return n < BENCH_NPHOT ? n - 1 : n;
+}
+
+// level 0 decodes, 1 histograms too and 2 fills the cube as well
+static double BenchDecode(const struct packets *p, int level, const struct pm2config *cfg)
+{
+    struct photonbatch *pb = aligned_alloc(64, sizeof(struct photonbatch));
+    uint16_t *image = AllocImage(cfg);
+    uint32_t *cube = level > 1 ? CubeAlloc(cfg) : NULL;
+    uint64_t nphot = 0, k;
+    double t0 = Now(), t;
+
+    for(k=0;;k++) {
+       DecodePhotons(Packet(p, k) + 8, Photons(p, k), pb);
+       if( level > 0 ) HistogramPhotons(image, pb);
+       if( level > 1 ) CubePhotons(cube, pb, cfg);
+       nphot += pb->n;
+       if( (k & 1023) == 1023 && (t = Now() - t0) >= BENCH_MINTIME ) break;
+    }
+    free(pb);
+    free(image);
+    free(cube);
+    return nphot / t;
+}
+
+static double BenchFraming(const struct packets *p)
+{
+    struct packetframer *f = FramerCreate();
+    char *packet;
+    unsigned int len;
+    uint64_t npkt = 0, k;
+    double t0 = Now(), t;
+
+    for(k=0;;k++) {
+       FramerPush(f, Packet(p, k), p->len[k % BENCH_NPKT]);
+       while( FramerNext(f, &packet, &len) ) npkt++;
+       if( (k & 1023) == 1023 && (t = Now() - t0) >= BENCH_MINTIME ) break;
+    }
+    FramerFree(f);
+    return npkt / t;
+}
+
+static double BenchAdd(const struct pm2config *cfg)
+{
+    uint16_t *a = AllocImage(cfg), *b = AllocImage(cfg);
+    uint64_t k;
+    double t0 = Now(), t;
+
+    for(k=0;k<=ConfigNpix(cfg);k++) b[k] = k & 7;
+    for(k=0;;k++) {
+       AddImage(a, b, ConfigNpix(cfg) + 1);
+       if( (k & 255) == 255 && (t = Now() - t0) >= BENCH_MINTIME ) break;
+    }
+    // keep the sums live
+    if( a[0] == 12345 ) printf(" ");
+    free(a);
+    free(b);
+    return k / t;
+}
+
+static double BenchRolling(const struct pm2config *cfg)
+{
+    struct pm2config c = *cfg;
+    struct rollingimage *r;
+    uint16_t *sub = AllocImage(cfg), *out = AllocImage(cfg);
+    uint64_t k;
+    double t0 = Now(), t;
+
+    c.subframe = 100;
+    c.window = 1000;
+    r = RollingCreate(&c);
+    for(k=0;k<=ConfigNpix(cfg);k++) sub[k] = k & 7;
+    for(k=0;;k++) {
+       RollingAdd(r, sub, out);
+       if( (k & 255) == 255 && (t = Now() - t0) >= BENCH_MINTIME ) break;
+    }
+    RollingFree(r);
+    free(sub);
+    free(out);
+    return k / t;
+}
+
+static double BenchPack(const struct packets *p, double *ratio, double *unpack)
+{
+    char *rec = malloc((size_t) BENCH_NPKT * PACK_MAXREC), out[PACK_MAXLEN];
+    unsigned int *reclen = malloc(sizeof(unsigned int) * BENCH_NPKT), used, pktlen, len;
+    uint64_t k, in = 0, packed = 0;
+    double t0 = Now(), t, rate;
+
+    for(k=0;;k++) {
+       reclen[k % BENCH_NPKT] = PackRecord(Packet(p, k), p->len[k % BENCH_NPKT], rec + (k % BENCH_NPKT) * PACK_MAXREC, &used, &pktlen);
+       in += used;
+       packed += reclen[k % BENCH_NPKT];
+       if( (k & 1023) == 1023 && (t = Now() - t0) >= BENCH_MINTIME ) break;
+    }
+    rate = k / t;
+    *ratio = (double) packed / in;
+
+    t0 = Now();
+    for(k=0;;k++) {
+       UnpackRecord(rec + (k % BENCH_NPKT) * PACK_MAXREC, reclen[k % BENCH_NPKT], out, &len);
+       if( (k & 1023) == 1023 && (t = Now() - t0) >= BENCH_MINTIME ) break;
+    }
+    *unpack = k / t;
+    free(rec);
+    free(reclen);
+    return rate;
+}
+
+static double BenchDisk(const char *dir, int mb, int *direct)
+{
+    struct diskwriter *dw;
+    char fname[DW_PATHLEN], *buf;
+    uint64_t written = 0, latency;
+    int i, queued;
+    double t0, t;
+
+    snprintf(fname, sizeof(fname), "%s/pm2bench.%d.bin", dir, getpid());
+    if( (dw = DiskWriterCreate()) == NULL || (buf = malloc(1 << 20)) == NULL ) return 0;
+    memset(buf, 0x5A, 1 << 20);
+
+    t0 = Now();
+    DiskWriterOpen(dw, fname, NULL);
+    for(i=0;i<mb;i++) DiskWriterAppend(dw, buf, 1 << 20);
+    DiskWriterClose(dw);
+    DiskWriterStats(dw, &written, &latency, &queued);
+    *direct = dw->direct;
+    DiskWriterFree(dw);
+    t = Now() - t0;
+
+    remove(fname);
+    free(buf);
+    return mb / t;
+}
+
+int main(int argc, char *argv[])
+{
+    struct pm2config cfg;
+    struct packets p;
+    const char *dir = "/tmp";
+    double decode, parse, cube, framing, add, rolling, pack, ratio, unpack, disk = 0;
+    int opt, mb = 256, direct = 0;
+
+    ConfigLoad(NULL, &cfg);
+    while( (opt = getopt(argc, argv, "d:m:")) != -1 ) {
+       switch( opt ) {
+          case 'd': dir = optarg; break;
+          case 'm': mb = atoi(optarg); break;
+          default:
+             fprintf(stderr, "usage: %s [-d dir for the disk benchmark, \"\" to skip it] [-m MB to write]\n", argv[0]);
+             return 1;
+       }
+    }
+
+    DecodeInit(cfg.codec, cfg.xpix, cfg.ypix);
+    MakePackets(&p, &cfg);
+
+    fprintf(stderr, "Bench: decode\n");
+    decode = BenchDecode(&p, 0, &cfg);
+    parse = BenchDecode(&p, 1, &cfg);
+    cfg.cubebins = 64;
+    cube = BenchDecode(&p, 2, &cfg);
+    fprintf(stderr, "Bench: framing\n");
+    framing = BenchFraming(&p);
+    fprintf(stderr, "Bench: image\n");
+    add = BenchAdd(&cfg);
+    rolling = BenchRolling(&cfg);
+    fprintf(stderr, "Bench: pack\n");
+    pack = BenchPack(&p, &ratio, &unpack);
+    if( *dir ) {
+       fprintf(stderr, "Bench: disk, %d MB to %s\n", mb, dir);
+       disk = BenchDisk(dir, mb, &direct);
+    }
+
+    printf("{\n");
+    printf("  \"build\": {\"firmware\": \"%s\", \"decode_kernel\": \"%s\", \"compiler\": \"%s\", \"xpix\": %d, \"ypix\": %d, \"nroach\": %d},\n", cfg.codec->name, DecodeKernel(), __VERSION__, cfg.xpix, cfg.ypix, cfg.nroach);
+    printf("  \"decode\": {\"photons_per_s\": %.0f},\n", decode);
+    printf("  \"parse\": {\"photons_per_s\": %.0f},\n", parse);
+    printf("  \"cube\": {\"photons_per_s\": %.0f, \"bins\": %d},\n", cube, cfg.cubebins);
+    printf("  \"framing\": {\"packets_per_s\": %.0f},\n", framing);
+    printf("  \"image\": {\"add_per_s\": %.0f, \"rolling_add_per_s\": %.0f},\n", add, rolling);
+    printf("  \"pack\": {\"packets_per_s\": %.0f, \"unpack_packets_per_s\": %.0f, \"ratio\": %.4f},\n", pack, unpack, ratio);
+    if( *dir ) printf("  \"disk\": {\"mbytes_per_s\": %.1f, \"mbytes\": %d, \"direct\": %s}\n", disk, mb, direct ? "true" : "false");
+    else printf("  \"disk\": null\n");
+    printf("}\n");
+
+    free(p.data);
+    free(p.len);
+    return 0;
+}
@@ -1,143 +1,421 @@
-// BinCheck.c 
+// BinCheck.c
 // check the .bin files written out by PacketMaster2
 //    Ben Mazin, 7/2/16
+//
+// Each file is mapped into memory and cut into chunks that start on a packet header.  A pool of threads
+// checks the chunks: per ROACH the frame counter has to step by one from packet to packet and photon
+// times must never go backwards.  Each chunk remembers the first and last frame and time it saw for
+// every board, so when the pool is done the chunks are stitched back together in file order and the
+// sequence is checked across chunk and file boundaries too.  The header times wrap, so each chunk
+// unwraps them against the newest it has seen, starting from the time its file was opened.  The photons are binned into an image on
+// the way through, which can be written out as a .img for Bin2PNG.  A bit packed file is unpacked
+// whole and checked as one chunk.  The packets are read in the format of the firmware the first file's
+// header names.
+//
+//   BinCheck [-j threads] [-r roach] [-o image.img] [-v] file.bin [file.bin ...]
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
-#include <sys/types.h>
-#include <sys/wait.h>
 #include <string.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <netdb.h>
 #include <stdint.h>
-#include <sys/time.h>
-#include <signal.h>
 #include <time.h>
-#include <errno.h>
 #include <pthread.h>
-#include <semaphore.h>
-#include <signal.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
-#include <inttypes.h>
-#include <math.h>
+
+#include "Config.h"
+#include "BinFile.h"
+#include "PhotonDecode.h"
+#include "Timebin.h"
 
 #define _POSIX_C_SOURCE 200809L
 
-#define BUFLEN 1500
-#define PORT 50000
-#define XPIX 80
-#define YPIX 125
-#define NROACH 10
-
-// compile with gcc -o BinCheck BinCheck.c -I. -lm -lrt
-
-struct datapacket {
-    unsigned int xcoord:10;
-    unsigned int ycoord:10;
-    unsigned int timestamp:9;
-    unsigned int wvl:18;
-    unsigned int baseline:17;
-}__attribute__((packed));;
-
-struct hdrpacket {
-    unsigned int start:8;
-    unsigned int roach:8;
-    unsigned int frame:12;
-    unsigned long timestamp:36;
-}__attribute__((packed));;
+#define CHUNKLEN (8*1024*1024)      // bytes of packets per unit of work
 
-int main(int argc, char *argv[])
-{	
-    FILE *rp;
-    uint64_t d1,curroach,curframe,curtime,timestamp,pnum,hnum;
-    struct hdrpacket *hdr;
-    struct datapacket *data;
-    uint64_t frame[NROACH],nphot[NROACH];
-    double arrivaltime[NROACH];
-    long i;
-    double photontime, curphotontime;    
-
-    // Make sure that the output filename argument has been provided
-	if (argc != 2) {
-		fprintf(stderr, "Please specify input .bin file to check!\n");
-		return 1;
-	}
-	
-	printf("Loading %s\n",argv[1]);
-    rp = fopen(argv[1],"rb");
-
-    pnum = 0;
-    curroach = 0;
-    curframe = 0;
-    timestamp = 0;
-    hnum = 0;
-    memset(frame,0,sizeof(frame[0])*NROACH);
-    memset(nphot,0,sizeof(nphot[0])*NROACH);
-    memset(arrivaltime,0.0,sizeof(arrivaltime[0])*NROACH);
-        
-    while( !feof(rp) ) {
-        fread(&d1,sizeof(d1),1,rp);
-        hdr = (struct hdrpacket *) &d1;
-        
-        // see if the packet we read in was a header packet
-        if (hdr->start == 0b11111111) {         // found new packet header!
-            curroach = hdr->roach;
-            curframe = hdr->frame;
-            timestamp = hdr->timestamp;
-            photontime = ((double)timestamp)/2000.0 + 1451606400.0;
-            
-            // check if frame arrived in sequence
-            if( frame[curroach] != curframe ) {
-                if( frame[curroach] != 0 ) printf("Hdr packets %d: Nphot %d: Roach %d: Expected Frame %d, Received Frame %d\n",hnum,pnum,curroach,frame[curroach],curframe); fflush(stdout); // don't print error until we know what frame we are at
-                frame[curroach] = curframe+1;
-            }
-            else {
-                frame[curroach] = (frame[curroach]+1)%4096;
-            }
-                       
-            hnum++; 
-        }
-        else {                                  // must be a data packet!
-            // if we haven't seen a header packet yet ignore this photon 
-            if( hnum == 0 ) continue;            
-            // if it is a fake photon skip it            
-            if (hdr->start == 0b01111111 && hdr->roach == 0b11111111 ) continue;
-            
-            data = (struct datapacket *) &d1;
-            curphotontime = photontime + (1e-6*((double)data->timestamp));
-            //printf(" - (%d,%d,%d) Timestamp = %f, Last Photon = %f\n",hnum,pnum,data->timestamp,curphotontime,arrivaltime[curroach]);           
-            
-            if( curphotontime <= arrivaltime[curroach] ) {
-                printf("Photon out of time order! (%d,%d) Timestamp = %f, Last Photon = %f\n",hnum,pnum,curphotontime,arrivaltime[curroach]);
-            }
-            arrivaltime[curroach] = curphotontime;
-            
-            //printf("Timestamp = %f, Last Packet = %f\n",photontime,curphotontime);
-            
-            // construct photon arrival time and see if it is out of order
-            
-            
-            nphot[curroach]++;
-            pnum++;            
-            
-            if(nphot[0] > 20) break;
-        }
-        
-    }
-    
-    printf("Received %d header packets.\n",hnum);
-    printf("Received %d photon data packets.\n",pnum);
-    for(i=0;i<NROACH;i++) printf("ROACH %d -> %d photons\n",i,nphot[i]);
-    
-        
-    fclose(rp);
+// compile with gcc -O2 -o BinCheck BinCheck.c Config.c BinFile.c PhotonPack.c PhotonDecode.c PacketCodec.c -I. -lm -lrt -lpthread
+
+// what one chunk saw from one board
+struct roachstats {
+    uint64_t npkt, nphot;
+    int firstframe, lastframe;      // -1 until the board's first packet
+    uint64_t firsttime, lasttime;   // photon times in us since TIMEBIN_EPOCH
+    uint64_t frameerr, timeerr;
+};
+
+struct unit {
+    int file;
+    int chunk, nchunk;
+    struct roachstats *rs;          // nroach of them
+    uint64_t bytes;
+    uint64_t badroach;              // packets from a roach id past the end of the array
+    uint64_t stray;                 // words outside any packet
+    int failed;
+};
+
+struct binfile {
+    const char *name;
+    uint64_t datastart, dataend;
+    int container;
+    int packed;                     // PhotonPack records, checked as one unit once unpacked
+    int64_t start;                  // ticks when the Writer opened it (last wrote it, for raw packets)
+};
+
+struct checker {
+    struct binfile *file;
+    struct unit *unit;
+    int nunit;
+    int next;                       // next unit to hand out
+    int nroach, roach, verbose;
+    unsigned int npix;
+    const struct packetcodec *codec;
+};
 
+struct worker {
+    pthread_t thread;
+    struct checker *ck;
+    uint32_t *image;                // npix+1, the last is the off-array sink
+};
+
+// first header word at or after pos, or end
+static uint64_t NextHeader(const char *base, uint64_t start, uint64_t pos, uint64_t end)
+{
+    pos = start + ((pos - start) & ~(uint64_t) 7);
+    while( pos + 8 <= end && !CodecIsHeader(base + pos) ) pos += 8;
+    return pos + 8 <= end ? pos : end;
 }
 
+static void CheckPhotons(struct checker *ck, struct worker *wk, struct unit *u, struct roachstats *rs,
+                         const char *words, unsigned int n, uint64_t t0, uint64_t pos)
+{
+    struct photonbatch pb;
+    unsigned int i, j, m;
+    uint64_t t;
+
+    for(i=0;i<n;i+=m) {
+       m = n - i < DECODE_MAXPHOT ? n - i : DECODE_MAXPHOT;
+       DecodePhotons(words + 8*i, m, &pb);
+       for(j=0;j<pb.n;j++) {
+          wk->image[pb.pix[j]]++;
+          t = t0 + pb.timestamp[j];
+          if( rs->nphot > 0 && t < rs->lasttime ) {
+             rs->timeerr++;
+             if( ck->verbose ) printf("%s: byte %lu: Photon out of time order, %lu us before the last one\n",ck->file[u->file].name,pos + 8*(i+j),rs->lasttime - t);
+          }
+          if( rs->nphot == 0 ) rs->firsttime = t;
+          rs->lasttime = t;
+          rs->nphot++;
+       }
+    }
+}
+
+static void CheckUnit(struct checker *ck, struct worker *wk, struct unit *u)
+{
+    struct binfile *bf = &ck->file[u->file];
+    struct roachstats *rs;
+    struct packetheader hdr;
+    const char *base;
+    char *raw = NULL;
+    struct stat st;
+    uint64_t len, start, end, pos, run, t0;
+    int64_t newest = bf->start, t;
+    int fd, roach, frame;
+
+    if( (fd = open(bf->name, O_RDONLY)) == -1 || fstat(fd, &st) == -1 || st.st_size < (off_t) bf->dataend ) {
+       perror(bf->name);
+       if( fd != -1 ) close(fd);
+       u->failed = 1;
+       return;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if( base == MAP_FAILED ) {
+       perror(bf->name);
+       u->failed = 1;
+       return;
+    }
+    madvise((void *) base, st.st_size, MADV_SEQUENTIAL);
+
+    len = bf->dataend - bf->datastart;
+    if( bf->packed ) {
+       // record boundaries can't be found from the middle, unpack the whole file and check the words
+       if( (raw = malloc(UnpackedLength(base + bf->datastart, len) + 8)) == NULL ) {
+          perror(bf->name);
+          munmap((void *) base, st.st_size);
+          u->failed = 1;
+          return;
+       }
+       end = UnpackRecords(base + bf->datastart, len, raw);
+       u->bytes = len;
+       munmap((void *) base, st.st_size);
+       base = raw;
+       start = 0;
+    }
+    else {
+       // every worker finds the same boundaries, so neighbouring chunks meet at a header
+       start = bf->datastart;
+       if( u->chunk > 0 ) start = NextHeader(base, bf->datastart, bf->datastart + len*u->chunk/u->nchunk, bf->dataend);
+       end = bf->dataend;
+       if( u->chunk + 1 < u->nchunk ) end = NextHeader(base, bf->datastart, bf->datastart + len*(u->chunk+1)/u->nchunk, bf->dataend);
+       u->bytes = end - start;
+    }
+
+    pos = start;
+    while( pos + 8 <= end ) {
+       if( !CodecIsHeader(base + pos) ) {
+          // junk before the first header or after a short packet's fake photon
+          u->stray++;
+          pos += 8;
+          continue;
+       }
+
+       ck->codec->header(base + pos, &hdr);
+       roach = hdr.roach;
+       frame = hdr.frame;
+       t = TimebinNearest(hdr.ticks, ck->codec->tickbits, newest);
+       if( t > newest ) newest = t;
+       t0 = (uint64_t) t * (1000/TIMEBIN_TICKS);
+
+       // the photons run to the next header or the fake photon that ends a short packet
+       pos += 8;
+       run = pos;
+       while( pos + 8 <= end && !CodecIsHeader(base + pos) && !CodecIsShort(base + pos) ) pos += 8;
 
+       if( roach >= ck->nroach ) u->badroach++;
+       else if( ck->roach < 0 || roach == ck->roach ) {
+          rs = &u->rs[roach];
+          if( rs->lastframe >= 0 && frame != (rs->lastframe + 1) % 4096 ) {
+             rs->frameerr++;
+             if( ck->verbose ) printf("%s: byte %lu: Roach %d: Expected Frame %d, Received Frame %d\n",bf->name,run-8,roach,(rs->lastframe+1)%4096,frame);
+          }
+          if( rs->firstframe < 0 ) rs->firstframe = frame;
+          rs->lastframe = frame;
+          rs->npkt++;
+          CheckPhotons(ck, wk, u, rs, base + run, (pos - run)/8, t0, run);
+       }
 
+       if( pos + 8 <= end && CodecIsShort(base + pos) ) pos += 8;
+    }
+
+    if( raw != NULL ) free(raw);
+    else munmap((void *) base, st.st_size);
+}
+
+static void *CheckThread(void *arg)
+{
+    struct worker *wk = (struct worker *) arg;
+    struct checker *ck = wk->ck;
+    int i;
 
+    while( (i = __atomic_fetch_add(&ck->next, 1, __ATOMIC_RELAXED)) < ck->nunit ) CheckUnit(ck, wk, &ck->unit[i]);
+    return NULL;
+}
+
+static int CompareNames(const void *a, const void *b)
+{
+    return strcmp(*(const char **) a, *(const char **) b);
+}
+
+static double Now()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + 1e-9*t.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+    struct pm2config cfg;
+    struct checker ck;
+    struct worker *wk;
+    struct binfile *bf;
+    struct binheader h;
+    struct binentry *index;
+    struct stat st;
+    struct roachstats *total, *rs, *prev;
+    struct unit *u;
+    FILE *rp, *wp;
+    const struct packetcodec *codec;
+    const char *outname = NULL;
+    char **names;
+    uint64_t nentries, bytes = 0, badroach = 0, stray = 0, err;
+    uint32_t *image;
+    uint16_t *img;
+    unsigned int p;
+    int i, j, k, r, opt, nthreads, nfiles, geometry = 0;
+    double t0;
+
+    ConfigLoad(NULL, &cfg);
+    memset(&ck, 0, sizeof(ck));
+    ck.roach = -1;
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    while( (opt = getopt(argc, argv, "j:r:o:v")) != -1 ) {
+       switch( opt ) {
+          case 'j': nthreads = atoi(optarg); break;
+          case 'r': ck.roach = atoi(optarg); break;
+          case 'o': outname = optarg; break;
+          case 'v': ck.verbose = 1; break;
+          default:
+             fprintf(stderr, "usage: %s [-j threads] [-r roach] [-o image.img] [-v] file.bin [file.bin ...]\n", argv[0]);
+             return 1;
+       }
+    }
+    if( optind >= argc ) {
+       fprintf(stderr, "Please specify the .bin files to check!\n");
+       return 1;
+    }
+    if( nthreads < 1 ) nthreads = 1;
+
+    // the file names are the second they were opened, so name order is time order
+    nfiles = argc - optind;
+    names = &argv[optind];
+    qsort(names, nfiles, sizeof(char *), CompareNames);
+
+    // read the headers, split every file into chunks
+    bf = calloc(nfiles, sizeof(struct binfile));
+    ck.nroach = cfg.nroach;
+    for(i=0;i<nfiles;i++) {
+       bf[i].name = names[i];
+       if( (rp = fopen(names[i], "rb")) == NULL ) {
+          perror(names[i]);
+          bf[i].container = -1;
+          continue;
+       }
+       bf[i].container = BinLoad(rp, &h, &index, &nentries, &bf[i].datastart, &bf[i].dataend);
+       if( bf[i].container > 0 ) bf[i].start = TimebinClock(h.starttime, h.startnsec);
+       else bf[i].start = TimebinClock(fstat(fileno(rp), &st) == 0 ? st.st_mtime : time(NULL), 0);
+       fclose(rp);
+       free(index);
+       if( bf[i].container < 0 ) continue;
+       bf[i].packed = bf[i].container > 0 && h.codec == BIN_CODEC_PACK;
+       if( (codec = BinCodec(&h, bf[i].container, &cfg)) == NULL ) {
+          printf("%s: firmware %.32s has no packet format, skipping it\n",names[i],h.firmware);
+          bf[i].container = -1;
+          continue;
+       }
+       if( ck.codec == NULL ) ck.codec = codec;
+       else if( codec != ck.codec ) {
+          printf("%s: %s packets, not %s like the first file, skipping it\n",names[i],codec->name,ck.codec->name);
+          bf[i].container = -1;
+          continue;
+       }
+       if( bf[i].container > 0 ) {
+          if( (int) h.nroach > ck.nroach ) ck.nroach = h.nroach;
+          if( !geometry ) {
+             cfg.xpix = h.xpix;
+             cfg.ypix = h.ypix;
+          }
+          else if( h.xpix != (uint32_t) cfg.xpix || h.ypix != (uint32_t) cfg.ypix ) printf("%s: %ux%u array, imaging it as %dx%d\n",names[i],h.xpix,h.ypix,cfg.xpix,cfg.ypix);
+          geometry = 1;
+       }
+       ck.nunit += bf[i].packed ? 1 : (bf[i].dataend - bf[i].datastart + CHUNKLEN - 1) / CHUNKLEN;
+    }
+    if( ck.roach >= ck.nroach ) {
+       fprintf(stderr, "Roach %d is outside the %d board array\n",ck.roach,ck.nroach);
+       return 1;
+    }
+
+    ck.file = bf;
+    ck.unit = calloc(ck.nunit, sizeof(struct unit));
+    for(i=0,k=0;i<nfiles;i++) {
+       if( bf[i].container < 0 ) continue;
+       r = bf[i].packed ? 1 : (bf[i].dataend - bf[i].datastart + CHUNKLEN - 1) / CHUNKLEN;
+       for(j=0;j<r;j++,k++) {
+          ck.unit[k].file = i;
+          ck.unit[k].chunk = j;
+          ck.unit[k].nchunk = r;
+          ck.unit[k].rs = calloc(ck.nroach, sizeof(struct roachstats));
+          for(p=0;p<(unsigned int) ck.nroach;p++) ck.unit[k].rs[p].firstframe = ck.unit[k].rs[p].lastframe = -1;
+       }
+    }
+
+    if( ck.codec == NULL ) ck.codec = cfg.codec;
+    DecodeInit(ck.codec, cfg.xpix, cfg.ypix);
+    ck.npix = ConfigNpix(&cfg);
+    printf("Checking %d files (%d chunks) on %d threads, %dx%d pixels, %d roaches, %s packets, %s decode\n",nfiles,ck.nunit,nthreads,cfg.xpix,cfg.ypix,ck.nroach,ck.codec->name,DecodeKernel());
+
+    t0 = Now();
+    wk = calloc(nthreads, sizeof(struct worker));
+    for(i=0;i<nthreads;i++) {
+       wk[i].ck = &ck;
+       wk[i].image = calloc(ck.npix + 1, sizeof(uint32_t));
+       if( pthread_create(&wk[i].thread, NULL, CheckThread, &wk[i]) != 0 ) {
+          perror("pthread_create");
+          return 1;
+       }
+    }
+    image = calloc(ck.npix + 1, sizeof(uint32_t));
+    for(i=0;i<nthreads;i++) {
+       pthread_join(wk[i].thread, NULL);
+       for(p=0;p<=ck.npix;p++) image[p] += wk[i].image[p];
+       free(wk[i].image);
+    }
+    t0 = Now() - t0;
+
+    // stitch the chunks together in file order, a board's sequence has to carry on across every seam
+    total = calloc(ck.nroach, sizeof(struct roachstats));
+    for(r=0;r<ck.nroach;r++) total[r].firstframe = total[r].lastframe = -1;
+    for(k=0;k<ck.nunit;k++) {
+       u = &ck.unit[k];
+       bytes += u->bytes;
+       badroach += u->badroach;
+       stray += u->stray;
+       for(r=0;r<ck.nroach;r++) {
+          rs = &u->rs[r];
+          prev = &total[r];
+          if( rs->npkt == 0 ) continue;
+          if( prev->lastframe >= 0 && rs->firstframe != (prev->lastframe + 1) % 4096 ) {
+             prev->frameerr++;
+             if( ck.verbose ) printf("%s: chunk %d: Roach %d: Expected Frame %d, Received Frame %d\n",bf[u->file].name,u->chunk,r,(prev->lastframe+1)%4096,rs->firstframe);
+          }
+          if( prev->nphot > 0 && rs->nphot > 0 && rs->firsttime < prev->lasttime ) prev->timeerr++;
+          if( prev->firstframe < 0 ) prev->firstframe = rs->firstframe;
+          if( prev->nphot == 0 ) prev->firsttime = rs->firsttime;
+          prev->lastframe = rs->lastframe;
+          if( rs->nphot > 0 ) prev->lasttime = rs->lasttime;
+          prev->npkt += rs->npkt;
+          prev->nphot += rs->nphot;
+          prev->frameerr += rs->frameerr;
+          prev->timeerr += rs->timeerr;
+       }
+       free(u->rs);
+    }
+
+    err = 0;
+    for(r=0;r<ck.nroach;r++) {
+       if( ck.roach >= 0 && r != ck.roach ) continue;
+       printf("ROACH %d -> %lu packets, %lu photons, %lu frame sequence errors, %lu photons out of time order",r,total[r].npkt,total[r].nphot,total[r].frameerr,total[r].timeerr);
+       if( total[r].nphot > 0 ) printf(", %.4f to %.4f",total[r].firsttime/1e6 + TIMEBIN_EPOCH,total[r].lasttime/1e6 + TIMEBIN_EPOCH);
+       printf("\n");
+       err += total[r].frameerr + total[r].timeerr;
+    }
+    if( badroach > 0 ) printf("%lu packets from roaches outside the %d board array\n",badroach,ck.nroach);
+    if( stray > 0 ) printf("%lu words outside any packet\n",stray);
+    printf("Off-array photons = %u\n",image[ck.npix]);
+    printf("Checked %.1f MBytes in %.2f s, %.0f MBytes/sec\n",bytes/1e6,t0,bytes/1e6/(t0 > 0 ? t0 : 1));
+
+    if( outname != NULL ) {
+       // same layout as the Cuber's .img, counts clipped to 16 bits
+       img = malloc(sizeof(uint16_t) * ck.npix);
+       for(p=0;p<ck.npix;p++) img[p] = image[p] > 65535 ? 65535 : image[p];
+       if( (wp = fopen(outname, "wb")) == NULL ) perror(outname);
+       else {
+          fwrite(img, sizeof(uint16_t), ck.npix, wp);
+          fclose(wp);
+          printf("Image written to %s\n",outname);
+       }
+       free(img);
+    }
+
+    for(k=0;k<ck.nunit;k++) if( ck.unit[k].failed ) err++;
+    free(total);
+    free(image);
+    free(wk);
+    free(ck.unit);
+    free(bf);
+    return err > 0 ? 2 : 0;
+}
@@ -0,0 +1,254 @@
+// BinFile.c
+// the .bin container the Writer produces, see BinFile.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "BinFile.h"
+
+_Static_assert(sizeof(struct binheader) == BIN_HDRLEN, "binheader must be BIN_HDRLEN bytes");
+_Static_assert(sizeof(struct binentry) == 24, "binentry is part of the file format");
+_Static_assert(sizeof(struct bintrailer) == 48, "bintrailer is part of the file format");
+
+void BinHeaderInit(struct binheader *h, const struct pm2config *cfg, const struct timespec *start)
+{
+    memset(h, 0, sizeof(struct binheader));
+    memcpy(h->magic, BIN_MAGIC, 8);
+    h->version = 1;
+    h->codec = BIN_CODEC_RAW;
+    h->hdrlen = BIN_HDRLEN;
+    h->xpix = cfg->xpix;
+    h->ypix = cfg->ypix;
+    h->nroach = cfg->nroach;
+    h->starttime = start->tv_sec;
+    h->startnsec = start->tv_nsec;
+    snprintf(h->firmware, sizeof(h->firmware), "%s", cfg->firmware);
+}
+
+void BinIndexReset(struct binindex *ix)
+{
+    ix->n = 0;
+    ix->first = UINT64_MAX;
+    ix->last = 0;
+    ix->unindexed = 0;
+}
+
+void BinIndexFree(struct binindex *ix)
+{
+    free(ix->entry);
+    ix->entry = NULL;
+    ix->size = 0;
+    BinIndexReset(ix);
+}
+
+void BinIndexAdd(struct binindex *ix, uint64_t offset, const char *packet, unsigned int len)
+{
+    struct binentry *e;
+    struct packetheader h;
+
+    if( len < 8 || !CodecIsHeader(packet) ) {
+       ix->unindexed += len;
+       return;
+    }
+
+    if( ix->n == ix->size ) {
+       e = realloc(ix->entry, sizeof(struct binentry) * (ix->size ? 2*ix->size : 4096));
+       if( e == NULL ) {
+          ix->unindexed += len;
+          return;
+       }
+       ix->entry = e;
+       ix->size = ix->size ? 2*ix->size : 4096;
+    }
+
+    ix->codec->header(packet, &h);
+    e = &ix->entry[ix->n++];
+    e->offset = offset;
+    e->timestamp = h.ticks;
+    e->frame = h.frame;
+    e->roach = h.roach;
+    e->pad = 0;
+    e->nphot = len/8 - 1;
+
+    if( e->timestamp < ix->first ) ix->first = e->timestamp;
+    if( e->timestamp > ix->last ) ix->last = e->timestamp;
+}
+
+const struct packetcodec *BinCodec(const struct binheader *h, int container, const struct pm2config *cfg)
+{
+    char firmware[sizeof(h->firmware)+1];
+
+    if( container <= 0 ) return cfg->codec;
+    memcpy(firmware, h->firmware, sizeof(h->firmware));
+    firmware[sizeof(h->firmware)] = 0;
+    // a header that leaves it blank is in the format there always was
+    if( firmware[0] == 0 ) return CodecDefault();
+    return CodecFind(firmware);
+}
+
+void BinTrailerInit(struct bintrailer *t, const struct binindex *ix, uint64_t index)
+{
+    memset(t, 0, sizeof(struct bintrailer));
+    t->index = index;
+    t->nentries = ix->n;
+    t->first = ix->n ? ix->first : 0;
+    t->last = ix->last;
+    t->unindexed = ix->unindexed;
+    memcpy(t->magic, BIN_IDXMAGIC, 8);
+}
+
+int BinLoad(FILE *fp, struct binheader *h, struct binentry **index, uint64_t *nentries,
+            uint64_t *datastart, uint64_t *dataend)
+{
+    struct bintrailer t;
+    long size;
+
+    *index = NULL;
+    *nentries = 0;
+    memset(h, 0, sizeof(struct binheader));
+
+    if( fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0 ) return -1;
+    *datastart = 0;
+    *dataend = size;
+    rewind(fp);
+
+    if( size < BIN_HDRLEN || fread(h, sizeof(struct binheader), 1, fp) != 1 || memcmp(h->magic, BIN_MAGIC, 8) != 0 ) {
+       // raw packets from before the container
+       memset(h, 0, sizeof(struct binheader));
+       rewind(fp);
+       return 0;
+    }
+    if( h->version > BIN_VERSION || h->hdrlen < BIN_HDRLEN || h->hdrlen > size || h->codec > BIN_CODEC_PACK ) {
+       fprintf(stderr, "BinLoad: unsupported .bin version %u\n", h->version);
+       return -1;
+    }
+    *datastart = h->hdrlen;
+
+    // a closed file ends with the trailer, and the index sits between the packets and the trailer
+    if( size >= h->hdrlen + sizeof(t) && fseek(fp, size - sizeof(t), SEEK_SET) == 0 &&
+        fread(&t, sizeof(t), 1, fp) == 1 && memcmp(t.magic, BIN_IDXMAGIC, 8) == 0 &&
+        t.index >= h->hdrlen && t.index + t.nentries*sizeof(struct binentry) + sizeof(t) == (uint64_t) size ) {
+       *dataend = t.index;
+       if( t.nentries > 0 ) {
+          if( (*index = malloc(t.nentries*sizeof(struct binentry))) == NULL ||
+              fseek(fp, t.index, SEEK_SET) != 0 || fread(*index, sizeof(struct binentry), t.nentries, fp) != t.nentries ) {
+             fprintf(stderr, "BinLoad: could not read the index\n");
+             free(*index);
+             *index = NULL;
+             fseek(fp, *datastart, SEEK_SET);
+             return 1;
+          }
+          *nentries = t.nentries;
+       }
+       fseek(fp, *datastart, SEEK_SET);
+       return 2;
+    }
+
+    fseek(fp, *datastart, SEEK_SET);
+    return 1;
+}
+
+int BinScanOpen(struct binscan *bs, FILE *fp, int roach)
+{
+    memset(bs, 0, sizeof(struct binscan));
+    bs->fp = fp;
+    bs->roach = roach;
+    bs->container = BinLoad(fp, &bs->h, &bs->index, &bs->nentries, &bs->pos, &bs->end);
+    if( bs->container > 0 && bs->h.codec == BIN_CODEC_PACK ) {
+       bs->rec = malloc(PACK_MAXREC);
+       bs->words = malloc(PACK_MAXLEN);
+       if( bs->rec == NULL || bs->words == NULL ) {
+          BinScanClose(bs);
+          return -1;
+       }
+    }
+    return bs->container;
+}
+
+// read and unpack the record at bs->pos, returns its length or 0 at the end of the packets
+static unsigned int BinScanRecord(struct binscan *bs)
+{
+    struct packrec r;
+    unsigned int n, len;
+
+    if( bs->pos + sizeof(r) > bs->end || fseek(bs->fp, bs->pos, SEEK_SET) != 0 || fread(bs->rec, sizeof(r), 1, bs->fp) != 1 ) return 0;
+    memcpy(&r, bs->rec, sizeof(r));
+    if( bs->pos + sizeof(r) + r.len > bs->end || r.len > PACK_MAXREC - sizeof(r) || fread(bs->rec + sizeof(r), 1, r.len, bs->fp) != r.len ) return 0;
+    if( (n = UnpackRecord(bs->rec, sizeof(r) + r.len, (char *) bs->words, &len)) == 0 ) {
+       fprintf(stderr, "BinScan: corrupt record at byte %lu\n", bs->pos);
+       return 0;
+    }
+    bs->pos += n;
+    bs->nwords = len/8;
+    bs->word = 0;
+    return n;
+}
+
+// BinScanWord() for a packed file, one record at a time
+static int BinScanPacked(struct binscan *bs, uint64_t *w)
+{
+    unsigned char *b;
+
+    while( bs->word == bs->nwords ) {
+       if( bs->roach >= 0 && bs->index != NULL ) {
+          while( bs->next < bs->nentries && bs->index[bs->next].roach != bs->roach ) bs->next++;
+          if( bs->next == bs->nentries ) return 0;
+          bs->pos = bs->index[bs->next].offset;
+          if( BinScanRecord(bs) == 0 ) return 0;
+          // the packet without the fake photon, as for a raw file
+          if( bs->nwords > bs->index[bs->next].nphot + 1 ) bs->nwords = bs->index[bs->next].nphot + 1;
+          bs->next++;
+          continue;
+       }
+
+       if( BinScanRecord(bs) == 0 ) return 0;
+       b = (unsigned char *) bs->words;
+       if( bs->nwords > 0 && b[0] == 0xFF ) bs->keep = (bs->roach < 0 || b[1] == bs->roach);
+       if( bs->roach >= 0 && !bs->keep ) bs->word = bs->nwords;
+    }
+    *w = bs->words[bs->word++];
+    return 1;
+}
+
+int BinScanWord(struct binscan *bs, uint64_t *w)
+{
+    unsigned char *b = (unsigned char *) w;
+
+    if( bs->rec != NULL ) return BinScanPacked(bs, w);
+
+    // jump straight to the next packet from the board we want
+    if( bs->roach >= 0 && bs->index != NULL ) {
+       while( bs->remaining == 0 ) {
+          while( bs->next < bs->nentries && bs->index[bs->next].roach != bs->roach ) bs->next++;
+          if( bs->next == bs->nentries ) return 0;
+          bs->pos = bs->index[bs->next].offset;
+          bs->remaining = bs->index[bs->next].nphot + 1;
+          bs->next++;
+          if( fseek(bs->fp, bs->pos, SEEK_SET) != 0 ) return 0;
+       }
+       if( fread(w, sizeof(uint64_t), 1, bs->fp) != 1 ) return 0;
+       bs->remaining--;
+       bs->pos += 8;
+       return 1;
+    }
+
+    while( bs->pos + 8 <= bs->end ) {
+       if( fread(w, sizeof(uint64_t), 1, bs->fp) != 1 ) return 0;
+       bs->pos += 8;
+       // the first byte of a header word is 0xFF and the second is the roach id
+       if( b[0] == 0xFF ) bs->keep = (bs->roach < 0 || b[1] == bs->roach);
+       if( bs->roach < 0 || bs->keep ) return 1;
+    }
+    return 0;
+}
+
+void BinScanClose(struct binscan *bs)
+{
+    free(bs->index);
+    free(bs->rec);
+    free(bs->words);
+    bs->index = NULL;
+    bs->rec = NULL;
+    bs->words = NULL;
+}
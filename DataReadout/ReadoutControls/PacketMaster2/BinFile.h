@@ -0,0 +1,125 @@
+// BinFile.h
+// the .bin container the Writer produces, one per second
+//
+//   struct binheader                       geometry, firmware and start time, BIN_HDRLEN bytes
+//   packets                                exactly as they came off the wire, in the firmware's format
+//   struct binentry[nentries]              one per packet: roach, frame, offset, photon count
+//   struct bintrailer                      where the index is, ends with BIN_IDXMAGIC
+//
+// The index and trailer are written when the file is closed, so a file cut short by a crash has a header
+// and packets but no trailer; BinLoad() then reports no index and the data running to the end of the
+// file.  Files from before the container (raw packets, no header) load the same way with no header.
+// All fields are little endian, the byte order of the acquisition machines.
+//
+// A file written with compress = pack (version 2, codec BIN_CODEC_PACK) holds PhotonPack records in
+// place of the raw packets, and the index offsets point at the records.  BinScanWord() unpacks them, so
+// readers that go through it see the same words either way.
+
+#ifndef BINFILE_H
+#define BINFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "Config.h"
+#include "PhotonPack.h"
+
+#define BIN_MAGIC "PM2BIN\0"           // 8 bytes with the terminator, first word of the file
+#define BIN_IDXMAGIC "PM2IDX\0"        // last word of a closed file
+#define BIN_VERSION 2                  // raw files are still written as version 1
+#define BIN_HDRLEN 128
+
+// how the packets between the header and the index are stored
+#define BIN_CODEC_RAW 0                 // as they came off the wire
+#define BIN_CODEC_PACK 1                // PhotonPack records
+
+struct binheader {
+    char magic[8];
+    uint32_t version;
+    uint32_t hdrlen;                    // packets start here
+    uint32_t xpix, ypix, nroach;
+    uint32_t codec;                     // BIN_CODEC_RAW or BIN_CODEC_PACK, 0 in version 1 files
+    int64_t starttime;                  // CLOCK_REALTIME when the file was opened, seconds
+    int64_t startnsec;                  //  and nanoseconds
+    char firmware[32];
+    char reserved[BIN_HDRLEN - 80];
+};
+
+struct binentry {
+    uint64_t offset;                    // byte offset of the packet's header word in the file
+    uint64_t timestamp;                 // header timestamp, 0.5 ms ticks since the start of 2016
+    uint32_t nphot;                     // photons in the packet, not counting the header
+    uint16_t frame;
+    uint8_t roach;
+    uint8_t pad;
+};
+
+struct bintrailer {
+    uint64_t index;                     // byte offset of the first binentry, also where the packets end
+    uint64_t nentries;
+    uint64_t first, last;               // smallest and largest header timestamp in the file
+    uint64_t unindexed;                 // bytes of packet data that did not start with a header word
+    char magic[8];
+};
+
+// index of the file being written, grown as packets arrive
+struct binindex {
+    struct binentry *entry;
+    uint64_t n, size;
+    uint64_t first, last;
+    uint64_t unindexed;
+    const struct packetcodec *codec;    // format of the packets, set before the first BinIndexAdd()
+};
+
+// fill in a header for a raw file opened at start, a packed one sets version 2 and codec after this
+void BinHeaderInit(struct binheader *h, const struct pm2config *cfg, const struct timespec *start);
+
+void BinIndexReset(struct binindex *ix);
+void BinIndexFree(struct binindex *ix);
+
+// index one packet that starts at byte offset in the file, anything that is not a header is counted
+// as unindexed
+void BinIndexAdd(struct binindex *ix, uint64_t offset, const char *packet, unsigned int len);
+
+// trailer for an index that will be written at byte offset index
+void BinTrailerInit(struct bintrailer *t, const struct binindex *ix, uint64_t index);
+
+// read the header and index of an open .bin file.  Returns 2 for a closed container with its index, 1
+// for a container that was never closed (no index), 0 for a raw file from before the container and -1
+// on error.  Packets occupy [*datastart, *dataend).  *index is malloc'd, free it when done.
+int BinLoad(FILE *fp, struct binheader *h, struct binentry **index, uint64_t *nentries,
+            uint64_t *datastart, uint64_t *dataend);
+
+// packet format of a file BinLoad() returned container for: the firmware its header names, cfg's for a
+// raw file from before the container.  NULL if the header names a firmware there is no format for
+const struct packetcodec *BinCodec(const struct binheader *h, int container, const struct pm2config *cfg);
+
+// word by word reader over the packets of a .bin file, optionally only those from one board.  With an
+// index it seeks from one of the board's packets to the next, without one it reads every word and
+// drops the other boards' packets as it goes.
+struct binscan {
+    FILE *fp;
+    struct binheader h;
+    struct binentry *index;
+    uint64_t nentries;
+    uint64_t next;              // next index entry to look at
+    uint64_t remaining;         // words left in the current indexed packet
+    uint64_t pos, end;          // byte position in the file and end of the packets
+    int container;              // BinLoad() result
+    int roach;                  // board to keep, -1 for all of them
+    int keep;                   // unindexed scan: inside a packet from the board we want
+    char *rec;                  // packed files: the record being read, and the words it unpacked to
+    uint64_t *words;
+    unsigned int nwords, word;
+};
+
+// returns the BinLoad() result, -1 on error
+int BinScanOpen(struct binscan *bs, FILE *fp, int roach);
+
+// next word in file (wire) byte order, returns 0 at the end of the packets
+int BinScanWord(struct binscan *bs, uint64_t *w);
+
+void BinScanClose(struct binscan *bs);
+
+#endif
@@ -0,0 +1,270 @@
+// BinToNpy.c
+// export the photons in PacketMaster2 .bin files as columns of NumPy .npy arrays
+//
+// Instead of every reduction script unpacking the bitfield words itself with struct.unpack (as
+// parsePhaseDump2.py does), the photons are decoded here with the same kernels as the Cuber and written
+// out struct-of-arrays, one flat little endian .npy file per field:
+//
+//   prefix.roach.npy     uint8     board the photon came from
+//   prefix.x.npy         uint16    pixel column
+//   prefix.y.npy         uint16    pixel row
+//   prefix.time.npy      uint64    arrival time, us since the Unix epoch (header time + photon offset)
+//   prefix.wvl.npy       uint32    wavelength (phase) field as sent, 18 bits
+//   prefix.baseline.npy  uint32    baseline field as sent, 17 bits
+//   prefix.energy.npy    float32   eV from the calibration table (see Calibration.h), NaN for a pixel
+//                                  it does not cover.  Only written with -c or a configured calibration
+//
+// Row i of every file is the same photon.  The files are written a chunk at a time as the .bin files are
+// read, so a whole night never has to fit in memory, and the shape in each header is filled in at the
+// end.  Load them with numpy.load(name, mmap_mode='r') to work on them without reading them in.
+//
+//   BinToNpy [-r roach] [-o prefix] [-c calibration] file.bin [file.bin ...]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "Config.h"
+#include "BinFile.h"
+#include "Timebin.h"
+#include "PhotonDecode.h"
+#include "Calibration.h"
+
+#define NPY_HDRLEN 128              // fixed header length, so the shape can be rewritten in place
+#define NPY_CHUNK 65536             // photons buffered per column before they are written
+
+// compile with gcc -O2 -o BinToNpy BinToNpy.c Config.c BinFile.c PhotonPack.c PhotonDecode.c Calibration.c PacketCodec.c -I. -lm
+
+enum { COL_ROACH, COL_X, COL_Y, COL_TIME, COL_WVL, COL_BASELINE, COL_ENERGY, NCOL };
+
+static const char *colname[NCOL] = { "roach", "x", "y", "time", "wvl", "baseline", "energy" };
+static const char *coldescr[NCOL] = { "|u1", "<u2", "<u2", "<u8", "<u4", "<u4", "<f4" };
+static const int colsize[NCOL] = { 1, 2, 2, 8, 4, 4, 4 };
+
+struct npyout {
+    int ncol;                       // columns written, everything but the energy without a calibration
+    const struct calibration *cal;
+    FILE *fp[NCOL];
+    char *buf[NCOL];
+    unsigned int n;                 // photons buffered
+    uint64_t total;                 // photons written
+    int xpix, ypix;                 // array the photons are decoded for
+};
+
+// version 1.0 header padded with spaces to NPY_HDRLEN bytes
+static int NpyHeader(FILE *fp, const char *descr, uint64_t n)
+{
+    char h[NPY_HDRLEN];
+    int len;
+
+    memset(h, ' ', sizeof(h));
+    memcpy(h, "\x93NUMPY\x01\x00", 8);
+    h[8] = (NPY_HDRLEN - 10) & 0xFF;
+    h[9] = (NPY_HDRLEN - 10) >> 8;
+    len = snprintf(h + 10, sizeof(h) - 10, "{'descr': '%s', 'fortran_order': False, 'shape': (%lu,), }", descr, n);
+    h[10 + len] = ' ';
+    h[NPY_HDRLEN - 1] = '\n';
+    return fseek(fp, 0, SEEK_SET) == 0 && fwrite(h, sizeof(h), 1, fp) == 1 ? 0 : -1;
+}
+
+static int NpyOpen(struct npyout *o, const char *prefix, const struct calibration *cal)
+{
+    char name[512];
+    int c;
+
+    memset(o, 0, sizeof(struct npyout));
+    o->cal = cal;
+    o->ncol = cal != NULL ? NCOL : COL_ENERGY;
+    for(c=0;c<o->ncol;c++) {
+       snprintf(name, sizeof(name), "%s.%s.npy", prefix, colname[c]);
+       if( (o->fp[c] = fopen(name, "wb")) == NULL || NpyHeader(o->fp[c], coldescr[c], 0) != 0 ) {
+          perror(name);
+          return -1;
+       }
+       if( (o->buf[c] = malloc((size_t) NPY_CHUNK * colsize[c])) == NULL ) {
+          fprintf(stderr, "BinToNpy: out of memory\n");
+          return -1;
+       }
+    }
+    return 0;
+}
+
+static int NpyFlush(struct npyout *o)
+{
+    int c;
+
+    for(c=0;c<o->ncol;c++)
+       if( o->n > 0 && fwrite(o->buf[c], colsize[c], o->n, o->fp[c]) != o->n ) {
+          perror(colname[c]);
+          return -1;
+       }
+    o->total += o->n;
+    o->n = 0;
+    return 0;
+}
+
+// append a decoded packet's photons, t0 is the header time in us since the Unix epoch
+static int NpyAppend(struct npyout *o, struct photonbatch *pb, int roach, uint64_t t0)
+{
+    unsigned int i, k;
+
+    if( o->cal != NULL ) CalibratePhotons(o->cal, pb);
+    for(i=0;i<pb->n;i++) {
+       if( o->n == NPY_CHUNK && NpyFlush(o) != 0 ) return -1;
+       k = o->n++;
+       ((uint8_t *) o->buf[COL_ROACH])[k] = roach;
+       ((uint16_t *) o->buf[COL_X])[k] = pb->xcoord[i];
+       ((uint16_t *) o->buf[COL_Y])[k] = pb->ycoord[i];
+       ((uint64_t *) o->buf[COL_TIME])[k] = t0 + pb->timestamp[i];
+       ((uint32_t *) o->buf[COL_WVL])[k] = pb->wvl[i];
+       ((uint32_t *) o->buf[COL_BASELINE])[k] = pb->baseline[i];
+       if( o->cal != NULL ) ((float *) o->buf[COL_ENERGY])[k] = pb->energy[i];
+    }
+    return 0;
+}
+
+static int NpyClose(struct npyout *o)
+{
+    int c, err = NpyFlush(o);
+
+    for(c=0;c<o->ncol;c++) {
+       if( o->fp[c] != NULL ) {
+          if( NpyHeader(o->fp[c], coldescr[c], o->total) != 0 ) err = -1;
+          if( fclose(o->fp[c]) != 0 ) err = -1;
+       }
+       free(o->buf[c]);
+    }
+    return err;
+}
+
+static int CompareNames(const void *a, const void *b)
+{
+    return strcmp(*(const char **) a, *(const char **) b);
+}
+
+// decode one file's packets, in the format its header names, into the columns.  Returns the photons it
+// held or -1 on error
+static int64_t ExportFile(struct npyout *o, const char *name, int roach, const struct pm2config *cfg)
+{
+    struct binscan bs;
+    struct photonbatch pb;
+    struct packetheader hdr;
+    const struct packetcodec *codec;
+    char words[8*DECODE_MAXPHOT];
+    unsigned int n = 0;
+    uint64_t w, t0 = 0, before = o->total + o->n;
+    const char *p = (const char *) &w;      // the word's bytes as they are in the file
+    int64_t newest, t;
+    int cur = -1, more;
+    struct stat st;
+    FILE *rp;
+
+    if( (rp = fopen(name, "rb")) == NULL ) {
+       perror(name);
+       return -1;
+    }
+    if( BinScanOpen(&bs, rp, roach) < 0 ) {
+       fclose(rp);
+       return -1;
+    }
+    if( (codec = BinCodec(&bs.h, bs.container, cfg)) == NULL ) {
+       fprintf(stderr, "%s: firmware %.32s has no packet format\n", name, bs.h.firmware);
+       BinScanClose(&bs);
+       fclose(rp);
+       return -1;
+    }
+    DecodeInit(codec, o->xpix, o->ypix);
+
+    // the header ticks wrap, unwrap them against the newest time seen, starting from when the Writer
+    // opened the file (when it was last written for raw packets, which record no start time)
+    if( bs.container > 0 ) newest = TimebinClock(bs.h.starttime, bs.h.startnsec);
+    else newest = TimebinClock(fstat(fileno(rp), &st) == 0 ? st.st_mtime : time(NULL), 0);
+
+    // gather a packet's photon words and decode them together, a packet ends at the next header word,
+    // the fake photon that ends a short packet, or the end of the file
+    do {
+       more = BinScanWord(&bs, &w);
+       if( !more || CodecIsHeader(p) || CodecIsShort(p) || n == DECODE_MAXPHOT ) {
+          if( n > 0 && cur >= 0 ) {
+             DecodePhotons(words, n, &pb);
+             if( NpyAppend(o, &pb, cur, t0) != 0 ) break;
+          }
+          n = 0;
+       }
+       if( !more ) break;
+
+       if( CodecIsHeader(p) ) {
+          codec->header(p, &hdr);
+          cur = hdr.roach;
+          t = TimebinNearest(hdr.ticks, codec->tickbits, newest);
+          if( t > newest ) newest = t;
+          t0 = (uint64_t) t * (1000/TIMEBIN_TICKS) + (uint64_t) TIMEBIN_EPOCH * 1000000;
+       }
+       else if( CodecIsShort(p) ) cur = -1;    // anything after the fake photon is not a photon
+       else memcpy(words + 8*n++, p, 8);
+    } while( 1 );
+
+    BinScanClose(&bs);
+    fclose(rp);
+    return more ? -1 : (int64_t) (o->total + o->n - before);
+}
+
+int main(int argc, char *argv[])
+{
+    struct pm2config cfg;
+    struct npyout o;
+    const char *prefix = "photons", *calpath;
+    struct calibration *cal = NULL;
+    char **names;
+    int i, opt, roach = -1, nfiles, err = 0;
+    int64_t n;
+
+    ConfigLoad(NULL, &cfg);
+    calpath = cfg.calibration;
+    while( (opt = getopt(argc, argv, "r:o:c:")) != -1 ) {
+       switch( opt ) {
+          case 'r': roach = atoi(optarg); break;
+          case 'o': prefix = optarg; break;
+          case 'c': calpath = optarg; break;
+          default:
+             fprintf(stderr, "usage: %s [-r roach] [-o prefix] [-c calibration] file.bin [file.bin ...]\n", argv[0]);
+             return 1;
+       }
+    }
+    if( optind >= argc ) {
+       fprintf(stderr, "Please specify the .bin files to export!\n");
+       return 1;
+    }
+
+    // the file names are the second they were opened, so name order is time order
+    nfiles = argc - optind;
+    names = &argv[optind];
+    qsort(names, nfiles, sizeof(char *), CompareNames);
+
+    // without a calibration only the coordinates are kept, so the geometry just has to cover the array.
+    // The table is indexed by the configured array's pixels.
+    if( calpath[0] ) {
+       if( (cal = CalibrationLoad(calpath, &cfg)) == NULL ) return 1;
+       printf("%s: %u of %u pixels calibrated\n", calpath, cal->ncal, cal->npix);
+    }
+    if( NpyOpen(&o, prefix, cal) != 0 ) return 1;
+    o.xpix = cal != NULL ? cfg.xpix : 1024;
+    o.ypix = cal != NULL ? cfg.ypix : 1024;
+
+    for(i=0;i<nfiles;i++) {
+       if( (n = ExportFile(&o, names[i], roach, &cfg)) < 0 ) {
+          fprintf(stderr, "%s: export failed\n", names[i]);
+          err = 1;
+          continue;
+       }
+       printf("%s: %ld photons\n", names[i], n);
+    }
+
+    if( NpyClose(&o) != 0 ) err = 1;
+    printf("Wrote %lu photons to %s.{roach,x,y,time,wvl,baseline%s}.npy\n", o.total, prefix, cal != NULL ? ",energy" : "");
+    CalibrationFree(cal);
+    return err;
+}
@@ -0,0 +1,69 @@
+// Calibration.c
+// per pixel phase to energy calibration, see Calibration.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "Calibration.h"
+
+struct calibration *CalibrationLoad(const char *path, const struct pm2config *cfg)
+{
+    struct calibration *cal;
+    FILE *rp;
+    char line[512], *p;
+    float c[4];
+    double fx, fy;
+    unsigned int i;
+    int x, y, n, lineno = 0, bad = 0;
+
+    if( (rp = fopen(path, "r")) == NULL ) {
+       perror(path);
+       return NULL;
+    }
+    if( (cal = calloc(1, sizeof(struct calibration))) == NULL ) {
+       fclose(rp);
+       return NULL;
+    }
+    cal->npix = ConfigNpix(cfg);
+    if( posix_memalign((void **) &cal->coef, 64, sizeof(cal->coef[0]) * (cal->npix+1)) != 0 ) {
+       free(cal);
+       fclose(rp);
+       return NULL;
+    }
+    for(i=0;i<=cal->npix;i++) cal->coef[i][0] = cal->coef[i][1] = cal->coef[i][2] = cal->coef[i][3] = NAN;
+
+    while( fgets(line, sizeof(line), rp) != NULL ) {
+       lineno++;
+       if( (p = strchr(line, '#')) != NULL ) *p = 0;
+       c[2] = c[3] = 0;
+       // x and y as doubles too, np.savetxt's default format writes them as 1.000000000000000000e+00
+       n = sscanf(line, "%lf %lf %f %f %f %f", &fx, &fy, &c[0], &c[1], &c[2], &c[3]);
+       if( n <= 0 ) continue;
+       x = n >= 2 && fx == floor(fx) && fx >= 0 && fx < cfg->xpix ? (int) fx : -1;
+       y = n >= 2 && fy == floor(fy) && fy >= 0 && fy < cfg->ypix ? (int) fy : -1;
+       if( n < 4 || x < 0 || y < 0 ) {
+          if( bad++ < 10 ) fprintf(stderr, "Calibration: %s:%d is not x y c0 c1 [c2 [c3]] for a pixel in the %dx%d array\n", path, lineno, cfg->xpix, cfg->ypix);
+          continue;
+       }
+       if( isnan(cal->coef[x*cfg->ypix + y][0]) ) cal->ncal++;
+       memcpy(cal->coef[x*cfg->ypix + y], c, sizeof(c));
+    }
+    fclose(rp);
+
+    if( cal->ncal == 0 ) {
+       fprintf(stderr, "Calibration: %s has no pixels in it\n", path);
+       CalibrationFree(cal);
+       return NULL;
+    }
+    if( bad > 0 ) fprintf(stderr, "Calibration: skipped %d lines of %s\n", bad, path);
+    return cal;
+}
+
+void CalibrationFree(struct calibration *cal)
+{
+    if( cal == NULL ) return;
+    free(cal->coef);
+    free(cal);
+}
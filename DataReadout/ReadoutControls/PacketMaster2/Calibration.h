@@ -0,0 +1,54 @@
+// Calibration.h
+// per pixel phase to energy calibration, applied to each decoded packet
+//
+// The wvl field is the pulse height in phase, an 18 bit fix18_15 number of radians.  A calibration
+// gives each pixel a cubic in that phase, energy in eV = c0 + c1*phase + c2*phase^2 + c3*phase^3, the
+// form the wavelength solutions fitted offline take.  The table is loaded from a text file with a line
+//
+//   x y c0 c1 [c2 [c3]]
+//
+// per calibrated pixel, x and y whole numbers in any format (np.savetxt of the solution does, with its
+// default format or fmt='%d %d %g %g %g %g'), '#' starting a comment.  Pixels with no line
+// get NaN coefficients, so their photons come out NaN and are left out of anything binned by energy.
+//
+// In memory it is one 16 byte entry per pixel, indexed by the decoder's flat pixel index, so the
+// DARKNESS array's whole table is 160 kB and stays in cache next to the image.  The Cuber loads
+// cfg->calibration at startup and again whenever a CALIBRATE file is dropped on the ramdisk (see
+// Control.h), without a restart.
+
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+#include <stdint.h>
+
+#include "Config.h"
+#include "PhotonDecode.h"
+
+#define CAL_PHASEBITS 15            // fraction bits of the wvl field
+
+struct calibration {
+    unsigned int npix;              // pixels in the array, coef has one more for the sink pixel
+    unsigned int ncal;              // pixels with a calibration
+    float (*coef)[4];               // c0..c3 of each pixel
+};
+
+// load a table for cfg's array from path, NULL (and the reason on stderr) if it can't be used
+struct calibration *CalibrationLoad(const char *path, const struct pm2config *cfg);
+
+void CalibrationFree(struct calibration *cal);
+
+// fill in pb->energy from the decoded wvl fields
+static inline void CalibratePhotons(const struct calibration *cal, struct photonbatch *pb)
+{
+    unsigned int i;
+    const float *c;
+    float p;
+
+    for(i=0;i<pb->n;i++) {
+       p = (float) ((int32_t) (pb->wvl[i] << 14) >> 14) * (1.0f / (1 << CAL_PHASEBITS));
+       c = cal->coef[pb->pix[i]];
+       pb->energy[i] = c[0] + p*(c[1] + p*(c[2] + p*c[3]));
+    }
+}
+
+#endif
@@ -0,0 +1,216 @@
+// Capture.c
+// TPACKET_V3 receive backend for the Reader threads, see Capture.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+
+#include "Capture.h"
+
+// IPv4, UDP, not a fragment, destination port cfg->port: "ip and udp dst port P and not ip[6:2] & 0x1fff != 0"
+static int CaptureFilter(int fd, int port)
+{
+    struct sock_filter code[] = {
+       BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),                  // ethertype
+       BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 8),
+       BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 23),                  // ip protocol
+       BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 6),
+       BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 20),                  // fragment offset
+       BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1fff, 4, 0),
+       BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 14),                 // x = ip header length
+       BPF_STMT(BPF_LD | BPF_H | BPF_IND, 16),                  // udp destination port
+       BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, port, 0, 1),
+       BPF_STMT(BPF_RET | BPF_K, 0xffff),
+       BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog prog = { sizeof(code)/sizeof(code[0]), code };
+
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+// bound UDP socket that throws away everything it is given
+static int CaptureSink(int port)
+{
+    struct sock_filter code[] = { BPF_STMT(BPF_RET | BPF_K, 0) };
+    struct sock_fprog prog = { 1, code };
+    struct sockaddr_in si;
+    int s;
+
+    if( (s = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP)) == -1 ) {
+       perror("capture sink socket");
+       return -1;
+    }
+    memset(&si, 0, sizeof(si));
+    si.sin_family = AF_INET;
+    si.sin_port = htons(port);
+    si.sin_addr.s_addr = htonl(INADDR_ANY);
+    if( setsockopt(s, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) == -1 || bind(s, (struct sockaddr *) &si, sizeof(si)) == -1 ) {
+       perror("capture sink");
+       close(s);
+       return -1;
+    }
+    return s;
+}
+
+struct capture *CaptureOpen(const char *ifname, int port, int fanout, int sink)
+{
+    struct capture *cap;
+    struct tpacket_req3 req;
+    struct sockaddr_ll ll;
+    int version = TPACKET_V3, arg;
+
+    if( (cap = calloc(1, sizeof(struct capture))) == NULL ) return NULL;
+    cap->sink = -1;
+    cap->map = MAP_FAILED;
+    cap->port = port;
+
+    // no protocol until the filter and the ring are in place, so nothing queues on the socket meanwhile
+    if( (cap->fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0)) == -1 ) {
+       perror("capture socket");
+       goto fail;
+    }
+    if( CaptureFilter(cap->fd, port) == -1 ) {
+       perror("capture filter");
+       goto fail;
+    }
+    if( setsockopt(cap->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1 ) {
+       perror("PACKET_VERSION");
+       goto fail;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = CAPTURE_BLOCKLEN;
+    req.tp_block_nr = CAPTURE_NBLOCKS;
+    req.tp_frame_size = CAPTURE_FRAMELEN;
+    req.tp_frame_nr = CAPTURE_BLOCKLEN / CAPTURE_FRAMELEN * CAPTURE_NBLOCKS;
+    req.tp_retire_blk_tov = CAPTURE_RETIRE;
+    if( setsockopt(cap->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) == -1 ) {
+       perror("PACKET_RX_RING");
+       goto fail;
+    }
+    cap->maplen = (size_t) CAPTURE_BLOCKLEN * CAPTURE_NBLOCKS;
+    cap->map = mmap(NULL, cap->maplen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, cap->fd, 0);
+    if( cap->map == MAP_FAILED ) cap->map = mmap(NULL, cap->maplen, PROT_READ | PROT_WRITE, MAP_SHARED, cap->fd, 0);
+    if( cap->map == MAP_FAILED ) {
+       perror("capture mmap");
+       goto fail;
+    }
+
+    memset(&ll, 0, sizeof(ll));
+    ll.sll_family = AF_PACKET;
+    ll.sll_protocol = htons(ETH_P_IP);
+    if( (ll.sll_ifindex = if_nametoindex(ifname)) == 0 ) {
+       perror(ifname);
+       goto fail;
+    }
+    if( bind(cap->fd, (struct sockaddr *) &ll, sizeof(ll)) == -1 ) {
+       perror("capture bind");
+       goto fail;
+    }
+
+    // our own transmissions are no use to us
+    arg = 1;
+    if( setsockopt(cap->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &arg, sizeof(arg)) == -1 ) perror("PACKET_IGNORE_OUTGOING");
+
+    // a flow hash keeps each board on one member of the group
+    if( fanout > 0 ) {
+       arg = (fanout & 0xffff) | (PACKET_FANOUT_HASH << 16);
+       if( setsockopt(cap->fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) == -1 ) {
+          perror("PACKET_FANOUT");
+          goto fail;
+       }
+    }
+
+    if( sink && (cap->sink = CaptureSink(port)) == -1 ) goto fail;
+    return cap;
+
+  fail:
+    CaptureClose(cap);
+    return NULL;
+}
+
+void CaptureClose(struct capture *cap)
+{
+    if( cap->map != MAP_FAILED ) munmap(cap->map, cap->maplen);
+    if( cap->fd != -1 ) close(cap->fd);
+    if( cap->sink != -1 ) close(cap->sink);
+    free(cap);
+}
+
+static inline struct tpacket_block_desc *CaptureDesc(struct capture *cap, unsigned int block)
+{
+    return (struct tpacket_block_desc *) (cap->map + (size_t) block * CAPTURE_BLOCKLEN);
+}
+
+int CaptureBlock(struct capture *cap, int wakefd, int timeout)
+{
+    struct tpacket_block_desc *desc = CaptureDesc(cap, cap->block);
+    struct tpacket_stats_v3 st;
+    socklen_t len = sizeof(st);
+    struct pollfd pfd[2];
+
+    if( cap->open != NULL ) return 1;
+
+    // the kernel fills the blocks in order, so only the next one can be ready
+    if( !(__atomic_load_n(&desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) ) {
+       pfd[0].fd = cap->fd;
+       pfd[0].events = POLLIN | POLLERR;
+       pfd[1].fd = wakefd;
+       pfd[1].events = POLLIN;
+       poll(pfd, 2, timeout);
+       if( !(__atomic_load_n(&desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER) ) return 0;
+    }
+
+    cap->open = desc;
+    cap->left = desc->hdr.bh1.num_pkts;
+    cap->pkt = (struct tpacket3_hdr *) ((char *) desc + desc->hdr.bh1.offset_to_first_pkt);
+
+    // once a block is a cheap moment to collect the drop count, reading it resets the kernel's
+    if( getsockopt(cap->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0 ) cap->drops += st.tp_drops;
+    return 1;
+}
+
+int CaptureNext(struct capture *cap, const char **data, unsigned int *len)
+{
+    struct tpacket3_hdr *pkt;
+    const struct iphdr *ip;
+    const struct udphdr *udp;
+    unsigned int iplen, udplen;
+
+    while( cap->left > 0 ) {
+       pkt = cap->pkt;
+       cap->pkt = (struct tpacket3_hdr *) ((char *) pkt + pkt->tp_next_offset);
+       cap->left--;
+
+       // the filter has checked the protocol and port, make sure the whole datagram made it into the frame
+       ip = (const struct iphdr *) ((const char *) pkt + pkt->tp_net);
+       iplen = ip->ihl * 4;
+       udp = (const struct udphdr *) ((const char *) ip + iplen);
+       udplen = ntohs(udp->len);
+       if( pkt->tp_snaplen < pkt->tp_net - pkt->tp_mac + iplen + udplen || udplen < sizeof(struct udphdr) || ntohs(udp->dest) != cap->port ) {
+          cap->skipped++;
+          continue;
+       }
+       *data = (const char *) udp + sizeof(struct udphdr);
+       *len = udplen - sizeof(struct udphdr);
+       return 1;
+    }
+
+    if( cap->open != NULL ) {
+       __atomic_store_n(&cap->open->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+       cap->open = NULL;
+       cap->block = (cap->block + 1) % CAPTURE_NBLOCKS;
+    }
+    return 0;
+}
@@ -0,0 +1,56 @@
+// Capture.h
+// TPACKET_V3 receive backend for the Reader threads
+//
+// Instead of a recvmmsg() per batch the kernel drops the ROACH frames straight into a ring of blocks
+// mapped into our address space, and the Reader walks a whole block of datagrams with no syscall at all
+// until the block is used up and handed back.  A classic BPF filter on the packet socket keeps only IPv4
+// UDP for our port, and the Reader copies each payload from the block into its PacketRing slot, which is
+// the one copy every stage then reads in place.
+//
+// The kernel still runs the frames through the UDP stack, so one capture also binds a sink socket on the
+// port with a filter that discards everything: without a bound socket the host would answer every
+// datagram with an ICMP port unreachable.  Several Reader threads join one PACKET_FANOUT group hashed on
+// the flow, so each board always lands on the same thread as with SO_REUSEPORT.
+//
+// Opening a packet socket needs CAP_NET_RAW.  When it fails the Reader falls back to its UDP socket.
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/if_packet.h>
+
+#define CAPTURE_BLOCKLEN (1 << 20)  // bytes per kernel block, a multiple of the page size
+#define CAPTURE_NBLOCKS 64          // blocks per capture ring
+#define CAPTURE_FRAMELEN 2048       // frame size the kernel lays packets out against
+#define CAPTURE_RETIRE 10           // ms before the kernel hands over a block that is not full
+
+struct capture {
+    int fd;                         // AF_PACKET socket
+    int sink;                       // UDP socket keeping the port bound, -1 if another capture holds it
+    int port;
+    char *map;
+    size_t maplen;
+    unsigned int block;             // block we are reading or waiting on
+    struct tpacket_block_desc *open;    // that block once the kernel has handed it over, else NULL
+    struct tpacket3_hdr *pkt;       // next packet in the open block
+    unsigned int left;              // packets still to read in it
+    uint64_t drops;                 // frames the kernel could not fit in the ring
+    uint64_t skipped;               // frames in the ring that were not a whole datagram for our port
+};
+
+// packet ring on interface ifname for UDP port, joining fanout group (0 for none).  sink binds the port.
+// Returns NULL, having said why, if the capture could not be set up.
+struct capture *CaptureOpen(const char *ifname, int port, int fanout, int sink);
+void CaptureClose(struct capture *cap);
+
+// sleep until the kernel hands over a block or wakefd is readable, at most timeout ms.
+// Returns 1 with a block open, 0 otherwise.
+int CaptureBlock(struct capture *cap, int wakefd, int timeout);
+
+// next UDP payload in the open block, len bytes at *data, valid until the next call.  Returns 0 and
+// hands the block back to the kernel once it is used up.
+int CaptureNext(struct capture *cap, const char **data, unsigned int *len);
+
+#endif
@@ -0,0 +1,317 @@
+// Config.c
+// array geometry and run time settings, see Config.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "Config.h"
+
+// a window shorter than a subframe is one subframe, anything else is rounded to a whole number of subframes
+static void ConfigWindow(struct pm2config *cfg)
+{
+    int nsub;
+
+    if( cfg->window < cfg->subframe ) cfg->window = cfg->subframe;
+    nsub = (cfg->window + cfg->subframe/2) / cfg->subframe;
+    if( nsub > CONFIG_MAXSUB ) {
+       fprintf(stderr, "Config: window = %d ms is more than %d subframes, using %d\n", cfg->window, CONFIG_MAXSUB, CONFIG_MAXSUB);
+       nsub = CONFIG_MAXSUB;
+    }
+    else if( nsub * cfg->subframe != cfg->window ) fprintf(stderr, "Config: window = %d ms rounded to %d ms, a whole number of subframes\n", cfg->window, nsub * cfg->subframe);
+    cfg->window = nsub * cfg->subframe;
+}
+
+void ConfigDefaults(struct pm2config *cfg)
+{
+    int i;
+
+    cfg->xpix = 80;
+    cfg->ypix = 125;
+    cfg->nroach = 10;
+    memset(cfg->ownroach, 1, sizeof(cfg->ownroach));
+    cfg->node = 0;
+    cfg->nodes = 1;
+    cfg->aggregator[0] = 0;
+    cfg->port = 50000;
+    cfg->buflen = 1500;
+    cfg->readers = 1;
+    for(i=0;i<CONFIG_MAXREADERS;i++) cfg->readercpu[i] = -1;
+    for(i=0;i<CONFIG_MAXCPUS;i++) cfg->cubercpu[i] = -1;
+    cfg->writercpu = -1;
+    cfg->publishercpu = -1;
+    cfg->readerprio = 0;
+    cfg->cuberprio = 0;
+    cfg->writerprio = 0;
+    cfg->publisherprio = 0;
+    cfg->hugepages = 0;
+    cfg->mlock = 0;
+    cfg->capture = CONFIG_CAPTURE_SOCKET;
+    strcpy(cfg->interface, "eth0");
+    cfg->cuberthreads = 0;
+    cfg->subframe = 1000;
+    cfg->window = 1000;
+    cfg->reorder = 100;
+    cfg->metrics = 0;
+    cfg->publish = 0;
+    cfg->cubebins = 0;
+    cfg->wvlmin = 0;
+    cfg->wvlmax = 1 << 18;
+    cfg->hotrate = 0;
+    cfg->hothold = 10;
+    cfg->liveslots = 8;
+    cfg->imgfiles = 1;
+    cfg->watch[0] = 0;
+    cfg->lightbin = 1000;
+    cfg->lightslots = 16;
+    cfg->beammap[0] = 0;
+    cfg->calibration[0] = 0;
+    cfg->emin = 800;
+    cfg->emax = 1600;
+    cfg->compress = 0;
+    strcpy(cfg->firmware, "darkness");
+    cfg->codec = CodecDefault();
+}
+
+static char *Trim(char *s)
+{
+    char *e;
+
+    while( isspace((unsigned char) *s) ) s++;
+    e = s + strlen(s);
+    while( e > s && isspace((unsigned char) e[-1]) ) *--e = 0;
+    return s;
+}
+
+// comma separated list of up to n cores, one per thread
+static void ConfigCpus(int *cpu, int n, const char *val)
+{
+    char *end;
+    int i;
+
+    for(i=0;i<n;i++) cpu[i] = -1;
+    for(i=0;i<n && *val;i++) {
+       cpu[i] = strtol(val, &end, 10);
+       if( end == val ) {
+          cpu[i] = -1;
+          break;
+       }
+       val = end;
+       while( *val == ',' || *val == ' ' ) val++;
+    }
+}
+
+// SCHED_FIFO priority of a stage, 0 for none
+static void ConfigPrio(const char *key, int *prio)
+{
+    if( *prio < 0 || *prio > CONFIG_MAXPRIO ) {
+       fprintf(stderr, "Config: %s = %d is out of range (0 to %d). Using 0\n", key, *prio, CONFIG_MAXPRIO);
+       *prio = 0;
+    }
+}
+
+// boards this node owns, a list of ids and ranges like 0-4,7.  Empty is every board
+static void ConfigRoaches(struct pm2config *cfg, const char *val)
+{
+    char *end;
+    long first, last, i;
+
+    memset(cfg->ownroach, *val == 0, sizeof(cfg->ownroach));
+    while( *val ) {
+       first = last = strtol(val, &end, 10);
+       if( end == val ) break;
+       val = end;
+       if( *val == '-' ) {
+          last = strtol(++val, &end, 10);
+          if( end == val ) break;
+          val = end;
+       }
+       for(i=first;i<=last;i++) {
+          if( i >= 0 && i < 256 ) cfg->ownroach[i] = 1;
+       }
+       while( *val == ',' || *val == ' ' ) val++;
+    }
+    if( *val ) fprintf(stderr, "Config: roaches = ... %s is not a list of roach ids and ranges\n", val);
+}
+
+static int ConfigSet(struct pm2config *cfg, const char *key, const char *val)
+{
+    if( !strcasecmp(key, "xpix") ) cfg->xpix = atoi(val);
+    else if( !strcasecmp(key, "ypix") ) cfg->ypix = atoi(val);
+    else if( !strcasecmp(key, "nroach") ) cfg->nroach = atoi(val);
+    else if( !strcasecmp(key, "roaches") ) ConfigRoaches(cfg, val);
+    else if( !strcasecmp(key, "node") ) cfg->node = atoi(val);
+    else if( !strcasecmp(key, "nodes") ) cfg->nodes = atoi(val);
+    else if( !strcasecmp(key, "aggregator") ) snprintf(cfg->aggregator, sizeof(cfg->aggregator), "%s", val);
+    else if( !strcasecmp(key, "port") ) cfg->port = atoi(val);
+    else if( !strcasecmp(key, "buflen") ) cfg->buflen = atoi(val);
+    else if( !strcasecmp(key, "readers") ) cfg->readers = atoi(val);
+    else if( !strcasecmp(key, "readercpus") ) ConfigCpus(cfg->readercpu, CONFIG_MAXREADERS, val);
+    else if( !strcasecmp(key, "cubercpus") ) ConfigCpus(cfg->cubercpu, CONFIG_MAXCPUS, val);
+    else if( !strcasecmp(key, "writercpu") ) cfg->writercpu = atoi(val);
+    else if( !strcasecmp(key, "publishercpu") ) cfg->publishercpu = atoi(val);
+    else if( !strcasecmp(key, "readerprio") ) cfg->readerprio = atoi(val);
+    else if( !strcasecmp(key, "cuberprio") ) cfg->cuberprio = atoi(val);
+    else if( !strcasecmp(key, "writerprio") ) cfg->writerprio = atoi(val);
+    else if( !strcasecmp(key, "publisherprio") ) cfg->publisherprio = atoi(val);
+    else if( !strcasecmp(key, "hugepages") ) cfg->hugepages = atoi(val) != 0;
+    else if( !strcasecmp(key, "mlock") ) cfg->mlock = atoi(val) != 0;
+    else if( !strcasecmp(key, "capture") ) cfg->capture = !strcasecmp(val, "tpacket") ? CONFIG_CAPTURE_TPACKET : CONFIG_CAPTURE_SOCKET;
+    else if( !strcasecmp(key, "interface") ) snprintf(cfg->interface, sizeof(cfg->interface), "%s", val);
+    else if( !strcasecmp(key, "cuberthreads") ) cfg->cuberthreads = atoi(val);
+    else if( !strcasecmp(key, "subframe") ) cfg->subframe = atoi(val);
+    else if( !strcasecmp(key, "window") ) cfg->window = atoi(val);
+    else if( !strcasecmp(key, "reorder") ) cfg->reorder = atoi(val);
+    else if( !strcasecmp(key, "metrics") ) cfg->metrics = atoi(val);
+    else if( !strcasecmp(key, "publish") ) cfg->publish = atoi(val);
+    else if( !strcasecmp(key, "cubebins") ) cfg->cubebins = atoi(val);
+    else if( !strcasecmp(key, "wvlmin") ) cfg->wvlmin = strtoul(val, NULL, 0);
+    else if( !strcasecmp(key, "wvlmax") ) cfg->wvlmax = strtoul(val, NULL, 0);
+    else if( !strcasecmp(key, "hotrate") ) cfg->hotrate = atoi(val);
+    else if( !strcasecmp(key, "hothold") ) cfg->hothold = atoi(val);
+    else if( !strcasecmp(key, "liveslots") ) cfg->liveslots = atoi(val);
+    else if( !strcasecmp(key, "imgfiles") ) cfg->imgfiles = atoi(val) != 0;
+    else if( !strcasecmp(key, "watch") ) snprintf(cfg->watch, sizeof(cfg->watch), "%s", val);
+    else if( !strcasecmp(key, "lightbin") ) cfg->lightbin = atoi(val);
+    else if( !strcasecmp(key, "lightslots") ) cfg->lightslots = atoi(val);
+    else if( !strcasecmp(key, "beammap") ) snprintf(cfg->beammap, sizeof(cfg->beammap), "%s", val);
+    else if( !strcasecmp(key, "calibration") ) snprintf(cfg->calibration, sizeof(cfg->calibration), "%s", val);
+    else if( !strcasecmp(key, "emin") ) cfg->emin = atoi(val);
+    else if( !strcasecmp(key, "emax") ) cfg->emax = atoi(val);
+    else if( !strcasecmp(key, "compress") ) cfg->compress = !strcasecmp(val, "pack");
+    else if( !strcasecmp(key, "firmware") ) snprintf(cfg->firmware, sizeof(cfg->firmware), "%s", val);
+    else return 0;
+    return 1;
+}
+
+int ConfigLoad(const char *path, struct pm2config *cfg)
+{
+    FILE *fp;
+    char line[512], *p, *eq;
+    int insection = 0, lineno = 0;
+
+    ConfigDefaults(cfg);
+
+    if( path == NULL ) path = getenv(CONFIG_ENV);
+    if( path == NULL ) path = CONFIG_PATH;
+
+    if( (fp = fopen(path, "r")) == NULL ) {
+       fprintf(stderr, "Config: could not read %s, using the DARKNESS defaults\n", path);
+       return 0;
+    }
+
+    while( fgets(line, sizeof(line), fp) != NULL ) {
+       lineno++;
+       if( (p = strpbrk(line, "#;")) != NULL ) *p = 0;
+       p = Trim(line);
+       if( *p == 0 ) continue;
+
+       if( *p == '[' ) {
+          insection = !strncasecmp(p, "[PacketMaster2]", 15);
+          continue;
+       }
+       if( !insection ) continue;
+
+       if( (eq = strchr(p, '=')) == NULL ) {
+          fprintf(stderr, "Config: %s:%d is not key = value\n", path, lineno);
+          continue;
+       }
+       *eq = 0;
+       if( !ConfigSet(cfg, Trim(p), Trim(eq+1)) ) fprintf(stderr, "Config: %s:%d unknown key %s\n", path, lineno, Trim(p));
+    }
+    fclose(fp);
+
+    if( cfg->xpix < 1 || cfg->xpix > 1024 || cfg->ypix < 1 || cfg->ypix > 1024 ) {
+       fprintf(stderr, "Config: %dx%d is not a valid array, coordinates are 10 bits. Using 80x125\n", cfg->xpix, cfg->ypix);
+       cfg->xpix = 80;
+       cfg->ypix = 125;
+    }
+    if( cfg->nroach < 1 || cfg->nroach > 256 ) {
+       fprintf(stderr, "Config: nroach = %d is out of range, roach ids are 8 bits. Using 10\n", cfg->nroach);
+       cfg->nroach = 10;
+    }
+    if( cfg->cuberthreads < 0 ) cfg->cuberthreads = 0;
+    if( cfg->readers < 1 || cfg->readers > CONFIG_MAXREADERS ) {
+       fprintf(stderr, "Config: readers = %d is out of range (1 to %d). Using 1\n", cfg->readers, CONFIG_MAXREADERS);
+       cfg->readers = 1;
+    }
+    if( cfg->subframe < 10 || cfg->subframe > 10000 ) {
+       fprintf(stderr, "Config: subframe = %d ms is out of range (10 to 10000). Using 1000\n", cfg->subframe);
+       cfg->subframe = 1000;
+    }
+    ConfigWindow(cfg);
+    if( cfg->cubebins < 0 || cfg->cubebins > CONFIG_MAXBINS ) {
+       fprintf(stderr, "Config: cubebins = %d is out of range (0 to %d). Using 0, no cube\n", cfg->cubebins, CONFIG_MAXBINS);
+       cfg->cubebins = 0;
+    }
+    if( cfg->wvlmax > 1 << 18 ) cfg->wvlmax = 1 << 18;
+    if( cfg->wvlmin >= cfg->wvlmax ) {
+       fprintf(stderr, "Config: wvlmin = %u is not below wvlmax = %u, the wvl field is 18 bits. Using 0 to %u\n", cfg->wvlmin, cfg->wvlmax, 1 << 18);
+       cfg->wvlmin = 0;
+       cfg->wvlmax = 1 << 18;
+    }
+    if( cfg->hotrate < 0 ) cfg->hotrate = 0;
+    if( cfg->hothold < 1 ) cfg->hothold = 1;
+    if( cfg->liveslots < 0 || cfg->liveslots > CONFIG_MAXLIVE ) {
+       fprintf(stderr, "Config: liveslots = %d is out of range (0 to %d). Using 8\n", cfg->liveslots, CONFIG_MAXLIVE);
+       cfg->liveslots = 8;
+    }
+    if( cfg->lightslots < 0 || cfg->lightslots > CONFIG_MAXLIVE ) {
+       fprintf(stderr, "Config: lightslots = %d is out of range (0 to %d). Using 16\n", cfg->lightslots, CONFIG_MAXLIVE);
+       cfg->lightslots = 16;
+    }
+    if( cfg->lightbin < 1 || cfg->subframe * 1000 % cfg->lightbin != 0 || cfg->subframe * 1000 / cfg->lightbin > CONFIG_MAXLIGHTBINS ) {
+       fprintf(stderr, "Config: lightbin = %d us does not split a %d ms subframe into 1 to %d bins. Using 1000\n", cfg->lightbin, cfg->subframe, CONFIG_MAXLIGHTBINS);
+       cfg->lightbin = 1000;
+    }
+    if( cfg->emin < 0 || cfg->emin >= cfg->emax ) {
+       fprintf(stderr, "Config: emin = %d meV is not between 0 and emax = %d meV. Using 800 to 1600\n", cfg->emin, cfg->emax);
+       cfg->emin = 800;
+       cfg->emax = 1600;
+    }
+    if( cfg->node < 0 || cfg->node >= CONFIG_MAXNODES ) {
+       fprintf(stderr, "Config: node = %d is out of range (0 to %d). Using 0\n", cfg->node, CONFIG_MAXNODES-1);
+       cfg->node = 0;
+    }
+    if( cfg->nodes < 1 || cfg->nodes > CONFIG_MAXNODES ) {
+       fprintf(stderr, "Config: nodes = %d is out of range (1 to %d). Using 1\n", cfg->nodes, CONFIG_MAXNODES);
+       cfg->nodes = 1;
+    }
+    ConfigPrio("readerprio", &cfg->readerprio);
+    ConfigPrio("cuberprio", &cfg->cuberprio);
+    ConfigPrio("writerprio", &cfg->writerprio);
+    ConfigPrio("publisherprio", &cfg->publisherprio);
+    if( cfg->reorder < 0 ) cfg->reorder = 0;
+    if( cfg->reorder > CONFIG_MAXREORDER * cfg->subframe ) {
+       fprintf(stderr, "Config: reorder = %d ms is more than %d subframes, using %d ms\n", cfg->reorder, CONFIG_MAXREORDER, CONFIG_MAXREORDER * cfg->subframe);
+       cfg->reorder = CONFIG_MAXREORDER * cfg->subframe;
+    }
+    if( (cfg->codec = CodecFind(cfg->firmware)) == NULL ) {
+       fprintf(stderr, "Config: firmware = %s is not a packet format (%s). Using %s\n", cfg->firmware, CodecNames(), CodecDefault()->name);
+       cfg->codec = CodecDefault();
+       snprintf(cfg->firmware, sizeof(cfg->firmware), "%s", cfg->codec->name);
+    }
+    return 1;
+}
+
+static void *AllocZeroed(size_t size)
+{
+    void *p;
+
+    size = (size + 63) & ~((size_t) 63);
+    if( posix_memalign(&p, 64, size) != 0 ) return NULL;
+    memset(p, 0, size);
+    return p;
+}
+
+uint16_t *AllocImage(const struct pm2config *cfg)
+{
+    return (uint16_t *) AllocZeroed(sizeof(uint16_t) * (ConfigNpix(cfg) + 1));
+}
+
+uint64_t *AllocFrames(const struct pm2config *cfg)
+{
+    return (uint64_t *) AllocZeroed(sizeof(uint64_t) * cfg->nroach);
+}
@@ -0,0 +1,119 @@
+// Config.h
+// array geometry and run time settings shared by PacketMaster2 and the offline tools (Bin2PNG, BinCheck,
+// BinToImg, BinToNpy, LoadGen, Bench and Aggregator)
+//
+// Settings come from the [PacketMaster2] section of an INI style file (the same format as darkDash.cfg).
+// The file is CONFIG_PATH unless the PACKETMASTER2_CFG environment variable or a command line
+// argument names another one.  Anything not in the file keeps the DARKNESS default.
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdint.h>
+
+#include "PacketCodec.h"
+
+#define CONFIG_PATH "/mnt/data0/PacketMaster2/PacketMaster2.cfg"
+#define CONFIG_ENV "PACKETMASTER2_CFG"
+#define CONFIG_MAXSUB 1000    // most subframes summed into one Cuber image
+#define CONFIG_MAXREORDER 127 // most subframes a board can trail the newest one by
+#define CONFIG_MAXLIVE 1024   // most images in the live image ring
+#define CONFIG_MAXNODES 64    // most PacketMaster2 nodes one Aggregator merges
+#define CONFIG_MAXREADERS 8   // most Reader threads, each with its own socket and ring
+#define CONFIG_MAXBINS 1024   // most wavelength bins per pixel in the spectral cube
+#define CONFIG_MAXCPUS 65     // most cores in cubercpus, the Cuber thread's and one per worker
+#define CONFIG_MAXPRIO 99     // highest SCHED_FIFO priority a stage can ask for
+#define CONFIG_MAXWATCH 32    // most pixels on the lightcurve watch list
+#define CONFIG_MAXLIGHTBINS 100000  // most lightcurve bins per pixel in a subframe
+
+// Reader receive backends
+#define CONFIG_CAPTURE_SOCKET 0     // UDP socket and recvmmsg()
+#define CONFIG_CAPTURE_TPACKET 1    // TPACKET_V3 ring on the interface, see Capture.h
+
+struct pm2config {
+    int xpix;               // image columns
+    int ypix;               // image rows
+    int nroach;             // number of boards, roach ids run 0..nroach-1
+    uint8_t ownroach[256];  // 1 for each board this node reads out, every board unless roaches says otherwise
+    int node;               // this node's id to the Aggregator, see Aggregate.h
+    int nodes;              // nodes the Aggregator merges images from
+    char aggregator[128];   // host:port of the Aggregator the Cuber sends its images to, empty for none
+    int port;               // UDP port the boards send photon packets to
+    int buflen;             // largest datagram the Reader accepts
+    int readers;            // Reader threads, each on its own SO_REUSEPORT socket feeding its own ring
+    int readercpu[CONFIG_MAXREADERS];   // core each Reader thread is pinned to, -1 for no pinning
+    int cubercpu[CONFIG_MAXCPUS];       // core the Cuber thread then each worker is pinned to, -1 for none
+    int writercpu;          // core the Writer thread is pinned to, -1 for no pinning
+    int publishercpu;       // core the Publisher is pinned to, -1 for no pinning
+    int readerprio;         // SCHED_FIFO priority of each stage's threads, 0 for the normal scheduler
+    int cuberprio;
+    int writerprio;
+    int publisherprio;
+    int hugepages;          // 1 to back the rings and packet buffers with hugepages, see Realtime.h
+    int mlock;              // 1 to lock each process's memory
+    int capture;            // CONFIG_CAPTURE_SOCKET or CONFIG_CAPTURE_TPACKET
+    char interface[32];     // interface the boards' frames arrive on, for the tpacket backend
+    int cuberthreads;       // Cuber worker threads, 0 parses on the Cuber thread
+    int subframe;           // ms between Cuber images, 10 to 10000
+    int window;             // ms of data summed into each Cuber image, a whole number of subframes
+    int reorder;            // ms a board's packets can trail the newest board and still make its subframe
+    int metrics;            // TCP port for the Prometheus /metrics endpoint, 0 for none
+    int publish;            // TCP port photon events are streamed to subscribers on, 0 for none
+    int cubebins;           // wavelength bins per pixel in the Cuber's spectral cube, 0 for no cube
+    uint32_t wvlmin;        // wvl field range the cube bins span, [wvlmin, wvlmax)
+    uint32_t wvlmax;
+    int hotrate;            // photons/s that get a pixel masked out of the images, 0 for no masking
+    int hothold;            // s a masked pixel stays masked before it is let through again
+    int liveslots;          // images kept in the shared memory live image ring, 0 for none
+    int imgfiles;           // write each image to the ramdisk as a .img and a .png as well, 0 or 1
+    char watch[256];        // x,y pixels the Cuber keeps lightcurves for, see Lightcurve.h
+    int lightbin;           // us per lightcurve bin, a whole number of bins to a subframe
+    int lightslots;         // subframes of lightcurves kept in shared memory, 0 for no lightcurves
+    char beammap[256];      // stamped to physical pixel remap, see Beammap.h, empty for none
+    char calibration[256];  // per pixel phase to energy table, see Calibration.h, empty for none
+    int emin;               // meV range the cube bins span once a calibration is loaded, [emin, emax)
+    int emax;
+    int compress;           // 1 to bit pack the photons in the .bin files, see PhotonPack.h
+    char firmware[32];      // readout firmware the boards run, recorded in every .bin header
+    const struct packetcodec *codec;    // its packet format, see PacketCodec.h
+};
+
+void ConfigDefaults(struct pm2config *cfg);
+
+// fill cfg from path (NULL picks CONFIG_ENV or CONFIG_PATH), returns 0 if the file could not be read,
+// in which case cfg holds the defaults
+int ConfigLoad(const char *path, struct pm2config *cfg);
+
+static inline unsigned int ConfigNpix(const struct pm2config *cfg)
+{
+    return cfg->xpix * cfg->ypix;
+}
+
+// 64 byte aligned, zeroed image of npix counts plus one sink pixel at image[npix] that collects
+// photons whose coordinates fall outside the array
+uint16_t *AllocImage(const struct pm2config *cfg);
+
+// 64 byte aligned, zeroed per-board frame counters
+uint64_t *AllocFrames(const struct pm2config *cfg);
+
+static inline void AddImageN(uint16_t *restrict dst, const uint16_t *restrict src, unsigned int npix)
+{
+    unsigned int i;
+
+    for(i=0;i<npix;i++) dst[i] += src[i];
+}
+
+// dst += src over the whole image.  The geometries we actually run get the pixel count as a constant
+// so the compiler can unroll and vectorize the loop, anything else takes the generic one.
+static inline void AddImage(uint16_t *dst, const uint16_t *src, unsigned int npix)
+{
+    switch( npix ) {
+       case 80*125:             // DARKNESS
+          AddImageN(dst, src, 80*125);
+          break;
+       default:
+          AddImageN(dst, src, npix);
+    }
+}
+
+#endif
@@ -0,0 +1,192 @@
+// Control.c
+// start/stop/quit control shared by the PacketMaster2 stages, see Control.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+
+#include "Control.h"
+
+static const char *tablefile[CONTROL_NTABLES] = CONTROL_TABLEFILES;
+
+struct pm2control *ControlCreate()
+{
+    struct pm2control *ctl;
+
+    ctl = mmap(NULL, sizeof(struct pm2control), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if( ctl == MAP_FAILED ) {
+       perror("control mmap");
+       return NULL;
+    }
+    memset(ctl, 0, sizeof(struct pm2control));
+    if( (ctl->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ) {
+       perror("control eventfd");
+       munmap(ctl, sizeof(struct pm2control));
+       return NULL;
+    }
+    ctl->inotify = -1;
+    return ctl;
+}
+
+static void ControlWakeAll(struct pm2control *ctl)
+{
+    uint64_t v = 1;
+    int i, r;
+
+    for(r=0;r<ctl->nrings;r++)
+       for(i=0;i<RING_MAXREADERS;i++) RingWake(ctl->rings[r], i);
+    if( write(ctl->wakefd, &v, sizeof(v)) == -1 ) perror("control wake");
+}
+
+// act on a control file that has just been written, returns 1 once QUIT has been seen
+static int ControlFile(struct pm2control *ctl, const char *name)
+{
+    FILE *rp;
+    char path[CONTROL_PATHLEN], file[CONTROL_PATHLEN];
+    int t;
+
+    for(t=0;t<CONTROL_NTABLES && strcmp(name, tablefile[t]);t++) ;
+
+    if( !strcmp(name, "START") ) {
+       if( (rp = fopen(CONTROL_START, "r")) == NULL ) return 0;
+       if( fscanf(rp, "%255s", path) != 1 ) path[0] = 0;
+       fclose(rp);
+       remove(CONTROL_START);
+       printf("CONTROL: START, writing to %s\n", path); fflush(stdout);
+
+       __atomic_store_n(&ctl->seq, ctl->seq + 1, __ATOMIC_SEQ_CST);
+       strcpy(ctl->path, path);
+       ctl->run++;
+       ctl->writing = 1;
+       __atomic_store_n(&ctl->seq, ctl->seq + 1, __ATOMIC_SEQ_CST);
+    }
+    else if( t < CONTROL_NTABLES ) {
+       snprintf(file, sizeof(file), "%s/%s", CONTROL_DIR, name);
+       if( (rp = fopen(file, "r")) == NULL ) return 0;
+       // a watch list is the whole line, pixels and all
+       if( t == CONTROL_WATCH ) {
+          if( fgets(path, sizeof(path), rp) == NULL ) path[0] = 0;
+          path[strcspn(path, "\r\n")] = 0;
+       }
+       else if( fscanf(rp, "%255s", path) != 1 ) path[0] = 0;
+       fclose(rp);
+       remove(file);
+       printf("CONTROL: %s from %s\n", name, path[0] ? path : "the configured table"); fflush(stdout);
+
+       __atomic_store_n(&ctl->seq, ctl->seq + 1, __ATOMIC_SEQ_CST);
+       strcpy(ctl->table[t].path, path);
+       __atomic_store_n(&ctl->table[t].run, ctl->table[t].run + 1, __ATOMIC_RELEASE);
+       __atomic_store_n(&ctl->seq, ctl->seq + 1, __ATOMIC_SEQ_CST);
+    }
+    else if( !strcmp(name, "STOP") ) {
+       remove(CONTROL_STOP);
+       printf("CONTROL: STOP\n"); fflush(stdout);
+       __atomic_store_n(&ctl->writing, 0, __ATOMIC_RELEASE);
+    }
+    else if( !strcmp(name, "QUIT") ) {
+       printf("CONTROL: QUIT\n"); fflush(stdout);
+       __atomic_store_n(&ctl->writing, 0, __ATOMIC_RELEASE);
+       __atomic_store_n(&ctl->quit, 1, __ATOMIC_RELEASE);
+       remove(CONTROL_START);
+       remove(CONTROL_STOP);
+       for(t=0;t<CONTROL_NTABLES;t++) {
+          snprintf(file, sizeof(file), "%s/%s", CONTROL_DIR, tablefile[t]);
+          remove(file);
+       }
+       remove(CONTROL_QUIT);
+    }
+    else return 0;
+
+    ControlWakeAll(ctl);
+    return ControlQuit(ctl);
+}
+
+static void *ControlThread(void *arg)
+{
+    struct pm2control *ctl = (struct pm2control *) arg;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    ssize_t n;
+    char *p, file[CONTROL_PATHLEN];
+    int t;
+
+    // files dropped before the watch was in place
+    if( access(CONTROL_START, F_OK) != -1 ) ControlFile(ctl, "START");
+    if( access(CONTROL_STOP, F_OK) != -1 ) ControlFile(ctl, "STOP");
+    for(t=0;t<CONTROL_NTABLES;t++) {
+       snprintf(file, sizeof(file), "%s/%s", CONTROL_DIR, tablefile[t]);
+       if( access(file, F_OK) != -1 ) ControlFile(ctl, tablefile[t]);
+    }
+    if( access(CONTROL_QUIT, F_OK) != -1 && ControlFile(ctl, "QUIT") ) return NULL;
+
+    while( (n = read(ctl->inotify, buf, sizeof(buf))) > 0 ) {
+       for(p=buf;p<buf+n;p+=sizeof(struct inotify_event)+ev->len) {
+          ev = (struct inotify_event *) p;
+          if( ev->len > 0 && ControlFile(ctl, ev->name) ) return NULL;
+       }
+    }
+    perror("control inotify read");
+    return NULL;
+}
+
+int ControlStart(struct pm2control *ctl, struct packetring **rings, int nrings)
+{
+    int i;
+
+    for(i=0;i<nrings;i++) ctl->rings[i] = rings[i];
+    ctl->nrings = nrings;
+    if( (ctl->inotify = inotify_init1(IN_CLOEXEC)) == -1 ) {
+       perror("inotify_init1");
+       return -1;
+    }
+    // a file someone finished writing, or one renamed into place
+    if( inotify_add_watch(ctl->inotify, CONTROL_DIR, IN_CLOSE_WRITE | IN_MOVED_TO) == -1 ) {
+       perror(CONTROL_DIR);
+       return -1;
+    }
+    if( pthread_create(&ctl->thread, NULL, ControlThread, ctl) != 0 ) {
+       perror("control thread");
+       return -1;
+    }
+    return 0;
+}
+
+void ControlStop(struct pm2control *ctl)
+{
+    pthread_join(ctl->thread, NULL);
+    close(ctl->inotify);
+}
+
+uint32_t ControlRun(const struct pm2control *ctl, char *path)
+{
+    uint32_t seq, run, writing;
+
+    // START can land while we copy the path, go round again if it did
+    do {
+       while( (seq = __atomic_load_n(&ctl->seq, __ATOMIC_ACQUIRE)) & 1 ) ;
+       strcpy(path, ctl->path);
+       run = ctl->run;
+       writing = __atomic_load_n(&ctl->writing, __ATOMIC_ACQUIRE);
+       __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while( seq != __atomic_load_n(&ctl->seq, __ATOMIC_RELAXED) );
+
+    return writing ? run : 0;
+}
+
+uint32_t ControlTable(const struct pm2control *ctl, int t, char *path)
+{
+    uint32_t seq, run;
+
+    do {
+       while( (seq = __atomic_load_n(&ctl->seq, __ATOMIC_ACQUIRE)) & 1 ) ;
+       strcpy(path, ctl->table[t].path);
+       run = __atomic_load_n(&ctl->table[t].run, __ATOMIC_ACQUIRE);
+       __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while( seq != __atomic_load_n(&ctl->seq, __ATOMIC_RELAXED) );
+
+    return run;
+}
@@ -0,0 +1,82 @@
+// Control.h
+// start/stop/quit control shared by the PacketMaster2 stages
+//
+// MkidDashboard.py still drives PacketMaster2 by dropping START (holding the write path), STOP and QUIT
+// files on the ramdisk.  Instead of every stage calling access() on those paths every time round its
+// loop, one control thread in the Reader process watches the directory with inotify, turns the files
+// into state in a small shared block and wakes the stages on their eventfds.  The stages only ever read
+// that block, which is a plain memory load, and otherwise sleep until there is data or a change.
+//
+// A CALIBRATE or BEAMMAP file (holding the path of a table, or nothing for the configured one) asks the
+// Cuber to reload its phase to energy calibration (see Calibration.h) or its pixel remap (Beammap.h).
+// A WATCH file holds a new lightcurve watch list itself rather than a path (see Lightcurve.h).
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "PacketRing.h"
+#include "Config.h"
+
+#define CONTROL_DIR "/mnt/ramdisk"
+#define CONTROL_START CONTROL_DIR "/START"
+#define CONTROL_STOP CONTROL_DIR "/STOP"
+#define CONTROL_QUIT CONTROL_DIR "/QUIT"
+#define CONTROL_PATHLEN 256
+
+// tables the Cuber reloads on request, and the file that asks for each
+#define CONTROL_CALIBRATION 0
+#define CONTROL_BEAMMAP 1
+#define CONTROL_WATCH 2
+#define CONTROL_NTABLES 3
+#define CONTROL_TABLEFILES { "CALIBRATE", "BEAMMAP", "WATCH" }
+
+struct controltable {
+    uint32_t run;                   // bumped on every request
+    char path[CONTROL_PATHLEN];     // table (or watch list) from the last request, empty for the configured one
+};
+
+struct pm2control {
+    uint32_t quit;                  // QUIT seen, every stage winds down
+    uint32_t writing;               // between a START and a STOP
+    uint32_t run;                   // bumped on every START, so a START without a STOP still starts a new file
+    uint32_t seq;                   // odd while the control thread is changing path and run, or a table
+    char path[CONTROL_PATHLEN];     // write path from the last START
+    struct controltable table[CONTROL_NTABLES];
+    int wakefd;                     // eventfd the Reader threads sleep on alongside their sockets
+
+    // control thread, only meaningful in the Reader process
+    pthread_t thread;
+    struct packetring *rings[CONFIG_MAXREADERS];
+    int nrings;
+    int inotify;
+};
+
+// shared anonymous mapping, call before forking the stages
+struct pm2control *ControlCreate();
+
+// start the control thread in this process, it wakes the Reader and every reader of every ring on a change
+int ControlStart(struct pm2control *ctl, struct packetring **rings, int nrings);
+
+// wait for the control thread to finish after QUIT
+void ControlStop(struct pm2control *ctl);
+
+static inline int ControlQuit(const struct pm2control *ctl)
+{
+    return __atomic_load_n(&ctl->quit, __ATOMIC_ACQUIRE);
+}
+
+// current START: returns the run number (0 while stopped) and copies its write path
+uint32_t ControlRun(const struct pm2control *ctl, char *path);
+
+static inline uint32_t ControlTableRun(const struct pm2control *ctl, int t)
+{
+    return __atomic_load_n(&ctl->table[t].run, __ATOMIC_ACQUIRE);
+}
+
+// last reload of table t: returns its number (0 if there has not been one) and copies its path
+uint32_t ControlTable(const struct pm2control *ctl, int t, char *path);
+
+#endif
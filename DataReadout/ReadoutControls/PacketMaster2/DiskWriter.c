@@ -0,0 +1,269 @@
+// DiskWriter.c
+// asynchronous large-block writer for the 1 second .bin files, see DiskWriter.h
+
+#define _GNU_SOURCE     // O_DIRECT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "DiskWriter.h"
+#include "Realtime.h"
+
+static uint64_t Microseconds()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec*1000000 + t.tv_nsec/1000;
+}
+
+// open fname for writing, O_DIRECT if the filesystem allows it
+static int OpenFile(const char *fname, int *direct)
+{
+    int fd;
+
+    fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+    *direct = (fd != -1);
+    if( fd == -1 && errno == EINVAL ) fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if( fd == -1 ) perror(fname);
+    return fd;
+}
+
+static int WriteAll(int fd, const char *buf, size_t len, const char *fname)
+{
+    ssize_t n;
+
+    while( len > 0 ) {
+       n = write(fd, buf, len);
+       if( n == -1 ) {
+          if( errno == EINTR ) continue;
+          perror(fname);
+          return -1;
+       }
+       buf += n;
+       len -= n;
+    }
+    return 0;
+}
+
+// the I/O thread: write queued blocks in order, open, truncate and close files as the blocks say
+static void *DiskWriterThread(void *arg)
+{
+    struct diskwriter *dw = (struct diskwriter *) arg;
+    struct dwblock *b;
+    int fd = -1, direct = 0, prefd = -1, predirect = 0;
+    char fname[DW_PATHLEN] = "", prename[DW_PATHLEN] = "";
+    uint64_t t0, t, size = 0;
+    size_t len;
+
+    while( 1 ) {
+       pthread_mutex_lock(&dw->lock);
+       while( dw->nbusy == 0 && !dw->quit ) pthread_cond_wait(&dw->cond, &dw->lock);
+       if( dw->nbusy == 0 ) {
+          pthread_mutex_unlock(&dw->lock);
+          break;
+       }
+       b = dw->busyq[dw->busyhead];
+       pthread_mutex_unlock(&dw->lock);
+
+       t0 = Microseconds();
+
+       if( fd == -1 || strcmp(fname, b->fname) != 0 ) {
+          if( fd != -1 ) close(fd);
+          strcpy(fname, b->fname);
+          size = 0;
+          if( prefd != -1 ) {
+             // the file we opened early, rename it if the second we guessed was wrong
+             if( strcmp(prename, fname) == 0 || rename(prename, fname) == 0 ) {
+                fd = prefd;
+                direct = predirect;
+             }
+             else {
+                close(prefd);
+                unlink(prename);
+                fd = OpenFile(fname, &direct);
+             }
+             prefd = -1;
+          }
+          else fd = OpenFile(fname, &direct);
+          if( direct != dw->direct && fd != -1 ) {
+             printf("WRITER: %s %s O_DIRECT\n", fname, direct ? "using" : "does not support");
+             dw->direct = direct;
+          }
+       }
+
+       if( fd != -1 && b->len > 0 ) {
+          // O_DIRECT lengths must be aligned, only the last block of a file is short and the padding
+          // is cut off again below
+          len = direct ? (b->len + DW_ALIGN - 1) & ~((size_t) DW_ALIGN - 1) : b->len;
+          if( WriteAll(fd, b->buf, len, fname) == 0 ) size += b->len;
+       }
+
+       if( b->eof ) {
+          if( fd != -1 ) {
+             if( direct && ftruncate(fd, size) == -1 ) perror(fname);
+             close(fd);
+          }
+          fd = -1;
+          if( b->next[0] != 0 ) {
+             strcpy(prename, b->next);
+             prefd = OpenFile(prename, &predirect);
+          }
+       }
+
+       t = Microseconds() - t0;
+
+       pthread_mutex_lock(&dw->lock);
+       dw->written += b->len;
+       if( t > dw->maxlatency ) dw->maxlatency = t;
+       dw->busyhead = (dw->busyhead + 1) % DW_NBLOCKS;
+       dw->nbusy--;
+       dw->freeq[dw->nfree++] = b;
+       pthread_cond_broadcast(&dw->cond);
+       pthread_mutex_unlock(&dw->lock);
+    }
+
+    if( fd != -1 ) close(fd);
+    if( prefd != -1 ) {
+       // opened early for a second that never came
+       close(prefd);
+       unlink(prename);
+    }
+    return NULL;
+}
+
+struct diskwriter *DiskWriterCreate()
+{
+    struct diskwriter *dw;
+    int i;
+
+    if( (dw = calloc(1, sizeof(struct diskwriter))) == NULL ) return NULL;
+
+    for(i=0;i<DW_NBLOCKS;i++) {
+       // page aligned, which covers DW_ALIGN
+       if( (dw->block[i].buf = HugeAlloc(DW_BLOCKLEN)) == NULL ) {
+          fprintf(stderr, "WRITER: could not allocate %d byte write blocks\n", DW_BLOCKLEN);
+          while( --i >= 0 ) HugeFree(dw->block[i].buf, DW_BLOCKLEN);
+          free(dw);
+          return NULL;
+       }
+       dw->freeq[i] = &dw->block[i];
+    }
+    dw->nfree = DW_NBLOCKS;
+    dw->direct = 1;
+
+    pthread_mutex_init(&dw->lock, NULL);
+    pthread_cond_init(&dw->cond, NULL);
+    if( pthread_create(&dw->thread, NULL, DiskWriterThread, dw) != 0 ) {
+       perror("WRITER: pthread_create");
+       for(i=0;i<DW_NBLOCKS;i++) HugeFree(dw->block[i].buf, DW_BLOCKLEN);
+       free(dw);
+       return NULL;
+    }
+    return dw;
+}
+
+static struct dwblock *GetBlock(struct diskwriter *dw)
+{
+    struct dwblock *b;
+
+    pthread_mutex_lock(&dw->lock);
+    while( dw->nfree == 0 ) pthread_cond_wait(&dw->cond, &dw->lock);
+    b = dw->freeq[--dw->nfree];
+    pthread_mutex_unlock(&dw->lock);
+
+    b->len = 0;
+    b->eof = 0;
+    return b;
+}
+
+static void Submit(struct diskwriter *dw, struct dwblock *b)
+{
+    pthread_mutex_lock(&dw->lock);
+    dw->busyq[(dw->busyhead + dw->nbusy) % DW_NBLOCKS] = b;
+    dw->nbusy++;
+    pthread_cond_broadcast(&dw->cond);
+    pthread_mutex_unlock(&dw->lock);
+}
+
+// finish the current file, keeping its guess at the next name so the I/O thread opens that early
+static void EndFile(struct diskwriter *dw)
+{
+    if( dw->cur == NULL ) return;
+    dw->cur->eof = 1;
+    Submit(dw, dw->cur);
+    dw->cur = NULL;
+}
+
+void DiskWriterOpen(struct diskwriter *dw, const char *fname, const char *next)
+{
+    EndFile(dw);
+
+    dw->cur = GetBlock(dw);
+    snprintf(dw->cur->fname, DW_PATHLEN, "%s", fname);
+    snprintf(dw->cur->next, DW_PATHLEN, "%s", next != NULL ? next : "");
+}
+
+void DiskWriterAppend(struct diskwriter *dw, const char *data, size_t len)
+{
+    struct dwblock *b;
+    size_t n;
+
+    while( dw->cur != NULL && len > 0 ) {
+       n = DW_BLOCKLEN - dw->cur->len;
+       if( n > len ) n = len;
+       memcpy(dw->cur->buf + dw->cur->len, data, n);
+       dw->cur->len += n;
+       data += n;
+       len -= n;
+
+       if( dw->cur->len == DW_BLOCKLEN ) {
+          b = GetBlock(dw);
+          strcpy(b->fname, dw->cur->fname);
+          strcpy(b->next, dw->cur->next);
+          Submit(dw, dw->cur);
+          dw->cur = b;
+       }
+    }
+}
+
+void DiskWriterClose(struct diskwriter *dw)
+{
+    // no file follows this one
+    if( dw->cur != NULL ) dw->cur->next[0] = 0;
+    EndFile(dw);
+}
+
+void DiskWriterStats(struct diskwriter *dw, uint64_t *written, uint64_t *maxlatency, int *queued)
+{
+    pthread_mutex_lock(&dw->lock);
+    *written = dw->written;
+    *maxlatency = dw->maxlatency;
+    *queued = dw->nbusy;
+    dw->maxlatency = 0;
+    pthread_mutex_unlock(&dw->lock);
+}
+
+void DiskWriterFree(struct diskwriter *dw)
+{
+    int i;
+
+    DiskWriterClose(dw);
+
+    pthread_mutex_lock(&dw->lock);
+    dw->quit = 1;
+    pthread_cond_broadcast(&dw->cond);
+    pthread_mutex_unlock(&dw->lock);
+    pthread_join(dw->thread, NULL);
+
+    pthread_mutex_destroy(&dw->lock);
+    pthread_cond_destroy(&dw->cond);
+    for(i=0;i<DW_NBLOCKS;i++) HugeFree(dw->block[i].buf, DW_BLOCKLEN);
+    free(dw);
+}
@@ -0,0 +1,66 @@
+// DiskWriter.h
+// asynchronous large-block writer for the 1 second .bin files
+//
+// The Writer copies packets into big page aligned blocks and hands each full block to a dedicated I/O
+// thread, which writes it with O_DIRECT (falling back to buffered writes on filesystems that refuse it).
+// Opening, truncating and closing files all happen on the I/O thread too, and the next second's file is
+// opened ahead of time, so a slow RAID delays the I/O thread, never the ring drain.  If the disk falls so
+// far behind that every block is queued, DiskWriterAppend() waits and the ring absorbs the backlog; any
+// overflow is counted against the Writer by the ring, the Reader never stalls.
+
+#ifndef DISKWRITER_H
+#define DISKWRITER_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define DW_BLOCKLEN (4*1024*1024)   // bytes per block, multiple of DW_ALIGN
+#define DW_NBLOCKS 8                // blocks in the pool, 32 MB of slack for the disk
+#define DW_ALIGN 4096               // O_DIRECT buffer, offset and length alignment
+#define DW_PATHLEN 288              // a CONTROL_PATHLEN data directory, a '/' and a "%ld.bin" name
+
+struct dwblock {
+    char *buf;
+    size_t len;
+    int eof;                        // last block of its file, truncate and close after writing
+    char fname[DW_PATHLEN];         // file this block belongs to
+    char next[DW_PATHLEN];          // name we expect the following file to have, pre-opened at eof
+};
+
+struct diskwriter {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct dwblock block[DW_NBLOCKS];
+    struct dwblock *freeq[DW_NBLOCKS];      // blocks ready to fill
+    struct dwblock *busyq[DW_NBLOCKS];      // blocks waiting for the I/O thread, in order
+    int nfree, nbusy, busyhead;
+    int quit;
+    struct dwblock *cur;                    // block the Writer is filling, NULL between files
+
+    // I/O thread statistics, read by the Writer for its once a second log line
+    uint64_t written;                       // bytes on disk
+    uint64_t maxlatency;                    // slowest block write in us since the last DiskWriterStats()
+    int direct;                             // last file opened with O_DIRECT
+};
+
+// allocate the block pool and start the I/O thread, NULL on failure
+struct diskwriter *DiskWriterCreate();
+
+// start writing to fname, next is the name we expect the file after it to have (it gets opened early)
+void DiskWriterOpen(struct diskwriter *dw, const char *fname, const char *next);
+
+// append len bytes to the current file
+void DiskWriterAppend(struct diskwriter *dw, const char *data, size_t len);
+
+// hand the current file to the I/O thread to finish and close, with no file to follow.  To roll over
+// to the next file just call DiskWriterOpen(), which closes the current one and uses its early open.
+void DiskWriterClose(struct diskwriter *dw);
+
+// copy the statistics out and reset the latency peak
+void DiskWriterStats(struct diskwriter *dw, uint64_t *written, uint64_t *maxlatency, int *queued);
+
+// close the current file, wait for every queued block to reach the disk and stop the I/O thread
+void DiskWriterFree(struct diskwriter *dw);
+
+#endif
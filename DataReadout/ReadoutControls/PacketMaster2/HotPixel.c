@@ -0,0 +1,88 @@
+// HotPixel.c
+// mask flaring pixels out of the Cuber's images, see HotPixel.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "HotPixel.h"
+
+struct hotpixels *HotCreate(const struct pm2config *cfg)
+{
+    struct hotpixels *h;
+    uint64_t threshold = (uint64_t) cfg->hotrate * cfg->subframe / 1000;
+
+    if( cfg->hotrate <= 0 ) return NULL;
+    if( (h = calloc(1, sizeof(struct hotpixels))) == NULL ) return NULL;
+    h->npix = ConfigNpix(cfg);
+    // the image counts are 16 bits, a pixel over that in one subframe has wrapped
+    h->threshold = threshold < 1 ? 1 : threshold > 65535 ? 65535 : threshold;
+    h->hold = ((int64_t) cfg->hothold * 1000 + cfg->subframe - 1) / cfg->subframe;
+    h->mask = calloc(h->npix+1, sizeof(uint8_t));
+    h->until = calloc(h->npix, sizeof(int64_t));
+    h->rate = calloc(h->npix, sizeof(uint32_t));
+    if( h->mask == NULL || h->until == NULL || h->rate == NULL ) {
+       HotFree(h);
+       return NULL;
+    }
+    return h;
+}
+
+void HotFree(struct hotpixels *h)
+{
+    if( h == NULL ) return;
+    free(h->mask);
+    free(h->until);
+    free(h->rate);
+    free(h);
+}
+
+int HotUpdate(struct hotpixels *h, const uint16_t *image, int64_t t, const struct pm2config *cfg)
+{
+    unsigned int i;
+    uint32_t nmasked = h->nmasked;
+    int changed = 0;
+
+    for(i=0;i<h->npix;i++) {
+       if( h->mask[i] ) {
+          if( t <= h->until[i] ) continue;
+          __atomic_store_n(&h->mask[i], 0, __ATOMIC_RELAXED);
+          nmasked--;
+          changed = 1;
+       }
+       else if( image[i] >= h->threshold ) {
+          h->rate[i] = (uint64_t) image[i] * 1000 / cfg->subframe;
+          h->until[i] = t + h->hold;
+          __atomic_store_n(&h->mask[i], 1, __ATOMIC_RELAXED);
+          nmasked++;
+          h->flagged++;
+          changed = 1;
+       }
+    }
+    __atomic_store_n(&h->nmasked, nmasked, __ATOMIC_RELAXED);
+    return changed;
+}
+
+int HotWrite(const struct hotpixels *h, const struct pm2config *cfg, const char *fname)
+{
+    FILE *wp;
+    char tmp[256];
+    unsigned int i;
+    int err = 0;
+
+    // written alongside and renamed into place, so a reader never sees half a list
+    snprintf(tmp, sizeof(tmp), "%s.tmp", fname);
+    if( (wp = fopen(tmp, "w")) == NULL ) {
+       perror(tmp);
+       return -1;
+    }
+    fprintf(wp, "# x y photons/s of the %u pixels masked over %u photons/s\n", h->nmasked, h->threshold * 1000 / cfg->subframe);
+    for(i=0;i<h->npix;i++)
+       if( h->mask[i] && fprintf(wp, "%u %u %u\n", i / cfg->ypix, i % cfg->ypix, h->rate[i]) < 0 ) err = -1;
+    if( fclose(wp) != 0 ) err = -1;
+    if( err == 0 && rename(tmp, fname) != 0 ) {
+       perror(fname);
+       err = -1;
+    }
+    return err;
+}
@@ -0,0 +1,66 @@
+// HotPixel.h
+// mask flaring pixels out of the Cuber's images by their photon rate
+//
+// A flaring or mis-tuned resonator can put out more photons than the rest of the array together.  Every
+// closed subframe's image is a count per pixel, so it gives each pixel's rate for free: a pixel over
+// cfg->hotrate photons/s is masked, and from then on its photons are dropped straight after the decode
+// and the remap, before the histogram, the calibration or the cube spend any time on them.  Its
+// photons are not counted while it is masked, so after cfg->hothold s it is let through again and
+// flagged again at the next close if it is still hot.
+//
+// The mask is one byte per pixel written only by the Cuber thread and read by whichever thread parses,
+// so a pixel flagged mid subframe is dropped from its next packet on.  The masked pixels are written to
+// HOT_FILE whenever the mask changes, for MkidDashboard.py, and counted in /metrics.
+
+#ifndef HOTPIXEL_H
+#define HOTPIXEL_H
+
+#include <stdint.h>
+
+#include "Config.h"
+#include "PhotonDecode.h"
+
+#define HOT_FILE "/mnt/ramdisk/hotpixels.txt"
+
+struct hotpixels {
+    unsigned int npix;
+    uint32_t threshold;             // counts in one subframe that flag a pixel
+    int64_t hold;                   // subframes a flagged pixel stays masked
+    uint32_t nmasked;               // pixels masked now, 0 skips MaskPhotons() altogether
+    uint64_t flagged;               // times a pixel has been flagged
+    uint8_t *mask;                  // npix+1 bytes, 1 drops the pixel's photons, the sink is never masked
+    int64_t *until;                 // last subframe each masked pixel stays masked for
+    uint32_t *rate;                 // photons/s each masked pixel was flagged at
+};
+
+// mask for cfg->hotrate and cfg->hothold, NULL when hotrate is 0 or on failure
+struct hotpixels *HotCreate(const struct pm2config *cfg);
+void HotFree(struct hotpixels *h);
+
+// flag the pixels over the threshold in subframe t's image and release the ones whose hold is up,
+// returns 1 if the mask changed
+int HotUpdate(struct hotpixels *h, const uint16_t *image, int64_t t, const struct pm2config *cfg);
+
+// write the masked pixels to fname, a line of x y photons/s each, returns 0 or -1 on error
+int HotWrite(const struct hotpixels *h, const struct pm2config *cfg, const char *fname);
+
+// drop the photons on masked pixels from pb, keeping the rest in order, returns how many were dropped.
+// Every photon is copied down whether it is kept or not so the loop has no branch in it.
+static inline unsigned int MaskPhotons(const struct hotpixels *h, struct photonbatch *pb)
+{
+    unsigned int i, j, n = pb->n;
+
+    for(i=0,j=0;i<n;i++) {
+       pb->xcoord[j] = pb->xcoord[i];
+       pb->ycoord[j] = pb->ycoord[i];
+       pb->timestamp[j] = pb->timestamp[i];
+       pb->wvl[j] = pb->wvl[i];
+       pb->baseline[j] = pb->baseline[i];
+       pb->pix[j] = pb->pix[i];
+       j += !__atomic_load_n(&h->mask[pb->pix[i]], __ATOMIC_RELAXED);
+    }
+    pb->n = j;
+    return n - j;
+}
+
+#endif
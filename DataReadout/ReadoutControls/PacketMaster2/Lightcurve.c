@@ -0,0 +1,148 @@
+// Lightcurve.c
+// count series for a watch list of pixels, see Lightcurve.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "Lightcurve.h"
+#include "Timebin.h"
+
+_Static_assert(sizeof(struct lightheader) == 64, "lightheader is read by pm2light.py");
+_Static_assert(sizeof(struct lightslot) == 64 + 4 * CONFIG_MAXWATCH, "lightslot is read by pm2light.py");
+
+struct lightwatch *LightWatchParse(const char *list, const struct pm2config *cfg)
+{
+    struct lightwatch *w;
+    const char *p = list;
+    char *end;
+    long x, y;
+
+    if( (w = calloc(1, sizeof(struct lightwatch))) == NULL ) return NULL;
+    if( (w->row = calloc(ConfigNpix(cfg)+1, 1)) == NULL ) {
+       free(w);
+       return NULL;
+    }
+    while( *p == ' ' || *p == '\t' ) p++;
+    if( !strncasecmp(p, "none", 4) ) return w;
+
+    while( *p ) {
+       x = strtol(p, &end, 10);
+       if( end == p || *end != ',' ) break;
+       p = end + 1;
+       y = strtol(p, &end, 10);
+       if( end == p || x < 0 || x >= cfg->xpix || y < 0 || y >= cfg->ypix ) break;
+       p = end;
+       while( *p == ' ' || *p == '\t' || *p == ';' ) p++;
+       if( w->row[x*cfg->ypix + y] ) continue;
+       if( w->n == CONFIG_MAXWATCH ) {
+          fprintf(stderr, "Lightcurve: watching the first %d pixels of %s\n", CONFIG_MAXWATCH, list);
+          return w;
+       }
+       w->x[w->n] = x;
+       w->y[w->n] = y;
+       w->row[x*cfg->ypix + y] = ++w->n;
+    }
+    if( *p ) {
+       fprintf(stderr, "Lightcurve: %s is not a list of x,y pixels in a %dx%d array\n", list, cfg->xpix, cfg->ypix);
+       LightWatchFree(w);
+       return NULL;
+    }
+    return w;
+}
+
+void LightWatchFree(struct lightwatch *w)
+{
+    if( w == NULL ) return;
+    free(w->row);
+    free(w);
+}
+
+static inline struct lightslot *LightSlot(const struct lightcurve *lc, uint64_t frame)
+{
+    return (struct lightslot *) ((char *) lc->hdr + sizeof(struct lightheader) + (frame % lc->hdr->nslots) * lc->hdr->slotlen);
+}
+
+struct lightcurve *LightCreate(const struct pm2config *cfg)
+{
+    struct lightcurve *lc;
+    struct lightheader *h;
+    unsigned int slotlen;
+    int fd;
+    void *p;
+
+    if( (lc = calloc(1, sizeof(struct lightcurve))) == NULL ) return NULL;
+    lc->binus = cfg->lightbin;
+    lc->nbins = cfg->subframe * 1000 / cfg->lightbin;
+    lc->ticklen = cfg->subframe * TIMEBIN_TICKS;
+    lc->tickmask = (1ULL << cfg->codec->tickbits) - 1;
+    slotlen = (sizeof(struct lightslot) + sizeof(uint16_t) * LightLen(lc) + 63) & ~63u;
+    lc->size = sizeof(struct lightheader) + (size_t) cfg->lightslots * slotlen;
+
+    // readers can be mapping the old file, so make a new one rather than resizing it under them
+    remove(LIGHT_PATH);
+    if( (fd = open(LIGHT_PATH, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1 ) {
+       perror(LIGHT_PATH);
+       free(lc);
+       return NULL;
+    }
+    if( ftruncate(fd, lc->size) == -1 ) {
+       perror("lightcurve ftruncate");
+       close(fd);
+       free(lc);
+       return NULL;
+    }
+    p = mmap(NULL, lc->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if( p == MAP_FAILED ) {
+       perror("lightcurve mmap");
+       free(lc);
+       return NULL;
+    }
+
+    // the file is zeroed by ftruncate, the magic goes in last so a reader never sees half a header
+    h = lc->hdr = (struct lightheader *) p;
+    h->version = LIGHT_VERSION;
+    h->nslots = cfg->lightslots;
+    h->slotlen = slotlen;
+    h->nbins = lc->nbins;
+    h->binus = lc->binus;
+    h->subframe = cfg->subframe;
+    h->maxwatch = CONFIG_MAXWATCH;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(h->magic, LIGHT_MAGIC, sizeof(LIGHT_MAGIC));
+    return lc;
+}
+
+void LightFree(struct lightcurve *lc)
+{
+    if( lc == NULL ) return;
+    munmap(lc->hdr, lc->size);
+    free(lc);
+}
+
+void LightPublish(struct lightcurve *lc, const struct lightwatch *w, const uint16_t *curve, int64_t start, uint32_t flags)
+{
+    uint64_t frame = lc->hdr->latest + 1, photons = 0;
+    struct lightslot *s = LightSlot(lc, frame);
+    unsigned int i, len = w->n * lc->nbins;
+
+    for(i=0;i<len;i++) photons += curve[i];
+
+    __atomic_store_n(&s->seq, 2*frame - 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    s->frame = frame;
+    s->start = start;
+    s->nwatch = w->n;
+    s->flags = flags;
+    s->photons = photons;
+    memcpy(s->x, w->x, sizeof(s->x));
+    memcpy(s->y, w->y, sizeof(s->y));
+    memcpy((char *) s + sizeof(struct lightslot), curve, sizeof(uint16_t) * len);
+    __atomic_store_n(&s->seq, 2*frame, __ATOMIC_RELEASE);
+    __atomic_store_n(&lc->hdr->latest, frame, __ATOMIC_RELEASE);
+}
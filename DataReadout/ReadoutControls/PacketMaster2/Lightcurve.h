@@ -0,0 +1,109 @@
+// Lightcurve.h
+// fine time binned count series for a watch list of pixels, for live photometry at millisecond cadence
+// and below where the images only come once a subframe
+//
+// The Cuber counts every photon that lands on a watched pixel (physical pixels, after any beammap
+// remap and the hot pixel mask) into bins of cfg->lightbin us by its time, the packet header's 0.5 ms
+// tick plus the photon's own us offset, so a subframe holds subframe*1000/lightbin bins per pixel.  On
+// the full array path that costs one table lookup per photon, and nothing at all with an empty list.
+// Like the images, each worker counts its own boards' photons into its own partial curves and the
+// Cuber sums them when the subframe closes, so a subframe's curves are complete once published.
+//
+// cfg->watch is a list of pixels as x,y pairs (columns then rows, like the images), at most
+// CONFIG_MAXWATCH of them.  A WATCH file on the ramdisk holding a new list (or nothing, for the
+// configured one, or "none" to stop watching) swaps the list while running.  The curves of the
+// subframes open across a swap are counted partly under the old list and flagged LIGHT_CHANGED.
+//
+// The curves go into a ring of cfg->lightslots subframes in LIGHT_PATH, published with the same seqlock
+// as LiveImage.h: a 64 byte header, then nslots slots of slotlen bytes, each a struct lightslot and
+// nwatch rows of nbins uint16 counts, all little endian.  pm2light.py is the Python side.  Each watched
+// pixel's photons are counted on /metrics too.
+
+#ifndef LIGHTCURVE_H
+#define LIGHTCURVE_H
+
+#include <stdint.h>
+
+#include "Config.h"
+#include "PhotonDecode.h"
+
+#define LIGHT_PATH "/mnt/ramdisk/Lightcurve.shm"
+#define LIGHT_MAGIC "PM2LC"         // zero padded to fill lightheader.magic
+#define LIGHT_VERSION 1
+
+#define LIGHT_CHANGED 1             // lightslot.flags: the watch list changed while the subframe was open
+
+// the watch list, swapped whole like a beammap
+struct lightwatch {
+    unsigned int n;
+    uint16_t x[CONFIG_MAXWATCH], y[CONFIG_MAXWATCH];
+    uint8_t *row;                   // npix+1 bytes, 1 + the curve row of each watched pixel, 0 for the rest
+};
+
+struct lightheader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nslots;
+    uint32_t slotlen;               // bytes from one slot to the next
+    uint32_t nbins;                 // bins per pixel in a subframe
+    uint32_t binus;                 // us per bin
+    uint32_t subframe;              // ms per subframe
+    uint64_t latest;                // newest frame published, 0 before the first
+    uint32_t maxwatch;              // rows of counts room is kept for in each slot
+    char pad[20];
+} __attribute__((aligned(64)));
+
+struct lightslot {
+    uint64_t seq;                   // 2f once frame f is in the slot, odd while it is being written
+    uint64_t frame;
+    int64_t start;                  // ms since the Unix epoch of the start of the subframe
+    uint32_t nwatch;                // rows of counts that follow
+    uint32_t flags;                 // LIGHT_ bits
+    uint64_t photons;               // sum of the counts
+    char pad[24];
+    uint16_t x[CONFIG_MAXWATCH], y[CONFIG_MAXWATCH];
+} __attribute__((aligned(64)));
+
+struct lightcurve {
+    struct lightheader *hdr;
+    size_t size;
+    unsigned int nbins;
+    unsigned int binus;
+    unsigned int ticklen;           // ticks per subframe, to find a packet's place in its subframe
+    uint64_t tickmask;              // the header time wraps at tickmask+1
+};
+
+// parse "x,y x,y ..." for cfg's array, NULL (and why on stderr) if it is not a list of pixels.  "none"
+// and an empty list give an empty watch list
+struct lightwatch *LightWatchParse(const char *list, const struct pm2config *cfg);
+void LightWatchFree(struct lightwatch *w);
+
+// create (or reset) LIGHT_PATH with room for cfg->lightslots subframes and map it, NULL on failure
+struct lightcurve *LightCreate(const struct pm2config *cfg);
+void LightFree(struct lightcurve *lc);
+
+// counts of one subframe, CONFIG_MAXWATCH rows of nbins
+static inline unsigned int LightLen(const struct lightcurve *lc)
+{
+    return CONFIG_MAXWATCH * lc->nbins;
+}
+
+// count the watched pixels' photons of a packet stamped tick (the wrapping header time) into curve, for
+// the subframe that starts at tick first
+static inline void LightPhotons(const struct lightcurve *lc, const struct lightwatch *w, uint16_t *curve, const struct photonbatch *pb, uint64_t tick, uint64_t first)
+{
+    unsigned int i, row, bin;
+    uint32_t us = ((tick - first) & lc->tickmask) * 500;
+
+    for(i=0;i<pb->n;i++) {
+       if( (row = w->row[pb->pix[i]]) == 0 ) continue;
+       // the last photons of a packet at the end of the subframe are up to 511 us past it
+       if( (bin = (us + pb->timestamp[i]) / lc->binus) >= lc->nbins ) bin = lc->nbins - 1;
+       curve[(row-1)*lc->nbins + bin]++;
+    }
+}
+
+// publish a closed subframe's curves for w's pixels, the subframe starting at start ms
+void LightPublish(struct lightcurve *lc, const struct lightwatch *w, const uint16_t *curve, int64_t start, uint32_t flags);
+
+#endif
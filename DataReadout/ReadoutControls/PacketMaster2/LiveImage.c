@@ -0,0 +1,94 @@
+// LiveImage.c
+// shared memory ring of the Cuber's latest images, see LiveImage.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "LiveImage.h"
+
+_Static_assert(sizeof(struct liveheader) == 64, "liveheader is read by pm2live.py");
+_Static_assert(sizeof(struct liveslot) == 64, "liveslot is read by pm2live.py");
+
+static inline struct liveslot *LiveSlot(const struct liveimage *live, uint64_t frame)
+{
+    return (struct liveslot *) ((char *) live->hdr + sizeof(struct liveheader) + (frame % live->hdr->nslots) * live->hdr->slotlen);
+}
+
+struct liveimage *LiveCreate(const struct pm2config *cfg, int nslots)
+{
+    struct liveimage *live;
+    struct liveheader *h;
+    unsigned int slotlen;
+    int fd;
+    void *p;
+
+    if( (live = calloc(1, sizeof(struct liveimage))) == NULL ) return NULL;
+    live->npix = ConfigNpix(cfg);
+    slotlen = (sizeof(struct liveslot) + sizeof(uint16_t) * live->npix + 63) & ~63u;
+    live->size = sizeof(struct liveheader) + (size_t) nslots * slotlen;
+
+    // readers can be mapping the old file, so make a new one rather than resizing it under them
+    remove(LIVE_PATH);
+    if( (fd = open(LIVE_PATH, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1 ) {
+       perror(LIVE_PATH);
+       free(live);
+       return NULL;
+    }
+    if( ftruncate(fd, live->size) == -1 ) {
+       perror("live image ftruncate");
+       close(fd);
+       free(live);
+       return NULL;
+    }
+    p = mmap(NULL, live->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if( p == MAP_FAILED ) {
+       perror("live image mmap");
+       free(live);
+       return NULL;
+    }
+
+    // the file is zeroed by ftruncate, the magic goes in last so a reader never sees half a header
+    h = live->hdr = (struct liveheader *) p;
+    h->version = LIVE_VERSION;
+    h->nslots = nslots;
+    h->slotlen = slotlen;
+    h->xpix = cfg->xpix;
+    h->ypix = cfg->ypix;
+    h->subframe = cfg->subframe;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(h->magic, LIVE_MAGIC, sizeof(LIVE_MAGIC));
+    return live;
+}
+
+void LivePublish(struct liveimage *live, const uint16_t *image, int64_t start, uint32_t window)
+{
+    uint64_t frame = live->hdr->latest + 1, photons = 0;
+    struct liveslot *s = LiveSlot(live, frame);
+    unsigned int i;
+
+    for(i=0;i<live->npix;i++) photons += image[i];
+
+    __atomic_store_n(&s->seq, 2*frame - 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    s->frame = frame;
+    s->start = start;
+    s->window = window;
+    s->npix = live->npix;
+    s->photons = photons;
+    s->offarray = image[live->npix];
+    memcpy((char *) s + sizeof(struct liveslot), image, sizeof(uint16_t) * live->npix);
+    __atomic_store_n(&s->seq, 2*frame, __ATOMIC_RELEASE);
+    __atomic_store_n(&live->hdr->latest, frame, __ATOMIC_RELEASE);
+}
+
+void LiveFree(struct liveimage *live)
+{
+    if( live == NULL ) return;
+    munmap(live->hdr, live->size);
+    free(live);
+}
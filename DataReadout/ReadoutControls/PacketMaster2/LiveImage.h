@@ -0,0 +1,67 @@
+// LiveImage.h
+// shared memory ring of the Cuber's latest images, for MkidDashboard.py and anything else watching live
+//
+// Instead of a .img and a .png per image on the ramdisk for the dashboard to find by listing the
+// directory (and to clean up, or the ramdisk fills), the Cuber copies each image into the next slot of
+// a ring in LIVE_PATH, made once at startup and mapped by any number of readers.  A reader only ever
+// reads the file: nothing it does can hold the Cuber up, and there is nothing to delete.
+//
+// Every slot carries a sequence number used as a seqlock.  Publishing frame f (numbered from 1) into
+// slot f % nslots sets the slot's seq to 2f-1, copies the image in, sets seq to 2f and then the header's
+// latest to f.  A reader takes latest, copies the slot, and keeps the copy if the slot's seq was 2f both
+// before and after; if not, the Cuber lapped it and it tries again with the new latest.  A reader that
+// wants no copy at all can use the image in place and check seq afterwards the same way.  pm2live.py is
+// the Python side.
+//
+// The layout is fixed little endian so Python can read it with struct and numpy: a 64 byte header,
+// then nslots slots of slotlen bytes, each a 64 byte struct liveslot and the npix counts (as in a .img,
+// x major) padded to a multiple of 64 bytes.
+
+#ifndef LIVEIMAGE_H
+#define LIVEIMAGE_H
+
+#include <stdint.h>
+
+#include "Config.h"
+
+#define LIVE_PATH "/mnt/ramdisk/LiveImage.shm"
+#define LIVE_MAGIC "PM2LIVE"        // with its terminating 0 fills liveheader.magic
+#define LIVE_VERSION 1
+
+struct liveheader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nslots;
+    uint32_t slotlen;               // bytes from one slot to the next
+    uint32_t xpix, ypix;
+    uint32_t subframe;              // ms between images
+    uint64_t latest;                // newest frame published, 0 before the first
+    char pad[24];
+} __attribute__((aligned(64)));
+
+struct liveslot {
+    uint64_t seq;                   // 2f once frame f is in the slot, odd while it is being written
+    uint64_t frame;
+    int64_t start;                  // ms since the Unix epoch of the start of the image's window
+    uint32_t window;                // ms summed into the image
+    uint32_t npix;
+    uint64_t photons;               // sum of the counts
+    uint64_t offarray;              // photons off the array (the sink pixel), not in the counts
+    char pad[16];
+} __attribute__((aligned(64)));
+
+struct liveimage {
+    struct liveheader *hdr;
+    size_t size;
+    unsigned int npix;
+};
+
+// create (or reset) LIVE_PATH with room for nslots images of cfg's array and map it, NULL on failure
+struct liveimage *LiveCreate(const struct pm2config *cfg, int nslots);
+
+// publish an image of npix+1 counts (the last the sink pixel) for the window starting at start ms
+void LivePublish(struct liveimage *live, const uint16_t *image, int64_t start, uint32_t window);
+
+void LiveFree(struct liveimage *live);
+
+#endif
@@ -0,0 +1,361 @@
+// LoadGen.c
+// drive PacketMaster2 with real UDP traffic from simulated ROACH boards
+//
+// TestReader() writes fake packets straight onto the ring, which tests neither the sockets nor the rates
+// a full array reaches.  LoadGen sends photon packets as UDP datagrams, one socket per simulated board
+// so the kernel spreads them over SO_REUSEPORT Readers the way the real boards are.  Packets either come
+// from a synthetic generator (-r packets per second per board, in the format of the configured
+// firmware) or are replayed from .bin files on the pacing of their header timestamps, and -x sends
+// either one at a multiple of real time.  Synthetic packets then come x times as often and their board
+// clock runs x times faster; replayed packets are sent with the headers they were recorded with, only
+// x times sooner, so their header times also run x times faster than the wall clock.
+//
+// Every packet has a deadline on an absolute CLOCK_MONOTONIC schedule.  Gaps longer than LOADGEN_SPIN
+// are slept with clock_nanosleep(), the rest of the way is spun, and the worst lateness is reported, so
+// if the generator itself cannot keep up it says so.  -l drops a fraction of the packets (the frame
+// counters still advance, so the receiver sees the gap) and -o holds a fraction back by up to -d packets
+// to reorder them.
+//
+//   LoadGen [-h host] [-p port] [-n boards] [-r rate] [-c photons] [-x speed] [-t seconds] [-l loss]
+//           [-o reorder] [-d depth] [file.bin ...]
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "Config.h"
+#include "BinFile.h"
+#include "Timebin.h"
+
+#define LOADGEN_SPIN 100000         // ns of a wait that is spun rather than slept
+#define LOADGEN_LATE 10000          // ns past its deadline a packet has to go out to count as late
+#define LOADGEN_MAXPHOT 100         // photons in a full packet
+#define LOADGEN_MAXHELD 256         // most packets held back for reordering at once
+
+// compile with gcc -O2 -o LoadGen LoadGen.c Config.c BinFile.c PhotonPack.c PacketCodec.c -I. -lm -lrt
+
+struct heldpkt {
+    int sock;
+    unsigned int len;
+    unsigned int countdown;         // packets still to send before this one goes
+    uint64_t words[LOADGEN_MAXPHOT + 2];
+};
+
+struct loadgen {
+    int *sock;                      // one connected socket per board
+    int nsock;
+    double speed, loss, reorder;
+    int depth;
+    uint64_t rng;
+    struct heldpkt held[LOADGEN_MAXHELD];
+    int nheld;
+
+    uint64_t start;                 // CLOCK_MONOTONIC ns the schedule counts from
+    uint64_t sent, bytes, dropped, reordered, errors;
+    uint64_t late, maxlate;         // packets sent after their deadline, and the worst miss in ns
+};
+
+static inline uint64_t Rand(struct loadgen *lg)
+{
+    // xorshift64*, a rand() per field would cost more than the send
+    lg->rng ^= lg->rng >> 12;
+    lg->rng ^= lg->rng << 25;
+    lg->rng ^= lg->rng >> 27;
+    return lg->rng * 0x2545F4914F6CDD1DUL;
+}
+
+static inline double Uniform(struct loadgen *lg)
+{
+    return (Rand(lg) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static inline uint64_t NowNs()
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000UL + t.tv_nsec;
+}
+
+// wait for an absolute deadline, sleeping for all but the last LOADGEN_SPIN ns of it
+static void Pace(struct loadgen *lg, uint64_t deadline)
+{
+    struct timespec t;
+    uint64_t now = NowNs();
+
+    if( now >= deadline ) {
+       if( now - deadline > LOADGEN_LATE ) lg->late++;
+       if( now - deadline > lg->maxlate ) lg->maxlate = now - deadline;
+       return;
+    }
+    if( deadline - now > LOADGEN_SPIN ) {
+       t.tv_sec = (deadline - LOADGEN_SPIN) / 1000000000UL;
+       t.tv_nsec = (deadline - LOADGEN_SPIN) % 1000000000UL;
+       while( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR ) ;
+    }
+    while( NowNs() < deadline ) ;
+}
+
+static void Send(struct loadgen *lg, int sock, const void *data, unsigned int len)
+{
+    if( send(sock, data, len, 0) == (ssize_t) len ) {
+       lg->sent++;
+       lg->bytes += len;
+    }
+    else lg->errors++;
+}
+
+// send a packet, or drop it or hold it back, then let go of any held packets whose turn has come
+static void Emit(struct loadgen *lg, int sock, const uint64_t *words, unsigned int len)
+{
+    struct heldpkt *h;
+    int i;
+
+    if( lg->loss > 0 && Uniform(lg) < lg->loss ) {
+       lg->dropped++;
+       return;
+    }
+    if( lg->reorder > 0 && lg->nheld < LOADGEN_MAXHELD && Uniform(lg) < lg->reorder ) {
+       h = &lg->held[lg->nheld++];
+       h->sock = sock;
+       h->len = len;
+       h->countdown = 1 + Rand(lg) % lg->depth;
+       memcpy(h->words, words, len);
+       lg->reordered++;
+       return;
+    }
+
+    Send(lg, sock, words, len);
+    for(i=0;i<lg->nheld;) {
+       h = &lg->held[i];
+       if( --h->countdown > 0 ) {
+          i++;
+          continue;
+       }
+       Send(lg, h->sock, h->words, h->len);
+       *h = lg->held[--lg->nheld];
+    }
+}
+
+static void Flush(struct loadgen *lg)
+{
+    int i;
+
+    for(i=0;i<lg->nheld;i++) Send(lg, lg->held[i].sock, lg->held[i].words, lg->held[i].len);
+    lg->nheld = 0;
+}
+
+// one synthetic packet from board roach: its columns of the array, times rising through the packet,
+// and a baseline that wanders slowly
+static unsigned int Synthesize(struct loadgen *lg, const struct pm2config *cfg, uint64_t *words, int roach,
+                               int frame, uint64_t ticks, int nphot, uint32_t *baseline)
+{
+    int i, ncol = cfg->xpix / cfg->nroach > 0 ? cfg->xpix / cfg->nroach : 1;
+    uint64_t r;
+
+    cfg->codec->putheader((char *) &words[0], roach, frame, ticks);
+    for(i=0;i<nphot;i++) {
+       r = Rand(lg);
+       *baseline = (*baseline + (r >> 60) - 8) & 0x1FFFF;
+       cfg->codec->putphoton((char *) &words[i+1], (roach * ncol + (r & 0xFFFF) % ncol) % cfg->xpix, ((r >> 16) & 0xFFFF) % cfg->ypix,
+                             i * 500 / nphot, (r >> 32) & 0x3FFF, *baseline);
+    }
+    // a short packet ends with a fake photon
+    if( nphot < LOADGEN_MAXPHOT ) {
+       cfg->codec->putshort((char *) &words[nphot+1]);
+       return 8*(nphot+2);
+    }
+    return 8*(nphot+1);
+}
+
+static void RunSynthetic(struct loadgen *lg, const struct pm2config *cfg, double rate, int nphot, double seconds)
+{
+    uint32_t *baseline = calloc(cfg->nroach, sizeof(uint32_t));
+    int *frame = calloc(cfg->nroach, sizeof(int));
+    uint64_t words[LOADGEN_MAXPHOT + 2], k, deadline, sim, ticks0;
+    struct timespec wall;
+    double period;
+    unsigned int len;
+    int r;
+
+    // the boards take turns, so packet k is board k % nroach
+    period = 1e9 / (rate * lg->speed * cfg->nroach);
+    clock_gettime(CLOCK_REALTIME, &wall);
+    ticks0 = TimebinClock(wall.tv_sec, wall.tv_nsec);
+    for(r=0;r<cfg->nroach;r++) baseline[r] = 40000 + 1000*r;
+
+    for(k=0;;k++) {
+       deadline = lg->start + (uint64_t) (k * period);
+       if( seconds > 0 && deadline - lg->start >= seconds * 1e9 ) break;
+       r = k % cfg->nroach;
+       // board time runs speed times faster than ours
+       sim = (uint64_t) ((deadline - lg->start) * lg->speed);
+       len = Synthesize(lg, cfg, words, r, frame[r], ticks0 + sim / 500000, nphot, &baseline[r]);
+       frame[r] = (frame[r] + 1) % 4096;
+       Pace(lg, deadline);
+       Emit(lg, lg->sock[r % lg->nsock], words, len);
+    }
+    free(baseline);
+    free(frame);
+}
+
+// replay the packets of a .bin file on the pacing of their header times, divided by lg->speed.  The
+// words go out as they were recorded, headers included.  first and last are the unwrapped header times
+// of the first and newest packet replayed so far, over every file.  Returns 0 on error
+static int RunReplay(struct loadgen *lg, const struct pm2config *cfg, const char *name, int64_t *first, int64_t *last)
+{
+    struct binscan bs;
+    struct packetheader hdr;
+    const struct packetcodec *codec;
+    struct stat st;
+    uint64_t words[LOADGEN_MAXPHOT + 2], w = 0, deadline = 0;
+    int64_t t;
+    const char *p = (const char *) &w;      // the word's bytes as they are in the file
+    unsigned int n = 0;
+    int more, roach = 0;
+    FILE *rp;
+
+    if( (rp = fopen(name, "rb")) == NULL ) {
+       perror(name);
+       return 0;
+    }
+    if( BinScanOpen(&bs, rp, -1) < 0 ) {
+       fclose(rp);
+       return 0;
+    }
+    if( (codec = BinCodec(&bs.h, bs.container, cfg)) == NULL ) {
+       fprintf(stderr, "%s: firmware %.32s has no packet format\n", name, bs.h.firmware);
+       BinScanClose(&bs);
+       fclose(rp);
+       return 0;
+    }
+    // the header ticks wrap, unwrap them against the newest time replayed, starting from when the Writer
+    // opened the first file (when it was last written for raw packets)
+    if( *first == INT64_MIN && bs.container > 0 ) *last = TimebinClock(bs.h.starttime, bs.h.startnsec);
+    else if( *first == INT64_MIN ) *last = TimebinClock(fstat(fileno(rp), &st) == 0 ? st.st_mtime : time(NULL), 0);
+
+    do {
+       more = BinScanWord(&bs, &w);
+       // a packet runs up to the next header, and takes in the fake photon that ends a short one
+       if( n > 0 && (!more || CodecIsHeader(p) || n == LOADGEN_MAXPHOT + 2) ) {
+          Pace(lg, deadline);
+          Emit(lg, lg->sock[roach % lg->nsock], words, 8*n);
+          n = 0;
+       }
+       if( !more ) break;
+
+       if( CodecIsHeader(p) ) {
+          codec->header(p, &hdr);
+          roach = hdr.roach;
+          t = TimebinNearest(hdr.ticks, codec->tickbits, *last);
+          if( *first == INT64_MIN ) *first = *last = t;
+          // the schedule never runs backwards, a board that is behind the others just goes at once
+          if( t > *last ) *last = t;
+          deadline = lg->start + (uint64_t) ((*last - *first) * 500000 / lg->speed);
+       }
+       else if( n == 0 ) continue;     // words outside any packet
+       words[n++] = w;
+    } while( 1 );
+
+    BinScanClose(&bs);
+    fclose(rp);
+    return 1;
+}
+
+static int CompareNames(const void *a, const void *b)
+{
+    return strcmp(*(const char **) a, *(const char **) b);
+}
+
+int main(int argc, char *argv[])
+{
+    struct pm2config cfg;
+    struct loadgen lg;
+    struct addrinfo hints, *ai;
+    const char *host = "127.0.0.1";
+    char port[16];
+    double rate = 1000, seconds = 10, elapsed;
+    int i, opt, nphot = LOADGEN_MAXPHOT, nfiles;
+    int64_t first = INT64_MIN, last = INT64_MIN;
+    char **names;
+
+    ConfigLoad(NULL, &cfg);
+    memset(&lg, 0, sizeof(lg));
+    lg.speed = 1;
+    lg.depth = 8;
+    snprintf(port, sizeof(port), "%d", cfg.port);
+
+    while( (opt = getopt(argc, argv, "h:p:n:r:c:x:t:l:o:d:")) != -1 ) {
+       switch( opt ) {
+          case 'h': host = optarg; break;
+          case 'p': snprintf(port, sizeof(port), "%s", optarg); break;
+          case 'n': cfg.nroach = atoi(optarg); break;
+          case 'r': rate = atof(optarg); break;
+          case 'c': nphot = atoi(optarg); break;
+          case 'x': lg.speed = atof(optarg); break;
+          case 't': seconds = atof(optarg); break;
+          case 'l': lg.loss = atof(optarg); break;
+          case 'o': lg.reorder = atof(optarg); break;
+          case 'd': lg.depth = atoi(optarg); break;
+          default:
+             fprintf(stderr, "usage: %s [-h host] [-p port] [-n boards] [-r packets/s per board] [-c photons per packet] [-x speed]\n"
+                             "       [-t seconds] [-l loss fraction] [-o reorder fraction] [-d reorder depth] [file.bin ...]\n", argv[0]);
+             return 1;
+       }
+    }
+    if( cfg.nroach < 1 || cfg.nroach > 256 || rate <= 0 || lg.speed <= 0 || lg.depth < 1 || nphot < 1 || nphot > LOADGEN_MAXPHOT ) {
+       fprintf(stderr, "LoadGen: boards 1 to 256, photons 1 to %d, rate, speed and depth must be positive\n", LOADGEN_MAXPHOT);
+       return 1;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if( (i = getaddrinfo(host, port, &hints, &ai)) != 0 ) {
+       fprintf(stderr, "%s: %s\n", host, gai_strerror(i));
+       return 1;
+    }
+    lg.nsock = cfg.nroach;
+    lg.sock = calloc(lg.nsock, sizeof(int));
+    for(i=0;i<lg.nsock;i++) {
+       if( (lg.sock[i] = socket(AF_INET, SOCK_DGRAM, 0)) == -1 || connect(lg.sock[i], ai->ai_addr, ai->ai_addrlen) == -1 ) {
+          perror("LoadGen socket");
+          return 1;
+       }
+    }
+    freeaddrinfo(ai);
+    lg.rng = NowNs() | 1;
+
+    lg.start = NowNs() + 1000000;
+    if( optind < argc ) {
+       nfiles = argc - optind;
+       names = &argv[optind];
+       qsort(names, nfiles, sizeof(char *), CompareNames);
+       printf("Replaying %d files to %s:%s at %.1fx\n", nfiles, host, port, lg.speed);
+       for(i=0;i<nfiles;i++) if( !RunReplay(&lg, &cfg, names[i], &first, &last) ) fprintf(stderr, "%s: replay failed\n", names[i]);
+    }
+    else {
+       printf("Sending %d boards x %.0f packets/s of %d photons to %s:%s at %.1fx for %.1f s\n", cfg.nroach, rate, nphot, host, port, lg.speed, seconds);
+       RunSynthetic(&lg, &cfg, rate, nphot, seconds);
+    }
+    Flush(&lg);
+    elapsed = (NowNs() - lg.start) / 1e9;
+
+    printf("Sent %lu packets, %.1f MBytes in %.2f s: %.0f packets/s, %.1f MBytes/s\n", lg.sent, lg.bytes/1e6, elapsed, lg.sent/elapsed, lg.bytes/1e6/elapsed);
+    printf("Dropped %lu, reordered %lu, send errors %lu\n", lg.dropped, lg.reordered, lg.errors);
+    printf("%lu packets went out more than %d us late, the worst by %.1f us\n", lg.late, LOADGEN_LATE/1000, lg.maxlate/1e3);
+    for(i=0;i<lg.nsock;i++) close(lg.sock[i]);
+    free(lg.sock);
+    return 0;
+}
@@ -0,0 +1,55 @@
+#!/usr/bin/env python
+"""
+Write a PacketMaster2 beammap remap (see Beammap.h) from two Beamlist files of DARKNESS-Beammapping.
+
+old is the Beamlist the firmware was loaded with, so its positions are the coordinates the boards
+stamp.  new is the redone one.  Every resonator is matched by its id: if it moved it gets a line from
+where the boards stamp it to where it really is, and if the new beammap could not place it (flag not 0)
+it is marked bad.  Lines hold for every board (roach -1), the coordinates already tell the boards apart.
+
+    MakeRemap.py [--xpix 80] [--ypix 125] old_Beamlist.txt new_Beamlist.txt > remap.txt
+"""
+
+from __future__ import print_function
+import argparse, sys
+
+
+def beamlist(fn):
+    """{resonator id: (flag, x, y)} from lines of id flag x y"""
+    out = {}
+    for line in open(fn):
+        f = line.split()
+        if len(f) >= 4 and not line.startswith('#'):
+            out[int(f[0])] = (int(f[1]), int(round(float(f[2]))), int(round(float(f[3]))))
+    return out
+
+
+def main():
+    ap = argparse.ArgumentParser(description='beammap remap for PacketMaster2 from an old and a new Beamlist')
+    ap.add_argument('--xpix', type=int, default=80)
+    ap.add_argument('--ypix', type=int, default=125)
+    ap.add_argument('old', help='Beamlist the firmware was loaded with')
+    ap.add_argument('new', help='redone Beamlist')
+    args = ap.parse_args()
+
+    old, new = beamlist(args.old), beamlist(args.new)
+    inside = lambda x, y: 0 <= x < args.xpix and 0 <= y < args.ypix
+    print('# roach x y px py, from %s to %s' % (args.old, args.new))
+    moved = bad = 0
+    for res in sorted(old):
+        flag, x, y = old[res]
+        # a resonator the firmware never placed on the array has no stamped pixel to remap
+        if flag != 0 or not inside(x, y):
+            continue
+        nflag, px, py = new.get(res, (1, 0, 0))
+        if nflag != 0 or not inside(px, py):
+            print(-1, x, y, -1, -1)
+            bad += 1
+        elif (px, py) != (x, y):
+            print(-1, x, y, px, py)
+            moved += 1
+    print('MakeRemap: %d pixels moved, %d bad' % (moved, bad), file=sys.stderr)
+
+
+if __name__ == '__main__':
+    main()
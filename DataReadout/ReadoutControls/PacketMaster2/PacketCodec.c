@@ -0,0 +1,33 @@
+// PacketCodec.c
+// the table of firmware packet formats, see PacketCodec.h
+
+#include <strings.h>
+
+#include "PacketCodec.h"
+
+#define CODEC_ENTRY(Name, firmware, be, ss,sb, rs,rb, fs,fb, ts,tb, ...) \
+    { firmware, tb, Name##Header, Name##Ticks, Name##Photon, Name##PutHeader, Name##PutPhoton, Name##PutShort },
+#define CODEC_NAME(Name, firmware, ...) " " firmware
+
+static const struct packetcodec codecs[] = { CODEC_FORMATS(CODEC_ENTRY) };
+
+const struct packetcodec *CodecFind(const char *firmware)
+{
+    unsigned int i;
+
+    for(i=0;i<sizeof(codecs)/sizeof(codecs[0]);i++) {
+       if( !strcasecmp(firmware, codecs[i].name) ) return &codecs[i];
+    }
+    return NULL;
+}
+
+const struct packetcodec *CodecDefault()
+{
+    return &codecs[0];
+}
+
+const char *CodecNames()
+{
+    // skip the leading space
+    return &(CODEC_FORMATS(CODEC_NAME))[1];
+}
@@ -0,0 +1,143 @@
+// PacketCodec.h
+// the packet formats of the readout firmwares, one specialization per firmware, shared by every stage
+// and every offline tool
+//
+// A packet is a header word then its photon words, 64 bits each.  The firmwares differ only in the byte
+// order of the words and where each field sits in them, so a format is one line of CODEC_FORMATS: the C
+// name, the cfg->firmware name (recorded in every .bin header), 1 if the words are big endian on the
+// wire, then the shift and width of every field
+//
+//   header   start roach frame ticks
+//   photon   xcoord ycoord timestamp wvl baseline
+//
+// CODEC_DEFINE turns each line into its own static inline loads, stores and field accessors with those
+// shifts and masks as constants (DarknessHeader(), LegacyPutPhoton(), ...), and PhotonDecode.c builds a
+// decode kernel per format from the same line.  The format is picked once, from cfg->firmware by
+// ConfigLoad() into cfg->codec or from a .bin file's header by the tools, so nothing branches on it per
+// word.  struct packetcodec is the picked format, for code that sees one packet at a time.
+//
+//   darkness   the DARKNESS boards, big endian, 36 bit timestamp in 0.5 ms ticks since TIMEBIN_EPOCH
+//   legacy     the earlier firmware PacketMaster2-defaultpipes.c reads, native (little endian) order,
+//              fields from the bottom bit up and a 32 bit timestamp
+//
+// Every format keeps the header's start byte (CODEC_START) first in memory and the roach id second, and
+// the fake photon that ends a short packet starts CODEC_SHORT 0xFF, so the framer, PhotonPack and the
+// Cuber's board lookup work on the raw bytes without knowing which format they hold.
+
+#ifndef PACKETCODEC_H
+#define PACKETCODEC_H
+
+#include <stdint.h>
+#include <string.h>
+#include <byteswap.h>
+
+#define CODEC_FORMATS(F) \
+    F(Darkness, "darkness", 1,  56,8, 48,8, 36,12,  0,36,  54,10, 44,10, 35,9, 17,18,  0,17) \
+    F(Legacy,   "legacy",   0,   0,8,  8,8, 16,12, 28,32,   0,10, 10,10, 20,9, 29,18, 47,17)
+
+#define CODEC_START 0xFF            // start field of a header word
+#define CODEC_SHORT 0x7F            // start field of the fake photon, every other bit of it is set
+
+struct packetheader {
+    uint64_t ticks;                 // header timestamp, wraps at 1 << packetcodec.tickbits
+    unsigned int frame;             // 12 bits, wraps
+    unsigned int roach;
+    unsigned int start;
+};
+
+// one photon word, for code that looks at them one at a time.  A packet's worth is decoded together by
+// DecodePhotons()
+struct packetphoton {
+    uint32_t xcoord, ycoord;
+    uint32_t timestamp;             // us after the header time
+    uint32_t wvl, baseline;
+};
+
+struct packetcodec {
+    const char *name;
+    unsigned int tickbits;
+    void (*header)(const char *packet, struct packetheader *h);
+    uint64_t (*ticks)(const char *packet);
+    void (*photon)(const char *p, struct packetphoton *ph);
+    void (*putheader)(char *p, unsigned int roach, unsigned int frame, uint64_t ticks);
+    void (*putphoton)(char *p, uint32_t xcoord, uint32_t ycoord, uint32_t timestamp, uint32_t wvl, uint32_t baseline);
+    void (*putshort)(char *p);
+};
+
+// the format of firmware, NULL if there is no such format
+const struct packetcodec *CodecFind(const char *firmware);
+
+// the format a file or config that names none is in
+const struct packetcodec *CodecDefault();
+
+// the names of every format, space separated, for messages
+const char *CodecNames();
+
+// tests on the raw bytes of a word that hold for every format
+static inline int CodecIsHeader(const char *p)
+{
+    return (uint8_t) p[0] == CODEC_START;
+}
+
+static inline int CodecIsShort(const char *p)
+{
+    return (uint8_t) p[0] == CODEC_SHORT && (uint8_t) p[1] == 0xFF;
+}
+
+static inline unsigned int CodecRoach(const char *p)
+{
+    return (uint8_t) p[1];
+}
+
+#define CODEC_FIELD(w, s, b) (((w) >> (s)) & ((1ULL << (b)) - 1))
+#define CODEC_PUT(v, s, b) (((uint64_t) (v) & ((1ULL << (b)) - 1)) << (s))
+
+#define CODEC_DEFINE(Name, firmware, be, ss,sb, rs,rb, fs,fb, ts,tb, xs,xb, ys,yb, us,ub, ws,wb, bs,bb) \
+static inline uint64_t Name##Load(const char *p) \
+{ \
+    uint64_t w; \
+    memcpy(&w, p, 8); \
+    return be ? __bswap_64(w) : w; \
+} \
+static inline void Name##Store(char *p, uint64_t w) \
+{ \
+    if( be ) w = __bswap_64(w); \
+    memcpy(p, &w, 8); \
+} \
+static inline void Name##Header(const char *p, struct packetheader *h) \
+{ \
+    uint64_t w = Name##Load(p); \
+    h->ticks = CODEC_FIELD(w, ts, tb); \
+    h->frame = CODEC_FIELD(w, fs, fb); \
+    h->roach = CODEC_FIELD(w, rs, rb); \
+    h->start = CODEC_FIELD(w, ss, sb); \
+} \
+static inline uint64_t Name##Ticks(const char *p) \
+{ \
+    return CODEC_FIELD(Name##Load(p), ts, tb); \
+} \
+static inline void Name##Photon(const char *p, struct packetphoton *ph) \
+{ \
+    uint64_t w = Name##Load(p); \
+    ph->xcoord = CODEC_FIELD(w, xs, xb); \
+    ph->ycoord = CODEC_FIELD(w, ys, yb); \
+    ph->timestamp = CODEC_FIELD(w, us, ub); \
+    ph->wvl = CODEC_FIELD(w, ws, wb); \
+    ph->baseline = CODEC_FIELD(w, bs, bb); \
+} \
+static inline void Name##PutHeader(char *p, unsigned int roach, unsigned int frame, uint64_t ticks) \
+{ \
+    Name##Store(p, CODEC_PUT(CODEC_START, ss, sb) | CODEC_PUT(roach, rs, rb) | CODEC_PUT(frame, fs, fb) | CODEC_PUT(ticks, ts, tb)); \
+} \
+static inline void Name##PutPhoton(char *p, uint32_t xcoord, uint32_t ycoord, uint32_t timestamp, uint32_t wvl, uint32_t baseline) \
+{ \
+    Name##Store(p, CODEC_PUT(xcoord, xs, xb) | CODEC_PUT(ycoord, ys, yb) | CODEC_PUT(timestamp, us, ub) | CODEC_PUT(wvl, ws, wb) | CODEC_PUT(baseline, bs, bb)); \
+} \
+static inline void Name##PutShort(char *p) \
+{ \
+    Name##Store(p, ~CODEC_PUT(CODEC_START ^ CODEC_SHORT, ss, sb)); \
+}
+
+CODEC_FORMATS(CODEC_DEFINE)
+
+#endif
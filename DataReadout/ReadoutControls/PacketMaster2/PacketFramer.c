@@ -0,0 +1,151 @@
+// PacketFramer.c
+// streaming packet framer for the PacketMaster2 photon stream, see PacketFramer.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "PacketFramer.h"
+#include "PacketCodec.h"
+#include "Realtime.h"
+
+#define FRAMER_MASK (FRAMER_LEN-1)
+
+struct packetframer *FramerCreate()
+{
+    struct packetframer *f;
+
+    if( (f = HugeAlloc(sizeof(struct packetframer))) == NULL ) return NULL;
+    FramerReset(f);
+    return f;
+}
+
+void FramerReset(struct packetframer *f)
+{
+    f->rd = 0;
+    f->wr = 0;
+    f->scan = 0;
+    f->skip = 0;
+    f->overrun = 0;
+    f->resync = 0;
+    f->synced = 1;
+}
+
+void FramerFree(struct packetframer *f)
+{
+    HugeFree(f, sizeof(struct packetframer));
+}
+
+int FramerPush(struct packetframer *f, const char *data, unsigned int len)
+{
+    unsigned int start, first;
+
+    if( f->wr - f->rd + len > FRAMER_LEN ) {
+       f->overrun += len;
+       return 0;
+    }
+
+    start = f->wr & FRAMER_MASK;
+    first = FRAMER_LEN - start;
+    if( len <= first ) memcpy(&f->buf[start], data, len);
+    else {
+       memcpy(&f->buf[start], data, first);
+       memcpy(f->buf, &data[first], len-first);
+    }
+    f->wr += len;
+    return 1;
+}
+
+int FramerNext(struct packetframer *f, char **packet, unsigned int *len)
+{
+    const char *w;
+    unsigned int start, plen, first;
+    int eof;
+
+    // drop the fake photon that ended the last short packet now the caller is done with it
+    f->rd += f->skip;
+    f->skip = 0;
+    if( f->scan < f->rd + 8 ) f->scan = f->rd + 8;
+
+    while( f->scan + 8 <= f->wr ) {
+       // test the first bytes of the word for the header (0xFF) or the fake photon (0x7F followed by
+       // 0xFF), which every firmware's format starts the same.  Words never straddle the end of the buffer.
+       w = &f->buf[f->scan & FRAMER_MASK];
+       eof = CodecIsShort(w);
+
+       if( !f->synced ) {
+          // lost track of the stream, drop words until the next header and carry on from there
+          f->rd = f->scan;
+          f->scan += 8;
+          if( CodecIsHeader(w) ) f->synced = 1;
+          else f->resync += 8;
+          continue;
+       }
+
+       if( CodecIsHeader(w) || eof ) {
+          plen = f->scan - f->rd;
+          if( plen > FRAMER_LONGPKT ) {
+             printf("Error - packet too long: %d\n",plen/8);
+             fflush(stdout);
+          }
+
+          // hand out the packet in place unless it wraps past the end of the buffer
+          start = f->rd & FRAMER_MASK;
+          if( start + plen <= FRAMER_LEN ) *packet = &f->buf[start];
+          else {
+             first = FRAMER_LEN - start;
+             memcpy(f->scratch, &f->buf[start], first);
+             memcpy(&f->scratch[first], f->buf, plen-first);
+             *packet = f->scratch;
+          }
+          *len = plen;
+
+          f->rd = f->scan;
+          f->skip = eof ? 8 : 0;
+          return 1;
+       }
+
+       f->scan += 8;
+
+       // no boundary where there should have been one, throw the run away rather than parse garbage
+       if( f->scan - f->rd > FRAMER_MAXPKT ) {
+          printf("Error - no packet boundary in %d bytes, resyncing\n",FRAMER_MAXPKT);
+          fflush(stdout);
+          f->resync += f->scan - f->rd;
+          f->rd = f->scan;
+          f->synced = 0;
+       }
+    }
+
+    return 0;
+}
+
+int FramerFlush(struct packetframer *f, char **packet, unsigned int *len)
+{
+    unsigned int start, plen, first;
+
+    f->rd += f->skip;
+    f->skip = 0;
+    if( !f->synced || f->wr == f->rd ) return 0;
+
+    plen = f->wr - f->rd;
+    if( plen > FRAMER_MAXPKT ) {
+       f->resync += plen;
+       f->rd = f->scan = f->wr;
+       return 0;
+    }
+
+    start = f->rd & FRAMER_MASK;
+    if( start + plen <= FRAMER_LEN ) *packet = &f->buf[start];
+    else {
+       first = FRAMER_LEN - start;
+       memcpy(f->scratch, &f->buf[start], first);
+       memcpy(&f->scratch[first], f->buf, plen-first);
+       *packet = f->scratch;
+    }
+    *len = plen;
+
+    f->rd = f->wr;
+    f->scan = f->wr;
+    return 1;
+}
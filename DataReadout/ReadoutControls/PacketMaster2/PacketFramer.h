@@ -0,0 +1,64 @@
+// PacketFramer.h
+// streaming packet framer for the PacketMaster2 photon stream
+//
+// Bytes are appended to a circular buffer and split into packets at the next 0xFF header word, or at
+// the fake photon that terminates a short packet.  A scan index remembers how far the search for the
+// next boundary got, so every word is looked at once no matter how much data is backed up.  Packets
+// are handed out as a pointer into the buffer; only a packet that wraps past the end of the buffer
+// is copied, into a small scratch area.
+
+#ifndef PACKETFRAMER_H
+#define PACKETFRAMER_H
+
+#include <stdint.h>
+
+#define FRAMER_LEN 1048576          // bytes of backlog the framer can hold, must be a power of two
+#define FRAMER_MAXPKT (808*2)       // longest run we will accept as one packet
+#define FRAMER_LONGPKT (104*8)      // print a warning for packets longer than this
+
+struct packetframer {
+    uint64_t rd;                    // start of the packet being assembled, always a header word
+    uint64_t wr;                    // end of the buffered data
+    uint64_t scan;                  // next word to test for a packet boundary
+    uint64_t skip;                  // bytes after the current packet to throw away (fake photon)
+    uint64_t overrun;               // bytes thrown away because the buffer was full
+    uint64_t resync;                // bytes thrown away because no boundary was found in FRAMER_MAXPKT
+    int synced;                     // 0 while skipping to the next header after a resync
+    char scratch[FRAMER_MAXPKT] __attribute__((aligned(64)));
+    char buf[FRAMER_LEN] __attribute__((aligned(64)));
+};
+
+struct packetframer *FramerCreate();
+void FramerReset(struct packetframer *f);
+void FramerFree(struct packetframer *f);
+
+// append len bytes to the stream, returns 0 and counts an overrun if they do not fit
+int FramerPush(struct packetframer *f, const char *data, unsigned int len);
+
+// returns 1 and sets *packet/*len to the next complete packet, or 0 if no complete packet is buffered.
+// The pointer is valid until the next call to FramerNext() or FramerPush().
+int FramerNext(struct packetframer *f, char **packet, unsigned int *len);
+
+// at the end of the stream hand out whatever is left as the last packet, same contract as FramerNext()
+int FramerFlush(struct packetframer *f, char **packet, unsigned int *len);
+
+// stream offset (bytes pushed since FramerReset()) of the packet FramerNext() or FramerFlush() just
+// returned, len is the length they gave back
+static inline uint64_t FramerOffset(struct packetframer *f, unsigned int len)
+{
+    return f->rd - len;
+}
+
+// 1 if the packet FramerNext() just returned was ended early by a fake photon
+static inline int FramerShort(struct packetframer *f)
+{
+    return f->skip != 0;
+}
+
+// bytes of unparsed data sitting in the framer
+static inline unsigned int FramerBacklog(struct packetframer *f)
+{
+    return f->wr - f->rd;
+}
+
+#endif
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE     // recvmmsg()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -21,32 +23,43 @@
 #include <inttypes.h>
 #include <math.h>
 #include <byteswap.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+
+#include "PacketRing.h"
+#include "PacketFramer.h"
+#include "PhotonDecode.h"
+#include "Config.h"
+#include "DiskWriter.h"
+#include "BinFile.h"
+#include "RenderPNG.h"
+#include "Control.h"
+#include "RollingImage.h"
+#include "Timebin.h"
+#include "Telemetry.h"
+#include "Capture.h"
+#include "PhotonPack.h"
+#include "SpectralCube.h"
+#include "Calibration.h"
+#include "Beammap.h"
+#include "HotPixel.h"
+#include "LiveImage.h"
+#include "Publisher.h"
+#include "Aggregate.h"
+#include "Realtime.h"
+#include "Lightcurve.h"
 
 #define _POSIX_C_SOURCE 200809L
 
-#define BUFLEN 1500
-#define PORT 50000
-#define XPIX 80
-#define YPIX 125
-#define NROACH 10
-//#define LOGPATH "/mnt/data0/logs/"
-
-// compile with gcc -o PacketMaster2 PacketMaster2.c -I. -lm -lrt
+#define RECVBATCH 64    // max datagrams pulled from the socket per recvmmsg() call
+#define CUBERQLEN 1024  // packets queued per Cuber worker, must be a power of two
 
-struct datapacket {
-    unsigned int baseline:17;
-    unsigned int wvl:18;
-    unsigned int timestamp:9;
-    unsigned int ycoord:10;
-    unsigned int xcoord:10;
-}__attribute__((packed));;
+_Static_assert(DW_PATHLEN >= CONTROL_PATHLEN + 32, "a .bin file name must fit any START path");
+//#define LOGPATH "/mnt/data0/logs/"
 
-struct hdrpacket {
-    unsigned long timestamp:36;
-    unsigned int frame:12;
-    unsigned int roach:8;
-    unsigned int start:8;
-}__attribute__((packed));;
+// compile with gcc -o PacketMaster2 PacketMaster2.c PacketRing.c PacketFramer.c PhotonDecode.c Config.c DiskWriter.c BinFile.c RenderPNG.c Control.c RollingImage.c Timebin.c Telemetry.c Capture.c PhotonPack.c SpectralCube.c Calibration.c Beammap.c HotPixel.c LiveImage.c Publisher.c Aggregate.c Realtime.c Lightcurve.c PacketCodec.c -I. -lm -lrt -lpthread -lpng
 
 void diep(char *s)
 {
@@ -55,390 +68,1289 @@ void diep(char *s)
   exit(1);
 }
 
-int need_to_stop() //Checks for a stop file and returns true if found, else returns 0
+// the optional outputs and tables a packet is parsed with besides its subframe's image, NULL for the ones
+// that are not configured or loaded
+struct parsetables {
+    uint32_t *cube;                     // the subframe's spectral cube
+    const struct beammap *bm;
+    const struct calibration *cal;
+    const struct hotpixels *hot;
+    const struct lightcurve *lc;        // with lw and curve, the subframe's lightcurves starting at tick0
+    const struct lightwatch *lw;
+    uint16_t *curve;
+    uint64_t tick0;
+};
+
+// parse one packet into image (and pt->cube, by energy when there is a calibration) with its pixels
+// remapped by pt->bm and the hot ones dropped when there are any, and the photons on pt->lw's pixels into
+// pt->curve.  Counts it against its board in stats, returns 0 if it came from a roach id outside the
+// configured array
+int ParsePacket( const struct pm2config *cfg, uint16_t *image, const struct parsetables *pt, char *packet, unsigned int l, struct roachstats *stats, struct photonbatch *pb)
 {
-    char stopfilename[] = "stop.bin";
-    FILE* stopfile;
-    stopfile = fopen(stopfilename,"r");
-    if (stopfile == 0) //Don't stop
-    {
-        errno = 0;
-        return 0;
+    struct packetheader hdr;
+    struct roachstats *rs;
+    uint16_t curframe;
+    unsigned int curroach, masked = 0;
+
+    // pull out header information from the first packet
+    cfg->codec->header(packet, &hdr);
+
+    curframe = hdr.frame;
+    curroach = hdr.roach;
+    if( curroach >= cfg->nroach ) return 0;
+        
+    // count the frames we never saw, the frame number is 12 bits and wraps
+    rs = &stats[curroach];
+    if( rs->seen && curframe != rs->nextframe ) TelemetryAdd(&rs->framegaps, (curframe - rs->nextframe) & 4095);
+    rs->nextframe = (curframe+1) & 4095;
+    rs->seen = 1;
+
+    // decode every photon in the packet at once, then bin them
+    DecodePhotons(&packet[8], l/8-1, pb);
+    if( pt->bm != NULL ) RemapPhotons(pt->bm, curroach, pb);
+    if( pt->hot != NULL && __atomic_load_n(&pt->hot->nmasked, __ATOMIC_RELAXED) > 0 ) masked = MaskPhotons(pt->hot, pb);
+    if( pt->curve != NULL && pt->lw->n > 0 ) LightPhotons(pt->lc, pt->lw, pt->curve, pb, hdr.ticks, pt->tick0);
+    HistogramPhotons(image, pb);
+    if( pt->cal != NULL ) CalibratePhotons(pt->cal, pb);
+    if( pt->cube != NULL ) {
+       if( pt->cal != NULL ) CubeEnergies(pt->cube, pb, cfg);
+       else CubePhotons(pt->cube, pb, cfg);
     }
-    else //Stop file exists, stop
-    {
-        printf("found stop file. Exiting\n");
-        return 1;
+
+    TelemetryAdd(&rs->packets, 1);
+    TelemetryAdd(&rs->photons, pb->n + masked);
+    if( masked > 0 ) TelemetryAdd(&rs->masked, masked);
+    return 1;
+}
+
+// One Cuber worker parses every packet from the ROACHes assigned to it into its own partial images,
+// one for each open subframe.  Workers are allocated separately and cache line aligned so no two
+// threads write the same line.
+struct cuberworker {
+    pthread_t thread;
+    const struct pm2config *cfg;
+    uint64_t head __attribute__((aligned(64)));     // next queue slot the Cuber thread fills
+    uint64_t tail __attribute__((aligned(64)));     // next queue slot the worker parses
+    uint64_t closed;                                // subframes this worker has closed
+    int quit;
+    uint32_t sleeping;                              // worker is (about to be) waiting on wakefd
+    int wakefd;                                     // eventfd the worker sleeps on when its queue is empty
+    uint16_t **partial __attribute__((aligned(64)));    // partial image for each open subframe
+    uint32_t **cube;                                // and partial spectral cube, NULL without cubebins
+    uint16_t **curve;                               // and partial lightcurves, NULL without lightslots
+    const uint64_t *tick0;                          // the Cuber's first tick of each open subframe
+    const struct lightcurve *light;
+    struct lightwatch *watch;                       // watch list the Cuber last published
+    struct beammap *beam;                           // tables the Cuber last published, NULL for none
+    struct calibration *cal;
+    const struct hotpixels *hot;                    // the Cuber's mask, NULL without hotrate
+    struct roachstats *stats;                       // per board counters, this worker writes its own boards'
+    uint64_t badroach;                              // packets from roach ids outside the array
+    uint16_t len[CUBERQLEN];                        // 0 marks the end of a subframe
+    uint8_t sub[CUBERQLEN];                         // open subframe each packet belongs to
+    char packet[CUBERQLEN][FRAMER_MAXPKT];
+    struct photonbatch pb;
+};
+
+// milliseconds since the epoch
+int64_t EpochMs(const struct timespec *spec)
+{
+    return (int64_t) spec->tv_sec*1000 + spec->tv_nsec/1000000;
+}
+
+// milliseconds until the next multiple of period ms since the epoch, the longest a stage can sleep
+// before its periodic work
+int MsToNext(int period)
+{
+    struct timespec spec;
+
+    clock_gettime(CLOCK_REALTIME, &spec);
+    return period - EpochMs(&spec) % period;
+}
+
+int MsToNextSecond()
+{
+    return MsToNext(1000);
+}
+
+// sleep on the eventfd until CuberQueue() or the quit flag wakes us, same handshake as RingWait()
+void CuberSleep(struct cuberworker *w)
+{
+    struct pollfd pfd;
+    uint64_t v;
+
+    __atomic_store_n(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+    if( __atomic_load_n(&w->head, __ATOMIC_SEQ_CST) == w->tail && !__atomic_load_n(&w->quit, __ATOMIC_SEQ_CST) ) {
+       pfd.fd = w->wakefd;
+       pfd.events = POLLIN;
+       poll(&pfd, 1, 1000);
     }
+    __atomic_store_n(&w->sleeping, 0, __ATOMIC_RELAXED);
+    while( read(w->wakefd, &v, sizeof(v)) == sizeof(v) ) ;
 }
 
-void ParsePacket( uint16_t image[XPIX][YPIX], char *packet, unsigned int l, uint64_t frame[NROACH])
+void CuberWake(struct cuberworker *w)
 {
-    unsigned int i;
-    struct hdrpacket *hdr;
-    struct datapacket *data;
-    uint64_t starttime;
-    uint16_t curframe;
-    char curroach;
-    uint64_t swp,swp1;
+    uint64_t v = 1;
 
-    // pull out header information from the first packet
-    swp = *((uint64_t *) (&packet[0]));
-    swp1 = __bswap_64(swp);
-    hdr = (struct hdrpacket *) (&swp1);             
+    if( write(w->wakefd, &v, sizeof(v)) == -1 ) perror("cuber worker wake");
+}
 
-    starttime = hdr->timestamp;
-    curframe = hdr->frame;
-    curroach = hdr->roach;
-        
-    // check for missed frames and print an error if we got the wrong frame number
-    if( frame[curroach] != curframe) {
-        //printf("Roach %d: Expected Frame %d, Received Frame %d\n",curroach,frame[curroach],curframe); fflush(stdout);
-        frame[curroach] = (frame[curroach]+1)%4096;
+void *CuberWorker(void *arg)
+{
+    struct cuberworker *w = (struct cuberworker *) arg;
+    struct parsetables pt;
+    unsigned int slot, sub;
+
+    while( 1 ) {
+       if( __atomic_load_n(&w->head, __ATOMIC_ACQUIRE) == w->tail ) {
+          if( __atomic_load_n(&w->quit, __ATOMIC_ACQUIRE) ) break;
+          CuberSleep(w);
+          continue;
+       }
+
+       slot = w->tail & (CUBERQLEN-1);
+       if( w->len[slot] > 0 ) {
+          sub = w->sub[slot];
+          pt.cube = w->cube != NULL ? w->cube[sub] : NULL;
+          pt.bm = __atomic_load_n(&w->beam, __ATOMIC_ACQUIRE);
+          pt.cal = __atomic_load_n(&w->cal, __ATOMIC_ACQUIRE);
+          pt.hot = w->hot;
+          pt.lc = w->light;
+          pt.lw = __atomic_load_n(&w->watch, __ATOMIC_ACQUIRE);
+          pt.curve = w->curve != NULL ? w->curve[sub] : NULL;
+          pt.tick0 = w->curve != NULL ? w->tick0[sub] : 0;
+          if( !ParsePacket(w->cfg, w->partial[sub], &pt, w->packet[slot], w->len[slot], w->stats, &w->pb) ) w->badroach++;
+       }
+       else {
+          // end of subframe marker, everything queued for it has been parsed so the Cuber thread can reduce it
+          __atomic_store_n(&w->closed, w->closed+1, __ATOMIC_RELEASE);
+       }
+       __atomic_store_n(&w->tail, w->tail+1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// queue a packet for open subframe sub (or an end of subframe marker when len is 0) for a worker,
+// waiting if it is backed up
+void CuberQueue(struct cuberworker *w, char *packet, unsigned int len, unsigned int sub)
+{
+    unsigned int slot;
+
+    while( w->head - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) >= CUBERQLEN ) usleep(10);
+
+    slot = w->head & (CUBERQLEN-1);
+    w->len[slot] = len;
+    w->sub[slot] = sub;
+    if( len > 0 ) memcpy(w->packet[slot], packet, len);
+    __atomic_store_n(&w->head, w->head+1, __ATOMIC_SEQ_CST);
+    if( __atomic_load_n(&w->sleeping, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&w->sleeping, 0, __ATOMIC_SEQ_CST) ) CuberWake(w);
+}
+
+// close open subframe sub on every worker and sum their partial images into image, their partial
+// cubes into cube when there is one, and the first curvelen counts of their lightcurves into curve
+void CuberReduce(struct cuberworker **workers, int nworkers, uint64_t nclosed, unsigned int sub, uint16_t *image, uint32_t *cube, uint16_t *curve, unsigned int curvelen)
+{
+    int i;
+    uint16_t *partial;
+    unsigned int npix = ConfigNpix(workers[0]->cfg);
+
+    for(i=0;i<nworkers;i++) CuberQueue(workers[i], NULL, 0, sub);
+
+    for(i=0;i<nworkers;i++) {
+       while( __atomic_load_n(&workers[i]->closed, __ATOMIC_ACQUIRE) < nclosed ) usleep(10);
+       partial = workers[i]->partial[sub];
+       AddImage(image, partial, npix+1);
+       memset(partial, 0, sizeof(uint16_t) * (npix+1));
+       if( cube != NULL ) {
+          CubeAdd(cube, workers[i]->cube[sub], CubeLen(workers[i]->cfg));
+          memset(workers[i]->cube[sub], 0, sizeof(uint32_t) * CubeLen(workers[i]->cfg));
+       }
+       if( curve != NULL && curvelen > 0 ) {
+          AddImage(curve, workers[i]->curve[sub], curvelen);
+          memset(workers[i]->curve[sub], 0, sizeof(uint16_t) * curvelen);
+       }
     }
-    else {
-        frame[curroach] = (frame[curroach]+1)%4096;
+}
+
+// what the Cuber thread needs to close subframes: the open ones live in open[t % tb->nopen], filled
+// directly in single threaded mode and summed from the workers' partial images when they close
+struct cuber {
+    const struct pm2config *cfg;
+    struct packetring **rings;      // one per Reader thread, each framed on its own
+    int nrings;
+    struct packetframer *framer[CONFIG_MAXREADERS];
+    struct timebin *tb;
+    struct cuberworker **workers;
+    int nthreads;
+    uint64_t nclosed;               // subframes closed on the workers
+    uint16_t **open;
+    uint32_t **cube;                // spectral cube of each open subframe, NULL without cubebins
+    struct beammap *beam;           // stamped to physical pixel remap, NULL for none
+    struct calibration *cal;        // phase to energy table, NULL for none
+    struct hotpixels *hot;          // pixels masked for their rate, NULL without hotrate
+    struct beammap *oldbeam;        // the tables they replaced, until every worker is past them
+    struct calibration *oldcal;
+    uint32_t tablerun[CONTROL_NTABLES]; // last reload of each acted on
+    uint16_t *window;               // the sliding sum of the last cfg->window ms, NULL for one subframe
+    struct rollingimage *roll;
+    struct pngrender *render;
+    struct liveimage *live;         // shared memory ring the images are published to, NULL without liveslots
+    struct lightcurve *light;       // shared memory ring of the lightcurves, NULL without lightslots
+    struct lightwatch *watch;       // pixels they are kept for
+    struct lightwatch *oldwatch;    // the list it replaced, until every worker is past it
+    uint16_t **curve;               // lightcurves of each open subframe
+    uint64_t *tick0;                // first tick of each open subframe
+    unsigned int lightrows;         // rows any worker can have counted into since the last close
+    int64_t lightchanged;           // last subframe that was open when the watch list changed
+    struct pm2telemetry *tm;
+    uint64_t *first;                // receive time of the first packet in each open subframe, 0 while empty
+    struct photonbatch *pb;
+    uint64_t badroach;
+    uint64_t foreign;               // packets from boards another node owns
+    struct aggsender *agg;          // sends the images to the Aggregator, NULL on a single host
+    int64_t logsec;                 // board second of the last log line
+    uint64_t pcount;                // packets since the last log line
+    uint64_t offarray;              // off-array photons since the last log line
+};
+
+// publish subframe t's lightcurves, count them on /metrics and clear them for the subframe that reuses
+// the slot
+void CuberLight(struct cuber *c, uint16_t *curve, unsigned int curvelen, int64_t t, int64_t start)
+{
+    const struct lightwatch *w = c->watch;
+    unsigned int i, r, nbins = c->light->nbins;
+    uint64_t n;
+
+    LightPublish(c->light, w, curve, start, t <= c->lightchanged ? LIGHT_CHANGED : 0);
+    for(r=0;r<w->n;r++) {
+       for(i=0,n=0;i<nbins;i++) n += curve[r*nbins + i];
+       TelemetryAdd(&c->tm->watch[r].photons, n);
+    }
+    memset(curve, 0, sizeof(uint16_t) * curvelen);
+    // past the swap only the new list's rows can fill
+    if( t > c->lightchanged ) c->lightrows = w->n;
+}
+
+// close the oldest open subframe, write it (or the window it completes) out and free its slot
+void CuberClose(struct cuber *c)
+{
+    int64_t t = c->tb->closed + 1;
+    int64_t start = TimebinStartMs(c->tb, t);
+    unsigned int sub = t % c->tb->nopen;
+    unsigned int npix = ConfigNpix(c->cfg);
+    uint16_t *image = c->open[sub];
+    uint16_t *out = image;
+    uint32_t winlen = c->roll != NULL ? c->cfg->window : c->cfg->subframe;
+    uint32_t *cube = c->cube != NULL ? c->cube[sub] : NULL;
+    uint16_t *curve = c->curve != NULL ? c->curve[sub] : NULL;
+    unsigned int curvelen = c->light != NULL ? c->lightrows * c->light->nbins : 0;
+    char outfile[160], *ext;
+    FILE *wp;
+    unsigned int backlog = 0;
+    uint64_t overflow = 0;
+    int r;
+
+    if( c->nthreads > 0 ) CuberReduce(c->workers, c->nthreads, ++c->nclosed, sub, image, cube, curve, curvelen);
+    // every worker has parsed up to the end of subframe marker queued after any reload, so none of
+    // them can still be using the tables it replaced
+    CalibrationFree(c->oldcal);
+    c->oldcal = NULL;
+    BeammapFree(c->oldbeam);
+    c->oldbeam = NULL;
+    LightWatchFree(c->oldwatch);
+    c->oldwatch = NULL;
+    c->offarray += image[npix];
+    if( c->first[sub] != 0 ) {
+       TelemetryLatency(&c->tm->imagelat, TelemetryNow() - c->first[sub]);
+       c->first[sub] = 0;
     }
+    TelemetryAdd(&c->tm->images, 1);
+    // the subframe's counts are its pixels' rates, mask the hot ones from the next packet on
+    if( c->hot != NULL && HotUpdate(c->hot, image, t, c->cfg) ) {
+       HotWrite(c->hot, c->cfg, HOT_FILE);
+       TelemetrySet(&c->tm->hotpixels, c->hot->nmasked);
+       TelemetrySet(&c->tm->hotflags, c->hot->flagged);
+    }
+    if( c->roll != NULL ) {
+       RollingAdd(c->roll, image, c->window);
+       out = c->window;
+    }
+
+    // the window ends with this subframe
+    if( c->live != NULL ) LivePublish(c->live, out, start + c->cfg->subframe - winlen, winlen);
+    if( c->agg != NULL ) AggSubmit(c->agg, out, start + c->cfg->subframe - winlen, winlen);
+    if( c->light != NULL ) CuberLight(c, curve, curvelen, t, start);
+
+    // whole second subframes keep the old <second>.img names, shorter ones add the milliseconds
+    if( c->cfg->subframe % 1000 == 0 ) sprintf(outfile,"/mnt/ramdisk/%" PRId64 ".img",start/1000);
+    else sprintf(outfile,"/mnt/ramdisk/%" PRId64 ".%03d.img",start/1000,(int) (start%1000));
+    if( c->cfg->imgfiles ) {
+       wp = fopen(outfile,"wb");
+       fwrite(out, sizeof(out[0]), npix, wp);
+       fclose(wp);
+    }
+    ext = outfile + strlen(outfile) - 4;
 
-    for(i=1;i<l/8;i++) {
-       
-       swp = *((uint64_t *) (&packet[i*8]));
-       swp1 = __bswap_64(swp);
-       data = (struct datapacket *) (&swp1);
-       image[(data->xcoord)%XPIX][(data->ycoord)%YPIX]++;
-       
-       // debug
-       //if( (data->xcoord)%XPIX == 25 ) {
-       //  printf("x,y = %d,%d = %d\t %lx\n",(data->xcoord),(data->ycoord), image[(data->xcoord)%XPIX][(data->ycoord)%YPIX], *((uint64_t *) (&packet[i*8])) );           
-       //}
+    // the cube is always the one subframe, even with a longer window
+    if( cube != NULL ) {
+       strcpy(ext, ".cube");
+       CubeWrite(outfile, cube, c->cfg, c->cal != NULL ? CUBE_MEV : CUBE_WVL, start);
+       memset(cube, 0, sizeof(cube[0]) * CubeLen(c->cfg));
     }
 
-    //printf("%d %d %d %d %d %d %d %d %d %d - roach %d frame %d\n",frame[0],frame[1],frame[2],frame[3],frame[4],frame[5],frame[6],frame[7],frame[8],frame[9],curroach,curframe); fflush(stdout);
+    // hand a copy to the render thread for the png preview
+    if( c->cfg->imgfiles ) {
+       strcpy(ext, ".png");
+       RenderSubmit(c->render, out, outfile);
+    }
+
+    memset(image, 0, sizeof(image[0]) * (npix+1));    // zero out array, including the sink pixel
+    c->tb->closed = t;
 
+    // log once a second of board time whatever the subframe
+    if( start/1000 > c->logsec ) {
+       for(r=0;r<c->nrings;r++) {
+          backlog += FramerBacklog(c->framer[r]);
+          overflow += c->rings[r]->reader[RING_CUBER].overflow;
+       }
+       printf("CUBER: Parse rate = %lu pkts/sec.  Data in buffer = %d.  Ring overflows = %lu.  Off-array photons = %lu.  Late packets = %lu\n",c->pcount,backlog,overflow,c->offarray,c->tb->late+c->tb->stale); fflush(stdout);
+       c->logsec = start/1000;
+       c->pcount = 0;
+       c->offarray = 0;
+    }
 }
 
-void Cuber()
+// close every subframe up to and including last.  Across a gap in the data longer than the open
+// subframes and the window there is nothing to write, so only the open ones are closed and the rest skipped.
+void CuberCloseUntil(struct cuber *c, int64_t last)
 {
-    int br,i,j,cwr;
-    char data[1024];
-    char olddata[1048576];
-    char packet[808*2];
-    time_t s,olds;  // Seconds
+    unsigned int i, nsub = c->roll != NULL ? c->roll->nsub : 1;
+
+    if( last - c->tb->closed > c->tb->nopen + nsub ) {
+       for(i=0;i<c->tb->nopen;i++) CuberClose(c);
+       for(i=0;c->roll!=NULL && i<nsub;i++) RollingAdd(c->roll, NULL, c->window);
+       c->tb->closed = last;
+       return;
+    }
+    while( c->tb->closed < last ) CuberClose(c);
+}
+
+// bin one framed packet by its header time, then parse it in place or hand it to the worker that owns
+// its ROACH.  stamp is the receive time of the oldest datagram in the batch, which stands in for the
+// packet's own as the framer no longer knows which datagram it came in.
+void CuberPacket(struct cuber *c, struct packetframer *framer, char *packet, unsigned int len, uint64_t stamp)
+{
+    unsigned int roach = CodecRoach(packet);
+    struct parsetables pt;
+    unsigned int sub;
+    int64_t t;
+
+    c->pcount++;
+    if( roach >= c->cfg->nroach ) {
+       c->badroach++;
+       TelemetryAdd(&c->tm->badroach, 1);
+       return;
+    }
+    // another node images this board, counting it here as well would count it twice once merged
+    if( !c->cfg->ownroach[roach] ) {
+       c->foreign++;
+       TelemetryAdd(&c->tm->foreign, 1);
+       return;
+    }
+    if( FramerShort(framer) ) TelemetryAdd(&c->tm->roach[roach].shortpkts, 1);
+    if( (t = TimebinPacket(c->tb, packet, roach)) == TIMEBIN_RESTART ) {
+       printf("CUBER: board clocks restarted, starting again from their time\n"); fflush(stdout);
+       CuberCloseUntil(c, c->tb->closed + c->tb->nopen);
+       TimebinRestart(c->tb, packet);
+       t = TimebinPacket(c->tb, packet, roach);
+    }
+    if( t < 0 ) {
+       TelemetryAdd(&c->tm->roach[roach].late, 1);
+       return;
+    }
+
+    // a packet past the open subframes pushes the oldest ones out
+    if( t > c->tb->closed + c->tb->nopen ) CuberCloseUntil(c, t - c->tb->nopen);
+    sub = t % c->tb->nopen;
+    if( c->first[sub] == 0 ) c->first[sub] = stamp ? stamp : TelemetryNow();
+    // only ever changes once the workers are done with the slot's last subframe
+    if( c->light != NULL && c->tick0[sub] != (uint64_t) t * c->light->ticklen ) c->tick0[sub] = (uint64_t) t * c->light->ticklen;
+    if( c->nthreads > 0 ) {
+       CuberQueue(c->workers[roach % c->nthreads], packet, len, sub);
+       return;
+    }
+    pt.cube = c->cube != NULL ? c->cube[sub] : NULL;
+    pt.bm = c->beam;
+    pt.cal = c->cal;
+    pt.hot = c->hot;
+    pt.lc = c->light;
+    pt.lw = c->watch;
+    pt.curve = c->curve != NULL ? c->curve[sub] : NULL;
+    pt.tick0 = c->light != NULL ? c->tick0[sub] : 0;
+    if( !ParsePacket(c->cfg,c->open[sub],&pt,packet,len,c->tm->roach,c->pb) ) c->badroach++;
+}
+
+// load a calibration table and publish it to the workers.  The table it replaces is freed once the
+// next subframe closes, or straight away when we parse on this thread.
+void CuberCalibrate(struct cuber *c, const char *path)
+{
+    struct calibration *cal;
+    int i;
+
+    if( (cal = CalibrationLoad(path, c->cfg)) == NULL ) {
+       printf("CUBER: could not load the calibration in %s, %s\n", path, c->cal != NULL ? "keeping the one we have" : "the cube stays in wvl units"); fflush(stdout);
+       return;
+    }
+    printf("CUBER: calibrated %u of %u pixels from %s\n", cal->ncal, cal->npix, path); fflush(stdout);
+    c->oldcal = c->cal;
+    c->cal = cal;
+    for(i=0;i<c->nthreads;i++) __atomic_store_n(&c->workers[i]->cal, cal, __ATOMIC_SEQ_CST);
+    if( c->nthreads == 0 ) {
+       CalibrationFree(c->oldcal);
+       c->oldcal = NULL;
+    }
+}
+
+// the same for a pixel remap
+void CuberBeammap(struct cuber *c, const char *path)
+{
+    struct beammap *bm;
+    int i;
+
+    if( (bm = BeammapLoad(path, c->cfg)) == NULL ) {
+       printf("CUBER: could not load the beammap remap in %s, %s\n", path, c->beam != NULL ? "keeping the one we have" : "using the stamped coordinates"); fflush(stdout);
+       return;
+    }
+    printf("CUBER: remapping %u pixels and dropping %u bad ones from %s\n", bm->nmoved, bm->nbad, path); fflush(stdout);
+    c->oldbeam = c->beam;
+    c->beam = bm;
+    for(i=0;i<c->nthreads;i++) __atomic_store_n(&c->workers[i]->beam, bm, __ATOMIC_SEQ_CST);
+    if( c->nthreads == 0 ) {
+       BeammapFree(c->oldbeam);
+       c->oldbeam = NULL;
+    }
+}
+
+// put the watched pixels on /metrics, their photon counts starting again from 0
+void CuberWatchTelemetry(struct cuber *c)
+{
+    const struct lightwatch *w = c->watch;
+    unsigned int r;
+
+    for(r=0;r<CONFIG_MAXWATCH;r++) {
+       TelemetrySet(&c->tm->watch[r].x, r < w->n ? w->x[r] : 0);
+       TelemetrySet(&c->tm->watch[r].y, r < w->n ? w->y[r] : 0);
+       TelemetrySet(&c->tm->watch[r].photons, 0);
+    }
+    TelemetrySet(&c->tm->nwatch, w->n);
+}
+
+// swap in a new lightcurve watch list.  The curves of the subframes open now are flagged as counted
+// partly under the old list, which is freed once the next subframe closes (or straight away when we
+// parse on this thread).
+void CuberWatch(struct cuber *c, const char *list)
+{
+    struct lightwatch *w;
+    int i;
+
+    if( c->light == NULL ) {
+       printf("CUBER: no lightcurves with lightslots = 0, ignoring the watch list\n"); fflush(stdout);
+       return;
+    }
+    if( (w = LightWatchParse(list, c->cfg)) == NULL ) {
+       printf("CUBER: could not use the watch list %s, keeping the %u pixels we have\n", list, c->watch->n); fflush(stdout);
+       return;
+    }
+    printf("CUBER: lightcurves for %u pixels in %u us bins\n", w->n, c->light->binus); fflush(stdout);
+    c->oldwatch = c->watch;
+    c->watch = w;
+    if( w->n > c->lightrows ) c->lightrows = w->n;
+    c->lightchanged = c->tb->closed + c->tb->nopen;
+    CuberWatchTelemetry(c);
+    for(i=0;i<c->nthreads;i++) __atomic_store_n(&c->workers[i]->watch, w, __ATOMIC_SEQ_CST);
+    if( c->nthreads == 0 ) {
+       LightWatchFree(c->oldwatch);
+       c->oldwatch = NULL;
+    }
+}
+
+// act on a CALIBRATE, BEAMMAP or WATCH, unless the table the last one replaced is still being retired
+void CuberTables(struct cuber *c, struct pm2control *ctl)
+{
+    const char *configured[CONTROL_NTABLES] = { c->cfg->calibration, c->cfg->beammap, c->cfg->watch };
+    char path[CONTROL_PATHLEN];
+    int t, busy;
+
+    for(t=0;t<CONTROL_NTABLES;t++) {
+       if( t == CONTROL_CALIBRATION ) busy = c->oldcal != NULL;
+       else if( t == CONTROL_BEAMMAP ) busy = c->oldbeam != NULL;
+       else busy = c->oldwatch != NULL;
+       if( ControlTableRun(ctl, t) == c->tablerun[t] || busy ) continue;
+       c->tablerun[t] = ControlTable(ctl, t, path);
+       if( !path[0] ) snprintf(path, sizeof(path), "%s", configured[t]);
+       // an empty watch list is a list, nothing watched
+       if( t == CONTROL_WATCH ) CuberWatch(c, path);
+       else if( !path[0] ) {
+          printf("CUBER: %s reload without a table, and none is configured\n", t == CONTROL_CALIBRATION ? "calibration" : "beammap"); fflush(stdout);
+       }
+       else if( t == CONTROL_CALIBRATION ) CuberCalibrate(c, path);
+       else CuberBeammap(c, path);
+    }
+}
+
+void Cuber(struct packetring **rings, int nrings, struct pm2control *ctl, struct pm2telemetry *tm, const struct pm2config *cfg)
+{
+    unsigned int i,n,len,total;
+    int r,nthreads;
+    char *packet;
     struct timespec spec;
-    uint16_t image[XPIX][YPIX];
-    FILE *wp;
-    char outfile[160];
-    unsigned int oldbr = 0;     // number of bytes of unparsed data sitting in olddata
-    uint64_t frame[NROACH];
-    uint64_t pcount = 0;
-    struct hdrpacket *hdr;
-    struct hdrpacket hdrv;
-    char temp[8];
-    uint64_t swp,swp1;
-    char cmd[120];    
+    int64_t idle = 0;       // ms (CLOCK_MONOTONIC) the rings went quiet with subframes still open
+    int wait;
+    uint64_t idx, now, stamp;
+    struct packetring *ring;
+    struct packetframer *framer;
+    struct cuber cub, *c = &cub;
+    char who[32];
     
     printf("Fear the wrath of CUBER!\n");
     printf(" Cuber: My PID is %d\n", getpid());
     printf(" Cuber: My parent's PID is %d\n", getppid()); fflush(stdout);
+    RealtimeLock("CUBER");
     
-    while( (cwr = open("/mnt/ramdisk/CuberPipe.pip", O_RDONLY | O_NDELAY)) == -1);
-    printf("cwr = %d\n",cwr);
-    
-    //cwr = open("/mnt/ramdisk/CuberPipe.pip", O_RDONLY );    
-    
-    //printf("struct sizes = %d, %d\n",sizeof(struct hdrpacket),sizeof(struct datapacket));
+    memset(c, 0, sizeof(struct cuber));
+    c->cfg = cfg;
+    c->rings = rings;
+    c->nrings = nrings;
+    c->tm = tm;
+    for(r=0;r<nrings;r++) {
+       if( (c->framer[r] = FramerCreate()) == NULL ) diep("framer allocation");
+    }
+    if( posix_memalign((void **) &c->pb, 64, sizeof(struct photonbatch)) != 0 ) diep("photon batch allocation");
+    nthreads = c->nthreads = cfg->cuberthreads;
+    clock_gettime(CLOCK_REALTIME, &spec);
+    if( (c->tb = TimebinCreate(cfg, &spec)) == NULL ) diep("timebin allocation");
+    if( (c->open = calloc(c->tb->nopen, sizeof(uint16_t *))) == NULL ) diep("image allocation");
+    if( (c->first = calloc(c->tb->nopen, sizeof(uint64_t))) == NULL ) diep("image allocation");
+    for(i=0;i<c->tb->nopen;i++) {
+       if( (c->open[i] = AllocImage(cfg)) == NULL ) diep("image allocation");
+    }
+    if( cfg->cubebins > 0 ) {
+       if( (c->cube = calloc(c->tb->nopen, sizeof(uint32_t *))) == NULL ) diep("cube allocation");
+       for(i=0;i<c->tb->nopen;i++) {
+          if( (c->cube[i] = CubeAlloc(cfg)) == NULL ) diep("cube allocation");
+       }
+    }
+    // a ring left behind by an earlier run would look live to its readers
+    if( cfg->lightslots == 0 ) remove(LIGHT_PATH);
+    if( cfg->liveslots == 0 ) remove(LIVE_PATH);
+    if( cfg->lightslots > 0 ) {
+       if( (c->light = LightCreate(cfg)) == NULL ) diep("lightcurve ring");
+       if( (c->watch = LightWatchParse(cfg->watch, cfg)) == NULL && (c->watch = LightWatchParse("none", cfg)) == NULL ) diep("watch list allocation");
+       c->lightrows = c->watch->n;
+       c->lightchanged = -1;
+       CuberWatchTelemetry(c);
+       if( (c->curve = calloc(c->tb->nopen, sizeof(uint16_t *))) == NULL || (c->tick0 = calloc(c->tb->nopen, sizeof(uint64_t))) == NULL ) diep("lightcurve allocation");
+       for(i=0;i<c->tb->nopen;i++) {
+          if( (c->curve[i] = calloc(LightLen(c->light), sizeof(uint16_t))) == NULL ) diep("lightcurve allocation");
+       }
+    }
+    if( (c->workers = calloc(nthreads+1, sizeof(struct cuberworker *))) == NULL ) diep("worker allocation");
+    remove(HOT_FILE);
+    if( cfg->hotrate > 0 && (c->hot = HotCreate(cfg)) == NULL ) diep("hot pixel mask allocation");
+    if( cfg->liveslots > 0 && (c->live = LiveCreate(cfg, cfg->liveslots)) == NULL ) diep("live image ring");
+    if( cfg->aggregator[0] && (c->agg = AggSenderCreate(cfg)) == NULL ) diep("aggregator sender");
+    // previews are encoded on their own thread so the PNG never stalls parsing
+    if( (c->render = RenderCreate(cfg->xpix, cfg->ypix)) == NULL ) diep("render thread");
+    // a window longer than one subframe is kept up to date subframe by subframe, never re-histogrammed
+    if( cfg->window > cfg->subframe ) {
+       if( (c->roll = RollingCreate(cfg)) == NULL || (c->window = AllocImage(cfg)) == NULL ) diep("rolling image allocation");
+    }
+    DecodeInit(cfg->codec, cfg->xpix, cfg->ypix);
+    printf(" Cuber: %s packets, photon decode kernel is %s\n", cfg->codec->name, DecodeKernel()); fflush(stdout);
+
+    // in threaded mode each worker owns the ROACHes with roach % nthreads == its number
+    for(i=0;i<nthreads;i++) {
+       if( (c->workers[i] = HugeAlloc(sizeof(struct cuberworker))) == NULL ) diep("worker allocation");
+       memset(c->workers[i], 0, sizeof(struct cuberworker));
+       c->workers[i]->cfg = cfg;
+       if( (c->workers[i]->partial = calloc(c->tb->nopen, sizeof(uint16_t *))) == NULL ) diep("partial image allocation");
+       for(n=0;n<c->tb->nopen;n++) {
+          if( (c->workers[i]->partial[n] = AllocImage(cfg)) == NULL ) diep("partial image allocation");
+       }
+       if( cfg->cubebins > 0 ) {
+          if( (c->workers[i]->cube = calloc(c->tb->nopen, sizeof(uint32_t *))) == NULL ) diep("partial cube allocation");
+          for(n=0;n<c->tb->nopen;n++) {
+             if( (c->workers[i]->cube[n] = CubeAlloc(cfg)) == NULL ) diep("partial cube allocation");
+          }
+       }
+       if( c->light != NULL ) {
+          if( (c->workers[i]->curve = calloc(c->tb->nopen, sizeof(uint16_t *))) == NULL ) diep("partial lightcurve allocation");
+          for(n=0;n<c->tb->nopen;n++) {
+             if( (c->workers[i]->curve[n] = calloc(LightLen(c->light), sizeof(uint16_t))) == NULL ) diep("partial lightcurve allocation");
+          }
+          c->workers[i]->light = c->light;
+          c->workers[i]->watch = c->watch;
+          c->workers[i]->tick0 = c->tick0;
+       }
+       c->workers[i]->stats = tm->roach;
+       c->workers[i]->hot = c->hot;
+       if( (c->workers[i]->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ) diep("worker eventfd");
+       if( pthread_create(&c->workers[i]->thread, NULL, CuberWorker, c->workers[i]) != 0 ) diep("worker thread");
+    }
+    // the Cuber thread takes the first of cubercpus and the workers the rest in order.  Pinned only
+    // now so the render, live and aggregator threads started above stay wherever the scheduler puts them
+    for(i=0;i<nthreads;i++) {
+       snprintf(who, sizeof(who), "CUBER worker %u", i);
+       RealtimeThread(c->workers[i]->thread, i+1 < CONFIG_MAXCPUS ? cfg->cubercpu[i+1] : -1, cfg->cuberprio, who);
+    }
+    RealtimeThread(pthread_self(), cfg->cubercpu[0], cfg->cuberprio, "CUBER");
+    printf(" Cuber: %dx%d pixels from %d roaches", cfg->xpix, cfg->ypix, cfg->nroach);
+    if( nthreads > 0 ) printf(", parsing with %d worker threads", nthreads);
+    if( nrings > 1 ) printf(", reading %d rings", nrings);
+    printf("\n");
+    printf(" Cuber: an image every %d ms of board time", cfg->subframe);
+    if( c->roll != NULL ) printf(", each summing the last %d ms", cfg->window);
+    printf(", boards may trail by %d ms\n", cfg->reorder); fflush(stdout);
+    if( c->agg != NULL ) {
+       printf(" Cuber: node %d of a multi-host array, imaging %d of the boards and sending to %s\n", cfg->node, c->agg->nown, cfg->aggregator); fflush(stdout);
+    }
+    if( c->hot != NULL ) {
+       printf(" Cuber: masking pixels over %d photons/s for %d s at a time\n", cfg->hotrate, cfg->hothold); fflush(stdout);
+    }
+    if( c->cube != NULL ) {
+       printf(" Cuber: spectral cube of %d wavelength bins over wvl %u to %u\n", cfg->cubebins, cfg->wvlmin, cfg->wvlmax); fflush(stdout);
+    }
+    if( c->light != NULL ) {
+       printf(" Cuber: lightcurves in %d us bins for %u watched pixels, the last %d subframes in %s\n", cfg->lightbin, c->watch->n, cfg->lightslots, LIGHT_PATH); fflush(stdout);
+    }
+    if( cfg->beammap[0] ) CuberBeammap(c, cfg->beammap);
+    if( cfg->calibration[0] ) CuberCalibrate(c, cfg->calibration);
+    for(r=0;r<CONTROL_NTABLES;r++) c->tablerun[r] = ControlTableRun(ctl, r);
+    for(r=0;r<nrings;r++) RingAttach(rings[r], RING_CUBER);
 
-    memset(image, 0, sizeof(image[0][0]) * XPIX * YPIX);    // zero out array
-    memset(olddata, 0, sizeof(olddata[0])*2048);    // zero out array
-    memset(data, 0, sizeof(data[0]) * 1024);    // zero out array
-    memset(packet, 0, sizeof(packet[0]) * 808 * 2);    // zero out array
-    memset(frame,0,sizeof(frame[0])*NROACH);
+    while( !ControlQuit(ctl) )
+    {
+       // move a batch of datagrams off each ring into its framer.  We may be in the middle of a packet,
+       // the framer only hands a packet back once the next header shows it is complete.
+       total = 0;
+       for(r=0;r<nrings;r++) {
+          ring = rings[r];
+          framer = c->framer[r];
+          n = RingAvailable(ring, RING_CUBER);
+          if( n > RECVBATCH ) n = RECVBATCH;
+          if( n == 0 ) continue;
+          total += n;
+          idx = ring->reader[RING_CUBER].tail;
+          now = TelemetryNow();
+          stamp = *RingStamp(ring, idx);
+          for(i=0;i<n;i++) {
+             if( FramerBacklog(framer) + *RingLen(ring, idx+i) > FRAMER_LEN ) break;
+             FramerPush(framer, RingSlot(ring, idx+i), *RingLen(ring, idx+i));
+             TelemetryLatency(&tm->ringlat, now - *RingStamp(ring, idx+i));
+          }
+          if( i > 0 ) RingRelease(ring, RING_CUBER, i);
 
-    clock_gettime(CLOCK_REALTIME, &spec);   
-    olds  = spec.tv_sec;
+          while( FramerNext(framer, &packet, &len) ) CuberPacket(c, framer, packet, len, stamp);
+       }
+       CuberCloseUntil(c, TimebinHorizon(c->tb));
 
-    while (access( "/mnt/ramdisk/QUIT", F_OK ) == -1)
-    {
-       // if it is a new second, zero the image array and start over
-       clock_gettime(CLOCK_REALTIME, &spec);   
-       s  = spec.tv_sec;
-       if( s > olds ) {                 
-          // we are in a new second, so write out image array and then zero out the array
-          //printf("CUBER: Finised second %d.",olds);  fflush(stdout);
-          
-          sprintf(outfile,"/mnt/ramdisk/%d.img",olds);
-          wp = fopen(outfile,"wb");
-          printf("WRITING: %d %d \n",image[25][39],image[25][54]);
-          fwrite(image, sizeof(image[0][0]), XPIX * YPIX, wp);
-          fclose(wp);
+       CuberTables(c, ctl);
 
-          olds = s;
-          memset(image, 0, sizeof(image[0][0]) * XPIX * YPIX);    // zero out array
-          printf("CUBER: Parse rate = %d pkts/sec.  Data in buffer = %d\n",pcount,oldbr); fflush(stdout);
-          pcount=0;
-          
-          // spawn Bin2PNG to make png file
-          sprintf(cmd,"/mnt/data0/PacketMaster2/Bin2PNG %s /mnt/ramdisk/%d.png &",outfile,olds);
-          system(cmd);
+       if( total > 0 ) {
+          idle = 0;
+          continue;
        }
-       
-       // not a new second, so read in new data and parse it          
-	   br = read(cwr, data, 1024*sizeof(char));
-	    
-       if( br != -1) {
-          //if( br > 0 ) printf("br = %d | oldbr = %d\n",br,oldbr);fflush(stdout);
-                 
-          // we may be in the middle of a packet so put together a full packet from old data and new data
-          // and only parse when the packet is complete
-
-          // append current data to existing data if old data is present
-          // NOTE !!!  olddata must start with a packet header
-          if( oldbr > 0 ) {
-             memmove(&olddata[oldbr],data,br);
-             oldbr+=br;
-          } 
-          else {
-             memcpy(olddata,data,br);
-             oldbr=br;          
-          }
-       }   
-       
-       // if there is data waiting, process it
-       if( oldbr > 0 ) {       
-          // search the available data for a packet boundary
-          for( i=1; i<oldbr/8; i++) {
-             
-             swp = *((uint64_t *) (&olddata[i*8]));
-             swp1 = __bswap_64(swp);
-             hdr = (struct hdrpacket *) (&swp1);             
-            
-                          
-             //printf("%d-%d\t",i,hdr->start); fflush(stdout);
-             if (hdr->start == 0b11111111) {        // found new packet header!
-                //printf("Found new packet header at %d.  roach=%d, frame=%d\n",i,hdr->roach,hdr->frame);
-       
-                if( i*8 > 104*8 ) { 
-                   printf("Error - packet too long: %d\n",i);
-                   //printf("br = %d : oldbr = %d : i = %d\n",br,oldbr,i);
-                   //for(j=0;j<oldbr/8;j++) printf("%d : 0x%X\n",j,(uint64_t) olddata[j*8]);                
-                   fflush(stdout);
-                }
-                
-                //printf("Packet ends at %d\n",i*8);
-
-                // fill packet for parsing
-                memmove(packet,olddata,i*8);
-                   
-                // copy any extra data to olddata
-                memmove(olddata,&olddata[i*8],oldbr-i*8);
-                oldbr = oldbr-i*8;
-                   
-                // parse it!
-                pcount++;
-                ParsePacket(image,packet,i*8,frame);
-                break;  // abort loop and start over!                
-             } 
-             else if (hdr->start == 0b01111111 && hdr->roach == 0b11111111 )  {  // short packet detected
-                // fill packet for parsing
-                //printf("Partial Packet %d\n",i);fflush(stdout);
-                
-                memmove(packet,olddata,i*8);
-                   
-                // copy any extra data to olddata, removing fake photon
-                memmove(olddata,&olddata[(i+1)*8],oldbr-(i+1)*8);
-                oldbr = oldbr-(i+1)*8;
-                   
-                // parse it!
-                pcount++;
-                ParsePacket(image,packet,i*8,frame);
-                break;  // abort loop and start over!                
-                
-             }           
-             
-             // need to check for short/EOF packet, which is one zero and 63 ones
-             /*
-             if( olddata[i*8] == 0b01111111 && olddata[i*8+1] == 0b11111111 ) {
-                // detected short packet!  Copy and parse!
-                print("Detected short packet!\n");
-                memmove(packet,olddata,i*8);
-                   
-                // copy any extra data to olddata, but don't copy EOF packet!
-                memmove(olddata,&olddata[i*8+8],br-oldbr-8);
-                oldbr = br - oldbr - 8;
-                ParsePacket(image,packet,br-oldbr,frame);             
-             } 
-             */           
+
+       // nothing new on the rings.  Sleep until a Reader publishes or a control change, and if the boards
+       // stay quiet for longer than a board could trail the others close whatever is still open.
+       wait = -1;
+       if( TimebinNewest(c->tb) > c->tb->closed ) {
+          clock_gettime(CLOCK_MONOTONIC, &spec);
+          if( idle == 0 ) idle = EpochMs(&spec);
+          wait = idle + cfg->reorder + cfg->subframe - EpochMs(&spec);
+          if( wait <= 0 ) {
+             CuberCloseUntil(c, TimebinNewest(c->tb));
+             idle = 0;
+             wait = -1;
           }
-          
-                   
-       }                
+       }
+       RingWaitAny(rings, nrings, RING_CUBER, wait);
     }
 
     printf("CUBER: Closing\n");
-    close(cwr);
+    for(i=0;i<nthreads;i++) {
+       __atomic_store_n(&c->workers[i]->quit, 1, __ATOMIC_SEQ_CST);
+       CuberWake(c->workers[i]);
+       pthread_join(c->workers[i]->thread, NULL);
+       close(c->workers[i]->wakefd);
+       c->badroach += c->workers[i]->badroach;
+       for(n=0;n<c->tb->nopen;n++) free(c->workers[i]->partial[n]);
+       free(c->workers[i]->partial);
+       if( c->workers[i]->cube != NULL ) {
+          for(n=0;n<c->tb->nopen;n++) free(c->workers[i]->cube[n]);
+          free(c->workers[i]->cube);
+       }
+       if( c->workers[i]->curve != NULL ) {
+          for(n=0;n<c->tb->nopen;n++) free(c->workers[i]->curve[n]);
+          free(c->workers[i]->curve);
+       }
+       HugeFree(c->workers[i], sizeof(struct cuberworker));
+    }
+    if( c->badroach > 0 ) printf("CUBER: ignored %lu packets from roach ids >= %d\n", c->badroach, cfg->nroach);
+    if( c->foreign > 0 ) printf("CUBER: ignored %lu packets from boards other nodes own\n", c->foreign);
+    if( c->tb->late > 0 || c->tb->stale > 0 ) printf("CUBER: dropped %lu packets that arrived after their subframe closed, %lu more than %d s behind\n", c->tb->late, c->tb->stale, TIMEBIN_STALE/TIMEBIN_TICKS/1000);
+    if( c->render->replaced > 0 ) printf("CUBER: %lu png previews skipped, the render thread fell behind\n", c->render->replaced);
+    RenderFree(c->render);
+    if( c->roll != NULL ) {
+       RollingFree(c->roll);
+       free(c->window);
+    }
+    for(r=0;r<nrings;r++) {
+       RingDetach(rings[r], RING_CUBER);
+       FramerFree(c->framer[r]);
+    }
+    for(i=0;i<c->tb->nopen;i++) free(c->open[i]);
+    free(c->open);
+    CalibrationFree(c->cal);
+    CalibrationFree(c->oldcal);
+    BeammapFree(c->beam);
+    BeammapFree(c->oldbeam);
+    if( c->hot != NULL && c->hot->flagged > 0 ) printf("CUBER: masked hot pixels %lu times\n", c->hot->flagged);
+    HotFree(c->hot);
+    LiveFree(c->live);
+    if( c->curve != NULL ) {
+       for(i=0;i<c->tb->nopen;i++) free(c->curve[i]);
+       free(c->curve);
+    }
+    free(c->tick0);
+    LightWatchFree(c->watch);
+    LightWatchFree(c->oldwatch);
+    LightFree(c->light);
+    if( c->agg != NULL ) printf("CUBER: sent %lu images to the aggregator, %lu lost\n", c->agg->sent, c->agg->dropped);
+    AggSenderFree(c->agg);
+    if( c->cube != NULL ) {
+       for(i=0;i<c->tb->nopen;i++) free(c->cube[i]);
+       free(c->cube);
+    }
+    free(c->first);
+    TimebinFree(c->tb);
+    free(c->pb);
+    free(c->workers);
     return;
 }
 
-void Writer()
+// a .bin file being written: the header goes out first, packets are framed as they are appended so
+// the index can be built on the fly, and the index and trailer are added when the file is finished.
+// With compress = pack each datagram is packed a record at a time instead, and every record that holds
+// a packet goes in the index.
+struct binwriter {
+    struct diskwriter *dw;
+    struct packetframer *framer;
+    struct binindex ix;
+    uint64_t offset;            // bytes appended to the current file
+    int open;
+    char *rec;                  // PACK_MAXREC bytes for the record being packed, NULL writes raw packets
+    uint64_t packed, unpacked;  // bytes out and in since the last log line
+};
+
+static void BinWriterIndex(struct binwriter *bw, int flush)
+{
+    char *packet;
+    unsigned int len;
+
+    while( FramerNext(bw->framer, &packet, &len) )
+       BinIndexAdd(&bw->ix, BIN_HDRLEN + FramerOffset(bw->framer, len), packet, len);
+    if( flush && FramerFlush(bw->framer, &packet, &len) )
+       BinIndexAdd(&bw->ix, BIN_HDRLEN + FramerOffset(bw->framer, len), packet, len);
+}
+
+static void BinWriterFinish(struct binwriter *bw)
+{
+    struct bintrailer t;
+
+    if( !bw->open ) return;
+    if( bw->rec == NULL ) BinWriterIndex(bw, 1);
+    BinTrailerInit(&t, &bw->ix, bw->offset);
+    DiskWriterAppend(bw->dw, (char *) bw->ix.entry, bw->ix.n*sizeof(struct binentry));
+    DiskWriterAppend(bw->dw, (char *) &t, sizeof(t));
+    bw->open = 0;
+}
+
+static void BinWriterOpen(struct binwriter *bw, const struct pm2config *cfg, const char *fname, const char *next, const struct timespec *start)
+{
+    struct binheader h;
+
+    BinWriterFinish(bw);
+    DiskWriterOpen(bw->dw, fname, next);
+    BinHeaderInit(&h, cfg, start);
+    if( bw->rec != NULL ) {
+       h.version = 2;
+       h.codec = BIN_CODEC_PACK;
+    }
+    DiskWriterAppend(bw->dw, (char *) &h, sizeof(h));
+    FramerReset(bw->framer);
+    BinIndexReset(&bw->ix);
+    bw->offset = sizeof(h);
+    bw->open = 1;
+}
+
+static void BinWriterPack(struct binwriter *bw, const char *data, unsigned int len)
+{
+    unsigned int n, used, pktlen;
+
+    bw->unpacked += len;
+    while( len > 0 ) {
+       n = PackRecord(data, len, bw->rec, &used, &pktlen);
+       DiskWriterAppend(bw->dw, bw->rec, n);
+       BinIndexAdd(&bw->ix, bw->offset, data, pktlen > 0 ? pktlen : used);
+       bw->offset += n;
+       bw->packed += n;
+       data += used;
+       len -= used;
+    }
+}
+
+static void BinWriterAppend(struct binwriter *bw, const char *data, unsigned int len)
+{
+    if( bw->rec != NULL ) {
+       BinWriterPack(bw, data, len);
+       return;
+    }
+    DiskWriterAppend(bw->dw, data, len);
+    bw->offset += len;
+    // the Writer drains the framer after every datagram, so it only ever holds one partial packet
+    FramerPush(bw->framer, data, len);
+    BinWriterIndex(bw, 0);
+}
+
+static void BinWriterClose(struct binwriter *bw)
+{
+    BinWriterFinish(bw);
+    DiskWriterClose(bw->dw);
+}
+
+void Writer(struct packetring **rings, int nrings, struct pm2control *ctl, struct pm2telemetry *tm, const struct pm2config *cfg)
 {
-    long            ms; // Milliseconds
     time_t          s,olds;  // Seconds
     struct timespec spec;
-    long dat, outcount;
-    int mode=0;
-    FILE *wp, *rp;
-    char data[1024];
-    char path[80];
-    char fname[120];
-    int br,wwr;
+    long outcount;
+    int mode=0, queued;
+    char path[CONTROL_PATHLEN];
+    uint32_t run = 0, newrun;
+    char fname[DW_PATHLEN], next[DW_PATHLEN];
+    unsigned int i,n,total;
+    int r;
+    uint64_t idx, written, latency, overflow;
+    struct packetring *ring;
+    struct binwriter bw;
 
     printf("Rev up the RAID array,WRITER is active!\n");
     printf(" Writer: My PID is %d\n", getpid());
     printf(" Writer: My parent's PID is %d\n", getppid());
+    RealtimeLock("WRITER");
+
+    // the disk is written from its own I/O thread so a slow fopen/fclose/write on the RAID can't
+    // hold up draining the ring
+    memset(&bw, 0, sizeof(bw));
+    bw.ix.codec = cfg->codec;
+    if( (bw.dw = DiskWriterCreate()) == NULL ) return;
+    if( (bw.framer = FramerCreate()) == NULL ) {
+       printf("WRITER: could not allocate the packet index framer\n");
+       DiskWriterFree(bw.dw);
+       return;
+    }
+    if( cfg->compress && (bw.rec = malloc(PACK_MAXREC)) == NULL ) printf("WRITER: no memory to pack the photons, writing them raw\n");
+    if( bw.rec != NULL ) printf("WRITER: bit packing the photons\n");
+    // after DiskWriterCreate() so the I/O thread, which spends its time blocked on the RAID, is left
+    // on the normal scheduler
+    RealtimeThread(pthread_self(), cfg->writercpu, cfg->writerprio, "WRITER");
 
-    wwr = open("/mnt/ramdisk/WriterPipe.pip", O_RDONLY | O_NDELAY);
-    //wwr = open("/mnt/ramdisk/WriterPipe.pip", O_RDONLY );
-
-    //  Write looks for a file on /mnt/ramdisk named "START" which contains the write path.  
-    //  If this file is present, enter writing mode
-    //  and delete the file.  Keep writing until the file "STOP" file appears.
-    //  Shut down if a "QUIT" file appears 
+    //  The control thread turns a "START" file on /mnt/ramdisk (which contains the write path) into a new
+    //  run in the control block.  Enter writing mode and keep writing until the run ends with a "STOP",
+    //  or a new "START" begins another.  Shut down when "QUIT" appears.
 
-    // mode = 0 :  Not doing anything, just keep pipe clear and junk and data that comes down it
-    // mode = 1 :  "START" file detected enter write mode
-    // mode = 2 :  continous writing mode, watch for "STOP" or "QUIT" files
-    // mode = 3 :  QUIT file detected, exit
+    // mode = 0 :  Not doing anything, detached from the ring so the Reader doesn't wait for us
+    // mode = 1 :  START seen, enter write mode
+    // mode = 2 :  continous writing mode, until the run changes or QUIT
+    // mode = 3 :  QUIT seen, exit
 
     while (mode != 3) {
 
-       // keep the pipe clean!       
-       if( mode == 0 ) { 
-	   br = read(wwr, data, 1024*sizeof(char)); 
-           //if( br != -1) printf("Writer: received %d\n",br);
-       }
+       newrun = ControlRun(ctl, path);
 
-       if( mode == 0 && access( "/mnt/ramdisk/START", F_OK ) != -1 ) {
-          // start file exists, go to mode 1
+       // idle, nothing to drain until the control thread wakes us
+       if( mode == 0 && newrun == 0 && !ControlQuit(ctl) ) RingWaitAny(rings, nrings, RING_WRITER, -1);
+
+       if( mode == 0 && newrun != 0 && newrun != run ) {
+          // start file arrived, go to mode 1
            mode = 1;
+           run = newrun;
            printf("Mode 0->1\n");
        } 
 
        if( mode == 1 ) {
-          // read path from start, generate filename, and open file pointer for writing
-          rp = fopen("/mnt/ramdisk/START","r");
-          fscanf(rp,"%s",path);
-          fclose(rp);
-          remove("/mnt/ramdisk/START");
-
+          // generate filename and open the file for writing
           clock_gettime(CLOCK_REALTIME, &spec);   
           s  = spec.tv_sec;
           olds = s;
-          sprintf(fname,"%s/%d.bin",path,s);
+          snprintf(fname,sizeof(fname),"%s/%ld.bin",path,s);
+          snprintf(next,sizeof(next),"%s/%ld.bin",path,s+1);
           printf("Writing to %s\n",fname);
-          wp = fopen(fname,"wb");
+          BinWriterOpen(&bw,cfg,fname,next,&spec);
+          for(r=0;r<nrings;r++) RingAttach(rings[r], RING_WRITER);
           mode = 2;
           outcount = 0;
           printf("Mode 1->2\n");
        }
 
        if( mode == 2 ) {
-          if ( access( "/mnt/ramdisk/STOP", F_OK ) != -1 ) {
-             // stop file exists, finish up and go to mode 0
-	         fclose(wp);
-             remove("/mnt/ramdisk/STOP");
+          if ( newrun != run ) {
+             // stopped, or restarted with a new path, finish up and go to mode 0
+             for(r=0;r<nrings;r++) RingDetach(rings[r], RING_WRITER);
+             BinWriterClose(&bw);
              mode = 0;
              printf("Mode 2->0\n");
           } else {
-             // continuous write mode, store data from the pipe to disk
+             // continuous write mode, store data from the ring to disk
 
 	     // start a new file every 1 seconds
              clock_gettime(CLOCK_REALTIME, &spec);   
              s  = spec.tv_sec;
 
              if( s - olds >= 1 ) {
-                 fclose(wp);
-                 sprintf(fname,"%s/%d.bin",path,s);
-                 printf("WRITER: Writing to %s, rate = %ld MBytes/sec\n",fname,outcount/1000000);
-                 wp = fopen(fname,"wb");
+                 // the I/O thread closes the old file and has the next one opened already
+                 snprintf(fname,sizeof(fname),"%s/%ld.bin",path,s);
+                 snprintf(next,sizeof(next),"%s/%ld.bin",path,s+1);
+                 BinWriterOpen(&bw,cfg,fname,next,&spec);
+                 DiskWriterStats(bw.dw,&written,&latency,&queued);
+                 TelemetrySet(&tm->diskbytes, written);
+                 TelemetrySet(&tm->diskqueued, queued);
+                 TelemetrySet(&tm->diskmaxlat, latency);
+                 for(r=0,overflow=0;r<nrings;r++) overflow += rings[r]->reader[RING_WRITER].overflow;
+                 printf("WRITER: Writing to %s, rate = %ld MBytes/sec, ring overflows = %lu, blocks queued = %d, slowest write = %lu us\n",fname,outcount/1000000,overflow,queued,latency);
+                 if( bw.rec != NULL && bw.unpacked > 0 ) printf("WRITER: packed to %.1f%% of the photon stream\n",100.0*bw.packed/bw.unpacked);
+                 bw.packed = bw.unpacked = 0;
                  olds = s;
                  outcount = 0;               
              }
 
-	     // attempt to read from the pipe
-             br = read(wwr, data, 1024*sizeof(char));
-             
-             if( br > 0 ) {  
-                //printf("br = %d\n",br);
-                fwrite( data, 1, br, wp);
-                outcount += br;
+	     // write out everything waiting on the rings straight from the slots.  The boards send every
+	     // packet in a datagram of its own, so interleaving the rings a datagram at a time keeps
+	     // every packet in the file whole.
+             total = 0;
+             for(r=0;r<nrings;r++) {
+                ring = rings[r];
+                n = RingAvailable(ring, RING_WRITER);
+                idx = ring->reader[RING_WRITER].tail;
+                for(i=0;i<n;i++) {
+                   BinWriterAppend(&bw, RingSlot(ring, idx+i), *RingLen(ring, idx+i));
+                   outcount += *RingLen(ring, idx+i);
+                }
+                if( n > 0 ) RingRelease(ring, RING_WRITER, n);
+                total += n;
              }
+             if( total == 0 ) RingWaitAny(rings, nrings, RING_WRITER, MsToNextSecond());
          }
        }
 
        // check for quit flag and then bug out if received! 
-       if( access( "/mnt/ramdisk/QUIT", F_OK ) != -1 ) {
-	      fclose(wp);
-          remove("/mnt/ramdisk/START");
-          remove("/mnt/ramdisk/STOP");
-          remove("/mnt/ramdisk/QUIT");
+       if( ControlQuit(ctl) ) {
+          if( mode == 2 ) {
+             for(r=0;r<nrings;r++) RingDetach(rings[r], RING_WRITER);
+             BinWriterClose(&bw);
+          }
           mode = 3;
           printf("Mode 3\n");
        }
 
     }
 
-/*
-    clock_gettime(CLOCK_REALTIME, &spec);
+    DiskWriterFree(bw.dw);
+    FramerFree(bw.framer);
+    BinIndexFree(&bw.ix);
+    free(bw.rec);
+    printf("WRITER: Closing\n");
+    return;
+}
 
-    s  = spec.tv_sec;
-    ms = lround(spec.tv_nsec / 1.0e6); // Convert nanoseconds to milliseconds
+// reload the Publisher's copy of a table after a CALIBRATE or BEAMMAP.  Nothing else uses its copies,
+// so the old one goes at once.  A WATCH is only for the Cuber.
+void PublisherTables(struct pm2control *ctl, const struct pm2config *cfg, uint32_t *tablerun, struct calibration **cal, struct beammap **bm)
+{
+    const char *configured[CONTROL_NTABLES] = { cfg->calibration, cfg->beammap, cfg->watch };
+    char path[CONTROL_PATHLEN];
+    struct calibration *newcal;
+    struct beammap *newbm;
+    int t;
+
+    for(t=0;t<CONTROL_NTABLES;t++) {
+       if( ControlTableRun(ctl, t) == tablerun[t] ) continue;
+       tablerun[t] = ControlTable(ctl, t, path);
+       if( !path[0] ) snprintf(path, sizeof(path), "%s", configured[t]);
+       if( !path[0] ) continue;
+       if( t == CONTROL_CALIBRATION && (newcal = CalibrationLoad(path, cfg)) != NULL ) {
+          CalibrationFree(*cal);
+          *cal = newcal;
+       }
+       else if( t == CONTROL_BEAMMAP && (newbm = BeammapLoad(path, cfg)) != NULL ) {
+          BeammapFree(*bm);
+          *bm = newbm;
+       }
+       else continue;
+       printf("PUBLISHER: reloaded the %s from %s\n", t == CONTROL_CALIBRATION ? "calibration" : "beammap", path); fflush(stdout);
+    }
+}
 
-    printf("Current time: %"PRIdMAX".%03ld seconds since the Epoch\n", (intmax_t)s, ms);
+// Stream every photon on the rings to the event subscribers, decoded, remapped and calibrated the way
+// the Cuber sees them (but not hot pixel masked).  Packets are framed and dropped while nobody is
+// subscribed.  The Publisher must never be the slow reader that fills a ring, so with more than half a
+// ring waiting it skips to the newest datagram instead.
+void Publisher(struct packetring **rings, int nrings, struct pm2control *ctl, struct pm2telemetry *tm, const struct pm2config *cfg)
+{
+    struct publisher *p;
+    struct packetframer *framer[CONFIG_MAXREADERS];
+    struct packetring *ring;
+    struct photonbatch *pb;
+    struct packetheader hdr;
+    struct beammap *bm = NULL;
+    struct calibration *cal = NULL;
+    uint32_t tablerun[CONTROL_NTABLES];
+    uint64_t idx, t0;
+    int64_t newest, t;
+    struct timespec now;
+    unsigned int n, i, len, total, flags;
+    char *packet;
+    int r;
+
+    printf(" Publisher: My PID is %d\n", getpid()); fflush(stdout);
+    RealtimeLock("PUBLISHER");
+    if( (p = PublisherCreate(cfg, cfg->publish)) == NULL ) {
+       printf("PUBLISHER: could not listen on port %d, no event stream\n", cfg->publish); fflush(stdout);
+       return;
+    }
+    for(r=0;r<nrings;r++) {
+       if( (framer[r] = FramerCreate()) == NULL ) diep("framer allocation");
+    }
+    if( posix_memalign((void **) &pb, 64, sizeof(struct photonbatch)) != 0 ) diep("photon batch allocation");
+    DecodeInit(cfg->codec, cfg->xpix, cfg->ypix);
+    if( cfg->beammap[0] ) bm = BeammapLoad(cfg->beammap, cfg);
+    if( cfg->calibration[0] ) cal = CalibrationLoad(cfg->calibration, cfg);
+    for(r=0;r<CONTROL_NTABLES;r++) tablerun[r] = ControlTableRun(ctl, r);
+    RealtimeThread(pthread_self(), cfg->publishercpu, cfg->publisherprio, "PUBLISHER");
+    for(r=0;r<nrings;r++) RingAttach(rings[r], RING_PUBLISHER);
+    printf("PUBLISHER: streaming photon events on port %d%s%s\n", cfg->publish, bm != NULL ? ", remapped" : "", cal != NULL ? ", calibrated" : ""); fflush(stdout);
+    // the header ticks wrap, unwrap them against the newest time seen, the host clock before the first packet
+    clock_gettime(CLOCK_REALTIME, &now);
+    newest = TimebinClock(now.tv_sec, now.tv_nsec);
+
+    while( !ControlQuit(ctl) )
+    {
+       total = 0;
+       for(r=0;r<nrings;r++) {
+          ring = rings[r];
+          n = RingAvailable(ring, RING_PUBLISHER);
+          if( n > RING_NSLOTS/2 ) {
+             RingRelease(ring, RING_PUBLISHER, n);
+             FramerReset(framer[r]);
+             TelemetryAdd(&tm->pubskipped, n);
+             continue;
+          }
+          if( n > RECVBATCH ) n = RECVBATCH;
+          if( n == 0 ) continue;
+          total += n;
+          idx = ring->reader[RING_PUBLISHER].tail;
+          for(i=0;i<n;i++) {
+             if( FramerBacklog(framer[r]) + *RingLen(ring, idx+i) > FRAMER_LEN ) break;
+             FramerPush(framer[r], RingSlot(ring, idx+i), *RingLen(ring, idx+i));
+          }
+          if( i > 0 ) RingRelease(ring, RING_PUBLISHER, i);
+
+          while( FramerNext(framer[r], &packet, &len) ) {
+             if( p->nsubs == 0 || len < 16 ) continue;
+             cfg->codec->header(packet, &hdr);
+             if( hdr.roach >= cfg->nroach ) continue;
+             t = TimebinNearest(hdr.ticks, cfg->codec->tickbits, newest);
+             if( t > newest ) newest = t;
+             t0 = (uint64_t) t * (1000/TIMEBIN_TICKS) + (uint64_t) TIMEBIN_EPOCH * 1000000;
+             DecodePhotons(&packet[8], len/8-1, pb);
+             flags = 0;
+             if( bm != NULL ) {
+                RemapPhotons(bm, hdr.roach, pb);
+                flags |= PUB_REMAPPED;
+             }
+             if( cal != NULL ) {
+                CalibratePhotons(cal, pb);
+                flags |= PUB_ENERGY;
+             }
+             PublisherPacket(p, hdr.roach, hdr.frame, t0, pb, flags);
+          }
+       }
+
+       PublisherTables(ctl, cfg, tablerun, &cal, &bm);
+       PublisherPoll(p);
+       TelemetrySet(&tm->pubsubs, p->nsubs);
+       TelemetrySet(&tm->pubevents, p->events);
+       TelemetrySet(&tm->pubdropped, p->dropped);
 
-    while(exitflag == 0) {
-       read(pfds[0], &dat, sizeof(long));
-       printf("%ld\n",dat);	
+       // the sockets are only serviced between batches, so never sleep long with subscribers waiting
+       if( total == 0 ) RingWaitAny(rings, nrings, RING_PUBLISHER, PUB_POLLMS);
     }
-*/
-    printf("WRITER: Closing\n");
-    close(wwr);
-    return;
+
+    printf("PUBLISHER: Closing, %lu photons published, %lu subscribers dropped for falling behind, %lu datagrams skipped\n", p->events, p->dropped, tm->pubskipped); fflush(stdout);
+    for(r=0;r<nrings;r++) {
+       RingDetach(rings[r], RING_PUBLISHER);
+       FramerFree(framer[r]);
+    }
+    PublisherFree(p);
+    CalibrationFree(cal);
+    BeammapFree(bm);
+    free(pb);
 }
 
 
-void Reader()
+// one Reader thread: its own socket on the port, its own ring, optionally its own core
+struct readerthread {
+  pthread_t thread;
+  int id;
+  struct packetring *ring;
+  struct pm2control *ctl;
+  struct readerstats *stats;
+  const struct pm2config *cfg;
+};
+
+// the control eventfd woke us, clear it unless it was QUIT, which the other Reader threads still have to see
+static void ReaderWoken(struct pm2control *ctl)
+{
+  uint64_t v;
+
+  if( ControlQuit(ctl) ) return;
+  while( read(ctl->wakefd, &v, sizeof(v)) == sizeof(v) ) ;
+  // a QUIT that landed while we drained has to stay visible too
+  v = 1;
+  if( ControlQuit(ctl) && write(ctl->wakefd, &v, sizeof(v)) == -1 ) perror("reader wake");
+}
+
+// tpacket backend: walk each block the kernel hands over and copy its datagrams into free ring slots,
+// publishing every RECVBATCH so the stages never wait for a whole block.  Returns -1 if the capture
+// could not be opened, so the caller can fall back to the socket.
+static int ReaderCapture(struct readerthread *rt, unsigned int buflen)
+{
+  struct packetring *ring = rt->ring;
+  struct pm2control *ctl = rt->ctl;
+  const struct pm2config *cfg = rt->cfg;
+  struct capture *cap;
+  const char *data;
+  unsigned int len, k, nfree;
+  uint64_t now, nFrames = 0;
+  ssize_t nTotalBytes = 0;
+
+  // one fanout group per PacketMaster2, and only the first thread keeps the port bound
+  cap = CaptureOpen(cfg->interface, cfg->port, cfg->readers > 1 ? 1 + getpid() % 0xfffe : 0, rt->id == 0);
+  if( cap == NULL ) {
+    printf("READER %d: no packet ring on %s, falling back to the socket\n", rt->id, cfg->interface); fflush(stdout);
+    return -1;
+  }
+  printf("READER %d: capturing on %s\n", rt->id, cfg->interface); fflush(stdout);
+
+  while( !ControlQuit(ctl) )
+  {
+    if( !CaptureBlock(cap, ctl->wakefd, -1) ) {
+      ReaderWoken(ctl);
+      continue;
+    }
+
+    now = TelemetryNow();
+    nfree = RingFree(ring);
+    k = 0;
+    while( CaptureNext(cap, &data, &len) ) {
+      if( len > buflen ) len = buflen;
+      nFrames++;
+      nTotalBytes += len;
+      if( k == nfree || k == RECVBATCH ) {
+        if( k > 0 ) RingPublish(ring, k);
+        k = 0;
+        if( (nfree = RingFree(ring)) == 0 ) {
+          RingDrop(ring, 1);
+          continue;
+        }
+      }
+      memcpy(RingSlot(ring, ring->head+k), data, len);
+      *RingLen(ring, ring->head+k) = len;
+      *RingStamp(ring, ring->head+k) = now;
+      k++;
+    }
+    if( k > 0 ) RingPublish(ring, k);
+
+    TelemetrySet(&rt->stats->datagrams, nFrames);
+    TelemetrySet(&rt->stats->bytes, nTotalBytes);
+    TelemetrySet(&rt->stats->sockdrops, cap->drops);
+  }
+
+  printf("READER %d: received %lu frames, %zd bytes, %lu dropped on a full ring, %lu dropped by the kernel\n",rt->id,nFrames,nTotalBytes,ring->dropped,cap->drops);
+  CaptureClose(cap);
+  return 0;
+}
+
+void *ReaderThread(void *arg)
 {
+  struct readerthread *rt = (struct readerthread *) arg;
+  struct packetring *ring = rt->ring;
+  struct pm2control *ctl = rt->ctl;
+  const struct pm2config *cfg = rt->cfg;
+  int cpu = cfg->readercpu[rt->id];
+  char who[16];
   //set up a socket connection
-  struct sockaddr_in si_me, si_other;
-  int s, i, slen=sizeof(si_other);
-  unsigned char buf[BUFLEN], buf2[BUFLEN];
-  ssize_t nBytesReceived = 0;
+  struct sockaddr_in si_me;
+  int s, i, n, nfree, buflen;
   ssize_t nTotalBytes = 0;
-  int cwrp, wwr;
-  int n1,n2;
+  char *scratch;                            // RECVBATCH slots to drain the socket into when the ring is full
+  struct mmsghdr msgs[RECVBATCH];
+  struct iovec iovecs[RECVBATCH];
+  char cmsgs[RECVBATCH][CMSG_SPACE(sizeof(uint32_t))];    // SO_RXQ_OVFL drop count
+  struct cmsghdr *cm;
+  struct pollfd pfd[2];
+  uint64_t now;
+  uint32_t drops;
   
-  printf("READER: Connecting to Socket!\n"); fflush(stdout);
+  printf("READER %d: Connecting to Socket!\n", rt->id); fflush(stdout);
 
-  // open up FIFOs for writing in non-blocking mode
+  // on the core that takes the interrupts for our share of the NIC's RX queues, and since the ring
+  // pages are first touched from here they land on that core's NUMA node
+  snprintf(who, sizeof(who), "READER %d", rt->id);
+  RealtimeThread(pthread_self(), cpu, cfg->readerprio, who);
+  HugePrefault(ring->data, (size_t) RING_NSLOTS*RING_SLOTLEN);
 
-  while( (cwrp = open("/mnt/ramdisk/CuberPipe.pip", O_WRONLY | O_NDELAY)) == -1 );
-  //printf("cwrp = %d",cwrp);
-  
-  while( (wwr = open("/mnt/ramdisk/WriterPipe.pip", O_WRONLY | O_NDELAY)) == -1);
-  //printf("wwr = %d",wwr);
+  if( posix_memalign((void **) &scratch, 64, RECVBATCH*RING_SLOTLEN) != 0 )
+    diep("scratch allocation");
+
+  // a datagram has to fit in one ring slot
+  buflen = cfg->buflen < RING_SLOTLEN ? cfg->buflen : RING_SLOTLEN;
+
+  if( cfg->capture == CONFIG_CAPTURE_TPACKET && ReaderCapture(rt, buflen) == 0 ) {
+    free(scratch);
+    return NULL;
+  }
 
   if ((s=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP))==-1)
     diep("socket");
-  printf("READER: socket created\n");
+  printf("READER %d: socket created\n", rt->id);
   fflush(stdout);
 
+  // every Reader thread binds the same port, the kernel hashes each board's source address to one socket
+  int one = 1;
+  if( cfg->readers > 1 && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1 )
+    diep("SO_REUSEPORT");
+  if( cpu >= 0 && setsockopt(s, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == -1 )
+    perror("SO_INCOMING_CPU");
+
   memset((char *) &si_me, 0, sizeof(si_me));
   si_me.sin_family = AF_INET;
-  si_me.sin_port = htons(PORT);
+  si_me.sin_port = htons(cfg->port);
   si_me.sin_addr.s_addr = htonl(INADDR_ANY);
   if (bind(s, (const struct sockaddr *)(&si_me), sizeof(si_me))==-1)
       diep("bind");
-  printf("READER: socket bind\n");
+  printf("READER %d: socket bind\n", rt->id);
   fflush(stdout);
 
   //Set receive buffer size, the default is too small.  
@@ -450,83 +1362,96 @@ void Reader()
   if (retval == -1)
     diep("set receive buffer size");
 
-  //Set recv to timeout after 3 secs
-  const struct timeval sock_timeout={.tv_sec=3, .tv_usec=0};
-  retval = setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char*)&sock_timeout, sizeof(sock_timeout));
-  if (retval == -1)
-    diep("set receive buffer size");
+  // have the kernel tell us how many datagrams it dropped because the buffer was full anyway
+  if( setsockopt(s, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one)) == -1 )
+    perror("SO_RXQ_OVFL");
+
+  // when the socket runs dry sleep on it and on the control eventfd, so QUIT wakes us straight away
+  pfd[0].fd = s;
+  pfd[0].events = POLLIN;
+  pfd[1].fd = ctl->wakefd;
+  pfd[1].events = POLLIN;
 
   uint64_t nFrames = 0;
 
-  //FILE* dump_file;
-  //dump_file = fopen("phaseDump.bin","wb");
+  memset(msgs, 0, sizeof(msgs));
 
-  while (access( "/mnt/ramdisk/QUIT", F_OK ) == -1)
+  while( !ControlQuit(ctl) )
   {
-    /*
-    if (nFrames % 100 == 0)
-    {
-        printf("Frame %d\n",nFrames);  fflush(stdout);
+    // point the batch straight at the free slots of the shared ring, so the kernel copy is the only one.
+    // If the slowest stage has let the ring fill, keep draining the socket into scratch and count the loss.
+    nfree = RingFree(ring);
+    for(i=0;i<RECVBATCH;i++) {
+      iovecs[i].iov_base = nfree > 0 ? RingSlot(ring, ring->head+i) : &scratch[i*RING_SLOTLEN];
+      iovecs[i].iov_len = buflen;
+      msgs[i].msg_hdr.msg_iov = &iovecs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_control = cmsgs[i];
+      msgs[i].msg_hdr.msg_controllen = sizeof(cmsgs[i]);
     }
-    */
-    nBytesReceived = recv(s, buf, BUFLEN, 0);
-    if (nBytesReceived == -1)
+
+    // take whatever is queued without blocking, under load this never sleeps or polls
+    n = recvmmsg(s, msgs, nfree > 0 && nfree < RECVBATCH ? nfree : RECVBATCH, MSG_DONTWAIT, NULL);
+    if (n == -1)
     {
-      if (errno == EAGAIN || errno == EWOULDBLOCK)
-      {// recv timed out, clear the error and check again
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      {// socket is empty, sleep until a datagram or a control change arrives
         errno = 0;
+        if( poll(pfd, 2, -1) > 0 && (pfd[1].revents & POLLIN) ) ReaderWoken(ctl);
         continue;
       }
       else
-        diep("recvfrom()");
-    }
-    nTotalBytes += nBytesReceived;
-//    printf("Received packet from %s:%d\nData: %s\n\n", 
-//           inet_ntoa(si_other.sin_addr), ntohs(si_other.sin_port), buf);
-    //printf("Received %d bytes. Data: ",nBytesReceived);
-    ++nFrames; 
-    //fwrite(buf,sizeof(char),nBytesReceived,dump_file);
-    //printf("read from socket %d %d!\n",nFrames, nBytesReceived);
-    
-    //write(cwr, buf, nBytesReceived);
-    //write(wwr, buf, nBytesReceived);
-    
-    memmove(buf2,buf,BUFLEN);
-    
-    n1=write(wwr, buf, nBytesReceived);
-    if( n1 == -1) perror("write wwr");
-    n2=write(cwrp, buf2, nBytesReceived);
-    if( n2 == -1) perror("write cwr");
-    
-    //printf("wrote 2 pipes %d %d!\n",nFrames, nBytesReceived);
-
-    /*
-    pack = buf[7]+(buf[6]<<8)+(buf[5]<<16)+(buf[4]<<24)+((uint64_t)buf[3]<<32)+((uint64_t)buf[2]<<40)+((uint64_t)buf[1]<<48)+((uint64_t)buf[0]<<56);
-    packDiff = pack - lastPack;
-    if ((packDiff > expectedPackDiff) && (pack != 0))
-    {
-        nLostFrames += packDiff/expectedPackDiff;
-        printf("lost %d frames total of %d\n",nLostFrames,nFrames);
+        diep("recvmmsg()");
     }
 
-    lastPack = pack;
-    */
-
-    //while(1) {
-    //     dat = rand();
-    //     write(pfdsa[1], &dat, sizeof(long));
-    //     write(pfdsb[1], &dat, sizeof(long));
-    //}
+    for(i=0;i<n;i++) nTotalBytes += msgs[i].msg_len;
+    nFrames += n;
+    TelemetrySet(&rt->stats->datagrams, nFrames);
+    TelemetrySet(&rt->stats->bytes, nTotalBytes);
+
+    // the drop count is a running total the kernel only attaches once it is non zero, the last one wins
+    for(i=n-1;i>=0;i--) {
+      cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+      if( cm != NULL && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL ) {
+        memcpy(&drops, CMSG_DATA(cm), sizeof(drops));
+        TelemetrySet(&rt->stats->sockdrops, drops);
+        break;
+      }
+    }
 
+    if( nfree > 0 ) {
+      now = TelemetryNow();
+      for(i=0;i<n;i++) {
+        *RingLen(ring, ring->head+i) = msgs[i].msg_len;
+        *RingStamp(ring, ring->head+i) = now;
+      }
+      RingPublish(ring, n);
+    }
+    else RingDrop(ring, n);
   }
 
-  //fclose(dump_file);
-  printf("received %d frames, %d bytes\n",nFrames,nTotalBytes);
+  printf("READER %d: received %lu frames, %zd bytes, %lu dropped on a full ring, %lu dropped by the kernel\n",rt->id,nFrames,nTotalBytes,ring->dropped,rt->stats->sockdrops);
   close(s);
-  close(wwr);
-  close(cwrp);
-  return;
+  free(scratch);
+  return NULL;
+
+}
 
+// receive on cfg->readers threads, thread i feeding rings[i], until QUIT
+void Reader(struct packetring **rings, int nrings, struct pm2control *ctl, struct pm2telemetry *tm, const struct pm2config *cfg)
+{
+  struct readerthread rt[CONFIG_MAXREADERS];
+  int i;
+
+  for(i=0;i<nrings;i++) {
+    rt[i].id = i;
+    rt[i].ring = rings[i];
+    rt[i].ctl = ctl;
+    rt[i].stats = &tm->reader[i];
+    rt[i].cfg = cfg;
+    if( pthread_create(&rt[i].thread, NULL, ReaderThread, &rt[i]) != 0 ) diep("reader thread");
+  }
+  for(i=0;i<nrings;i++) pthread_join(rt[i].thread, NULL);
 }
 
 // copied from http://material.karlov.mff.cuni.cz/people/hajek/Magon/lojza/merak.c
@@ -557,80 +1482,42 @@ double timespec_subtract (struct timespec *x, struct timespec *y) {
   return 1.*(double)(x->tv_sec - y->tv_sec) + 1e-9*(double)(x->tv_nsec - y->tv_nsec);
 }
 
-void TestReader()
+void TestReader(struct packetring *ring, struct pm2control *ctl, const struct pm2config *cfg)
 {
-   // shove some realistic test data down the pipes
-   struct hdrpacket hdr;
-   struct hdrpacket *h1;
-   struct datapacket data[101];
-   uint64_t frame[NROACH];
+   // shove some realistic test data onto the ring, in the configured firmware's format
+   char data[101*8];
+   uint64_t *frame, ticks;
    unsigned int roach,i,nphot;
-   time_t          s,olds;  // Seconds
    struct timespec spec,oldspec;
-   int cwr, wwr;
-   int n1,n2;
-
-   // open up FIFOs for writing in non-blocking mode
-   //cwr = open("/mnt/ramdisk/CuberPipe.pip", O_WRONLY | O_NDELAY);
-   //wwr = open("/mnt/ramdisk/WriterPipe.pip", O_WRONLY | O_NDELAY);
-   cwr = open("/mnt/ramdisk/CuberPipe.pip", O_WRONLY);
-   wwr = open("/mnt/ramdisk/WriterPipe.pip", O_WRONLY);
 
-   memset(frame,0,sizeof(frame[0])*NROACH);
+   if( (frame = AllocFrames(cfg)) == NULL ) diep("frame allocation");
 
    srand(time(NULL));
 
-   while (access( "/mnt/ramdisk/QUIT", F_OK ) == -1) {
-      // make a fake packet and then shove it down the pipe
-      hdr.start = 0b11111111;
-      roach = rand()%NROACH;
-      hdr.roach = roach;
-      hdr.frame = frame[roach];
+   while( !ControlQuit(ctl) ) {
+      // make a fake packet and then shove it onto the ring
+      roach = rand()%cfg->nroach;
       clock_gettime(CLOCK_REALTIME, &oldspec);   
-      hdr.timestamp = (unsigned long) ((((double)oldspec.tv_sec + ((double)oldspec.tv_nsec)/1e9) - 1451606400.0)*2000.0) ;
-      //hdr.timestamp = rand()%10000000;
+      ticks = (uint64_t) ((((double)oldspec.tv_sec + ((double)oldspec.tv_nsec)/1e9) - 1451606400.0)*2000.0) ;
+      cfg->codec->putheader(data, roach, frame[roach], ticks);
       frame[roach] = (frame[roach]+1)%4096;
-            
-      memmove(data,&hdr,8);  // copy hdr packet into first slot
       
       // half the time make full packets, other half random length
-      if( rand()%2 == 0 ) {
-         nphot = 100;      
-         for(i=1;i<101;i++) {
-            data[i].xcoord = rand()%XPIX;
-            data[i].ycoord = rand()%YPIX;
-            data[i].timestamp = i*4;
-            data[i].wvl = rand()%16384;
-            data[i].baseline = rand()%16384; 
-         }      
-      }
-      else {
-         nphot = rand()%99;
-         for(i=1;i<nphot+1;i++) {
-            data[i].xcoord = rand()%XPIX;
-            data[i].ycoord = rand()%YPIX;
-            data[i].timestamp = i*4;
-            data[i].wvl = rand()%16384;
-            data[i].baseline = rand()%16384; 
-         }
-         
+      if( rand()%2 == 0 ) nphot = 100;
+      else nphot = rand()%99;
+      for(i=1;i<nphot+1;i++) cfg->codec->putphoton(&data[i*8], rand()%cfg->xpix, rand()%cfg->ypix, i*4, rand()%16384, rand()%16384);
+      if( nphot < 100 ) {
          // append fake photon/EOF packet
-         h1  = (struct hdrpacket *) &data[nphot+1];
-         h1->start = 0b01111111;
-         h1->roach = 0b11111111;
-         h1->frame = 0b111111111111;
-         h1->timestamp = 0b11111111111111111111111111111111;
+         cfg->codec->putshort(&data[(nphot+1)*8]);
          nphot++;         
-         
-         //printf("nphot = %d, EOF = %" PRIu64 "\n", nphot,*((uint64_t *)&data[(nphot+1)*8])); fflush(stdout);
-
       }
 
-      n1=write(wwr, data, sizeof(struct datapacket)*(nphot+1));
-      if( n1 == -1) perror("write tr");
-      n2=write(cwr, data, sizeof(struct datapacket)*(nphot+1));
-      if( n2 == -1) perror("write tr");
-      //printf("%d %d\n",n1,n2);
+      // like the old blocking pipe writes, wait for room rather than dropping
+      while( RingFree(ring) == 0 ) usleep(10);
+      memcpy(RingSlot(ring, ring->head), data, 8*(nphot+1));
+      *RingLen(ring, ring->head) = 8*(nphot+1);
+      *RingStamp(ring, ring->head) = TelemetryNow();
+      RingPublish(ring, 1);
       
       // pause 1 millisecond
       
@@ -644,44 +1531,43 @@ void TestReader()
    }
    
    printf("TestReader: closing!\n");
-   close(cwr);
-   close(wwr);
+   free(frame);
  
 }
 
-int main(void)
+int main(int argc, char *argv[])
 {
     pid_t pid;
-    int rv;
-//    int pfdsa[2];
-//    int pfdsb[2];
-    char buf[30];
+    struct packetring *rings[CONFIG_MAXREADERS];
+    char ringpath[160];
+    int i;
+    struct pm2control *ctl;
+    struct pm2telemetry *tm;
+    struct pm2config cfg;
 
     signal(SIGCHLD, SIG_IGN);  /* now I don't have to wait()! */
 
-    // Create the pipe for the photon data
-/*  pipe(pfdsa);
-    pipe(pfdsb);
-    fcntl(pfdsa[0], F_SETFL, O_NONBLOCK);
-    fcntl(pfdsb[0], F_SETFL, O_NONBLOCK); */
-    // experimental - increase pipe buffer size!  Only works in linux >2.6.35, which dark is not currently running
-    //int pipe_sz = fcntl(pfdsa[1], F_SETPIPE_SZ, sizeof(size_t));
-    //int pipe_sz = fcntl(pfdsb[1], F_SETPIPE_SZ, sizeof(size_t));
-    
-    // delete any relic FIFO pipes
+    // geometry and settings, from the file named on the command line or the default config
+    ConfigLoad(argc > 1 ? argv[1] : NULL, &cfg);
+    RealtimeInit(&cfg);
+
+    // delete any relic FIFO pipes from older versions
     remove("/mnt/ramdisk/CuberPipe.pip");
     remove("/mnt/ramdisk/WriterPipe.pip");
     
-    // switch from normal pipes to named pipes/FIFOs on the ramdisk
-    mknod("/mnt/ramdisk/CuberPipe.pip", S_IFIFO | 0666 , 0);
-    mknod("/mnt/ramdisk/WriterPipe.pip", S_IFIFO | 0666 , 0);
+    // the photon data goes through a shared memory ring per Reader thread on the ramdisk, mapped before
+    // the fork so Reader, Writer and Cuber all see the same slots
+    for(i=0;i<cfg.readers;i++) {
+        RingPath(ringpath, sizeof(ringpath), i);
+        if( (rings[i] = RingCreate(ringpath)) == NULL ) exit(1);
+    }
+    if( (ctl = ControlCreate()) == NULL ) exit(1);
+    if( (tm = TelemetryCreate(&cfg)) == NULL ) exit(1);
         
     // Delete pre-existing control files
-    remove("/mnt/ramdisk/START");
-    remove("/mnt/ramdisk/STOP");
-    remove("/mnt/ramdisk/QUIT");
-    
-    //printf("struct sizes = %d, %d\n",sizeof(struct hdrpacket),sizeof(struct datapacket));
+    remove(CONTROL_START);
+    remove(CONTROL_STOP);
+    remove(CONTROL_QUIT);
 
     switch(pid = fork()) {
     case -1:
@@ -689,7 +1575,7 @@ int main(void)
         exit(1);         /* parent exits */
 
     case 0:
-	Writer();
+	Writer(rings, cfg.readers, ctl, tm, &cfg);
         exit(0);
 
     default:
@@ -700,13 +1586,39 @@ int main(void)
 	// spawn Cuber
 	if (!fork()) {
 	        //printf("MASTER: Spawning Cuber\n"); fflush(stdout);
-        	Cuber();
+        	Cuber(rings, cfg.readers, ctl, tm, &cfg);
         	//printf("MASTER: Cuber died!\n"); fflush(stdout);
         	exit(0);
     	} 
+
+	// spawn Publisher, only with a port to stream on
+	if( cfg.publish > 0 && !fork() ) {
+	        Publisher(rings, cfg.readers, ctl, tm, &cfg);
+	        exit(0);
+	}
         
-	Reader();
-	//TestReader();
+	// memory locks are not inherited, so every process takes its own
+	RealtimeLock("READER");
+
+	// the control thread watches for START/STOP/QUIT and wakes the stages
+	if( ControlStart(ctl, rings, cfg.readers) != 0 ) {
+	        printf("READER: no control thread, telling the other stages to quit\n");
+	        ctl->quit = 1;
+	        for(i=0;i<cfg.readers;i++) {
+	                RingWake(rings[i], RING_CUBER);
+	                RingWake(rings[i], RING_WRITER);
+	                RingWake(rings[i], RING_PUBLISHER);
+	        }
+	}
+	else {
+	        // counters for the dashboard, PacketMaster2 runs fine without them if the port is taken
+	        if( TelemetryStart(tm, rings, cfg.readers, cfg.metrics) != 0 ) printf("READER: no /metrics endpoint on port %d\n", cfg.metrics);
+	        else if( cfg.metrics > 0 ) printf("READER: serving /metrics on port %d\n", cfg.metrics);
+	        Reader(rings, cfg.readers, ctl, tm, &cfg);
+	        //TestReader(rings[0], ctl, &cfg);
+	        TelemetryStop(tm);
+	        ControlStop(ctl);
+	}
 
         wait(NULL);
         printf("Reader: En Taro Adun!\n");
@@ -0,0 +1,203 @@
+// PacketRing.c
+// shared memory packet ring between the PacketMaster2 stages, see PacketRing.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+
+#include "PacketRing.h"
+
+void RingPath(char *path, size_t len, int i)
+{
+    if( i == 0 ) snprintf(path, len, "%s", RING_PATH);
+    else snprintf(path, len, "/mnt/ramdisk/PacketRing%d.shm", i);
+}
+
+static size_t RingSize()
+{
+    return sizeof(struct packetring) + (size_t) RING_NSLOTS*RING_SLOTLEN;
+}
+
+static struct packetring *RingMap(const char *path, int flags)
+{
+    int fd;
+    void *p;
+
+    if( (fd = open(path, flags, 0666)) == -1 ) {
+       perror(path);
+       return NULL;
+    }
+    if( (flags & O_CREAT) && ftruncate(fd, RingSize()) == -1 ) {
+       perror("ring ftruncate");
+       close(fd);
+       return NULL;
+    }
+    p = mmap(NULL, RingSize(), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if( p == MAP_FAILED ) {
+       perror("ring mmap");
+       return NULL;
+    }
+    return (struct packetring *) p;
+}
+
+struct packetring *RingCreate(const char *path)
+{
+    struct packetring *ring;
+    int i;
+
+    remove(path);
+    if( (ring = RingMap(path, O_RDWR | O_CREAT | O_TRUNC)) == NULL ) return NULL;
+
+    memset(ring, 0, sizeof(struct packetring));
+    ring->nslots = RING_NSLOTS;
+    ring->slotlen = RING_SLOTLEN;
+    for(i=0;i<RING_MAXREADERS;i++) {
+       if( (ring->reader[i].wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ) {
+          perror("ring eventfd");
+          RingClose(ring);
+          return NULL;
+       }
+    }
+    __atomic_store_n(&ring->magic, RING_MAGIC, __ATOMIC_RELEASE);
+    return ring;
+}
+
+struct packetring *RingOpen(const char *path)
+{
+    struct packetring *ring;
+
+    if( (ring = RingMap(path, O_RDWR)) == NULL ) return NULL;
+
+    if( ring->magic != RING_MAGIC || ring->nslots != RING_NSLOTS || ring->slotlen != RING_SLOTLEN ) {
+       fprintf(stderr, "%s is not a compatible packet ring\n", path);
+       RingClose(ring);
+       return NULL;
+    }
+    return ring;
+}
+
+void RingClose(struct packetring *ring)
+{
+    munmap(ring, RingSize());
+}
+
+// number of slots the producer can fill without overwriting data an attached reader still needs
+unsigned int RingFree(struct packetring *ring)
+{
+    int i;
+    uint64_t head, tail, used, maxused = 0;
+
+    head = ring->head;
+    for(i=0;i<RING_MAXREADERS;i++) {
+       if( !__atomic_load_n(&ring->reader[i].active, __ATOMIC_ACQUIRE) ) continue;
+       tail = __atomic_load_n(&ring->reader[i].tail, __ATOMIC_ACQUIRE);
+       used = head - tail;
+       if( used > maxused ) maxused = used;
+    }
+    return maxused >= RING_NSLOTS ? 0 : RING_NSLOTS - maxused;
+}
+
+// make the next n slots (already filled via RingSlot/RingLen) visible to the readers
+void RingPublish(struct packetring *ring, unsigned int n)
+{
+    int i;
+
+    // sequentially consistent so either the reader sees the new head before it sleeps, or we see its
+    // sleeping flag and wake it
+    __atomic_store_n(&ring->head, ring->head + n, __ATOMIC_SEQ_CST);
+    for(i=0;i<RING_MAXREADERS;i++) {
+       if( __atomic_load_n(&ring->reader[i].sleeping, __ATOMIC_SEQ_CST) &&
+           __atomic_exchange_n(&ring->reader[i].sleeping, 0, __ATOMIC_SEQ_CST) ) RingWake(ring, i);
+    }
+}
+
+// account for n packets the producer had to throw away because the ring was full.  The loss is
+// charged to every attached reader that was a full ring behind, so the log shows who is slow.
+void RingDrop(struct packetring *ring, unsigned int n)
+{
+    int i;
+    uint64_t tail;
+
+    ring->dropped += n;
+    for(i=0;i<RING_MAXREADERS;i++) {
+       if( !__atomic_load_n(&ring->reader[i].active, __ATOMIC_ACQUIRE) ) continue;
+       tail = __atomic_load_n(&ring->reader[i].tail, __ATOMIC_ACQUIRE);
+       if( ring->head - tail >= RING_NSLOTS ) ring->reader[i].overflow += n;
+    }
+}
+
+// start consuming at the current head
+void RingAttach(struct packetring *ring, int reader)
+{
+    __atomic_store_n(&ring->reader[reader].tail, __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->reader[reader].active, 1, __ATOMIC_RELEASE);
+}
+
+// stop holding back the producer, e.g. the Writer while it is not recording
+void RingDetach(struct packetring *ring, int reader)
+{
+    __atomic_store_n(&ring->reader[reader].active, 0, __ATOMIC_RELEASE);
+}
+
+// hand n slots back to the producer once the reader is done with them
+void RingRelease(struct packetring *ring, int reader, unsigned int n)
+{
+    __atomic_store_n(&ring->reader[reader].tail, ring->reader[reader].tail + n, __ATOMIC_RELEASE);
+}
+
+void RingWait(struct packetring *ring, int reader, int timeout)
+{
+    struct ringreader *r = &ring->reader[reader];
+    struct pollfd pfd;
+    uint64_t v;
+
+    __atomic_store_n(&r->sleeping, 1, __ATOMIC_SEQ_CST);
+    if( __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == r->tail || !r->active ) {
+       pfd.fd = r->wakefd;
+       pfd.events = POLLIN;
+       poll(&pfd, 1, timeout);
+    }
+    __atomic_store_n(&r->sleeping, 0, __ATOMIC_RELAXED);
+
+    // eventfds count, drain it so the next wait sleeps again
+    while( read(r->wakefd, &v, sizeof(v)) == sizeof(v) ) ;
+}
+
+void RingWaitAny(struct packetring **rings, int nrings, int reader, int timeout)
+{
+    struct pollfd pfd[nrings];
+    struct ringreader *r;
+    int i, ready = 0;
+    uint64_t v;
+
+    // flag ourselves asleep on every ring before looking at any head, so a publish on any of them either
+    // shows up in the check or wakes us
+    for(i=0;i<nrings;i++) __atomic_store_n(&rings[i]->reader[reader].sleeping, 1, __ATOMIC_SEQ_CST);
+    for(i=0;i<nrings;i++) {
+       r = &rings[i]->reader[reader];
+       if( __atomic_load_n(&rings[i]->head, __ATOMIC_SEQ_CST) != r->tail && r->active ) ready = 1;
+       pfd[i].fd = r->wakefd;
+       pfd[i].events = POLLIN;
+    }
+    if( !ready ) poll(pfd, nrings, timeout);
+
+    for(i=0;i<nrings;i++) {
+       r = &rings[i]->reader[reader];
+       __atomic_store_n(&r->sleeping, 0, __ATOMIC_RELAXED);
+       while( read(r->wakefd, &v, sizeof(v)) == sizeof(v) ) ;
+    }
+}
+
+void RingWake(struct packetring *ring, int reader)
+{
+    uint64_t v = 1;
+
+    if( write(ring->reader[reader].wakefd, &v, sizeof(v)) == -1 ) return;
+}
@@ -0,0 +1,101 @@
+// PacketRing.h
+// shared memory packet ring between the PacketMaster2 stages
+//
+// One producer (Reader) drops whole datagrams into fixed-size slots.  Each consumer (Cuber, Writer,
+// Publisher) has its own read cursor and reads the slots in place, so one copy of each packet serves
+// every stage.  The producer never blocks: if an attached consumer has fallen a full ring behind, the
+// packet is dropped and counted against that consumer instead of silently vanishing.
+//
+// A consumer with nothing to do sleeps in RingWait() on its own eventfd, and the producer only pays for
+// a write() to that eventfd when it publishes to a consumer that is actually asleep.  The eventfds are
+// created with the ring, so wakeups work in the processes forked from the one that called RingCreate().
+//
+// With several Reader threads each one has a ring of its own (RingPath() names them), so the producers
+// never share a cache line, and the consumers read all of them and sleep in RingWaitAny().
+
+#ifndef PACKETRING_H
+#define PACKETRING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define RING_PATH "/mnt/ramdisk/PacketRing.shm"
+#define RING_MAGIC 0x524b5450   // "PTKR"
+#define RING_NSLOTS 32768       // must be a power of two
+#define RING_SLOTLEN 1536       // bytes per slot, multiple of the 64 byte cache line
+#define RING_MAXREADERS 4
+
+// consumer ids
+#define RING_CUBER 0
+#define RING_WRITER 1
+#define RING_PUBLISHER 2
+
+struct ringreader {
+    uint64_t tail;              // next slot this reader will consume
+    uint64_t overflow;          // packets dropped because this reader was a full ring behind
+    uint32_t active;            // producer only respects the cursor of attached readers
+    uint32_t sleeping;          // reader is (about to be) blocked in RingWait()
+    int wakefd;                 // eventfd the reader sleeps on
+} __attribute__((aligned(64)));
+
+struct packetring {
+    uint32_t magic;
+    uint32_t nslots;
+    uint32_t slotlen;
+    uint64_t dropped;           // total packets the producer could not place
+    uint64_t head __attribute__((aligned(64)));     // next slot the producer will fill
+    struct ringreader reader[RING_MAXREADERS];
+    uint16_t len[RING_NSLOTS] __attribute__((aligned(64)));   // bytes used in each slot
+    uint64_t stamp[RING_NSLOTS] __attribute__((aligned(64))); // CLOCK_MONOTONIC us each slot was received
+    char data[] __attribute__((aligned(4096)));
+};
+
+// ring file for Reader thread i, the first keeps RING_PATH
+void RingPath(char *path, size_t len, int i);
+
+// create (or reset) the ring file and map it, call before forking the stages
+struct packetring *RingCreate(const char *path);
+// map an existing ring file from another process
+struct packetring *RingOpen(const char *path);
+void RingClose(struct packetring *ring);
+
+// producer side
+unsigned int RingFree(struct packetring *ring);
+void RingPublish(struct packetring *ring, unsigned int n);
+void RingDrop(struct packetring *ring, unsigned int n);
+
+// consumer side
+void RingAttach(struct packetring *ring, int reader);
+void RingDetach(struct packetring *ring, int reader);
+void RingRelease(struct packetring *ring, int reader, unsigned int n);
+
+// sleep until data is published for this reader, someone calls RingWake() or timeout ms pass (-1 for
+// no timeout).  Returns at once if data is already waiting.
+void RingWait(struct packetring *ring, int reader, int timeout);
+// RingWait() on several rings at once, returns when any of them has data for this reader
+void RingWaitAny(struct packetring **rings, int nrings, int reader, int timeout);
+// wake a reader whether or not there is data, e.g. for a control change
+void RingWake(struct packetring *ring, int reader);
+
+static inline char *RingSlot(struct packetring *ring, uint64_t idx)
+{
+    return &ring->data[(idx & (RING_NSLOTS-1))*RING_SLOTLEN];
+}
+
+static inline uint16_t *RingLen(struct packetring *ring, uint64_t idx)
+{
+    return &ring->len[idx & (RING_NSLOTS-1)];
+}
+
+static inline uint64_t *RingStamp(struct packetring *ring, uint64_t idx)
+{
+    return &ring->stamp[idx & (RING_NSLOTS-1)];
+}
+
+// number of published slots waiting for this reader, starting at ring->reader[reader].tail
+static inline unsigned int RingAvailable(struct packetring *ring, int reader)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - ring->reader[reader].tail;
+}
+
+#endif
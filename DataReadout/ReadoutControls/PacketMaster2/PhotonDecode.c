@@ -0,0 +1,161 @@
+// PhotonDecode.c
+// decode a packet's worth of photon words, see PhotonDecode.h
+
+#include <stdio.h>
+#include <string.h>
+#include <byteswap.h>
+#include <immintrin.h>
+
+#include "PhotonDecode.h"
+
+// xcoord and ycoord are 10 bit fields, these map every possible value onto the image.  A coordinate off
+// the edge of the array maps to npix, so the sum is >= npix and clamps to the sink pixel.
+static int32_t xlut[1024] __attribute__((aligned(64)));     // x * ypix, or npix
+static int32_t ylut[1024] __attribute__((aligned(64)));     // y, or npix
+static uint32_t npix;
+
+static void DecodeScalarDarkness(const char *words, unsigned int nwords, struct photonbatch *pb);
+static void (*decoder)(const char *words, unsigned int nwords, struct photonbatch *pb) = DecodeScalarDarkness;
+static const char *kernel = "scalar";
+
+// a word decoder and a scalar kernel for every format, with its shifts and masks as constants
+#define DECODE_DEFINE(Name, firmware, be, ss,sb, rs,rb, fs,fb, ts,tb, xs,xb, ys,yb, us,ub, ws,wb, bs,bb) \
+_Static_assert(xb <= 10 && yb <= 10, "xlut and ylut cover 10 bit coordinates"); \
+static inline void Decode##Name##Word(uint64_t v, struct photonbatch *pb, unsigned int i) \
+{ \
+    pb->baseline[i] = CODEC_FIELD(v, bs, bb); \
+    pb->wvl[i] = CODEC_FIELD(v, ws, wb); \
+    pb->timestamp[i] = CODEC_FIELD(v, us, ub); \
+    pb->ycoord[i] = CODEC_FIELD(v, ys, yb); \
+    pb->xcoord[i] = CODEC_FIELD(v, xs, xb); \
+    pb->pix[i] = xlut[pb->xcoord[i]] + ylut[pb->ycoord[i]]; \
+    pb->pix[i] = pb->pix[i] < npix ? pb->pix[i] : npix; \
+} \
+static void DecodeScalar##Name(const char *words, unsigned int nwords, struct photonbatch *pb) \
+{ \
+    unsigned int i; \
+\
+    for(i=0;i<nwords;i++) Decode##Name##Word(Name##Load(&words[i*8]), pb, i); \
+    pb->n = nwords; \
+}
+#define DECODE_SCALAR(Name, firmware, ...) { firmware, DecodeScalar##Name },
+
+CODEC_FORMATS(DECODE_DEFINE)
+
+static const struct {
+    const char *firmware;
+    void (*scalar)(const char *words, unsigned int nwords, struct photonbatch *pb);
+} scalars[] = { CODEC_FORMATS(DECODE_SCALAR) };
+
+// The vector kernels are for the darkness format only.  After the byte swap each word splits into a low half (baseline and the bottom 15 bits of wvl) and a
+// high half (top 3 bits of wvl, timestamp, ycoord, xcoord).  The shuffle does the byte swap and gathers
+// the low halves of two words next to each other and the high halves next to each other in one step,
+// so every field can then be pulled out of 32 bit lanes.
+#define SWAPSPLIT 7,6,5,4, 15,14,13,12, 3,2,1,0, 11,10,9,8
+
+__attribute__((target("sse4.1")))
+static void DecodeSSE4(const char *words, unsigned int nwords, struct photonbatch *pb)
+{
+    unsigned int i;
+    const __m128i swap = _mm_setr_epi8(SWAPSPLIT);
+    const __m128i m17 = _mm_set1_epi32(0x1FFFF);
+    const __m128i m9 = _mm_set1_epi32(0x1FF);
+    const __m128i m10 = _mm_set1_epi32(0x3FF);
+    const __m128i m3 = _mm_set1_epi32(0x7);
+    const __m128i sink = _mm_set1_epi32(npix);
+    __m128i a, b, lo, hi;
+
+    for(i=0;i+4<=nwords;i+=4) {
+       a = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) &words[i*8]), swap);
+       b = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) &words[i*8+16]), swap);
+       lo = _mm_unpacklo_epi64(a, b);
+       hi = _mm_unpackhi_epi64(a, b);
+
+       _mm_store_si128((__m128i *) &pb->baseline[i], _mm_and_si128(lo, m17));
+       _mm_store_si128((__m128i *) &pb->wvl[i], _mm_or_si128(_mm_srli_epi32(lo, 17), _mm_slli_epi32(_mm_and_si128(hi, m3), 15)));
+       _mm_store_si128((__m128i *) &pb->timestamp[i], _mm_and_si128(_mm_srli_epi32(hi, 3), m9));
+       _mm_store_si128((__m128i *) &pb->ycoord[i], _mm_and_si128(_mm_srli_epi32(hi, 12), m10));
+       _mm_store_si128((__m128i *) &pb->xcoord[i], _mm_srli_epi32(hi, 22));
+
+       pb->pix[i] = xlut[pb->xcoord[i]] + ylut[pb->ycoord[i]];
+       pb->pix[i+1] = xlut[pb->xcoord[i+1]] + ylut[pb->ycoord[i+1]];
+       pb->pix[i+2] = xlut[pb->xcoord[i+2]] + ylut[pb->ycoord[i+2]];
+       pb->pix[i+3] = xlut[pb->xcoord[i+3]] + ylut[pb->ycoord[i+3]];
+       _mm_store_si128((__m128i *) &pb->pix[i], _mm_min_epu32(_mm_load_si128((__m128i *) &pb->pix[i]), sink));
+    }
+    for(;i<nwords;i++) DecodeDarknessWord(DarknessLoad(&words[i*8]), pb, i);
+    pb->n = nwords;
+}
+
+__attribute__((target("avx2")))
+static void DecodeAVX2(const char *words, unsigned int nwords, struct photonbatch *pb)
+{
+    unsigned int i;
+    const __m256i swap = _mm256_setr_epi8(SWAPSPLIT, SWAPSPLIT);
+    const __m256i m17 = _mm256_set1_epi32(0x1FFFF);
+    const __m256i m9 = _mm256_set1_epi32(0x1FF);
+    const __m256i m10 = _mm256_set1_epi32(0x3FF);
+    const __m256i m3 = _mm256_set1_epi32(0x7);
+    const __m256i sink = _mm256_set1_epi32(npix);
+    __m256i a, b, lo, hi, x, y;
+
+    for(i=0;i+8<=nwords;i+=8) {
+       // per 128 bit lane the shuffle leaves [lo lo hi hi], the 64 bit permute makes each register
+       // [lo x4 | hi x4] and the cross lane permute collects all eight low and all eight high halves
+       a = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *) &words[i*8]), swap);
+       b = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *) &words[i*8+32]), swap);
+       a = _mm256_permute4x64_epi64(a, _MM_SHUFFLE(3,1,2,0));
+       b = _mm256_permute4x64_epi64(b, _MM_SHUFFLE(3,1,2,0));
+       lo = _mm256_permute2x128_si256(a, b, 0x20);
+       hi = _mm256_permute2x128_si256(a, b, 0x31);
+
+       x = _mm256_srli_epi32(hi, 22);
+       y = _mm256_and_si256(_mm256_srli_epi32(hi, 12), m10);
+       _mm256_store_si256((__m256i *) &pb->baseline[i], _mm256_and_si256(lo, m17));
+       _mm256_store_si256((__m256i *) &pb->wvl[i], _mm256_or_si256(_mm256_srli_epi32(lo, 17), _mm256_slli_epi32(_mm256_and_si256(hi, m3), 15)));
+       _mm256_store_si256((__m256i *) &pb->timestamp[i], _mm256_and_si256(_mm256_srli_epi32(hi, 3), m9));
+       _mm256_store_si256((__m256i *) &pb->ycoord[i], y);
+       _mm256_store_si256((__m256i *) &pb->xcoord[i], x);
+       _mm256_store_si256((__m256i *) &pb->pix[i], _mm256_min_epu32(_mm256_add_epi32(_mm256_i32gather_epi32(xlut, x, 4), _mm256_i32gather_epi32(ylut, y, 4)), sink));
+    }
+    for(;i<nwords;i++) DecodeDarknessWord(DarknessLoad(&words[i*8]), pb, i);
+    pb->n = nwords;
+}
+
+void DecodeInit(const struct packetcodec *codec, int xpix, int ypix)
+{
+    unsigned int i;
+
+    npix = xpix * ypix;
+    for(i=0;i<1024;i++) {
+       xlut[i] = i < xpix ? i * ypix : npix;
+       ylut[i] = i < ypix ? i : npix;
+    }
+
+    decoder = scalars[0].scalar;
+    for(i=0;i<sizeof(scalars)/sizeof(scalars[0]);i++) {
+       if( !strcmp(codec->name, scalars[i].firmware) ) decoder = scalars[i].scalar;
+    }
+    kernel = "scalar";
+    if( decoder != DecodeScalarDarkness ) return;
+
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports("avx2") ) {
+       decoder = DecodeAVX2;
+       kernel = "avx2";
+    }
+    else if( __builtin_cpu_supports("sse4.1") ) {
+       decoder = DecodeSSE4;
+       kernel = "sse4.1";
+    }
+}
+
+const char *DecodeKernel()
+{
+    return kernel;
+}
+
+void DecodePhotons(const char *words, unsigned int nwords, struct photonbatch *pb)
+{
+    decoder(words, nwords, pb);
+}
@@ -0,0 +1,51 @@
+// PhotonDecode.h
+// decode a packet's worth of photon words into struct-of-arrays form
+//
+// Where the fields sit in a photon word depends on the firmware, see PacketCodec.h.  For the darkness
+// format (after the byte swap) it is, from the top bit down, xcoord:10 ycoord:10 timestamp:9 wvl:18
+// baseline:17.  The decoders below pull the fields out with shifts and masks, for darkness eight words
+// at a time with AVX2 or four at a time with SSE4.1, falling back to plain C when neither is available
+// and for every other format.  The kernel is picked once at run time by DecodeInit().
+
+#ifndef PHOTONDECODE_H
+#define PHOTONDECODE_H
+
+#include <stdint.h>
+
+#include "PacketCodec.h"
+
+#define DECODE_MAXPHOT 256      // more than the photons in the longest packet the framer accepts
+
+struct photonbatch {
+    unsigned int n;
+    uint32_t xcoord[DECODE_MAXPHOT] __attribute__((aligned(32)));
+    uint32_t ycoord[DECODE_MAXPHOT] __attribute__((aligned(32)));
+    uint32_t timestamp[DECODE_MAXPHOT] __attribute__((aligned(32)));
+    uint32_t wvl[DECODE_MAXPHOT] __attribute__((aligned(32)));
+    uint32_t baseline[DECODE_MAXPHOT] __attribute__((aligned(32)));
+    uint32_t pix[DECODE_MAXPHOT] __attribute__((aligned(32)));     // flat image index, x*ypix + y
+    float energy[DECODE_MAXPHOT] __attribute__((aligned(32)));     // eV, only filled in by CalibratePhotons()
+};
+
+// pick the fastest kernel this CPU supports for codec's photons and build the pixel index tables for an
+// xpix by ypix image.  Photons with a coordinate past the edge of the array get pix = xpix*ypix, the
+// sink pixel.
+void DecodeInit(const struct packetcodec *codec, int xpix, int ypix);
+
+// name of the kernel DecodeInit() picked, for the log
+const char *DecodeKernel();
+
+// decode nwords photon words starting at words into pb, nwords <= DECODE_MAXPHOT
+void DecodePhotons(const char *words, unsigned int nwords, struct photonbatch *pb);
+
+// add the decoded photons to a flat xpix*ypix image that has room for the sink pixel
+static inline void HistogramPhotons(uint16_t *image, const struct photonbatch *pb)
+{
+    unsigned int i;
+
+    // plain dependent increments on the index array, so photons landing on the same pixel within a
+    // vector can never lose counts the way a scatter would
+    for(i=0;i<pb->n;i++) image[pb->pix[i]]++;
+}
+
+#endif
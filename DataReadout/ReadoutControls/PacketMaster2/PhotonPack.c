@@ -0,0 +1,251 @@
+// PhotonPack.c
+// lossless bit packing of the photon stream, see PhotonPack.h
+
+#include <string.h>
+#include <byteswap.h>
+
+#include "PhotonPack.h"
+
+_Static_assert(sizeof(struct packrec) == 8, "packrec is part of the file format");
+
+// photon fields, low bit first: baseline 17, wavelength 18, timestamp 9, y 10, x 10
+#define NFIELD 5
+static const int fieldshift[NFIELD] = { 54, 44, 35, 17, 0 };
+static const int fieldbits[NFIELD] = { 10, 10, 9, 18, 17 };
+static const int fielddelta[NFIELD] = { 0, 0, 1, 0, 1 };   // stored as a delta from the photon before
+
+struct bitio {
+    unsigned char *p, *end;
+    uint64_t acc;
+    int n;
+};
+
+static inline void PutBits(struct bitio *b, uint64_t v, int n)
+{
+    b->acc |= v << b->n;
+    b->n += n;
+    while( b->n >= 8 ) {
+       *b->p++ = b->acc;
+       b->acc >>= 8;
+       b->n -= 8;
+    }
+}
+
+static inline void PutFlush(struct bitio *b)
+{
+    if( b->n > 0 ) *b->p++ = b->acc;
+    b->acc = 0;
+    b->n = 0;
+}
+
+static inline uint64_t GetBits(struct bitio *b, int n)
+{
+    uint64_t v;
+
+    while( b->n < n && b->p < b->end ) {
+       b->acc |= (uint64_t) *b->p++ << b->n;
+       b->n += 8;
+    }
+    v = b->acc & ((1UL << n) - 1);
+    b->acc >>= n;
+    b->n -= n;
+    return v;
+}
+
+static inline uint64_t Word(const char *p)
+{
+    uint64_t w;
+
+    memcpy(&w, p, 8);
+    return __bswap_64(w);
+}
+
+static inline uint64_t Field(uint64_t w, int f)
+{
+    return (w >> fieldshift[f]) & ((1UL << fieldbits[f]) - 1);
+}
+
+static inline uint64_t Zigzag(int64_t d)
+{
+    return ((uint64_t) d << 1) ^ (uint64_t) (d >> 63);
+}
+
+static inline int64_t Unzigzag(uint64_t u)
+{
+    return (int64_t) (u >> 1) ^ -(int64_t) (u & 1);
+}
+
+static inline int Width(uint64_t v)
+{
+    return v ? 64 - __builtin_clzl(v) : 0;
+}
+
+static unsigned int PackRaw(const char *in, unsigned int len, char *out)
+{
+    struct packrec *r = (struct packrec *) out;
+
+    r->len = len;
+    r->rawlen = len;
+    r->kind = PACK_RAW;
+    r->flags = 0;
+    r->pad = 0;
+    memcpy(out + sizeof(struct packrec), in, len);
+    return sizeof(struct packrec) + len;
+}
+
+unsigned int PackRecord(const char *in, unsigned int len, char *out, unsigned int *used, unsigned int *pktlen)
+{
+    struct packrec *r = (struct packrec *) out;
+    struct bitio b;
+    uint64_t w, v, d, base[NFIELD], last[NFIELD], val;
+    int width[NFIELD], f;
+    unsigned int i, n, tail, body;
+
+    if( len > PACK_MAXLEN ) len = PACK_MAXLEN;
+
+    // bytes that are not a packet run to the next header word
+    if( len < 8 || (Word(in) >> 56) != 0xFF ) {
+       for(i=8;i+8<=len && (Word(in+i) >> 56) != 0xFF;i+=8) ;
+       *used = i < len && i+8 <= len ? i : len;
+       *pktlen = 0;
+       return PackRaw(in, *used, out);
+    }
+
+    // the photons run to the next header or the fake photon that ends a short packet
+    for(n=0;8*(n+2)<=len;n++) {
+       w = Word(in + 8*(n+1));
+       if( (w >> 56) == 0xFF || (w >> 48) == 0x7FFF ) break;
+    }
+    tail = 8*(n+2) <= len && (Word(in + 8*(n+1)) >> 48) == 0x7FFF;
+    *pktlen = 8*(n+1);
+    *used = *pktlen + 8*tail;
+
+    // smallest value of the offset fields, largest offset or delta of every field
+    for(f=0;f<NFIELD;f++) {
+       base[f] = Field(Word(in+8), f);
+       v = 0;
+       if( !fielddelta[f] )
+          for(i=0;i<n;i++) if( (val = Field(Word(in+8*(i+1)), f)) < base[f] ) base[f] = val;
+       last[f] = base[f];
+       for(i=0;i<n;i++) {
+          val = Field(Word(in+8*(i+1)), f);
+          d = fielddelta[f] ? Zigzag((int64_t) val - (int64_t) last[f]) : val - base[f];
+          last[f] = val;
+          if( d > v ) v = d;
+       }
+       width[f] = Width(v);
+    }
+    for(f=0,v=0;f<NFIELD;f++) v += width[f];
+    body = 8 + NFIELD + (64 + n*v + 7)/8 + 8*tail;
+    if( n == 0 || body >= *used ) return PackRaw(in, *used, out);
+
+    r->len = body;
+    r->rawlen = *used;
+    r->kind = PACK_BITS;
+    r->flags = tail ? PACK_TAIL : 0;
+    r->pad = 0;
+    out += sizeof(struct packrec);
+    memcpy(out, in, 8);
+    for(f=0;f<NFIELD;f++) out[8+f] = width[f];
+
+    b.p = (unsigned char *) out + 8 + NFIELD;
+    b.acc = 0;
+    b.n = 0;
+    for(f=0;f<NFIELD;f++) {
+       PutBits(&b, base[f], fieldbits[f]);
+       last[f] = base[f];
+    }
+    for(i=0;i<n;i++) {
+       w = Word(in+8*(i+1));
+       for(f=0;f<NFIELD;f++) {
+          val = Field(w, f);
+          PutBits(&b, fielddelta[f] ? Zigzag((int64_t) val - (int64_t) last[f]) : val - base[f], width[f]);
+          last[f] = val;
+       }
+    }
+    PutFlush(&b);
+    if( tail ) memcpy(b.p, in + *pktlen, 8);
+
+    return sizeof(struct packrec) + body;
+}
+
+unsigned int UnpackRecord(const char *in, size_t avail, char *out, unsigned int *outlen)
+{
+    struct packrec r;
+    struct bitio b;
+    uint64_t w, base[NFIELD], last[NFIELD], val;
+    int width[NFIELD], f, bits;
+    unsigned int i, n, tail, stream;
+
+    if( avail < sizeof(r) ) return 0;
+    memcpy(&r, in, sizeof(r));
+    if( r.rawlen > PACK_MAXLEN || sizeof(r) + r.len > avail ) return 0;
+    in += sizeof(r);
+
+    if( r.kind == PACK_RAW ) {
+       if( r.len != r.rawlen ) return 0;
+       memcpy(out, in, r.len);
+       *outlen = r.len;
+       return sizeof(r) + r.len;
+    }
+    if( r.kind != PACK_BITS ) return 0;
+
+    tail = (r.flags & PACK_TAIL) != 0;
+    if( r.rawlen % 8 != 0 || r.rawlen < 8*(2+tail) || r.len < 8 + NFIELD ) return 0;
+    n = r.rawlen/8 - 1 - tail;
+    for(f=0,bits=0;f<NFIELD;f++) {
+       width[f] = (unsigned char) in[8+f];
+       if( width[f] > fieldbits[f] + 1 ) return 0;
+       bits += width[f];
+    }
+    stream = (64 + n*bits + 7)/8;
+    if( r.len != 8 + NFIELD + stream + 8*tail ) return 0;
+
+    memcpy(out, in, 8);
+    b.p = (unsigned char *) in + 8 + NFIELD;
+    b.end = b.p + stream;
+    b.acc = 0;
+    b.n = 0;
+    for(f=0;f<NFIELD;f++) last[f] = base[f] = GetBits(&b, fieldbits[f]);
+    for(i=0;i<n;i++) {
+       w = 0;
+       for(f=0;f<NFIELD;f++) {
+          val = GetBits(&b, width[f]);
+          val = fielddelta[f] ? (uint64_t) ((int64_t) last[f] + Unzigzag(val)) : base[f] + val;
+          last[f] = val;
+          w |= (val & ((1UL << fieldbits[f]) - 1)) << fieldshift[f];
+       }
+       w = __bswap_64(w);
+       memcpy(out + 8*(i+1), &w, 8);
+    }
+    if( tail ) memcpy(out + 8*(n+1), in + 8 + NFIELD + stream, 8);
+
+    *outlen = r.rawlen;
+    return sizeof(r) + r.len;
+}
+
+size_t UnpackedLength(const char *in, size_t len)
+{
+    struct packrec r;
+    size_t pos = 0, total = 0;
+
+    while( pos + sizeof(r) <= len ) {
+       memcpy(&r, in + pos, sizeof(r));
+       if( pos + sizeof(r) + r.len > len ) break;
+       total += r.rawlen;
+       pos += sizeof(r) + r.len;
+    }
+    return total;
+}
+
+size_t UnpackRecords(const char *in, size_t len, char *out)
+{
+    size_t pos = 0, total = 0;
+    unsigned int n, outlen;
+
+    while( (n = UnpackRecord(in + pos, len - pos, out + total, &outlen)) > 0 ) {
+       pos += n;
+       total += outlen;
+    }
+    return total;
+}
@@ -0,0 +1,57 @@
+// PhotonPack.h
+// lossless bit packing of the photon stream for the compressed .bin files
+//
+// A packed file holds records, each one packet as the board sent it, or a run of bytes that is not a
+// packet.  A record starts with a struct packrec.  The header word is kept as it came off the wire, each
+// photon field is stored in only as many bits as the packet needs: x, y and wavelength as offsets from
+// the packet's smallest value, timestamp and baseline as zigzag deltas from the photon before, since the
+// times only increase through a packet and the baseline drifts slowly from one pixel to the next.  The
+// fake photon that ends a short packet is kept verbatim.  A packet that would not get any smaller is
+// stored raw, so a record is never more than 8 bytes larger than the data it holds.  The fields are
+// split where the darkness format has them (see PacketCodec.h), packets of other firmwares pack less
+// tightly but unpack just the same.
+//
+// Unpacking a record gives back exactly the bytes that were packed.
+
+#ifndef PHOTONPACK_H
+#define PHOTONPACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PACK_MAXLEN 2048            // most bytes of wire data one record holds, at least a ring slot
+#define PACK_MAXREC (PACK_MAXLEN + 16)  // longest record, prefix included
+
+// record kinds
+#define PACK_RAW 0                  // len bytes of wire data verbatim
+#define PACK_BITS 1                 // header word, field widths and bases, packed photons
+
+// record flags
+#define PACK_TAIL 1                 // the packet ends with a fake photon, stored after the photons
+
+struct packrec {
+    uint16_t len;                   // record bytes after this prefix
+    uint16_t rawlen;                // bytes of wire data the record unpacks to
+    uint8_t kind;
+    uint8_t flags;
+    uint16_t pad;
+};
+
+// pack one record from the start of in[0..len): a packet with its fake photon if it has one, or the
+// bytes before the next header.  Returns the record length written to out (PACK_MAXREC bytes is always
+// enough), with *used the bytes of in it took and *pktlen the length of the packet without its fake
+// photon (0 for bytes that are not a packet).
+unsigned int PackRecord(const char *in, unsigned int len, char *out, unsigned int *used, unsigned int *pktlen);
+
+// unpack the record at in into out (PACK_MAXLEN bytes), avail bytes are readable at in.  Returns the
+// record length and sets *outlen, or 0 if the record is cut short or corrupt.
+unsigned int UnpackRecord(const char *in, size_t avail, char *out, unsigned int *outlen);
+
+// bytes of wire data the records in in[0..len) unpack to, stopping at the first bad one
+size_t UnpackedLength(const char *in, size_t len);
+
+// unpack every record in in[0..len) into out, which holds UnpackedLength() bytes.  Returns the bytes
+// written.
+size_t UnpackRecords(const char *in, size_t len, char *out);
+
+#endif
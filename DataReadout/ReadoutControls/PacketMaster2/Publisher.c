@@ -0,0 +1,247 @@
+// Publisher.c
+// photon events streamed to network subscribers, see Publisher.h
+
+#define _GNU_SOURCE     // accept4()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "Publisher.h"
+
+_Static_assert(sizeof(struct pubframe) == 16, "pubframe is read by pm2stream.py");
+_Static_assert(sizeof(struct pubevent) == 24, "pubevent is read by pm2stream.py");
+
+struct publisher *PublisherCreate(const struct pm2config *cfg, int port)
+{
+    struct publisher *p;
+    struct sockaddr_in si;
+    int i, one = 1;
+
+    if( (p = calloc(1, sizeof(struct publisher))) == NULL ) return NULL;
+    p->cfg = cfg;
+    for(i=0;i<PUB_MAXSUBS;i++) p->sub[i].fd = -1;
+
+    if( (p->listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1 ) {
+       perror("publisher socket");
+       free(p);
+       return NULL;
+    }
+    setsockopt(p->listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&si, 0, sizeof(si));
+    si.sin_family = AF_INET;
+    si.sin_port = htons(port);
+    si.sin_addr.s_addr = htonl(INADDR_ANY);
+    if( bind(p->listenfd, (const struct sockaddr *) &si, sizeof(si)) == -1 || listen(p->listenfd, 8) == -1 ) {
+       perror("publisher bind");
+       close(p->listenfd);
+       free(p);
+       return NULL;
+    }
+    return p;
+}
+
+static void PublisherDrop(struct publisher *p, struct pubsub *s, const char *why)
+{
+    printf("PUBLISHER: subscriber %d %s after %lu photons\n", (int) (s - p->sub), why, s->events); fflush(stdout);
+    if( s->active ) p->nsubs--;
+    close(s->fd);
+    free(s->buf);
+    memset(s, 0, sizeof(struct pubsub));
+    s->fd = -1;
+}
+
+// "roach 0 3 x 10 40 y 0 60", returns 0 if the line made sense
+static int PublisherFilter(struct pubfilter *f, const struct pm2config *cfg, char *line)
+{
+    char *tok, *save, *end;
+    long v;
+    int roaches = 0, *range = NULL, nrange = 0;
+
+    f->x0 = f->y0 = 0;
+    f->x1 = cfg->xpix;
+    f->y1 = cfg->ypix;
+    memset(f->roach, 1, sizeof(f->roach));
+
+    for(tok=strtok_r(line, " \t\r", &save);tok!=NULL;tok=strtok_r(NULL, " \t\r", &save)) {
+       v = strtol(tok, &end, 10);
+       if( *end == 0 && end != tok ) {
+          if( range != NULL && nrange < 2 ) range[nrange++] = v;
+          else if( roaches && v >= 0 && v < 256 ) f->roach[v] = 1;
+          else return -1;
+          continue;
+       }
+       if( range != NULL && nrange != 2 ) return -1;
+       range = NULL;
+       roaches = 0;
+       if( !strcmp(tok, "roach") ) {
+          memset(f->roach, 0, sizeof(f->roach));
+          roaches = 1;
+       }
+       else if( !strcmp(tok, "x") ) range = &f->x0;
+       else if( !strcmp(tok, "y") ) range = &f->y0;
+       else return -1;
+       nrange = 0;
+    }
+    return range != NULL && nrange != 2 ? -1 : 0;
+}
+
+static void PublisherAccept(struct publisher *p)
+{
+    struct sockaddr_in si;
+    socklen_t len = sizeof(si);
+    int fd, i;
+
+    while( (fd = accept4(p->listenfd, (struct sockaddr *) &si, &len, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1 ) {
+       for(i=0;i<PUB_MAXSUBS && p->sub[i].fd != -1;i++) ;
+       if( i == PUB_MAXSUBS || (p->sub[i].buf = malloc(PUB_BUFLEN)) == NULL ) {
+          printf("PUBLISHER: turned away %s, already serving %d subscribers\n", inet_ntoa(si.sin_addr), PUB_MAXSUBS); fflush(stdout);
+          close(fd);
+          continue;
+       }
+       p->sub[i].fd = fd;
+       printf("PUBLISHER: subscriber %d connected from %s:%d\n", i, inet_ntoa(si.sin_addr), ntohs(si.sin_port)); fflush(stdout);
+       len = sizeof(si);
+    }
+}
+
+// read the filter line while there is none, afterwards only notice the subscriber hanging up
+static int PublisherRead(struct publisher *p, struct pubsub *s)
+{
+    struct pubfilter *f = &s->filter;
+    char scratch[256], *nl;
+    ssize_t n;
+    int r;
+
+    if( s->active ) {
+       while( (n = recv(s->fd, scratch, sizeof(scratch), MSG_DONTWAIT)) > 0 ) ;
+    }
+    else {
+       n = recv(s->fd, s->line + s->linelen, sizeof(s->line) - 1 - s->linelen, MSG_DONTWAIT);
+       if( n > 0 ) {
+          s->linelen += n;
+          s->line[s->linelen] = 0;
+          if( (nl = strchr(s->line, '\n')) == NULL ) {
+             if( s->linelen == sizeof(s->line) - 1 ) {
+                PublisherDrop(p, s, "sent a filter line that is too long");
+                return -1;
+             }
+             return 0;
+          }
+          *nl = 0;
+          if( PublisherFilter(f, p->cfg, s->line) != 0 ) {
+             PublisherDrop(p, s, "sent a filter that is not roach/x/y");
+             return -1;
+          }
+          for(r=0,n=0;r<p->cfg->nroach && r<256;r++) n += f->roach[r];
+          printf("PUBLISHER: subscriber %d wants x %d to %d, y %d to %d from %d roaches\n", (int) (s - p->sub), f->x0, f->x1-1, f->y0, f->y1-1, (int) n); fflush(stdout);
+          s->active = 1;
+          p->nsubs++;
+          return 0;
+       }
+    }
+    if( n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK) ) {
+       PublisherDrop(p, s, "hung up");
+       return -1;
+    }
+    return 0;
+}
+
+void PublisherPacket(struct publisher *p, unsigned int roach, unsigned int frame, uint64_t t0, const struct photonbatch *pb, unsigned int flags)
+{
+    const unsigned int npix = ConfigNpix(p->cfg), ypix = p->cfg->ypix;
+    struct pubsub *s;
+    struct pubframe *fr;
+    struct pubevent *ev;
+    const struct pubfilter *f;
+    unsigned int i, k;
+    int x, y;
+    size_t need = sizeof(struct pubframe) + pb->n * sizeof(struct pubevent);
+    int j;
+
+    for(j=0;j<PUB_MAXSUBS;j++) {
+       s = &p->sub[j];
+       f = &s->filter;
+       if( !s->active || roach >= 256 || !f->roach[roach] ) continue;
+       if( s->len + need > PUB_BUFLEN && s->off > 0 ) {
+          memmove(s->buf, s->buf + s->off, s->len - s->off);
+          s->len -= s->off;
+          s->off = 0;
+       }
+       if( s->len + need > PUB_BUFLEN ) {
+          PublisherDrop(p, s, "fell behind");
+          p->dropped++;
+          continue;
+       }
+
+       fr = (struct pubframe *) (s->buf + s->len);
+       ev = (struct pubevent *) (fr + 1);
+       for(i=0,k=0;i<pb->n;i++) {
+          if( pb->pix[i] >= npix ) continue;          // off the array, or a bad pixel
+          if( flags & PUB_REMAPPED ) {
+             x = pb->pix[i] / ypix;
+             y = pb->pix[i] % ypix;
+          }
+          else {
+             x = pb->xcoord[i];
+             y = pb->ycoord[i];
+          }
+          if( x < f->x0 || x >= f->x1 || y < f->y0 || y >= f->y1 ) continue;
+          ev[k].time = t0 + pb->timestamp[i];
+          ev[k].x = x;
+          ev[k].y = y;
+          ev[k].wvl = pb->wvl[i];
+          ev[k].baseline = pb->baseline[i];
+          ev[k].energy = (flags & PUB_ENERGY) ? pb->energy[i] : __builtin_nanf("");
+          k++;
+       }
+       if( k == 0 ) continue;
+       memcpy(fr->magic, PUB_MAGIC, 4);
+       fr->n = k;
+       fr->roach = roach;
+       fr->flags = flags;
+       fr->frame = frame;
+       s->len += sizeof(struct pubframe) + k * sizeof(struct pubevent);
+       s->events += k;
+       p->events += k;
+    }
+}
+
+void PublisherPoll(struct publisher *p)
+{
+    struct pubsub *s;
+    ssize_t n;
+    int i;
+
+    PublisherAccept(p);
+    for(i=0;i<PUB_MAXSUBS;i++) {
+       s = &p->sub[i];
+       if( s->fd == -1 || PublisherRead(p, s) != 0 ) continue;
+       while( s->off < s->len ) {
+          n = send(s->fd, s->buf + s->off, s->len - s->off, MSG_DONTWAIT | MSG_NOSIGNAL);
+          if( n > 0 ) s->off += n;
+          else {
+             if( n == -1 && errno != EAGAIN && errno != EWOULDBLOCK ) PublisherDrop(p, s, "went away");
+             break;
+          }
+       }
+       if( s->fd != -1 && s->off == s->len ) s->off = s->len = 0;
+    }
+}
+
+void PublisherFree(struct publisher *p)
+{
+    int i;
+
+    if( p == NULL ) return;
+    for(i=0;i<PUB_MAXSUBS;i++) {
+       if( p->sub[i].fd != -1 ) PublisherDrop(p, &p->sub[i], "closed");
+    }
+    close(p->listenfd);
+    free(p);
+}
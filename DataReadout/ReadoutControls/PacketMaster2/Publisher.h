@@ -0,0 +1,92 @@
+// Publisher.h
+// photon events streamed to network subscribers as they arrive, for the fast guiding, wavefront sensing
+// and quick look consumers that cannot wait for a .bin file to close
+//
+// The Publisher stage reads the rings like the Writer and the Cuber, decodes each packet (remapped and
+// calibrated with the same tables as the Cuber) and hands it to PublisherPacket(), which copies the
+// photons each subscriber asked for into that subscriber's output buffer.  PublisherPoll() accepts new
+// subscribers and sends what is buffered without ever blocking.  A subscriber that lets PUB_BUFLEN
+// bytes pile up is disconnected rather than slowing anything down: it reconnects and carries on from
+// the photons arriving then.
+//
+// A subscriber connects to the publish port over TCP and sends one line of filter, then only reads:
+//
+//   roach 0 3 7       only these boards (any number of them)
+//   x 10 40           only columns 10 to 39, physical pixels after any beammap remap
+//   y 0 60            only rows 0 to 59
+//
+// in any combination on the one line, and an empty line for every photon.  It gets a stream of frames,
+// one per packet that had photons for it, each a struct pubframe followed by n struct pubevent, all
+// little endian.  pm2stream.py is the Python side.
+
+#ifndef PUBLISHER_H
+#define PUBLISHER_H
+
+#include <stdint.h>
+
+#include "Config.h"
+#include "PhotonDecode.h"
+
+#define PUB_MAXSUBS 16                  // most subscribers at once
+#define PUB_BUFLEN (16*1024*1024)       // bytes queued for a subscriber before it is dropped, ~0.7 s at 1M photons/s
+#define PUB_MAXLINE 256                 // longest filter line
+#define PUB_POLLMS 10                   // longest the stage sleeps between servicing the sockets
+#define PUB_MAGIC "PM2E"
+
+#define PUB_ENERGY 1                    // pubframe.flags: energy is calibrated, NaN otherwise
+#define PUB_REMAPPED 2                  // x and y went through a beammap remap
+
+struct pubframe {
+    char magic[4];
+    uint32_t n;                         // events that follow
+    uint16_t roach;
+    uint16_t flags;
+    uint32_t frame;                     // the packet's 12 bit frame number
+};
+
+struct pubevent {
+    uint64_t time;                      // us since the Unix epoch
+    uint16_t x, y;
+    uint32_t wvl;                       // wavelength (phase) field as sent, 18 bits
+    uint32_t baseline;                  // baseline field as sent, 17 bits
+    float energy;                       // eV, NaN without a calibration for the pixel
+};
+
+struct pubfilter {
+    int x0, x1, y0, y1;                 // half open region
+    uint8_t roach[256];                 // 1 for each board wanted
+};
+
+struct pubsub {
+    int fd;
+    int active;                         // 0 until the filter line is in
+    struct pubfilter filter;
+    char line[PUB_MAXLINE];
+    unsigned int linelen;
+    char *buf;                          // PUB_BUFLEN bytes, buf[off..len) still to send
+    size_t off, len;
+    uint64_t events;                    // sent to this subscriber
+};
+
+struct publisher {
+    const struct pm2config *cfg;
+    int listenfd;
+    int nsubs;                          // subscribers with their filter in, the stage skips decoding at 0
+    uint64_t dropped;                   // subscribers disconnected for falling behind
+    uint64_t events;                    // events queued across every subscriber
+    struct pubsub sub[PUB_MAXSUBS];
+};
+
+// listen on port, NULL on failure
+struct publisher *PublisherCreate(const struct pm2config *cfg, int port);
+
+// queue a decoded packet's photons for every subscriber that wants them.  t0 is the header time in us
+// since the Unix epoch, flags the PUB_ bits that apply to the batch
+void PublisherPacket(struct publisher *p, unsigned int roach, unsigned int frame, uint64_t t0, const struct photonbatch *pb, unsigned int flags);
+
+// accept subscribers, read their filters and send what is queued, never blocks
+void PublisherPoll(struct publisher *p);
+
+void PublisherFree(struct publisher *p);
+
+#endif
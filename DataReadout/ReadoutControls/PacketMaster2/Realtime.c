@@ -0,0 +1,100 @@
+// Realtime.c
+// hugepages, memory locking, pinning and SCHED_FIFO for the PacketMaster2 stages, see Realtime.h
+
+#define _GNU_SOURCE     // pthread_setaffinity_np(), MAP_HUGETLB
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "Realtime.h"
+
+static int hugepages = 0, lockmem = 0;
+
+void RealtimeInit(const struct pm2config *cfg)
+{
+    hugepages = cfg->hugepages;
+    lockmem = cfg->mlock;
+}
+
+static size_t HugeLen(size_t len)
+{
+    size_t page = hugepages ? RT_HUGEPAGE : (size_t) sysconf(_SC_PAGESIZE);
+
+    return (len + page - 1) / page * page;
+}
+
+// write every page so it is backed now, from this thread and so on this thread's NUMA node
+static void Prefault(void *p, size_t len)
+{
+    volatile char *c = (volatile char *) p;
+    size_t i, page = sysconf(_SC_PAGESIZE);
+
+    for(i=0;i<len;i+=page) c[i] = 0;
+}
+
+void *HugeAlloc(size_t len)
+{
+    void *p = MAP_FAILED;
+
+    len = HugeLen(len);
+    if( hugepages ) p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if( p == MAP_FAILED ) {
+       // no reserved hugepages left, transparent ones are the next best thing
+       p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+       if( p == MAP_FAILED ) return NULL;
+       if( hugepages ) madvise(p, len, MADV_HUGEPAGE);
+    }
+    Prefault(p, len);
+    return p;
+}
+
+void HugeFree(void *p, size_t len)
+{
+    if( p != NULL ) munmap(p, HugeLen(len));
+}
+
+void HugePrefault(void *p, size_t len)
+{
+    if( hugepages ) madvise(p, len, MADV_HUGEPAGE);
+    if( hugepages || lockmem ) Prefault(p, len);
+}
+
+void RealtimeLock(const char *who)
+{
+    // on fault, so the shared rings are still first touched by their Readers
+    if( lockmem && mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) != 0 ) {
+       printf("%s: could not lock memory (%s), raise the memlock ulimit or grant CAP_IPC_LOCK\n", who, strerror(errno)); fflush(stdout);
+    }
+}
+
+int RealtimeThread(pthread_t t, int cpu, int prio, const char *who)
+{
+    cpu_set_t cpus;
+    struct sched_param sp;
+    int r = 0, err;
+
+    if( cpu >= 0 ) {
+       CPU_ZERO(&cpus);
+       CPU_SET(cpu, &cpus);
+       if( pthread_setaffinity_np(t, sizeof(cpus), &cpus) != 0 ) {
+          printf("%s: could not pin to cpu %d\n", who, cpu);
+          r = -1;
+       }
+       else printf("%s: pinned to cpu %d\n", who, cpu);
+    }
+    if( prio > 0 ) {
+       memset(&sp, 0, sizeof(sp));
+       sp.sched_priority = prio;
+       if( (err = pthread_setschedparam(t, SCHED_FIFO, &sp)) != 0 ) {
+          printf("%s: could not run SCHED_FIFO at priority %d (%s)\n", who, prio, strerror(err));
+          r = -1;
+       }
+       else printf("%s: running SCHED_FIFO at priority %d\n", who, prio);
+    }
+    fflush(stdout);
+    return r;
+}
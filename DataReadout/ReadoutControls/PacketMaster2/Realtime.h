@@ -0,0 +1,48 @@
+// Realtime.h
+// hugepage backed, locked buffers and pinned, real time scheduled stages for a host that does nothing
+// but read out the array
+//
+// With hugepages = 1 the big buffers the stages go through for every packet (the framers, the Cuber's
+// worker queues and the Writer's disk blocks) come from 2 MB pages, MAP_HUGETLB ones when the kernel
+// has some reserved (vm.nr_hugepages) and transparent ones otherwise, and the rings on the ramdisk are
+// advised to use transparent hugepages too (which needs the tmpfs mounted with huge=within_size or
+// shmem_enabled set to advise).  Every such buffer, and the ring slots, are faulted in when they are
+// set up, by the thread that will use them, rather than one page at a time under the first packets.
+//
+// With mlock = 1 each process locks its memory with mlockall() so nothing the stages touch is ever
+// paged out.  That needs CAP_IPC_LOCK or a memlock ulimit as large as the process.
+//
+// Each stage can be pinned to its own core (readercpus, cubercpus, writercpu, publishercpu) and run
+// SCHED_FIFO at its own priority (readerprio, cuberprio, writerprio, publisherprio, 0 leaves the
+// stage on the normal scheduler), which needs CAP_SYS_NICE.  A stage that cannot get what it was
+// configured with says so and carries on without it.
+
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "Config.h"
+
+#define RT_HUGEPAGE (2*1024*1024)   // hugepage size HugeAlloc() rounds up to
+
+// take hugepages and mlock for this process from cfg, the tools never call it and get ordinary pages
+void RealtimeInit(const struct pm2config *cfg);
+
+// page aligned, zeroed and faulted in buffer of len bytes, from hugepages when they are on.  NULL on
+// failure
+void *HugeAlloc(size_t len);
+void HugeFree(void *p, size_t len);
+
+// advise hugepages for a shared mapping and fault it in from the calling thread
+void HugePrefault(void *p, size_t len);
+
+// lock the process's memory, pages already in and any faulted in later, when mlock is on
+void RealtimeLock(const char *who);
+
+// pin thread t to cpu (-1 leaves it where it is) and run it SCHED_FIFO at prio (0 leaves it on the
+// normal scheduler), returns 0 if it got both
+int RealtimeThread(pthread_t t, int cpu, int prio, const char *who);
+
+#endif
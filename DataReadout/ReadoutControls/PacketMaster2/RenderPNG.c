@@ -0,0 +1,177 @@
+// RenderPNG.c
+// PNG previews of the Cuber images, see RenderPNG.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <png.h>
+#include <zlib.h>
+
+#include "RenderPNG.h"
+
+int WriteImagePNG(const char *filename, int width, int height, const uint16_t *buffer, const char *title)
+{
+	int code = 0;
+	FILE *fp = NULL;
+	png_structp png_ptr = NULL;
+	png_infop info_ptr = NULL;
+	png_bytep row = NULL;
+	int x, y;
+	uint16_t v;
+
+	// Open file for writing (binary mode)
+	fp = fopen(filename, "wb");
+	if (fp == NULL) {
+		fprintf(stderr, "Could not open file %s for writing\n", filename);
+		code = 1;
+		goto finalise;
+	}
+
+	// Initialize write structure
+	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (png_ptr == NULL) {
+		fprintf(stderr, "Could not allocate write struct\n");
+		code = 1;
+		goto finalise;
+	}
+
+	// Initialize info structure
+	info_ptr = png_create_info_struct(png_ptr);
+	if (info_ptr == NULL) {
+		fprintf(stderr, "Could not allocate info struct\n");
+		code = 1;
+		goto finalise;
+	}
+
+	// Allocate memory for one row (1 byte per pixel - gray)
+	row = (png_bytep) malloc(width * sizeof(png_byte));
+	if (row == NULL) {
+		fprintf(stderr, "Could not allocate row\n");
+		code = 1;
+		goto finalise;
+	}
+
+	// Setup Exception handling
+	if (setjmp(png_jmpbuf(png_ptr))) {
+		fprintf(stderr, "Error during png creation\n");
+		code = 1;
+		goto finalise;
+	}
+
+	png_init_io(png_ptr, fp);
+
+	// a preview, so speed over size: no row filters and the quickest deflate
+	png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
+	png_set_compression_level(png_ptr, Z_BEST_SPEED);
+
+	// Write header (8 bit grayscale)
+	png_set_IHDR(png_ptr, info_ptr, width, height,
+			8, PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE,
+			PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+
+	// Set title
+	if (title != NULL) {
+		png_text title_text;
+		title_text.compression = PNG_TEXT_COMPRESSION_NONE;
+		title_text.key = "Title";
+		title_text.text = (char *) title;
+		png_set_text(png_ptr, info_ptr, &title_text, 1);
+	}
+
+	png_write_info(png_ptr, info_ptr);
+
+	// Write image data, counts/8 as before, clipped to white instead of wrapping
+	for (y=0 ; y<height ; y++) {
+		for (x=0 ; x<width ; x++) {
+			v = buffer[y*width + x] >> 3;
+			row[x] = v > 255 ? 255 : v;
+		}
+		png_write_row(png_ptr, row);
+	}
+
+	// End write
+	png_write_end(png_ptr, NULL);
+
+	finalise:
+	if (fp != NULL) fclose(fp);
+	if (info_ptr != NULL) png_free_data(png_ptr, info_ptr, PNG_FREE_ALL, -1);
+	if (png_ptr != NULL) png_destroy_write_struct(&png_ptr, &info_ptr);
+	if (row != NULL) free(row);
+
+	return code;
+}
+
+static void *RenderThread(void *arg)
+{
+    struct pngrender *r = (struct pngrender *) arg;
+    uint16_t *swap;
+
+    pthread_mutex_lock(&r->lock);
+    while( 1 ) {
+       while( !r->pending && !r->quit ) pthread_cond_wait(&r->cond, &r->lock);
+       if( !r->pending ) break;
+
+       // take the waiting image, the Cuber can fill the other buffer while we encode
+       swap = r->image[0];
+       r->image[0] = r->image[1];
+       r->image[1] = swap;
+       strcpy(r->fname[0], r->fname[1]);
+       r->pending = 0;
+       pthread_mutex_unlock(&r->lock);
+
+       WriteImagePNG(r->fname[0], r->width, r->height, r->image[0], "PacketMaster2");
+
+       pthread_mutex_lock(&r->lock);
+       r->rendered++;
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+struct pngrender *RenderCreate(int width, int height)
+{
+    struct pngrender *r;
+
+    if( (r = calloc(1, sizeof(struct pngrender))) == NULL ) return NULL;
+    r->width = width;
+    r->height = height;
+    r->image[0] = malloc(sizeof(uint16_t) * width * height);
+    r->image[1] = malloc(sizeof(uint16_t) * width * height);
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+
+    if( r->image[0] == NULL || r->image[1] == NULL || pthread_create(&r->thread, NULL, RenderThread, r) != 0 ) {
+       fprintf(stderr, "RenderPNG: could not start the render thread\n");
+       free(r->image[0]);
+       free(r->image[1]);
+       free(r);
+       return NULL;
+    }
+    return r;
+}
+
+void RenderSubmit(struct pngrender *r, const uint16_t *image, const char *fname)
+{
+    pthread_mutex_lock(&r->lock);
+    if( r->pending ) r->replaced++;
+    memcpy(r->image[1], image, sizeof(uint16_t) * r->width * r->height);
+    snprintf(r->fname[1], RENDER_PATHLEN, "%s", fname);
+    r->pending = 1;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+}
+
+void RenderFree(struct pngrender *r)
+{
+    pthread_mutex_lock(&r->lock);
+    r->quit = 1;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->cond);
+    free(r->image[0]);
+    free(r->image[1]);
+    free(r);
+}
@@ -0,0 +1,42 @@
+// RenderPNG.h
+// PNG previews of the Cuber images, written by Bin2PNG or from a render thread inside PacketMaster2
+//
+// The previews are 8 bit grayscale with no row filtering and the fastest zlib level, which is plenty for
+// a quick look and keeps the encode well under a millisecond for the 80x125 array.  The render thread
+// takes images through a one deep handoff: RenderSubmit() copies the image and returns at once, and if
+// the thread is still busy with the previous second the older pending image is replaced, never queued.
+
+#ifndef RENDERPNG_H
+#define RENDERPNG_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define RENDER_PATHLEN 160
+
+// write a width x height image of counts to filename, title goes in the PNG text chunk (may be NULL).
+// Returns 0 on success.
+int WriteImagePNG(const char *filename, int width, int height, const uint16_t *buffer, const char *title);
+
+struct pngrender {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int width, height;
+    uint16_t *image[2];             // the one being rendered and the one waiting
+    char fname[2][RENDER_PATHLEN];
+    int pending;                    // image[1] holds a submitted image not yet picked up
+    int quit;
+    uint64_t rendered, replaced;    // previews written, and submissions overwritten before rendering
+};
+
+// start a render thread for width x height images, NULL on failure
+struct pngrender *RenderCreate(int width, int height);
+
+// queue image (width*height counts) to be written to fname, never blocks on the encode
+void RenderSubmit(struct pngrender *r, const uint16_t *image, const char *fname);
+
+// finish any pending image and stop the thread
+void RenderFree(struct pngrender *r);
+
+#endif
@@ -0,0 +1,78 @@
+// RollingImage.c
+// sliding integration window over the Cuber's subframe images, see RollingImage.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "RollingImage.h"
+
+struct rollingimage *RollingCreate(const struct pm2config *cfg)
+{
+    struct rollingimage *r;
+    unsigned int i;
+
+    if( (r = calloc(1, sizeof(struct rollingimage))) == NULL ) return NULL;
+    r->npix = ConfigNpix(cfg);
+    r->nsub = cfg->window / cfg->subframe;
+    r->sub = calloc(r->nsub, sizeof(uint16_t *));
+    r->sum = calloc(r->npix+1, sizeof(uint32_t));
+    if( r->sub == NULL || r->sum == NULL ) {
+       RollingFree(r);
+       return NULL;
+    }
+    for(i=0;i<r->nsub;i++) {
+       if( (r->sub[i] = AllocImage(cfg)) == NULL ) {
+          RollingFree(r);
+          return NULL;
+       }
+    }
+    return r;
+}
+
+static inline void RollingAddN(uint32_t *restrict sum, uint16_t *restrict old, const uint16_t *restrict sub,
+                               uint16_t *restrict out, unsigned int n)
+{
+    unsigned int i;
+    uint32_t v;
+
+    for(i=0;i<n;i++) {
+       v = sum[i] - old[i] + sub[i];
+       sum[i] = v;
+       old[i] = sub[i];
+       out[i] = v > 0xFFFF ? 0xFFFF : v;
+    }
+}
+
+void RollingAdd(struct rollingimage *r, const uint16_t *subframe, uint16_t *out)
+{
+    uint16_t *old = r->sub[r->next];
+    unsigned int i;
+
+    if( subframe == NULL ) {
+       for(i=0;i<=r->npix;i++) r->sum[i] -= old[i];
+       memset(old, 0, sizeof(uint16_t) * (r->npix+1));
+       for(i=0;i<=r->npix;i++) out[i] = r->sum[i] > 0xFFFF ? 0xFFFF : r->sum[i];
+    }
+    else {
+       // the geometries we run get the pixel count as a constant, as in AddImage()
+       switch( r->npix ) {
+          case 80*125:
+             RollingAddN(r->sum, old, subframe, out, 80*125+1);
+             break;
+          default:
+             RollingAddN(r->sum, old, subframe, out, r->npix+1);
+       }
+    }
+    r->next = (r->next + 1) % r->nsub;
+}
+
+void RollingFree(struct rollingimage *r)
+{
+    unsigned int i;
+
+    if( r->sub != NULL ) for(i=0;i<r->nsub;i++) free(r->sub[i]);
+    free(r->sub);
+    free(r->sum);
+    free(r);
+}
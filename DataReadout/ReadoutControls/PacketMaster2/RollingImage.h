@@ -0,0 +1,34 @@
+// RollingImage.h
+// sliding integration window over the Cuber's subframe images
+//
+// The Cuber closes an image every subframe (cfg->subframe ms).  With a window of N subframes the
+// image it publishes is the sum of the last N of them.  Rather than re-histogram the window every
+// subframe we keep the last N subframes in a ring plus a running 32 bit sum: the newest subframe is
+// added, the one falling out of the window is subtracted, and the sum is clipped to 16 bits for the
+// .img.  The sink pixel at image[npix] is carried along like any other.
+
+#ifndef ROLLINGIMAGE_H
+#define ROLLINGIMAGE_H
+
+#include <stdint.h>
+
+#include "Config.h"
+
+struct rollingimage {
+    unsigned int npix;          // pixels per image, not counting the sink pixel
+    unsigned int nsub;          // subframes in the window
+    unsigned int next;          // ring slot the next subframe goes in, the oldest once the ring is full
+    uint16_t **sub;             // the last nsub subframes
+    uint32_t *sum;              // their sum, 32 bits so a full window of saturated subframes still fits
+};
+
+// ring of cfg->window / cfg->subframe subframes, NULL on failure
+struct rollingimage *RollingCreate(const struct pm2config *cfg);
+
+// add subframe (npix+1 counts, NULL for an empty one) and drop the oldest, then write the window
+// clipped to 16 bits into out (npix+1 counts)
+void RollingAdd(struct rollingimage *r, const uint16_t *subframe, uint16_t *out);
+
+void RollingFree(struct rollingimage *r);
+
+#endif
@@ -0,0 +1,49 @@
+// SpectralCube.c
+// wavelength resolved images, see SpectralCube.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SpectralCube.h"
+
+_Static_assert(sizeof(struct cubeheader) == 40, "cubeheader is part of the file format");
+
+uint32_t *CubeAlloc(const struct pm2config *cfg)
+{
+    size_t size = ((sizeof(uint32_t) * CubeLen(cfg)) + 63) & ~((size_t) 63);
+    void *p;
+
+    if( posix_memalign(&p, 64, size) != 0 ) return NULL;
+    memset(p, 0, size);
+    return (uint32_t *) p;
+}
+
+int CubeWrite(const char *fname, const uint32_t *cube, const struct pm2config *cfg, int units, int64_t start)
+{
+    struct cubeheader h;
+    size_t n = (size_t) ConfigNpix(cfg) * cfg->cubebins;
+    FILE *wp;
+    int err = 0;
+
+    memset(&h, 0, sizeof(h));
+    strcpy(h.magic, CUBE_MAGIC);
+    h.xpix = cfg->xpix;
+    h.ypix = cfg->ypix;
+    h.nbins = cfg->cubebins;
+    h.units = units;
+    h.min = units == CUBE_MEV ? cfg->emin : cfg->wvlmin;
+    h.max = units == CUBE_MEV ? cfg->emax : cfg->wvlmax;
+    h.start = start;
+
+    if( (wp = fopen(fname, "wb")) == NULL ) {
+       perror(fname);
+       return -1;
+    }
+    if( fwrite(&h, sizeof(h), 1, wp) != 1 || fwrite(cube, sizeof(uint32_t), n, wp) != n ) {
+       perror(fname);
+       err = -1;
+    }
+    if( fclose(wp) != 0 ) err = -1;
+    return err;
+}
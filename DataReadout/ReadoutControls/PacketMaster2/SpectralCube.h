@@ -0,0 +1,84 @@
+// SpectralCube.h
+// wavelength resolved images, accumulated by the Cuber next to the counts image
+//
+// With cubebins > 0 every photon is also histogrammed into cubebins equal bins for its pixel: by its
+// 18 bit wvl field over [wvlmin, wvlmax), or with a calibration loaded (see Calibration.h) by its
+// energy over [emin, emax) meV.  A cube is npix+1 pixels (the last one the sink pixel, as for the
+// image) of cubebins 32 bit counts each, a pixel's bins next to each other, so cube[pix * nbins + bin]
+// is one count and a spectrum is one contiguous run.  Photons outside the range, or on a pixel with
+// no calibration, are counted in the image but not the cube.
+//
+// A .cube file is a struct cubeheader followed by the npix*nbins counts, little endian, without the
+// sink pixel.  The Cuber writes one per subframe beside its .img, with the same name.
+
+#ifndef SPECTRALCUBE_H
+#define SPECTRALCUBE_H
+
+#include <stdint.h>
+
+#include "Config.h"
+#include "PhotonDecode.h"
+
+#define CUBE_MAGIC "PM2CUBE"        // with its terminating 0 fills cubeheader.magic
+
+// what the bins of a cube span
+#define CUBE_WVL 0                  // the raw wvl field
+#define CUBE_MEV 1                  // calibrated energy in meV
+
+struct cubeheader {
+    char magic[8];
+    uint32_t xpix, ypix, nbins;
+    uint32_t min, max;              // range the bins span in units, bin width (max-min)/nbins
+    uint32_t units;                 // CUBE_WVL or CUBE_MEV
+    int64_t start;                  // ms since the Unix epoch of the start of the subframe
+};
+
+// 64 byte aligned, zeroed cube of (npix+1)*cfg->cubebins counts
+uint32_t *CubeAlloc(const struct pm2config *cfg);
+
+static inline unsigned int CubeLen(const struct pm2config *cfg)
+{
+    return (ConfigNpix(cfg) + 1) * cfg->cubebins;
+}
+
+// add the decoded photons to cube.  The bin is found with a multiply and shift rather than a divide
+// per photon: with scale = nbins * 2^32 / range, rounded down, (wvl - wvlmin) * scale >> 32 is always
+// less than nbins.
+static inline void CubePhotons(uint32_t *cube, const struct photonbatch *pb, const struct pm2config *cfg)
+{
+    unsigned int i, nbins = cfg->cubebins;
+    uint32_t off, range = cfg->wvlmax - cfg->wvlmin;
+    uint64_t scale = ((uint64_t) nbins << 32) / range;
+
+    for(i=0;i<pb->n;i++) {
+       off = pb->wvl[i] - cfg->wvlmin;      // wraps to a large value below wvlmin
+       if( off >= range ) continue;
+       cube[pb->pix[i] * nbins + ((off * scale) >> 32)]++;
+    }
+}
+
+// the same by the calibrated energy of the photons, which CalibratePhotons() has filled in.  A pixel
+// without a calibration has a NaN energy, which fails both comparisons.
+static inline void CubeEnergies(uint32_t *cube, const struct photonbatch *pb, const struct pm2config *cfg)
+{
+    unsigned int i, nbins = cfg->cubebins;
+    float lo = cfg->emin * 1e-3f, scale = nbins / ((cfg->emax - cfg->emin) * 1e-3f), b;
+
+    for(i=0;i<pb->n;i++) {
+       b = (pb->energy[i] - lo) * scale;
+       if( !(b >= 0 && b < nbins) ) continue;
+       cube[pb->pix[i] * nbins + (unsigned int) b]++;
+    }
+}
+
+static inline void CubeAdd(uint32_t *restrict dst, const uint32_t *restrict src, unsigned int len)
+{
+    unsigned int i;
+
+    for(i=0;i<len;i++) dst[i] += src[i];
+}
+
+// write cube (without its sink pixel), binned in units, to fname as a .cube file, returns 0 or -1 on error
+int CubeWrite(const char *fname, const uint32_t *cube, const struct pm2config *cfg, int units, int64_t start);
+
+#endif
@@ -0,0 +1,222 @@
+// Telemetry.c
+// packet loss and latency counters served as Prometheus text, see Telemetry.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include "Telemetry.h"
+
+#define TELEMETRY_RESPLEN 16384    // bytes of response besides the per board lines
+
+struct pm2telemetry *TelemetryCreate(const struct pm2config *cfg)
+{
+    struct pm2telemetry *tm;
+    size_t size = sizeof(struct pm2telemetry) + sizeof(struct roachstats) * cfg->nroach;
+
+    tm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if( tm == MAP_FAILED ) {
+       perror("telemetry mmap");
+       return NULL;
+    }
+    memset(tm, 0, size);
+    tm->nroach = cfg->nroach;
+    tm->size = size;
+    tm->listenfd = -1;
+    return tm;
+}
+
+uint64_t TelemetryNow()
+{
+    struct timespec spec;
+
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return (uint64_t) spec.tv_sec*1000000 + spec.tv_nsec/1000;
+}
+
+// the response is built in one buffer, anything past the end is cut off rather than overrun
+struct metricsbuf {
+    char *p;
+    size_t len, size;
+};
+
+static void Emit(struct metricsbuf *m, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if( m->len >= m->size ) return;
+    va_start(ap, fmt);
+    n = vsnprintf(m->p + m->len, m->size - m->len, fmt, ap);
+    va_end(ap);
+    if( n > 0 ) m->len += n;
+    if( m->len > m->size ) m->len = m->size;
+}
+
+static uint64_t Load(const uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void EmitCounter(struct metricsbuf *m, const char *name, const char *help, uint64_t v)
+{
+    Emit(m, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", name, help, name, name, v);
+}
+
+#define EMIT_ROACH(m, tm, name, help, field) do { \
+    int _r; \
+    Emit(m, "# HELP %s %s\n# TYPE %s counter\n", name, help, name); \
+    for(_r=0;_r<(tm)->nroach;_r++) Emit(m, "%s{roach=\"%d\"} %lu\n", name, _r, Load(&(tm)->roach[_r].field)); \
+} while(0)
+
+static void EmitHistogram(struct metricsbuf *m, const char *name, const char *help, const struct latencyhist *h)
+{
+    uint64_t cum = 0;
+    int k;
+
+    Emit(m, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for(k=0;k<TELEMETRY_NBUCKET-1;k++) {
+       cum += Load(&h->bucket[k]);
+       Emit(m, "%s_bucket{le=\"%g\"} %lu\n", name, (double) (1UL << k) / 1e6, cum);
+    }
+    cum += Load(&h->bucket[TELEMETRY_NBUCKET-1]);
+    Emit(m, "%s_bucket{le=\"+Inf\"} %lu\n", name, cum);
+    Emit(m, "%s_sum %g\n", name, Load(&h->sum) / 1e6);
+    Emit(m, "%s_count %lu\n", name, Load(&h->count));
+}
+
+// one line per Reader thread, value is evaluated with _i set to the thread
+#define EMIT_READER(m, tm, name, help, value) do { \
+    int _i; \
+    Emit(m, "# HELP %s %s\n# TYPE %s counter\n", name, help, name); \
+    for(_i=0;_i<(tm)->nrings;_i++) Emit(m, "%s{reader=\"%d\"} %lu\n", name, _i, value); \
+} while(0)
+
+static void TelemetryFormat(struct pm2telemetry *tm, struct metricsbuf *m)
+{
+    int i;
+
+
+    EMIT_READER(m, tm, "pm2_datagrams_total", "Datagrams received from the boards.", Load(&tm->reader[_i].datagrams));
+    EMIT_READER(m, tm, "pm2_received_bytes_total", "Bytes received from the boards.", Load(&tm->reader[_i].bytes));
+    EMIT_READER(m, tm, "pm2_socket_drops_total", "Datagrams the kernel dropped on a full socket buffer.", Load(&tm->reader[_i].sockdrops));
+    EMIT_READER(m, tm, "pm2_ring_dropped_total", "Datagrams the Reader could not place on its ring.", Load(&tm->rings[_i]->dropped));
+    Emit(m, "# HELP pm2_ring_overflows_total Datagrams a stage lost by falling a full ring behind.\n# TYPE pm2_ring_overflows_total counter\n");
+    for(i=0;i<tm->nrings;i++) {
+       Emit(m, "pm2_ring_overflows_total{reader=\"%d\",stage=\"cuber\"} %lu\n", i, Load(&tm->rings[i]->reader[RING_CUBER].overflow));
+       Emit(m, "pm2_ring_overflows_total{reader=\"%d\",stage=\"writer\"} %lu\n", i, Load(&tm->rings[i]->reader[RING_WRITER].overflow));
+       Emit(m, "pm2_ring_overflows_total{reader=\"%d\",stage=\"publisher\"} %lu\n", i, Load(&tm->rings[i]->reader[RING_PUBLISHER].overflow));
+    }
+
+    EMIT_ROACH(m, tm, "pm2_packets_total", "Packets parsed.", packets);
+    EMIT_ROACH(m, tm, "pm2_photons_total", "Photons parsed.", photons);
+    EMIT_ROACH(m, tm, "pm2_frame_gaps_total", "Frames missing from the frame sequence.", framegaps);
+    EMIT_ROACH(m, tm, "pm2_masked_photons_total", "Photons dropped on masked hot pixels.", masked);
+    EMIT_ROACH(m, tm, "pm2_short_packets_total", "Packets ended early by the fake photon.", shortpkts);
+    EMIT_ROACH(m, tm, "pm2_late_packets_total", "Packets dropped because their subframe had closed.", late);
+    EmitCounter(m, "pm2_bad_roach_packets_total", "Packets from roach ids outside the array.", Load(&tm->badroach));
+    EmitCounter(m, "pm2_foreign_roach_packets_total", "Packets from boards another node owns.", Load(&tm->foreign));
+    EmitCounter(m, "pm2_images_total", "Images written by the Cuber.", Load(&tm->images));
+    Emit(m, "# HELP pm2_hot_pixels Pixels masked for their photon rate.\n# TYPE pm2_hot_pixels gauge\npm2_hot_pixels %lu\n", Load(&tm->hotpixels));
+    EmitCounter(m, "pm2_hot_pixel_flags_total", "Times a pixel has been masked for its photon rate.", Load(&tm->hotflags));
+    Emit(m, "# HELP pm2_watched_pixels Pixels on the lightcurve watch list.\n# TYPE pm2_watched_pixels gauge\npm2_watched_pixels %lu\n", Load(&tm->nwatch));
+    Emit(m, "# HELP pm2_watched_photons_total Photons counted into a watched pixel's lightcurves.\n# TYPE pm2_watched_photons_total counter\n");
+    for(i=0;i<Load(&tm->nwatch) && i<CONFIG_MAXWATCH;i++) {
+       Emit(m, "pm2_watched_photons_total{x=\"%lu\",y=\"%lu\"} %lu\n", Load(&tm->watch[i].x), Load(&tm->watch[i].y), Load(&tm->watch[i].photons));
+    }
+    EmitHistogram(m, "pm2_ring_latency_seconds", "Time from a datagram being received to the Cuber framing it.", &tm->ringlat);
+    EmitHistogram(m, "pm2_image_latency_seconds", "Time from the first packet of a subframe arriving to its image being written.", &tm->imagelat);
+
+    Emit(m, "# HELP pm2_publish_subscribers Subscribers to the photon event stream.\n# TYPE pm2_publish_subscribers gauge\npm2_publish_subscribers %lu\n", Load(&tm->pubsubs));
+    EmitCounter(m, "pm2_publish_photons_total", "Photons queued for event stream subscribers.", Load(&tm->pubevents));
+    EmitCounter(m, "pm2_publish_dropped_subscribers_total", "Event stream subscribers disconnected for falling behind.", Load(&tm->pubdropped));
+    EmitCounter(m, "pm2_publish_skipped_total", "Datagrams the Publisher skipped to keep from holding back the Readers.", Load(&tm->pubskipped));
+
+    EmitCounter(m, "pm2_disk_written_bytes_total", "Bytes the Writer has put on disk.", Load(&tm->diskbytes));
+    Emit(m, "# HELP pm2_disk_queued_blocks Blocks waiting for the disk I/O thread.\n# TYPE pm2_disk_queued_blocks gauge\npm2_disk_queued_blocks %lu\n", Load(&tm->diskqueued));
+    Emit(m, "# HELP pm2_disk_max_write_seconds Slowest block write over the last second.\n# TYPE pm2_disk_max_write_seconds gauge\npm2_disk_max_write_seconds %g\n", Load(&tm->diskmaxlat) / 1e6);
+}
+
+static void *TelemetryThread(void *arg)
+{
+    struct pm2telemetry *tm = (struct pm2telemetry *) arg;
+    struct metricsbuf m;
+    struct timeval tv = { 1, 0 };
+    char req[1024], hdr[256];
+    int fd, n, hlen;
+
+    m.size = TELEMETRY_RESPLEN + 512 * tm->nroach;
+    if( (m.p = malloc(m.size)) == NULL ) {
+       perror("telemetry buffer");
+       return NULL;
+    }
+
+    // one connection at a time, a scrape takes well under a millisecond
+    while( (fd = accept(tm->listenfd, NULL, NULL)) != -1 ) {
+       setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+       setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+       n = recv(fd, req, sizeof(req)-1, 0);
+       req[n > 0 ? n : 0] = 0;
+
+       m.len = 0;
+       if( !strncmp(req, "GET /metrics", 12) ) {
+          TelemetryFormat(tm, &m);
+          hlen = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", m.len);
+       }
+       else hlen = snprintf(hdr, sizeof(hdr), "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+       if( send(fd, hdr, hlen, MSG_NOSIGNAL) == hlen && m.len > 0 ) send(fd, m.p, m.len, MSG_NOSIGNAL);
+       close(fd);
+    }
+    free(m.p);
+    return NULL;
+}
+
+int TelemetryStart(struct pm2telemetry *tm, struct packetring **rings, int nrings, int port)
+{
+    struct sockaddr_in si;
+    int i, one = 1;
+
+    for(i=0;i<nrings;i++) tm->rings[i] = rings[i];
+    tm->nrings = nrings;
+    if( port <= 0 ) return 0;
+
+    if( (tm->listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1 ) {
+       perror("metrics socket");
+       return -1;
+    }
+    setsockopt(tm->listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&si, 0, sizeof(si));
+    si.sin_family = AF_INET;
+    si.sin_port = htons(port);
+    si.sin_addr.s_addr = htonl(INADDR_ANY);
+    if( bind(tm->listenfd, (const struct sockaddr *) &si, sizeof(si)) == -1 || listen(tm->listenfd, 8) == -1 ) {
+       perror("metrics bind");
+       close(tm->listenfd);
+       tm->listenfd = -1;
+       return -1;
+    }
+    if( pthread_create(&tm->thread, NULL, TelemetryThread, tm) != 0 ) {
+       perror("metrics thread");
+       close(tm->listenfd);
+       tm->listenfd = -1;
+       return -1;
+    }
+    return 0;
+}
+
+void TelemetryStop(struct pm2telemetry *tm)
+{
+    if( tm->listenfd == -1 ) return;
+    // wakes the accept() so the thread sees the socket is gone
+    shutdown(tm->listenfd, SHUT_RDWR);
+    pthread_join(tm->thread, NULL);
+    close(tm->listenfd);
+    tm->listenfd = -1;
+}
@@ -0,0 +1,122 @@
+// Telemetry.h
+// packet loss and latency counters for every stage, served as Prometheus text on /metrics
+//
+// The counters live in a shared anonymous mapping made before the fork, so the Reader, Cuber and Writer
+// all update the same block.  Every counter has exactly one writer (the Reader, the Cuber thread, or the
+// thread that parses a given board), so an update is a plain load and a relaxed store, no lock and no
+// read-modify-write.  A small HTTP thread in the Reader process formats the block when MkidDashboard.py
+// or a Prometheus server asks for http://<host>:<cfg->metrics>/metrics.
+//
+// Latencies go into power of two histograms: bucket k counts observations of at most 2^k us, the last
+// bucket everything longer.  The ring histogram is the time from the Reader's recvmmsg() to the Cuber
+// framing the datagram, the image histogram the time from the first packet of a subframe arriving to
+// its image being written.
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "Config.h"
+#include "PacketRing.h"
+
+#define TELEMETRY_NBUCKET 25        // 1 us to 8.4 s, then +Inf
+
+// per board, the parse fields from whichever thread owns the board and the rest from the Cuber thread
+struct roachstats {
+    uint64_t packets;               // packets parsed
+    uint64_t photons;               // photons in them
+    uint64_t framegaps;             // frames missing from the 12 bit frame sequence
+    uint64_t masked;                // photons dropped on hot pixels, counted in photons too
+    uint32_t nextframe;             // frame number we expect next
+    uint32_t seen;                  // 0 until the first packet sets nextframe
+    uint64_t shortpkts __attribute__((aligned(64)));   // packets ended early by the fake photon
+    uint64_t late;                  // packets dropped because their subframe had closed
+} __attribute__((aligned(64)));
+
+struct latencyhist {
+    uint64_t count;
+    uint64_t sum;                   // us
+    uint64_t bucket[TELEMETRY_NBUCKET];
+};
+
+// a pixel on the lightcurve watch list
+struct watchstats {
+    uint64_t x, y;
+    uint64_t photons;               // counted into its lightcurves since it was put on the list
+};
+
+// per Reader thread
+struct readerstats {
+    uint64_t datagrams;
+    uint64_t bytes;
+    uint64_t sockdrops;             // datagrams the kernel dropped on a full socket buffer, from SO_RXQ_OVFL
+} __attribute__((aligned(64)));
+
+struct pm2telemetry {
+    struct readerstats reader[CONFIG_MAXREADERS];
+    // Cuber thread
+    uint64_t images __attribute__((aligned(64)));
+    uint64_t badroach;              // packets from roach ids outside the array
+    uint64_t foreign;               // packets from boards another node owns
+    uint64_t hotpixels;             // pixels masked now
+    uint64_t hotflags;              // times a pixel has been masked
+    uint64_t nwatch;                // pixels on the lightcurve watch list
+    struct watchstats watch[CONFIG_MAXWATCH];
+    struct latencyhist ringlat;
+    struct latencyhist imagelat;
+    // Writer
+    uint64_t diskbytes __attribute__((aligned(64)));
+    uint64_t diskqueued;            // blocks waiting for the I/O thread at the last sample
+    uint64_t diskmaxlat;            // slowest block write in us over the last second
+    // Publisher
+    uint64_t pubsubs __attribute__((aligned(64)));  // subscribers connected now
+    uint64_t pubevents;             // photons queued for subscribers
+    uint64_t pubdropped;            // subscribers disconnected for falling behind
+    uint64_t pubskipped;            // datagrams skipped because the Publisher fell behind the rings
+
+    // metrics thread, only meaningful in the Reader process
+    struct packetring *rings[CONFIG_MAXREADERS];
+    int nrings;
+    pthread_t thread;
+    int listenfd;
+    int nroach;
+    size_t size;
+    struct roachstats roach[];
+};
+
+// shared anonymous mapping with room for cfg->nroach boards, call before forking the stages
+struct pm2telemetry *TelemetryCreate(const struct pm2config *cfg);
+
+// serve /metrics on port from a thread in this process, the rings supply the ring overflow counters
+int TelemetryStart(struct pm2telemetry *tm, struct packetring **rings, int nrings, int port);
+
+// stop the metrics thread, if one was started
+void TelemetryStop(struct pm2telemetry *tm);
+
+// counters are only ever written by one thread
+static inline void TelemetryAdd(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline void TelemetrySet(uint64_t *counter, uint64_t v)
+{
+    __atomic_store_n(counter, v, __ATOMIC_RELAXED);
+}
+
+static inline void TelemetryLatency(struct latencyhist *h, uint64_t us)
+{
+    unsigned int k = us <= 1 ? 0 : 64 - __builtin_clzll(us-1);
+
+    if( k >= TELEMETRY_NBUCKET ) k = TELEMETRY_NBUCKET-1;
+    TelemetryAdd(&h->bucket[k], 1);
+    TelemetryAdd(&h->sum, us);
+    TelemetryAdd(&h->count, 1);
+}
+
+// microseconds on CLOCK_MONOTONIC, the clock every latency is measured on
+uint64_t TelemetryNow();
+
+#endif
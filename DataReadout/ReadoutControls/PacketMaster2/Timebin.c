@@ -0,0 +1,91 @@
+// Timebin.c
+// bin packets into Cuber subframes by their header timestamp, see Timebin.h
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Timebin.h"
+
+struct timebin *TimebinCreate(const struct pm2config *cfg, const struct timespec *now)
+{
+    struct timebin *tb;
+    if( (tb = calloc(1, sizeof(struct timebin))) == NULL ) return NULL;
+    if( (tb->board = malloc(sizeof(int64_t) * cfg->nroach)) == NULL ) {
+       free(tb);
+       return NULL;
+    }
+    tb->subframe = (int64_t) cfg->subframe * TIMEBIN_TICKS;
+    tb->reorder = (int64_t) cfg->reorder * TIMEBIN_TICKS;
+    tb->nopen = (tb->reorder + tb->subframe - 1) / tb->subframe + 1;
+    tb->nroach = cfg->nroach;
+    tb->own = cfg->ownroach;
+    tb->codec = cfg->codec;
+    // only the wrap matters until the first packet arrives
+    tb->newest = TimebinClock(now->tv_sec, now->tv_nsec);
+    return tb;
+}
+
+void TimebinFree(struct timebin *tb)
+{
+    free(tb->board);
+    free(tb);
+}
+
+// header time to board time, whichever wrap lands closest to the newest time seen
+static inline int64_t TimebinUnwrap(const struct timebin *tb, const char *packet)
+{
+    return TimebinNearest(tb->codec->ticks(packet), tb->codec->tickbits, tb->newest);
+}
+
+void TimebinRestart(struct timebin *tb, const char *packet)
+{
+    int i;
+
+    tb->newest = TimebinUnwrap(tb, packet);
+    // a board trailing this one by up to the reorder window still gets in, so until we hear from them
+    // every board counts as being that far behind
+    for(i=0;i<tb->nroach;i++) tb->board[i] = tb->newest - tb->reorder;
+    tb->closed = (tb->newest - tb->reorder) / tb->subframe - 1;
+    tb->nstale = 0;
+    tb->started = 1;
+}
+
+int64_t TimebinPacket(struct timebin *tb, const char *packet, unsigned int roach)
+{
+    int64_t t;
+
+    if( !tb->started ) TimebinRestart(tb, packet);
+    t = TimebinUnwrap(tb, packet);
+
+    if( t < tb->newest - TIMEBIN_STALE ) {
+       tb->stale++;
+       if( ++tb->nstale >= TIMEBIN_RESYNC ) return TIMEBIN_RESTART;
+       return TIMEBIN_LATE;
+    }
+    tb->nstale = 0;
+
+    if( t > tb->newest ) tb->newest = t;
+    if( roach < tb->nroach && t > tb->board[roach] ) tb->board[roach] = t;
+
+    t /= tb->subframe;
+    if( t <= tb->closed ) {
+       tb->late++;
+       return TIMEBIN_LATE;
+    }
+    return t;
+}
+
+int64_t TimebinHorizon(const struct timebin *tb)
+{
+    int64_t h = tb->newest;
+    int i;
+
+    if( !tb->started ) return tb->closed;
+    // the slowest board still within the reorder window of the newest holds the rest up
+    for(i=0;i<tb->nroach;i++) {
+       if( tb->own[i] && tb->board[i] >= tb->newest - tb->reorder && tb->board[i] < h ) h = tb->board[i];
+    }
+    // every board has sent something at or after h, so the subframes ending by h are complete
+    return h / tb->subframe - 1;
+}
@@ -0,0 +1,95 @@
+// Timebin.h
+// bin packets into Cuber subframes by the timestamp in their header, not by when we read them
+//
+// Every header carries a 36 bit count of 0.5 ms ticks since TIMEBIN_EPOCH (32 bits with the legacy
+// firmware, see PacketCodec.h).  The count wraps, every 397 days for darkness and every 25 days for
+// legacy ticks, so it is unwrapped against the newest time seen (against the host clock for the very
+// first packet) into a 64 bit board time, and a packet belongs to subframe boardtime / subframe ticks.
+//
+// Boards do not arrive in lockstep, so the last few subframes stay open.  A subframe is closed once every
+// board that is still sending has moved past its end, or once the newest board is more than the
+// reorder window past it; a board that has fallen further behind than that no longer holds the others
+// up and its packets for closed subframes are counted as late and dropped.  On a node that reads out
+// only some of the boards (see Aggregate.h), the boards it does not read out never hold a subframe
+// open.  A packet far enough in the past that it cannot be a slow board (TIMEBIN_STALE) is counted as
+// stale, and a long enough run of them means the boards have restarted their clocks, so the Cuber
+// resynchronizes on them.
+
+#ifndef TIMEBIN_H
+#define TIMEBIN_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "Config.h"
+
+#define TIMEBIN_EPOCH 1451606400            // 2016-01-01 00:00:00 UTC, time zero of the header timestamp
+#define TIMEBIN_TICKS 2                     // header ticks per ms
+#define TIMEBIN_MAXOPEN (CONFIG_MAXREORDER+1)   // most subframes open at once
+#define TIMEBIN_STALE (10*1000*TIMEBIN_TICKS)   // ticks behind the newest board before a packet is stale
+#define TIMEBIN_RESYNC 1000                 // stale packets in a row that mean the clocks restarted
+
+#define TIMEBIN_LATE -1                     // TimebinPacket(): subframe already closed, drop the packet
+#define TIMEBIN_RESTART -2                  // TimebinPacket(): close everything and call TimebinRestart()
+
+struct timebin {
+    int64_t subframe;           // ticks per subframe
+    int64_t reorder;            // ticks a board may trail the newest one
+    unsigned int nopen;         // subframes open at once, subframe t uses slot t % nopen
+    int nroach;
+    const uint8_t *own;         // cfg->ownroach, only these boards hold subframes open
+    const struct packetcodec *codec;    // cfg->codec, reads the header time
+    int started;                // 0 until the first packet sets the time
+    int64_t closed;             // every subframe up to and including this one has been closed
+    int64_t newest;             // newest board time seen, ticks since TIMEBIN_EPOCH
+    int64_t *board;             // newest time from each board
+    uint64_t late;              // packets for subframes that were already closed
+    uint64_t stale;             // packets more than TIMEBIN_STALE behind
+    unsigned int nstale;        // stale packets since the last good one
+};
+
+// ticks since TIMEBIN_EPOCH at a CLOCK_REALTIME time
+static inline int64_t TimebinClock(int64_t sec, long nsec)
+{
+    return (sec - TIMEBIN_EPOCH) * 1000 * TIMEBIN_TICKS + nsec / (1000000/TIMEBIN_TICKS);
+}
+
+// a header time that wraps after 1 << bits ticks (packetcodec.tickbits) to full ticks since TIMEBIN_EPOCH,
+// whichever wrap lands closest to near, a time known to be within half a wrap of it
+static inline int64_t TimebinNearest(uint64_t ticks, unsigned int bits, int64_t near)
+{
+    int64_t wrap = 1LL << bits, d;
+
+    d = ((int64_t) ticks - near) & (wrap-1);
+    if( d >= wrap/2 ) d -= wrap;
+    return near + d;
+}
+
+// reorder, subframe and the packet format come from cfg, now (CLOCK_REALTIME) only picks the wrap of the
+// first packet
+struct timebin *TimebinCreate(const struct pm2config *cfg, const struct timespec *now);
+void TimebinFree(struct timebin *tb);
+
+// subframe index of a packet from roach, TIMEBIN_LATE or TIMEBIN_RESTART.  The index can be past the open
+// subframes (closed + nopen), the caller must then close the older ones to make room.
+int64_t TimebinPacket(struct timebin *tb, const char *packet, unsigned int roach);
+
+// start again from this packet's time after TIMEBIN_RESTART, once the open subframes are closed
+void TimebinRestart(struct timebin *tb, const char *packet);
+
+// last subframe that can be closed now that every board still sending has moved past it
+int64_t TimebinHorizon(const struct timebin *tb);
+
+// last subframe holding data, for closing everything when the boards have gone quiet
+static inline int64_t TimebinNewest(const struct timebin *tb)
+{
+    return tb->started ? tb->newest / tb->subframe : tb->closed;
+}
+
+// start of subframe t in ms since the unix epoch
+static inline int64_t TimebinStartMs(const struct timebin *tb, int64_t t)
+{
+    return (int64_t) TIMEBIN_EPOCH*1000 + t * tb->subframe / TIMEBIN_TICKS;
+}
+
+#endif
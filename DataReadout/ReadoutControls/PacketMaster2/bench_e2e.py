@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+"""
+End to end PacketMaster2 benchmark: run the pipeline against LoadGen and report what made it through.
+
+Starts ./PacketMaster2 (with whatever PACKETMASTER2_CFG points at), STARTs a run writing to a scratch
+directory, drives it with ./LoadGen for the requested rate and speed, scrapes /metrics before and after
+and QUITs.  The result is one JSON object on stdout: packets and photons per second through the Cuber,
+every drop counter, and p50/p99 of the ring and image latencies from the telemetry histograms.  Bench
+covers the stages one at a time, this covers them all at once.
+
+    bench_e2e.py [--rate 1000] [--speed 1] [--seconds 10] [--boards 10] [--photons 100] [--data /tmp/pm2bench]
+"""
+
+import argparse, json, os, re, shutil, subprocess, sys, time
+from urllib.request import urlopen
+
+RAMDISK = '/mnt/ramdisk'
+
+
+def scrape(port):
+    """metrics as {name: {labels: value}}"""
+    out = {}
+    for line in urlopen('http://localhost:%d/metrics' % port, timeout=5).read().decode().splitlines():
+        if line.startswith('#') or not line.strip():
+            continue
+        m = re.match(r'([a-z0-9_]+)(\{[^}]*\})?\s+(\S+)', line)
+        if m:
+            out.setdefault(m.group(1), {})[m.group(2) or ''] = float(m.group(3))
+    return out
+
+
+def total(m, name):
+    return sum(m.get(name, {}).values())
+
+
+def quantile(before, after, name, q):
+    """quantile in seconds from the change in a cumulative histogram, interpolated within the bucket"""
+    buckets = []
+    for labels, v in after.get(name + '_bucket', {}).items():
+        le = re.search(r'le="([^"]+)"', labels).group(1)
+        buckets.append((float('inf') if le == '+Inf' else float(le), v - before.get(name + '_bucket', {}).get(labels, 0)))
+    buckets.sort()
+    if not buckets or buckets[-1][1] == 0:
+        return None
+    target, lo, prev = q * buckets[-1][1], 0.0, 0.0
+    for le, n in buckets:
+        if n >= target:
+            if le == float('inf'):
+                return lo
+            return lo + (le - lo) * (target - prev) / (n - prev) if n > prev else le
+        lo, prev = le, n
+    return None
+
+
+def main():
+    ap = argparse.ArgumentParser(description='end to end PacketMaster2 benchmark')
+    ap.add_argument('--rate', type=float, default=1000, help='packets per second per board at 1x')
+    ap.add_argument('--speed', type=float, default=1, help='multiple of real rate')
+    ap.add_argument('--seconds', type=float, default=10)
+    ap.add_argument('--boards', type=int, default=10)
+    ap.add_argument('--photons', type=int, default=100, help='photons per packet')
+    ap.add_argument('--metrics', type=int, default=9187, help='port PacketMaster2 serves /metrics on')
+    ap.add_argument('--data', default='/tmp/pm2bench', help='where the run writes its .bin files')
+    args = ap.parse_args()
+
+    here = os.path.dirname(os.path.abspath(__file__))
+    shutil.rmtree(args.data, ignore_errors=True)
+    os.makedirs(args.data)
+    for f in ('START', 'STOP', 'QUIT'):
+        if os.path.exists(os.path.join(RAMDISK, f)):
+            os.remove(os.path.join(RAMDISK, f))
+
+    pm2 = subprocess.Popen([os.path.join(here, 'PacketMaster2')], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    try:
+        time.sleep(1)
+        with open(os.path.join(RAMDISK, 'START'), 'w') as f:
+            f.write(args.data)
+        time.sleep(0.5)
+        before = scrape(args.metrics)
+
+        lg = subprocess.run([os.path.join(here, 'LoadGen'), '-n', str(args.boards), '-r', str(args.rate), '-x', str(args.speed),
+                             '-t', str(args.seconds), '-c', str(args.photons)], stdout=subprocess.PIPE, universal_newlines=True)
+        sent = re.search(r'Sent (\d+) packets, ([\d.]+) MBytes in ([\d.]+) s', lg.stdout)
+        late = re.search(r'(\d+) packets went out more than', lg.stdout)
+
+        # let the reorder window and the last subframe close
+        time.sleep(2.5)
+        after = scrape(args.metrics)
+    finally:
+        open(os.path.join(RAMDISK, 'QUIT'), 'w').close()
+        try:
+            pm2.wait(timeout=10)
+        except subprocess.TimeoutExpired:
+            pm2.kill()
+
+    seconds = float(sent.group(3)) if sent else args.seconds
+    delta = lambda name: total(after, name) - total(before, name)
+    result = {
+        'loadgen': {'packets': int(sent.group(1)) if sent else None, 'mbytes': float(sent.group(2)) if sent else None,
+                    'seconds': seconds, 'late_packets': int(late.group(1)) if late else None,
+                    'rate': args.rate, 'speed': args.speed, 'boards': args.boards, 'photons': args.photons},
+        'received': {'datagrams': delta('pm2_datagrams_total'), 'bytes': delta('pm2_received_bytes_total')},
+        'parsed': {'packets': delta('pm2_packets_total'), 'photons': delta('pm2_photons_total'),
+                   'packets_per_s': delta('pm2_packets_total') / seconds, 'photons_per_s': delta('pm2_photons_total') / seconds},
+        'drops': {'socket': delta('pm2_socket_drops_total'), 'ring': delta('pm2_ring_dropped_total'),
+                  'ring_overflows': delta('pm2_ring_overflows_total'), 'frame_gaps': delta('pm2_frame_gaps_total'),
+                  'late': delta('pm2_late_packets_total')},
+        'latency_s': {'ring_p50': quantile(before, after, 'pm2_ring_latency_seconds', 0.5),
+                      'ring_p99': quantile(before, after, 'pm2_ring_latency_seconds', 0.99),
+                      'image_p50': quantile(before, after, 'pm2_image_latency_seconds', 0.5),
+                      'image_p99': quantile(before, after, 'pm2_image_latency_seconds', 0.99)},
+        'disk': {'mbytes': delta('pm2_disk_written_bytes_total') / 1e6},
+    }
+    json.dump(result, sys.stdout, indent=2)
+    print()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,110 @@
+"""
+Reader for the lightcurves PacketMaster2's Cuber keeps in /mnt/ramdisk/Lightcurve.shm
+
+The Cuber counts the photons on a watch list of pixels into lightbin us bins by their timestamps and
+publishes each subframe's counts as it closes it (see Lightcurve.h), so a photometry or timing loop
+gets millisecond cadence (or finer) series live instead of 1 Hz images or a reprocessed .bin file.
+The ring is mapped, followed and waited on by pm2live.Ring like the live image ring.
+
+    light = LightCurves()
+    frame = 0
+    while True:
+        frame = light.wait(frame)
+        meta, curves = light.read(frame)    # curves[(x, y)] is that pixel's counts, meta['bin'] s apart
+        ...
+
+Change the watch list by writing 'x,y x,y ...' to /mnt/ramdisk/WATCH, see watch().
+
+Works with python 2 and 3.
+"""
+
+import os, struct, time
+import numpy as np
+
+from pm2live import Ring
+
+LIGHT_PATH = '/mnt/ramdisk/Lightcurve.shm'
+LIGHT_MAGIC = b'PM2LC\0\0\0'
+LIGHT_VERSION = 1
+WATCH_FILE = '/mnt/ramdisk/WATCH'
+CHANGED = 1                                 # slot flags: the watch list changed while the subframe was open
+
+HEADER = struct.Struct('<8sIIIIIIQI')       # magic version nslots slotlen nbins binus subframe latest maxwatch
+SLOT = struct.Struct('<QQqIIQ')             # seq frame start nwatch flags photons
+SLOTLEN = 64                                # then x[maxwatch] and y[maxwatch] uint16
+
+
+def watch(pixels, path=WATCH_FILE):
+    """
+    Have the Cuber watch pixels, a list of (x, y), from the subframes opening next.  An empty list
+    stops watching, None goes back to the configured list
+    """
+    if pixels is None:
+        line = ''
+    elif len(pixels) == 0:
+        line = 'none'
+    else:
+        line = ' '.join('%d,%d' % (int(x), int(y)) for x, y in pixels)
+    tmp = path + '.tmp'
+    with open(tmp, 'w') as f:
+        f.write(line + '\n')
+    os.rename(tmp, path)
+
+
+class LightCurves(Ring):
+    HEADER = HEADER
+    MAGIC = LIGHT_MAGIC
+    VERSION = LIGHT_VERSION
+    KIND = 'lightcurve ring'
+
+    def __init__(self, path=LIGHT_PATH):
+        Ring.__init__(self, path)
+
+    def layout(self, fields):
+        self.nbins, self.binus, self.subframe = fields[4:7]
+        self.maxwatch = fields[8]
+        self.pixels = SLOTLEN + 4 * self.maxwatch
+
+    def read(self, frame=None):
+        """
+        Copy frame (or the newest one) out of the ring.  Returns (meta, curves), meta a dict of the slot
+        header (start and bin in s) and curves a dict of an nbins uint16 array for each watched (x, y),
+        or (None, None) if frame has been overwritten or was never published
+        """
+        while True:
+            if frame is None:
+                want = self.latest()
+                if want == 0:
+                    return None, None
+            else:
+                want = frame
+            off = self.offset(want)
+            seq, n, start, nwatch, flags, photons = SLOT.unpack_from(self.mm, off)
+            nwatch = min(nwatch, self.maxwatch)
+            xy = struct.unpack_from('<%dH' % (2 * self.maxwatch), self.mm, off + SLOTLEN)
+            counts = np.frombuffer(self.mm, dtype='<u2', count=nwatch * self.nbins, offset=off + self.pixels).copy()
+            if seq == 2 * want and self.seq(want) == seq:
+                meta = {'frame': n, 'start': start / 1000.0, 'bin': self.binus / 1e6, 'nbins': self.nbins,
+                        'photons': photons, 'changed': bool(flags & CHANGED)}
+                counts = counts.reshape((nwatch, self.nbins))
+                curves = dict(((xy[i], xy[self.maxwatch + i]), counts[i]) for i in range(nwatch))
+                return meta, curves
+            if frame is not None and (seq > 2 * want or self.latest() >= want + self.nslots):
+                return None, None
+            # torn by the Cuber writing the slot, or the frame not published yet
+            time.sleep(0.0005)
+
+
+if __name__ == '__main__':
+    import sys
+    light = LightCurves(sys.argv[1] if len(sys.argv) > 1 else LIGHT_PATH)
+    print('%s: %d slots of %d bins of %d us, %d ms subframes' % (light.path, light.nslots, light.nbins, light.binus, light.subframe))
+    frame = light.latest()
+    while True:
+        frame = light.wait(frame)
+        meta, curves = light.read(frame)
+        if meta is None:
+            print('frame %d overwritten before it could be read' % frame)
+            continue
+        peaks = '  '.join('%d,%d: %d (peak %d)' % (x, y, c.sum(), c.max()) for (x, y), c in sorted(curves.items()))
+        print('frame %d  start %.3f%s  %s' % (meta['frame'], meta['start'], '  (list changed)' if meta['changed'] else '', peaks))
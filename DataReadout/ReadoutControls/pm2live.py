@@ -0,0 +1,181 @@
+"""
+Reader for the live image ring PacketMaster2's Cuber publishes in /mnt/ramdisk/LiveImage.shm
+
+The Cuber copies every image into the next slot of the ring as it closes it (see LiveImage.h), so a
+viewer maps the one file and picks the newest image up from memory instead of listing the ramdisk for
+.img files, reading them and deleting them.  Nothing a reader does can slow the Cuber down: the file
+is only ever read here, and a slot the Cuber overwrites while it is being copied is noticed by its
+sequence number and read again.
+
+    live = LiveImage()
+    frame = 0
+    while True:
+        frame = live.wait(frame)
+        meta, image = live.read(frame)      # image is (ypix, xpix) like MkidDashboard's readBinToList
+        ...
+
+Ring is the part every PacketMaster2 shared memory ring has in common (the lightcurves in pm2light.py
+are read the same way): a 64 byte header starting magic, version, nslots and slotlen, with the newest
+frame at byte 32, then nslots slots of slotlen bytes whose first word is 2 * frame once it is written.
+
+Works with python 2 and 3.
+"""
+
+import mmap, os, struct, time
+import numpy as np
+
+LIVE_PATH = '/mnt/ramdisk/LiveImage.shm'
+LIVE_MAGIC = b'PM2LIVE\0'
+LIVE_VERSION = 1
+
+HEADER = struct.Struct('<8sIIIIIIQ')        # magic version nslots slotlen xpix ypix subframe latest
+SLOT = struct.Struct('<QQqIIQQ')            # seq frame start window npix photons offarray
+HEADERLEN = 64
+SLOTLEN = 64
+LATEST = 32                                 # offset of the header's latest
+
+
+class Ring(object):
+    """
+    A PacketMaster2 shared memory ring.  Each kind sets its header layout and magic below, takes the rest
+    of the header in layout() and reads its slots in read()
+    """
+    HEADER = None
+    MAGIC = None
+    VERSION = None
+    KIND = 'ring'
+
+    def __init__(self, path):
+        """
+        Map the ring, raises IOError if PacketMaster2 has not made it (or it is not this kind of ring)
+        """
+        self.path = path
+        self.mm = None
+        self.open()
+
+    def open(self):
+        with open(self.path, 'rb') as f:
+            self.inode = os.fstat(f.fileno()).st_ino
+            mm = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        fields = self.HEADER.unpack_from(mm, 0)
+        magic, version, nslots, slotlen = fields[:4]
+        if magic != self.MAGIC or version != self.VERSION or len(mm) < HEADERLEN + nslots * slotlen:
+            mm.close()
+            raise IOError('%s is not a version %d %s' % (self.path, self.VERSION, self.KIND))
+        if self.mm is not None:
+            self.mm.close()
+        self.mm = mm
+        self.nslots, self.slotlen = nslots, slotlen
+        self.layout(fields)
+
+    def layout(self, fields):
+        """the rest of the header, fields as HEADER unpacked them"""
+        pass
+
+    def reopen(self):
+        """
+        Map the ring again if a new PacketMaster2 has made a new one since, returns True if it did
+        """
+        try:
+            if os.stat(self.path).st_ino == self.inode:
+                return False
+            self.open()
+            return True
+        except (IOError, OSError):
+            return False
+
+    def latest(self):
+        """newest frame published, 0 before the first"""
+        return struct.unpack_from('<Q', self.mm, LATEST)[0]
+
+    def offset(self, frame):
+        return HEADERLEN + (frame % self.nslots) * self.slotlen
+
+    def seq(self, frame):
+        return struct.unpack_from('<Q', self.mm, self.offset(frame))[0]
+
+    def wait(self, after=0, timeout=None, poll=0.005):
+        """
+        Wait for a frame newer than after and return the newest, or after itself on timeout.  A new
+        PacketMaster2 run starts the frames again from 1, so after is forgotten when the ring is remade
+        """
+        stop = None if timeout is None else time.time() + timeout
+        while True:
+            if self.reopen():
+                after = 0
+            n = self.latest()
+            if n > after:
+                return n
+            if stop is not None and time.time() >= stop:
+                return after
+            time.sleep(poll)
+
+    def close(self):
+        if self.mm is not None:
+            self.mm.close()
+            self.mm = None
+
+
+class LiveImage(Ring):
+    HEADER = HEADER
+    MAGIC = LIVE_MAGIC
+    VERSION = LIVE_VERSION
+    KIND = 'live image ring'
+
+    def __init__(self, path=LIVE_PATH):
+        Ring.__init__(self, path)
+
+    def layout(self, fields):
+        self.xpix, self.ypix, self.subframe = fields[4:7]
+        self.npix = self.xpix * self.ypix
+
+    def valid(self, frame):
+        """True while frame is still in its slot, check after using a view()"""
+        return frame > 0 and self.seq(frame) == 2 * frame
+
+    def view(self, frame):
+        """
+        The image of frame in place, (ypix, xpix) with no copy.  The Cuber overwrites it nslots
+        images later, so check valid(frame) after reading it
+        """
+        image = np.frombuffer(self.mm, dtype='<u2', count=self.npix, offset=self.offset(frame) + SLOTLEN)
+        return image.reshape((self.xpix, self.ypix)).T
+
+    def read(self, frame=None):
+        """
+        Copy frame (or the newest one) out of the ring.  Returns (meta, image), meta a dict of the slot
+        header and image a (ypix, xpix) uint16 array, or (None, None) if frame has been overwritten or
+        was never published
+        """
+        while True:
+            if frame is None:
+                want = self.latest()
+                if want == 0:
+                    return None, None
+            else:
+                want = frame
+            off = self.offset(want)
+            seq, n, start, window, npix, photons, offarray = SLOT.unpack_from(self.mm, off)
+            image = np.frombuffer(self.mm, dtype='<u2', count=self.npix, offset=off + SLOTLEN).copy()
+            if seq == 2 * want and self.seq(want) == seq:
+                meta = {'frame': n, 'start': start / 1000.0, 'window': window / 1000.0,
+                        'photons': photons, 'offarray': offarray}
+                return meta, image.reshape((self.xpix, self.ypix)).T
+            if frame is not None and (seq > 2 * want or self.latest() >= want + self.nslots):
+                return None, None
+            # torn by the Cuber writing the slot, or the frame not published yet
+            time.sleep(0.0005)
+
+
+if __name__ == '__main__':
+    import sys
+    live = LiveImage(sys.argv[1] if len(sys.argv) > 1 else LIVE_PATH)
+    print('%s: %d slots of %d x %d pixels, %d ms subframes' % (live.path, live.nslots, live.xpix, live.ypix, live.subframe))
+    frame = live.latest()
+    while True:
+        frame = live.wait(frame)
+        meta, image = live.read(frame)
+        if meta is None:
+            print('frame %d overwritten before it could be read' % frame)
+            continue
+        print('frame %(frame)d  start %(start).3f  window %(window).3f s  %(photons)d photons  %(offarray)d off the array' % meta)
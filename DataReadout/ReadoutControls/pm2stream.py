@@ -0,0 +1,108 @@
+"""
+Subscriber for the photon event stream PacketMaster2's Publisher serves on its publish port
+
+Photons arrive as the boards send them, decoded (and remapped and calibrated when PacketMaster2 has a
+beammap and a calibration), so a fast guiding or wavefront sensing loop can use them at once rather
+than waiting for a .bin file to close.  Ask for just the boards or the region you need: the Publisher
+filters before it sends.  Read steadily, a subscriber that falls behind is disconnected (see
+Publisher.h); iterating again reconnects.
+
+    stream = EventStream('darkness-readout', 50001, x=(10, 40), y=(0, 60))
+    for roach, events in stream:
+        events['time'], events['x'], events['y'], events['wvl'], events['energy']
+
+Works with python 2 and 3.
+"""
+
+import socket, struct
+import numpy as np
+
+FRAME = struct.Struct('<4sIHHI')            # magic n roach flags frame
+FRAME_MAGIC = b'PM2E'
+ENERGY = 1                                  # frame flags: energy is calibrated
+REMAPPED = 2                                # x and y went through a beammap remap
+
+EVENT = np.dtype([('time', '<u8'), ('x', '<u2'), ('y', '<u2'), ('wvl', '<u4'), ('baseline', '<u4'), ('energy', '<f4')])
+
+
+class EventStream(object):
+    def __init__(self, host='localhost', port=50001, roach=None, x=None, y=None, timeout=None):
+        """
+        INPUTS:
+            host, port - where PacketMaster2 serves the event stream (publish in PacketMaster2.cfg)
+            roach - list of boards to get photons from, None for all of them
+            x, y - (first, last+1) column and row range, None for the whole array
+            timeout - s to wait for data before socket.timeout, None waits forever
+        """
+        self.host = host
+        self.port = port
+        self.timeout = timeout
+        words = []
+        if roach is not None:
+            words += ['roach'] + [str(int(r)) for r in roach]
+        if x is not None:
+            words += ['x', str(int(x[0])), str(int(x[1]))]
+        if y is not None:
+            words += ['y', str(int(y[0])), str(int(y[1]))]
+        self.filter = (' '.join(words) + '\n').encode('ascii')
+        self.sock = None
+        self.flags = 0
+
+    def connect(self):
+        self.close()
+        self.sock = socket.create_connection((self.host, self.port), timeout=self.timeout)
+        self.sock.sendall(self.filter)
+
+    def recvall(self, n):
+        buf = bytearray(n)
+        view = memoryview(buf)
+        got = 0
+        while got < n:
+            k = self.sock.recv_into(view[got:], n - got)
+            if k == 0:
+                raise EOFError('PacketMaster2 closed the event stream')
+            got += k
+        return buf
+
+    def read(self):
+        """
+        The next frame, as (roach, events) with events a structured array of EVENT.  Energies are NaN
+        unless self.flags & ENERGY
+        """
+        if self.sock is None:
+            self.connect()
+        magic, n, roach, self.flags, frame = FRAME.unpack(bytes(self.recvall(FRAME.size)))
+        if magic != FRAME_MAGIC:
+            self.close()
+            raise IOError('lost the frame boundary in the event stream')
+        return roach, np.frombuffer(self.recvall(n * EVENT.itemsize), dtype=EVENT)
+
+    def __iter__(self):
+        self.connect()
+        try:
+            while True:
+                yield self.read()
+        except EOFError:
+            self.close()
+
+    def close(self):
+        if self.sock is not None:
+            self.sock.close()
+            self.sock = None
+
+
+if __name__ == '__main__':
+    import argparse, time
+    ap = argparse.ArgumentParser(description='print the rate of the PacketMaster2 photon event stream')
+    ap.add_argument('--host', default='localhost')
+    ap.add_argument('--port', type=int, default=50001)
+    ap.add_argument('--roach', type=int, nargs='*')
+    ap.add_argument('-x', type=int, nargs=2)
+    ap.add_argument('-y', type=int, nargs=2)
+    args = ap.parse_args()
+    count, last = 0, time.time()
+    for roach, events in EventStream(args.host, args.port, args.roach, args.x, args.y):
+        count += len(events)
+        if time.time() - last >= 1:
+            print('%d photons/s' % (count / (time.time() - last)))
+            count, last = 0, time.time()